@@ -109,12 +109,23 @@ public class BackendDataC
     public boolean trackN;                  // keep a count of current instances; different than trackInstances
     public double  poll = -1;               // For connections, how much time is allowed to check full set of latent connections. Zero means every cycle. Negative means don't poll.
 
+    // See JobC.analyzeOffload()
+    public boolean        offload;                                        // Population integrates and updates its instances in a single kernel on an OpenMP target device.
+    public List<Variable> offloadColumns = new ArrayList<Variable> ();  // subset of localMembers mirrored as device arrays
+    public List<Variable> offloadDevice  = new ArrayList<Variable> ();  // subset of localUpdate evaluated in the kernel
+    public List<Variable> offloadHost    = new ArrayList<Variable> ();  // subset of localUpdate still evaluated by Part::update(). May share temporaries with offloadDevice.
+    public List<Variable> offloadTraced  = new ArrayList<Variable> ();  // subset of offloadColumns read by offloadHost, and thus copied back after every kernel
+
+    public boolean parallelInit;  // init() only writes members of its own instance, so Population::resize() may call it on worker threads. See JobC.analyzeParallelInit().
+
     // See InternalBackendData for description of the "inactive" mechanism.
     public boolean populationCanBeInactive; // Indicates that part satisfies all the compile-time conditions for an inactive population.
     public boolean connectionCanBeInactive; // Indicates that part satisfies all the compile-time conditions for an inactive connection instance.
 
     public List<String> globalColumns = new ArrayList<String> ();
     public List<String> localColumns  = new ArrayList<String> ();
+    public List<String> globalHandles = new ArrayList<String> ();  // Column handles for output() calls that have fixed holder and column name.
+    public List<String> localHandles  = new ArrayList<String> ();
     public Set<Object>  defined       = new HashSet<Object> ();  // Identifiers for IO objects that should be emitted only once in a given function. Cleared at the start of processing for each such function.
 
     public List<EventTarget> eventTargets    = new ArrayList<EventTarget> ();
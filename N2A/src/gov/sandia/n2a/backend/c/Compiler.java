@@ -13,6 +13,8 @@ import java.util.ArrayList;
 import java.util.HashMap;
 import java.util.List;
 import java.util.Map;
+import java.util.TreeMap;
+import java.util.Map.Entry;
 
 import gov.sandia.n2a.host.Host;
 import gov.sandia.n2a.host.Host.AnyProcess;
@@ -33,6 +35,9 @@ public abstract class Compiler
     protected boolean            debug;
     protected boolean            profiling;
     protected boolean            shared;
+    protected boolean            offload;
+    protected String             offloadTarget = "";  // Device type passed to the compiler. Blank means OpenMP target regions fall back to the host.
+    protected Path               precompiledHeader;   // Result of precompileHeader() with the same settings. Null means headers are parsed from source.
 
     public Compiler (Host host, Path localJobDir)
     {
@@ -101,6 +106,55 @@ public abstract class Compiler
         shared = true;
     }
 
+    /**
+        Enables OpenMP, so that "target" regions in the generated code run on an accelerator.
+        @param target Device type, in the form expected by the compiler. For example, "nvptx-none" for GCC.
+    **/
+    public void setOffload (String target)
+    {
+        offload       = true;
+        offloadTarget = target;
+    }
+
+    /**
+        Makes the compiler use a header that was previously built by precompileHeader() with the same settings.
+        Has no effect unless the factory supportsPrecompiledHeader().
+    **/
+    public void setPrecompiledHeader (Path pch)
+    {
+        precompiledHeader = pch;
+    }
+
+    /**
+        Compiles header into the file given by setOutput(), using all current settings except sources.
+        Only called when the factory supportsPrecompiledHeader().
+        @return File that captured the compiler's stdout.
+    **/
+    public Path precompileHeader (Path header) throws Exception
+    {
+        throw new UnsupportedOperationException ();
+    }
+
+    /**
+        Describes every setting that affects the compiler's product, apart from sources and output.
+        Two compilers with equal signatures produce interchangeable results from the same sources,
+        so JobC uses a digest of this string to name build products that it caches between jobs.
+    **/
+    public String signature ()
+    {
+        StringBuilder result = new StringBuilder ();
+        result.append ("debug=" + debug + " profiling=" + profiling + " shared=" + shared + " offload=" + offload + " " + offloadTarget + "\n");
+        for (Entry<String,String> define : new TreeMap<String,String> (defines).entrySet ())
+        {
+            result.append ("D " + define.getKey () + "=" + define.getValue () + "\n");
+        }
+        for (Path include : includes)       result.append ("I " + include    + "\n");
+        for (Path object : objects)         result.append ("O " + object     + "\n");
+        for (String library : libraries)    result.append ("l " + library    + "\n");
+        for (Path libraryDir : libraryDirs) result.append ("L " + libraryDir + "\n");
+        return result.toString ();
+    }
+
     public abstract Path compile     () throws Exception;  // returns file that captured the compiler's stdout
     public abstract Path compileLink () throws Exception;  // ditto
     public abstract Path linkLibrary () throws Exception;  // ditto
@@ -162,6 +162,11 @@ public class CompilerCL extends Compiler
         {
             return true;
         }
+
+        public boolean supportsPrecompiledHeader ()
+        {
+            return false;  // The /Yc and /Yu scheme wants a source file that stops at the header, so it is not used here.
+        }
     }
 
     protected Path         cl;
@@ -192,6 +197,11 @@ public class CompilerCL extends Compiler
         // The linker option /OPT:REF removes unused sections. It is on by default, except when debug is enabled.
     }
 
+    public String signature ()
+    {
+        return super.signature () + cl + " " + String.join (" ", settings) + "\n";
+    }
+
     public Path compile () throws Exception
     {
         List<String> command = new ArrayList<String> ();
@@ -199,6 +209,7 @@ public class CompilerCL extends Compiler
         command.add ("/c");
         if (debug) command.add ("/Zi");
         else       command.add ("/O2");
+        if (offload) command.add ("/openmp:llvm");  // MSVC has no device targets, so target regions run on the host.
         for (String setting : settings) command.add (setting);
 
         String target = "/MD";  // Always compile against multi-threaded DLL runtime.
@@ -237,6 +248,7 @@ public class CompilerCL extends Compiler
         command.add (cl.toString ());
         if (debug) command.add ("/Zi");
         else       command.add ("/O2");
+        if (offload) command.add ("/openmp:llvm");  // MSVC has no device targets, so target regions run on the host.
         for (String setting : settings) command.add (setting);
 
         String target = "/MD";
@@ -48,6 +48,14 @@ public class CompilerClang extends CompilerGCC
         super (host, localJobDir, gcc, Darwin);
     }
 
+    /// Clang does not search for precompiled headers, so it must be told which one to use.
+    public void addPrecompiledHeader (List<String> command)
+    {
+        if (precompiledHeader == null) return;
+        command.add ("-include-pch");
+        command.add (host.quote (precompiledHeader));
+    }
+
     public void addDebugCompile (List<String> command)
     {
         if (debug)
@@ -65,4 +73,11 @@ public class CompilerClang extends CompilerGCC
     {
         if (debug  &&  host instanceof Windows) command.add ("-debug");
     }
+
+    public void addOffload (List<String> command)
+    {
+        if (! offload) return;
+        command.add ("-fopenmp");
+        if (! offloadTarget.isBlank ()) command.add ("-fopenmp-targets=" + offloadTarget);
+    }
 }
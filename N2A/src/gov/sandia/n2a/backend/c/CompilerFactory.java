@@ -19,4 +19,5 @@ public interface CompilerFactory
     boolean  wrapperRequired ();             // Indicates that the shared library wrapper must be used for linking. If false, then compiler can link directly to the shared library, even if it is capable of generating a wrapper.
     boolean  debugRequired ();               // Indicates that debug symbols are stored in a separate file, as opposed to embedded in the executable or shared library file.
     boolean  supportsUnicodeIdentifiers ();  // UFT-8 encoded characters can be inserted directly into identifiers
+    boolean  supportsPrecompiledHeader ();   // Compiler.precompileHeader() works, and setPrecompiledHeader() has an effect.
 }
@@ -115,6 +115,11 @@ public class CompilerGCC extends Compiler
         {
             return version >= 10;
         }
+
+        public boolean supportsPrecompiledHeader ()
+        {
+            return true;
+        }
     }
 
     protected Path         gcc;
@@ -129,6 +134,7 @@ public class CompilerGCC extends Compiler
         this.Darwin = Darwin;
 
         settings.add ("-std=c++11");
+        settings.add ("-pthread");  // Runtime uses std::thread for multi-visitor EventStep.
         settings.add ("-ffunction-sections");
         settings.add ("-fdata-sections");
     }
@@ -140,6 +146,7 @@ public class CompilerGCC extends Compiler
         command.add ("-c");
         addDebugCompile (command);
         if (profiling) command.add ("-pg");
+        addOffload (command);
         if (shared) command.add ("-fpic");  // Could use -fPIC, but that option is specifically to avoid size limitations in global offset table that don't apply to any processor we are interested in.
         for (String setting : settings) command.add (setting);
 
@@ -150,6 +157,7 @@ public class CompilerGCC extends Compiler
             if (value.isBlank ()) command.add ("-D" + key);
             else                  command.add ("-D" + key + "=" + value);
         }
+        addPrecompiledHeader (command);
         for (Path include : includes)
         {
             command.add ("-I" + host.quote (include));
@@ -165,6 +173,51 @@ public class CompilerGCC extends Compiler
         return runCommand (command);
     }
 
+    public Path precompileHeader (Path header) throws Exception
+    {
+        List<String> command = new ArrayList<String> ();
+        command.add (gcc.toString ());
+        command.add ("-x");
+        command.add ("c++-header");
+        addDebugCompile (command);
+        if (profiling) command.add ("-pg");
+        addOffload (command);
+        if (shared) command.add ("-fpic");
+        for (String setting : settings) command.add (setting);
+
+        for (Entry<String,String> define : defines.entrySet ())
+        {
+            String key   = define.getKey ();
+            String value = define.getValue ();
+            if (value.isBlank ()) command.add ("-D" + key);
+            else                  command.add ("-D" + key + "=" + value);
+        }
+        for (Path include : includes)
+        {
+            command.add ("-I" + host.quote (include));
+        }
+        command.add (host.quote (header));
+
+        command.add ("-o");
+        command.add (host.quote (output));
+
+        return runCommand (command);
+    }
+
+    public String signature ()
+    {
+        return super.signature () + gcc + " " + optimize + " " + String.join (" ", settings) + (Darwin ? " Darwin" : "") + "\n";
+    }
+
+    /**
+        GCC finds a precompiled header on its own. When it processes #include "X.h",
+        it first checks each file in a directory named X.h.gch beside X.h, and silently
+        skips any that was built with incompatible settings.
+    **/
+    public void addPrecompiledHeader (List<String> command)
+    {
+    }
+
     public void addDebugCompile (List<String> command)
     {
         if (debug) command.add ("-g");
@@ -175,12 +228,20 @@ public class CompilerGCC extends Compiler
     {
     }
 
+    public void addOffload (List<String> command)
+    {
+        if (! offload) return;
+        command.add ("-fopenmp");
+        if (! offloadTarget.isBlank ()) command.add ("-foffload=" + offloadTarget);
+    }
+
     public Path compileLink () throws Exception
     {
         List<String> command = new ArrayList<String> ();
         command.add (gcc.toString ());
         addDebugCompile (command);
         if (profiling) command.add ("-pg");
+        addOffload (command);
         if (shared)
         {
             command.add ("-fpic");
@@ -197,6 +258,7 @@ public class CompilerGCC extends Compiler
             if (value.isBlank ()) command.add ("-D" + key);
             else                  command.add ("-D" + key + "=" + value);
         }
+        addPrecompiledHeader (command);
         for (Path include : includes)
         {
             command.add ("-I" + host.quote (include));
@@ -232,6 +294,7 @@ public class CompilerGCC extends Compiler
             command.add (gcc.toString ());
             command.add ("-shared");
             addDebugLink (command);
+            addOffload (command);
             if (host instanceof Windows)  // GCC is capable of generating a wrapper library, but does not require one when linking with other code.
             {
                 // export-all-symbols -- This is the default unless there is an explicit export in the
@@ -28,15 +28,37 @@ import gov.sandia.n2a.language.Operator;
 import gov.sandia.n2a.language.Split;
 import gov.sandia.n2a.language.Transformer;
 import gov.sandia.n2a.language.Visitor;
+import gov.sandia.n2a.language.function.AbsoluteValue;
+import gov.sandia.n2a.language.function.Atan;
+import gov.sandia.n2a.language.function.Ceil;
+import gov.sandia.n2a.language.function.Cosine;
 import gov.sandia.n2a.language.function.Delay;
 import gov.sandia.n2a.language.function.Draw;
 import gov.sandia.n2a.language.function.Event;
+import gov.sandia.n2a.language.function.Exp;
+import gov.sandia.n2a.language.function.Floor;
+import gov.sandia.n2a.language.function.Gaussian;
+import gov.sandia.n2a.language.function.Grid;
+import gov.sandia.n2a.language.function.HyperbolicTangent;
 import gov.sandia.n2a.language.function.Input;
+import gov.sandia.n2a.language.function.Log;
+import gov.sandia.n2a.language.function.Max;
 import gov.sandia.n2a.language.function.Mfile;
+import gov.sandia.n2a.language.function.Min;
 import gov.sandia.n2a.language.function.Mmatrix;
+import gov.sandia.n2a.language.function.Norm;
 import gov.sandia.n2a.language.function.Output;
+import gov.sandia.n2a.language.function.Pulse;
 import gov.sandia.n2a.language.function.ReadImage;
 import gov.sandia.n2a.language.function.ReadMatrix;
+import gov.sandia.n2a.language.function.Round;
+import gov.sandia.n2a.language.function.Sat;
+import gov.sandia.n2a.language.function.Signum;
+import gov.sandia.n2a.language.function.Sine;
+import gov.sandia.n2a.language.function.SquareRoot;
+import gov.sandia.n2a.language.function.SumSquares;
+import gov.sandia.n2a.language.function.Tangent;
+import gov.sandia.n2a.language.function.Uniform;
 import gov.sandia.n2a.language.operator.Add;
 import gov.sandia.n2a.language.operator.MultiplyElementwise;
 import gov.sandia.n2a.language.type.Matrix;
@@ -61,6 +83,9 @@ import java.nio.file.Files;
 import java.nio.file.Path;
 import java.nio.file.Paths;
 import java.nio.file.StandardCopyOption;
+import java.nio.charset.StandardCharsets;
+import java.security.MessageDigest;
+import java.security.NoSuchAlgorithmException;
 import java.util.ArrayList;
 import java.util.HashMap;
 import java.util.HashSet;
@@ -87,6 +112,12 @@ public class JobC extends Thread
     protected Path ffmpegIncDir;
     protected Path ffmpegBinDir;  // If non-null, then shared library dir should be added to path.
     protected Path jniIncDir;     // jni.h
+    protected Path   blasLibDir;  // If non-null, then dense matrix multiply is handed to BLAS.
+    protected Path   blasIncDir;  // cblas.h. If null while blasLibDir is set, then header is assumed to be on the compiler's default path.
+    protected String blasLib;     // Stem name of library that provides the cblas interface.
+    protected Path   mpiLibDir;   // If non-null, then MPI is available for distributed runs.
+    protected Path   mpiIncDir;   // mpi.h. If null while mpiLibDir is set, then header is assumed to be on the compiler's default path.
+    protected String mpiLib;      // Stem name of MPI library.
     protected Path jniIncMdDir;   // jni_md.h
 
     protected boolean supportsUnicodeIdentifiers;
@@ -96,6 +127,10 @@ public class JobC extends Thread
     protected boolean during;
     protected boolean after;
     protected boolean kokkos;        // profiling method
+    protected boolean profile;       // profiling method built into the runtime. Times the same regions as kokkos, and also counts simulator activity.
+    protected boolean adaptive;      // Integrator is DormandPrince, so emit the stage functions it uses for error control.
+    protected boolean euler;         // Integrator is Euler. Only Euler runs population batch loops. See batch().
+    protected boolean warnedBatch;   // batch() has already explained why it can't be used.
     public    boolean gprof;         // profiling method
     public    boolean debug;         // compile with debug symbols; applies to current model as well as any runtime components that happen to get rebuilt
     public    boolean cli;           // command-line interface
@@ -104,6 +139,13 @@ public class JobC extends Thread
     public    boolean shared = true; // When lib is false, determines whether target binary uses static or dynamic linking to runtime. When lib is true, determines whether target library is shared or static. Target library always contains full runtime, but will not include external resources like FFmpeg.
     public    boolean csharp;        // Emit library code for use by C# (and other CLR languages). Only has an effect when lib is true.
     public    boolean tls;           // Make global objects thread-local, so multiple simulations can be run in same process. (Generally, it is cleaner to use separate process for each simulation, but some users want this.)
+    protected boolean mpi;           // Divide instances of top-level populations among MPI ranks. Each rank runs a copy of the same binary.
+    protected boolean offload;       // At least one population runs its batch loop on an OpenMP target device. See analyzeOffload().
+    protected double  checkpoint;    // Simulated time between checkpoints. 0 means none are written. See Checkpoint in runtime.h.
+    protected int     threads;       // Number of worker threads used to process each EventStep. 1 means everything runs on the main thread. 0 or less means use all available hardware threads.
+    protected boolean pch;           // Compile the runtime headers once per configuration, and reuse them for every model. See usePrecompiledHeader().
+    protected boolean reuse;         // Skip compiling a model whose generated source and build settings match an earlier job. See build().
+    protected String  runtimeKey = ""; // Digest of the settings used to compile runtime objects. Set by rebuildRuntime(), and appended to the names of runtime objects and libraries.
     protected boolean usesPolling;
     protected List<ProvideOperator> extensions = new ArrayList<ProvideOperator> ();
 
@@ -168,11 +210,24 @@ public class JobC extends Thread
                 Backend.err.get ().println ("WARNING: Unsupported numeric type. Defaulting to single-precision float.");
             }
 
-            kokkos = model.getFlag ("$meta", "backend", "c", "kokkos");
+            kokkos  = model.getFlag ("$meta", "backend", "c", "kokkos");
+            profile = model.getFlag ("$meta", "backend", "c", "profile");
             gprof  = model.getFlag ("$meta", "backend", "c", "gprof");
             debug  = model.getFlag ("$meta", "backend", "c", "debug");
             cli    = model.getFlag ("$meta", "backend", "c", "cli");
             tls    = model.getFlag ("$meta", "backend", "c", "tls");
+            mpi    = model.getFlag ("$meta", "backend", "c", "mpi");
+            if (mpi  &&  tls)
+            {
+                Backend.err.get ().println ("WARNING: MPI does not work with thread-local simulators. Running on a single rank.");
+                mpi = false;
+            }
+            threads = model.getOrDefault (1, "$meta", "backend", "c", "threads");
+            pch     = model.getFlag ("$meta", "backend", "c", "pch");
+            reuse   = model.getFlag ("$meta", "backend", "c", "reuse");
+            String integrator = model.getOrDefault ("Euler", "$meta", "backend", "all", "integrator");
+            adaptive = integrator.equalsIgnoreCase ("DormandPrince")  &&  ! T.contains ("int");
+            euler    = ! integrator.equalsIgnoreCase ("RungeKutta")  &&  ! integrator.equalsIgnoreCase ("DormandPrince");  // Same fallback as generateCode()
             csharp = model.getFlag ("$meta", "backend", "c", "sharp");
             if (! lib  &&  model.data ("$meta", "backend", "c", "shared")) shared = model.getFlag ("$meta", "backend", "c", "shared");
 
@@ -196,6 +251,17 @@ public class JobC extends Thread
             jobDir           = Host.getJobDir (resourceDir, job);  // Unlike localJobDir (which is created by MDir), this may not exist until we explicitly create it.
             runtimeDir       = resourceDir.resolve ("backend").resolve ("c");
             detectExternalResources ();
+            if (mpi  &&  mpiLibDir == null)
+            {
+                Backend.err.get ().println ("WARNING: No MPI library found. Set backend.c.mpi in host configuration. Running on a single rank.");
+                mpi = false;
+            }
+            checkpoint = model.getOrDefault (0.0, "$meta", "backend", "c", "checkpoint");
+            if (checkpoint > 0  &&  mpi)
+            {
+                Backend.err.get ().println ("WARNING: Checkpoints are not available with MPI. None will be written.");
+                checkpoint = 0;
+            }
             rebuildRuntime ();
 
             Files.createDirectories (jobDir);  // digestModel() might write to a remote file (params), so we need to ensure the dir exists first.
@@ -236,12 +302,26 @@ public class JobC extends Thread
 
                 List<List<String>> commands = new ArrayList<List<String>> ();
                 List<String> command = new ArrayList<String> ();
+                if (mpi  &&  ! env.hasRun ())  // A host with its own launcher (such as a batch scheduler) is expected to start the ranks itself.
+                {
+                    // Same sizing as JobSTACS
+                    int cores = 1;
+                    if (! (env instanceof Remote)) cores = env.getProcessorTotal ();
+                    cores     = job.getOrDefault (cores, "host", "cores");
+                    int nodes = job.getOrDefault (1,     "host", "nodes");
+                    String mpirun = env.config.getOrDefault ("mpirun", "backend", "c", "mpirun");
+                    command.add (mpirun);
+                    command.add ("-np");
+                    command.add (String.valueOf (cores * nodes));
+                }
                 command.add (env.quote (commandPath));
                 commands.add (command);
 
                 List<Path> libPath = new ArrayList<Path> ();
                 if (shared) libPath.add (runtimeDir);
                 if (ffmpegBinDir != null) libPath.add (ffmpegBinDir);  // This could be redundant with existing system path.
+                if (blasLibDir   != null) libPath.add (blasLibDir);
+                if (mpi) libPath.add (mpiLibDir);
                 if (libPath.isEmpty ()) libPath = null;
 
                 env.submitJob (job, env.clobbersOut (), commands, libPath);
@@ -324,6 +404,96 @@ public class JobC extends Thread
             env.objects.put ("ffmpegBinDir", ffmpegBinDir);
         }
 
+        // BLAS
+        // Unlike FFmpeg, there is no search of typical locations. Results differ from the built-in
+        // kernel in the last few bits, so the user must ask for this explicitly.
+        if (env.objects.containsKey ("blasLibDir"))
+        {
+            blasLibDir = (Path)   env.objects.get ("blasLibDir");
+            blasIncDir = (Path)   env.objects.get ("blasIncDir");
+            blasLib    = (String) env.objects.get ("blasLib");
+        }
+        else
+        {
+            String blasString = env.config.get ("backend", "c", "blas");
+            if (! blasString.isBlank ())
+            {
+                blasLibDir = runtimeDir.resolve (blasString);
+                boolean wrap = factory.wrapperRequired ();
+                String prefix = factory.prefixLibrary (! wrap);
+                String suffix = wrap ? factory.suffixLibraryWrapper () : factory.suffixLibrary (true);
+                for (String name : new String[] {"openblas", "cblas", "mkl_rt", "blas"})
+                {
+                    if (! Files.exists (blasLibDir.resolve (prefix + name + suffix))) continue;
+                    blasLib = name;
+                    break;
+                }
+                if (blasLib == null)
+                {
+                    Backend.err.get ().println ("WARNING: No BLAS library found in " + blasLibDir + ". Using built-in matrix multiply.");
+                    blasLibDir = null;
+                }
+                else
+                {
+                    Path blasDir = blasLibDir.getParent ();
+                    for (String path : new String[] {"include/openblas", "include"})
+                    {
+                        blasIncDir = blasDir.resolve (path);
+                        if (Files.exists (blasIncDir.resolve ("cblas.h"))) break;
+                        blasIncDir = null;
+                    }
+                }
+            }
+
+            env.objects.put ("blasLibDir", blasLibDir);
+            env.objects.put ("blasIncDir", blasIncDir);
+            env.objects.put ("blasLib",    blasLib);
+        }
+
+        // MPI
+        if (env.objects.containsKey ("mpiLibDir"))
+        {
+            mpiLibDir = (Path)   env.objects.get ("mpiLibDir");
+            mpiIncDir = (Path)   env.objects.get ("mpiIncDir");
+            mpiLib    = (String) env.objects.get ("mpiLib");
+        }
+        else
+        {
+            boolean wrap = factory.wrapperRequired ();
+            String prefix = factory.prefixLibrary (! wrap);
+            String suffix = wrap ? factory.suffixLibraryWrapper () : factory.suffixLibrary (true);
+            String mpiString = env.config.get ("backend", "c", "mpi");
+            String[] paths;
+            if (mpiString.isBlank ()) paths = new String[] {"/usr/lib/x86_64-linux-gnu/openmpi/lib", "/usr/lib64/openmpi/lib", "/usr/lib64/mpich/lib", "/usr/local/lib", "/usr/lib64", "/usr/lib"};  // Search typical locations
+            else                      paths = new String[] {mpiString};  // Relative path is resolved w.r.t. the runtime dir, same as ffmpeg.
+            for (String path : paths)
+            {
+                mpiLibDir = runtimeDir.resolve (path);
+                for (String name : new String[] {"mpi", "msmpi"})
+                {
+                    if (! Files.exists (mpiLibDir.resolve (prefix + name + suffix))) continue;
+                    mpiLib = name;
+                    break;
+                }
+                if (mpiLib != null) break;
+                mpiLibDir = null;
+            }
+            if (mpiLibDir != null)
+            {
+                Path mpiDir = mpiLibDir.getParent ();
+                for (String path : new String[] {"include", "include/openmpi", "include/mpich"})
+                {
+                    mpiIncDir = mpiDir.resolve (path);
+                    if (Files.exists (mpiIncDir.resolve ("mpi.h"))) break;
+                    mpiIncDir = null;
+                }
+            }
+
+            env.objects.put ("mpiLibDir", mpiLibDir);
+            env.objects.put ("mpiIncDir", mpiIncDir);
+            env.objects.put ("mpiLib",    mpiLib);
+        }
+
         // TODO: freetype
 
         // JNI
@@ -364,7 +534,7 @@ public class JobC extends Thread
     {
         // Prevent jobs from trying to rebuild runtime in parallel.
         // They could interfere with each other.
-        // This is the only process that synchronizes on Host.
+        // Only this function and the caches of precompiled headers and models (see build()) synchronize on Host.
         synchronized (env)
         {
             // Update runtime source files, if necessary
@@ -382,6 +552,9 @@ public class JobC extends Thread
                 runtimeBuilt.put (env, runtimes);
             }
             CompilerFactory factory = BackendC.getFactory (env);
+            Compiler signer = factory.make (localJobDir);
+            configureRuntime (signer);
+            runtimeKey = digest (signer.signature ());
             String runtimeName = factory.prefixLibrary (shared) + runtimeName () + factory.suffixLibrary (shared);
             Path runtimeLib = runtimeDir.resolve (runtimeName);
             for (ProvideOperator pf : extensions)
@@ -395,7 +568,7 @@ public class JobC extends Thread
             }
             env.config.clear ("backend", "c", "compilerChanged");
 
-            if (changed)  // Delete all existing object files and runtime libs.
+            if (changed)  // Delete all existing object files, runtime libs, precompiled headers and cached models.
             {
                 runtimes.clear ();
                 try (DirectoryStream<Path> list = Files.newDirectoryStream (runtimeDir))
@@ -403,9 +576,18 @@ public class JobC extends Thread
                     for (Path file : list)
                     {
                         String fileName = file.getFileName ().toString ();
-                        if (fileName.endsWith (".o")  ||  fileName.contains ("runtime_"))  // The underscore after "runtime" is crucial.
+                        if (fileName.endsWith (".o")  ||  fileName.contains ("runtime_")  ||  fileName.startsWith ("model_"))  // The underscore after "runtime" is crucial.
+                        {
+                            job.set ("deleting " + file, "status");
+                            Files.delete (file);
+                        }
+                        else if (fileName.equals ("prelude.h.gch"))
                         {
                             job.set ("deleting " + file, "status");
+                            try (DirectoryStream<Path> headers = Files.newDirectoryStream (file))
+                            {
+                                for (Path header : headers) Files.delete (header);
+                            }
                             Files.delete (file);
                         }
                     }
@@ -447,13 +629,7 @@ public class JobC extends Thread
                 job.set ("Compiling " + objectName, "status");
 
                 Compiler c = factory.make (localJobDir);
-                if (shared) c.setShared ();
-                if (debug ) c.setDebug ();
-                if (gprof ) c.setProfiling ();
-                addIncludes (c);
-                c.addDefine ("n2a_T", T);
-                if (T.contains ("int")) c.addDefine ("n2a_FP");
-                if (tls) c.addDefine ("n2a_TLS");
+                configureRuntime (c);
                 c.addSource (runtimeDir.resolve (stem + ".cc"));
                 c.setOutput (object);
 
@@ -505,20 +681,22 @@ public class JobC extends Thread
         return unpackRuntime
         (
             JobC.class, job, runtimeDir, "runtime/",
-            "math.h", "fixedpoint.cc",
+            "math.h", "fixedpoint.cc", "fixedpoint.tcc",
             "holder.cc", "holder.h", "holder.tcc",
             "KDTree.h", "StringLite.h",
             "matrix.h", "Matrix.tcc", "MatrixFixed.tcc", "MatrixSparse.tcc", "pointer.h",
-            "MNode.h", "MNode.cc",
+            "MNode.h", "MNode.cc", "mappedfile.h",
             "nosys.h",
             "runtime.cc", "runtime.h", "runtime.tcc",
             "profiling.h", "profiling.cc",
+            "offload.h", "prelude.h",
             "myendian.h", "image.h", "Image.cc", "ImageFileFormat.cc", "ImageFileFormatBMP.cc", "PixelBuffer.cc", "PixelFormat.cc",
             "canvas.h", "CanvasImage.cc",
             "video.h", "Video.cc", "VideoFileFormatFFMPEG.cc",
             "NativeResource.cc", "NativeResource.h",
             "shared.h",
             "OutputHolder.h", "OutputParser.h",  // Not needed by runtime, but provided as a utility for users.
+            "benchmark.cc",  // Built by hand against the unpacked runtime, to measure throughput on a given machine.
             "Shader.vp", "Shader.fp"  // GPU code not compiled into runtime.
         );
     }
@@ -545,8 +723,10 @@ public class JobC extends Thread
     }
 
     /**
-        Runtime object code files will be named source_type_featureA_featureB...
-        in a standard order established by this function. 
+        Runtime object code files will be named source_type_featureA_featureB..._key
+        in a standard order established by this function. The key is a digest of the
+        complete compiler settings (see rebuildRuntime()), so changing compiler or external
+        libraries selects a different set of objects rather than reusing stale ones.
     **/
     public String objectName (String stem)
     {
@@ -556,7 +736,9 @@ public class JobC extends Thread
         if (shared) result.append ("_shared");
         if (debug ) result.append ("_debug");
         if (tls   ) result.append ("_tls");
+        if (mpi   ) result.append ("_mpi");
         if (gprof ) result.append ("_gprof");
+        if (! runtimeKey.isEmpty ()) result.append ("_" + runtimeKey);
         result.append (".o");
         return result.toString ();
     }
@@ -571,10 +753,42 @@ public class JobC extends Thread
         result.append ("runtime_" + T);
         if (debug) result.append ("_debug");
         if (tls  ) result.append ("_tls");
+        if (mpi  ) result.append ("_mpi");
         if (gprof) result.append ("_gprof");
+        if (! runtimeKey.isEmpty ()) result.append ("_" + runtimeKey);
         return result.toString ();
     }
 
+    /// Applies the settings shared by every runtime object file.
+    public void configureRuntime (Compiler c)
+    {
+        if (shared) c.setShared ();
+        if (debug ) c.setDebug ();
+        if (gprof ) c.setProfiling ();
+        addIncludes (c);
+        c.addDefine ("n2a_T", T);
+        if (T.contains ("int")) c.addDefine ("n2a_FP");
+        if (tls) c.addDefine ("n2a_TLS");
+    }
+
+    /**
+        @return A short hex digest of text, suitable for naming build products that are cached between jobs.
+    **/
+    public static String digest (String text)
+    {
+        try
+        {
+            byte[] hash = MessageDigest.getInstance ("SHA-256").digest (text.getBytes (StandardCharsets.UTF_8));
+            StringBuilder result = new StringBuilder ();
+            for (int i = 0; i < 6; i++) result.append (String.format ("%02x", hash[i]));
+            return result.toString ();
+        }
+        catch (NoSuchAlgorithmException e)  // Every Java platform is required to provide SHA-256.
+        {
+            return "";
+        }
+    }
+
     public void addIncludes (Compiler c)
     {
         c.addInclude (runtimeDir);
@@ -583,6 +797,16 @@ public class JobC extends Thread
             c.addInclude (ffmpegIncDir);
             c.addDefine ("HAVE_FFMPEG");
         }
+        if (blasLibDir != null  &&  ! T.contains ("int"))  // cblas has no integer gemm, so fixed-point keeps its own kernel.
+        {
+            if (blasIncDir != null) c.addInclude (blasIncDir);
+            c.addDefine ("n2a_BLAS");
+        }
+        if (mpi)
+        {
+            if (mpiIncDir != null) c.addInclude (mpiIncDir);
+            c.addDefine ("n2a_MPI");
+        }
         if (jniIncMdDir != null  &&  shared  &&  ! (env instanceof Remote))
         {
             c.addInclude (jniIncMdDir);
@@ -612,6 +836,16 @@ public class JobC extends Thread
             c.addLibrary ("avformat");
             c.addLibrary ("avutil");
         }
+        if (blasLibDir != null  &&  ! T.contains ("int"))
+        {
+            c.addLibraryDir (blasLibDir);
+            c.addLibrary (blasLib);
+        }
+        if (mpi)
+        {
+            c.addLibraryDir (mpiLibDir);
+            c.addLibrary (mpiLib);
+        }
         if (jniIncMdDir != null  &&  shared  &&  ! (env instanceof Remote))
         {
             c.addObject (runtimeDir.resolve (objectName ("NativeResource")));
@@ -623,11 +857,9 @@ public class JobC extends Thread
             if (path != null) c.addObject (path);
         }
 
-        if (kokkos)
-        {
-            c.addObject (runtimeDir.resolve (objectName ("profiling")));
-            c.addLibrary ("dl");  // kokkos should only be set on Linux systems.
-        }
+        // The simulator always links the profiling counters, whether or not a profiler is active.
+        c.addObject (runtimeDir.resolve (objectName ("profiling")));
+        if (! (env instanceof Windows)) c.addLibrary ("dl");  // for loading a Kokkos tool
     }
 
     public Path build (Path source) throws Exception
@@ -641,8 +873,9 @@ public class JobC extends Thread
         Path   binary = source.getParent ().resolve (stem + factory.suffixBinary ());
 
         Compiler c = factory.make (localJobDir);
-        if (debug) c.setDebug ();
-        if (gprof) c.setProfiling ();
+        if (debug  ) c.setDebug ();
+        if (gprof  ) c.setProfiling ();
+        if (offload) c.setOffload (env.config.get ("backend", "c", "offload"));
         addIncludes (c);
         for (ProvideOperator po : extensions)
         {
@@ -652,25 +885,84 @@ public class JobC extends Thread
         c.addDefine ("n2a_T", T);
         if (T.contains ("int")) c.addDefine ("n2a_FP");
         if (tls) c.addDefine ("n2a_TLS");
+        if (shared  &&  env instanceof Windows) c.addDefine ("n2a_DLL");
+        if (pch) usePrecompiledHeader (factory, c);
         c.setOutput (binary);
         c.addSource (source);
         if (shared)
         {
             c.addLibraryDir (runtimeDir);
             c.addLibrary (runtimeName ());
-            if (env instanceof Windows) c.addDefine ("n2a_DLL");
         }
         else
         {
             addRuntimeObjects (c);
         }
 
+        // A sweep that only varies parameters regenerates the same source for every job.
+        // Such a model only needs to be compiled once. The cached binaries are deleted
+        // along with the runtime objects whenever the runtime source changes.
+        // With a separate debug symbol file, the binary alone is not a complete product.
+        Path cached = null;
+        if (reuse  &&  ! (debug  &&  factory.debugRequired ()))
+        {
+            String key = digest (new String (Files.readAllBytes (source), StandardCharsets.UTF_8) + c.signature ());
+            cached = runtimeDir.resolve ("model_" + key + factory.suffixBinary ());
+            synchronized (env)
+            {
+                if (Files.exists (cached))
+                {
+                    job.set ("Reusing compiled model", "status");
+                    Files.copy (cached, binary, StandardCopyOption.REPLACE_EXISTING);
+                    return binary;
+                }
+            }
+        }
+
         Path out = c.compileLink ();
         Files.delete (out);
 
+        if (cached != null)
+        {
+            synchronized (env)
+            {
+                Files.copy (binary, cached, StandardCopyOption.REPLACE_EXISTING);
+            }
+        }
+
         return binary;
     }
 
+    /**
+        Points c at a precompiled form of prelude.h that matches its current settings, building it first if needed.
+        Each distinct configuration gets its own file in runtimeDir/prelude.h.gch, which is where GCC looks
+        for alternatives to prelude.h. These are shared by all jobs on the host, and deleted along with the
+        runtime objects whenever the runtime source changes.
+    **/
+    public void usePrecompiledHeader (CompilerFactory factory, Compiler c) throws Exception
+    {
+        if (! factory.supportsPrecompiledHeader ()) return;
+
+        String key = digest (c.signature ());
+        Path   dir = runtimeDir.resolve ("prelude.h.gch");
+        Path   pch = dir.resolve (key + ".gch");
+        synchronized (env)  // Same lock as rebuildRuntime(), so that parallel jobs don't write the same file.
+        {
+            if (! Files.exists (pch))
+            {
+                job.set ("Precompiling runtime headers", "status");
+                Files.createDirectories (dir);
+                // Build outside the directory, because GCC may examine any file in it while compiling another model.
+                Path temp = runtimeDir.resolve ("prelude_" + key + ".gch");
+                c.setOutput (temp);
+                Path out = c.precompileHeader (runtimeDir.resolve ("prelude.h"));
+                Files.delete (out);
+                Files.move (temp, pch, StandardCopyOption.REPLACE_EXISTING);
+            }
+        }
+        c.setPrecompiledHeader (pch);
+    }
+
     public void makeLibrary (Path source) throws Exception
     {
         // In order to make a library, we must compile in two steps:
@@ -682,9 +974,10 @@ public class JobC extends Thread
 
         // 1) Generate object file
         Compiler c = factory.make (localJobDir);
-        if (shared) c.setShared ();
-        if (debug ) c.setDebug ();
-        if (gprof ) c.setProfiling ();
+        if (shared ) c.setShared ();
+        if (debug  ) c.setDebug ();
+        if (gprof  ) c.setProfiling ();
+        if (offload) c.setOffload (env.config.get ("backend", "c", "offload"));
         addIncludes (c);
         for (ProvideOperator po : extensions)
         {
@@ -695,6 +988,7 @@ public class JobC extends Thread
         c.addDefine ("n2a_T", T);
         if (T.contains ("int")) c.addDefine ("n2a_FP");
         if (tls) c.addDefine ("n2a_TLS");
+        if (pch) usePrecompiledHeader (factory, c);
         c.setOutput (object);
         c.addSource (source);
         Path out = c.compile ();
@@ -769,6 +1063,13 @@ public class JobC extends Thread
         digestedModel.findConnectionMatrix ();
         analyzeEvents (digestedModel);
         analyze (digestedModel);
+        analyzeOffload (digestedModel);
+        if (digestedModel.metadata.getOrDefault ("", "backend", "c", "init").equals ("parallel")) analyzeParallelInit (digestedModel);
+        if (checkpoint > 0  &&  ! checkpointSafe (digestedModel))
+        {
+            Backend.err.get ().println ("WARNING: Checkpoints can't record variables that refer directly to matrix inputs. None will be written.");
+            checkpoint = 0;
+        }
     }
 
     public void tagCommandLineParameters (EquationSet s, Writer params) throws IOException
@@ -896,6 +1197,8 @@ public class JobC extends Thread
             }
         }
 
+        if (checkpoint > 0) s.needInstanceTracking = true;  // Checkpoint finds every live part through the instances vector of its population.
+
         // needInstanceTracking implies need $index
         if (s.needInstanceTracking  &&  ! s.isSingleton ())
         {
@@ -1040,13 +1343,15 @@ public class JobC extends Thread
 
         SIMULATOR = "Simulator<" + T + ">::instance" + (tls ? "->" : ".");
 
-        result.append ("#include \"math.h\"\n");  // math.h must always come first, because it messes with mode in which <cmath> is included.
-        result.append ("#include \"runtime.h\"\n");
-        if (kokkos)
+        result.append ("#include \"prelude.h\"\n");  // Must come first, so the compiler can substitute a precompiled form. Includes math.h, runtime.h, MatrixFixed.tcc and the standard headers.
+        if (kokkos  ||  profile)
         {
             result.append ("#include \"profiling.h\"\n");
         }
-        result.append ("#include \"MatrixFixed.tcc\"\n");  // Pulls in matrix.h, and thus access to all other matrix classes. We need templates for MatrixFixed because dimensions are arbitrary in user code.
+        if (offload)
+        {
+            result.append ("#include \"offload.h\"\n");
+        }
         for (ProvideOperator po : extensions)
         {
             Path include = po.include (this);
@@ -1054,11 +1359,6 @@ public class JobC extends Thread
             result.append ("#include <" + include.getFileName () + ">\n");
         }
         result.append ("\n");
-        result.append ("#include <iostream>\n");
-        result.append ("#include <vector>\n");
-        result.append ("#include <unordered_set>\n");  // Only needed for polling. We could walk the tree and check if any parts need polling before emitting this line, but it's probably not worth the effort.
-        result.append ("#include <csignal>\n");
-        result.append ("\n");
         generateClassList (digestedModel, result);
         result.append ("class Wrapper;\n");
         result.append ("\n");
@@ -1082,6 +1382,7 @@ public class JobC extends Thread
         if (tls) result.append ("thread_local ");
         result.append ("Wrapper * wrapper;\n");
         result.append ("\n");
+        int signature = result.toString ().hashCode ();  // Changes with the layout of any generated class, so a checkpoint from a different build is rejected.
 
         StringBuilder vectorDefinitions = new StringBuilder ();
         String SHARED = "";
@@ -1146,6 +1447,12 @@ public class JobC extends Thread
                 header.append ("  " + SHARED + "void " + ns_ + "init (int argc, const char * argv[]);\n");
                 header.append ("  " + SHARED + "void " + ns_ + "run (" + T + " until);\n");
                 header.append ("  " + SHARED + "void " + ns_ + "finish ();\n");
+                if (tls  &&  ! csharp)
+                {
+                    // Each member is a list of "name=value" arguments, as would be passed to init().
+                    // Returns the number of members that failed.
+                    header.append ("  " + SHARED + "int  runEnsemble (const std::vector<std::vector<std::string>> & members, const std::vector<std::string> & directories, " + T + " until, int threads = 0);\n");
+                }
                 header.append ("\n");
                 generateIOvector (digestedModel, SHARED, ns, header, vectorDefinitions);
                 if (! vectorDefinitions.isEmpty ())
@@ -1242,26 +1549,127 @@ public class JobC extends Thread
             result.append ("  Event<int>::exponent = " + dt.exponent + ";\n");
         }
         String integrator = digestedModel.metadata.getOrDefault ("Euler", "backend", "all", "integrator");
-        if (integrator.equalsIgnoreCase ("RungeKutta")) integrator = "RungeKutta";
-        else                                            integrator = "Euler";
+        String integratorArguments = "";
+        if      (integrator.equalsIgnoreCase ("RungeKutta"))    integrator = "RungeKutta";
+        else if (integrator.equalsIgnoreCase ("DormandPrince"))
+        {
+            if (T.contains ("int"))
+            {
+                integrator = "RungeKutta";
+                Backend.err.get ().println ("WARNING: DormandPrince requires floating-point. Using RungeKutta instead.");
+            }
+            else
+            {
+                integrator = "DormandPrince";
+                double atol = digestedModel.metadata.getOrDefault (1e-6, "backend", "all", "integrator", "atol");
+                double rtol = digestedModel.metadata.getOrDefault (1e-3, "backend", "all", "integrator", "rtol");
+                integratorArguments = " (" + context.print (atol, 0) + ", " + context.print (rtol, 0) + ")";
+            }
+        }
+        else integrator = "Euler";
         if (tls)
         {
-            result.append ("  Simulator<" + T + ">::instance = new Simulator<" + T + ">;\n");
+            result.append ("  if (! Simulator<" + T + ">::instance) Simulator<" + T + ">::instance = new Simulator<" + T + ">;\n");  // An Ensemble may have already supplied one.
         }
-        result.append ("  " + SIMULATOR + "integrator = new " + integrator + "<" + T + ">;\n");
+        result.append ("  " + SIMULATOR + "integrator = new " + integrator + "<" + T + ">" + integratorArguments + ";\n");
         result.append ("  " + SIMULATOR + "after = " + after + ";\n");
+        int spikes = digestedModel.metadata.getOrDefault (0, "backend", "c", "spikes");
+        if (spikes > 0) result.append ("  " + SIMULATOR + "spikes.reserve (" + spikes + ");\n");
+        if (digestedModel.metadata.data ("backend", "c", "merge")  &&  ! digestedModel.metadata.getFlag ("backend", "c", "merge"))
+        {
+            result.append ("  " + SIMULATOR + "mergeSpikes = false;\n");  // Each multi-target spike gets its own event, even when several arrive at the same time.
+        }
+        if (digestedModel.metadata.getFlag ("backend", "c", "cache"))
+        {
+            result.append ("  " + SIMULATOR + "cacheInputs = true;\n");  // Parsed text inputs are saved in binary sidecars beside their source files, for reuse by later runs.
+        }
+        if (tls  &&  ! (digestedModel.metadata.data ("backend", "c", "shareInputs")  &&  ! digestedModel.metadata.getFlag ("backend", "c", "shareInputs")))
+        {
+            result.append ("  " + SIMULATOR + "shareInputs = true;\n");  // Simulators running in other threads of this process reuse the same parsed input files.
+        }
+        if (digestedModel.metadata.getOrDefault ("", "backend", "c", "queue").equals ("calendar"))
+        {
+            // Each bucket covers one top-level cycle, so regular step events and spikes with short delays land near the front of the ring.
+            double width    = 1e-4;  // Same as default in Simulator::init()
+            int    exponent = 0;
+            Variable dt = digestedModel.find (new Variable ("$t", 1));
+            if (dt != null)
+            {
+                exponent = dt.exponent;
+                if (! dt.equations.isEmpty ()  &&  dt.hasAttribute ("constant")) width = ((Scalar) dt.type).value;
+            }
+            int buckets = digestedModel.metadata.getOrDefault (1024, "backend", "c", "queue", "buckets");
+            result.append ("  " + SIMULATOR + "queueEvent.useCalendar (" + context.print (width, exponent) + ", " + buckets + ");\n");
+        }
+        if (threads != 1)
+        {
+            result.append ("  " + SIMULATOR + "setThreads (" + threads + ");\n");
+            if (threadSafeUpdate (digestedModel)) result.append ("  " + SIMULATOR + "parallelUpdate = true;\n");
+        }
+        if (digestedModel.metadata.getOrDefault ("", "backend", "c", "connect").equals ("parallel"))
+        {
+            // Emitted even with a single thread, so that results are the same for any thread count.
+            if (threadSafeUpdate (digestedModel)) result.append ("  " + SIMULATOR + "parallelConnect = true;\n");
+            else Backend.err.get ().println ("WARNING: Model uses shared IO or external writes, so connections will be made serially.");
+        }
+        if (mpi)
+        {
+            // Before any output is opened, since ranks other than 0 write into their own directories.
+            result.append ("  " + SIMULATOR + "distributed.init ();\n");
+            Variable dt = digestedModel.find (new Variable ("$t", 1));
+            int exponent = dt == null ? 0 : dt.exponent;
+            double interval = mpiInterval (digestedModel, Double.POSITIVE_INFINITY);
+            if (interval < Double.POSITIVE_INFINITY) result.append ("  " + SIMULATOR + "distributed.interval = " + context.print (interval, exponent) + ";\n");
+            // Otherwise, Distributed::start() uses the period of the top-level part.
+            if (fixedNetwork (digestedModel)) result.append ("  " + SIMULATOR + "distributed.prune = true;\n");
+        }
+        if (profile)
+        {
+            // Goes through outputPath() so each member of an Ensemble reports into its own directory.
+            double sample = digestedModel.metadata.getOrDefault (0.0, "backend", "c", "profile", "sample");  // seconds of wall-clock time between samples
+            result.append ("  start_profiling (" + SIMULATOR + "outputPath (\"profile\").c_str ()");
+            if (sample > 0) result.append (", " + SIMULATOR + "outputPath (\"profile.samples\").c_str (), " + sample);
+            result.append (");\n");
+        }
+        if (checkpoint > 0)
+        {
+            Variable dt = digestedModel.find (new Variable ("$t", 1));
+            int exponent = dt == null ? 0 : dt.exponent;
+            result.append ("  " + SIMULATOR + "checkpointInterval = " + context.print (checkpoint, exponent) + ";\n");
+            result.append ("  " + SIMULATOR + "checkpointSignature = " + Integer.toUnsignedString (signature) + "u;\n");
+            result.append ("  " + SIMULATOR + "checkpointPath = " + SIMULATOR + "outputPath (\"checkpoint\");\n");
+            result.append ("  Checkpoint<" + T + "> checkpoint;\n");
+            result.append ("  bool resume = checkpoint.open (" + SIMULATOR + "checkpointPath);\n");  // Before initIO(), so output holders continue their files.
+        }
         result.append ("  initIO ();\n");
         result.append ("  wrapper = new Wrapper;\n");
-        result.append ("  " + SIMULATOR + "init (wrapper);\n");  // Simulator takes possession of wrapper, so it will be freed automatically.
+        if (checkpoint > 0)
+        {
+            result.append ("  if (resume) checkpoint.load (wrapper);\n");
+            result.append ("  else        " + SIMULATOR + "init (wrapper);\n");  // Simulator takes possession of wrapper, so it will be freed automatically.
+        }
+        else
+        {
+            result.append ("  " + SIMULATOR + "init (wrapper);\n");  // Simulator takes possession of wrapper, so it will be freed automatically.
+        }
         result.append ("}\n");
         result.append ("\n");
 
         // Finish
         result.append ("void " + ns + "finish ()\n");
         result.append ("{\n");
+        if (threads != 1)
+        {
+            result.append ("  if (" + SIMULATOR + "threads) " + SIMULATOR + "threads->report (cerr);\n");
+        }
+        if (digestedModel.metadata.data ("backend", "c", "spikes"))  // Report actual usage, to help choose the reserve size.
+        {
+            result.append ("  cerr << \"peak live spike events: \" << " + SIMULATOR + "spikes.peak << endl;\n");
+        }
         if (tls)
         {
             result.append ("  delete Simulator<" + T + ">::instance;\n");
+            result.append ("  Simulator<" + T + ">::instance = 0;\n");
         }
         else
         {
@@ -1272,10 +1680,14 @@ public class JobC extends Thread
         {
             result.append ("  delete params;\n");
         }
-        if (kokkos)
+        if (kokkos  ||  profile)
         {
             result.append ("  finalize_profiling ();\n");
         }
+        if (mpi)
+        {
+            result.append ("  " + SIMULATOR + "distributed.finalize ();\n");
+        }
         result.append ("}\n");
         result.append ("\n");
 
@@ -1286,6 +1698,27 @@ public class JobC extends Thread
             result.append ("{\n");
             result.append ("  " + SIMULATOR + "run (until);\n");
             result.append ("}\n");
+            if (tls  &&  ! csharp)
+            {
+                result.append ("\n");
+                result.append ("int " + ns + "runEnsemble (const vector<vector<string>> & members, const vector<string> & directories, " + T + " until, int threads)\n");
+                result.append ("{\n");
+                result.append ("  Ensemble<" + T + "> ensemble (" + ns + "init, " + ns + "run, " + ns + "finish);\n");
+                result.append ("  for (size_t i = 0; i < members.size (); i++)\n");
+                result.append ("  {\n");
+                result.append ("    Parameters<" + T + "> p;\n");
+                result.append ("    for (auto & a : members[i]) p.parse (a.c_str ());\n");
+                result.append ("    ensemble.add (p, i < directories.size () ? directories[i].c_str () : \"\");\n");
+                result.append ("  }\n");
+                result.append ("  ensemble.run (until, threads);\n");
+                result.append ("  for (size_t i = 0; i < ensemble.members.size (); i++)\n");
+                result.append ("  {\n");
+                result.append ("    const String & error = ensemble.members[i].error;\n");
+                result.append ("    if (! error.empty ()) cerr << \"ensemble member \" << i << \": \" << error << endl;\n");
+                result.append ("  }\n");
+                result.append ("  return ensemble.failures ();\n");
+                result.append ("}\n");
+            }
             if (! vectorDefinitions.isEmpty ())
             {
                 result.append ("\n");
@@ -1321,11 +1754,13 @@ public class JobC extends Thread
             result.append ("  catch (const char * message)\n");
             result.append ("  {\n");
             result.append ("    cerr << \"Exception: \" << message << endl;\n");
+            if (mpi) result.append ("    MPI_Abort (MPI_COMM_WORLD, 1);\n");  // Otherwise the other ranks wait forever at the next exchange.
             result.append ("    return 1;\n");
             result.append ("  }\n");
             result.append ("  catch (...)\n");
             result.append ("  {\n");
             result.append ("    cerr << \"Generic Exception\" << endl;\n");
+            if (mpi) result.append ("    MPI_Abort (MPI_COMM_WORLD, 1);\n");
             result.append ("    return 1;\n");
             result.append ("  }\n");
             result.append ("  return 0;\n");
@@ -1335,6 +1770,26 @@ public class JobC extends Thread
         Files.copy (new ByteArrayInputStream (result.toString ().getBytes ("UTF-8")), source);
     }
 
+    /**
+        Determines whether update() and updateDerivative() can run concurrently on separate threads.
+        This requires that no part writes into the buffers of another part, and that no shared IO
+        object is touched, since those phases are not otherwise synchronized.
+        Must be called after generateStatic(), which collects the IO objects.
+    **/
+    public boolean threadSafeUpdate (EquationSet s)
+    {
+        if (! mainInput.isEmpty ()  ||  ! mainOutput.isEmpty ()  ||  ! mainImageInput.isEmpty ()  ||  ! mainImageOutput.isEmpty ()  ||  ! mainExtension.isEmpty ()) return false;
+        return threadSafeUpdateRecursive (s);
+    }
+
+    public boolean threadSafeUpdateRecursive (EquationSet s)
+    {
+        BackendDataC bed = (BackendDataC) s.backendData;
+        if (! bed.localBufferedExternalWrite.isEmpty ()  ||  ! bed.globalBufferedExternalWrite.isEmpty ()) return false;
+        for (EquationSet p : s.parts) if (! threadSafeUpdateRecursive (p)) return false;
+        return true;
+    }
+
     public void generateClassList (EquationSet s, StringBuilder result)
     {
         for (EquationSet p : s.parts) generateClassList (p, result);
@@ -1497,6 +1952,15 @@ public class JobC extends Thread
                                         outputNames.put (fileName, o.name);
                                         mainOutput.add (o);
                                     }
+
+                                    // With both holder and column name fixed, trace() only needs to look up the column once.
+                                    boolean fixedColumn =  ! o.hasColumnName  ||  o.operands[2] instanceof Constant  &&  ((Constant) o.operands[2]).value instanceof Text;
+                                    if (fixedColumn  &&  ! o.getKeywordFlag ("raw")  &&  ! (o.operands[1].getType () instanceof Matrix))
+                                    {
+                                        List<String> handles = context.global ? bed.globalHandles : bed.localHandles;
+                                        o.columnHandle = "columnHandle" + handles.size ();
+                                        handles.add (o.columnHandle);
+                                    }
                                 }
                                 else if (f instanceof ReadImage)
                                 {
@@ -1727,6 +2191,7 @@ public class JobC extends Thread
             boolean time   = smooth  ||  i.getKeywordFlag ("time");
             if (time)   result.append ("  " + i.name + "->time = true;\n");
             if (smooth) result.append ("  " + i.name + "->smooth = true;\n");
+            if (i.getKeywordFlag ("index")) result.append ("  " + i.name + "->indexed = true;\n");
         }
         for (Output o : mainOutput)
         {
@@ -1947,6 +2412,15 @@ public class JobC extends Thread
             {
                 result.append ("  int firstborn;\n");
             }
+            if (bed.offload)
+            {
+                for (Variable v : bed.offloadColumns)
+                {
+                    result.append ("  OffloadColumn<" + type (v) + "> " + mangle ("column_", v) + ";\n");
+                }
+                result.append ("  int offloadCount = 0;\n");     // Number of instances in the columns as of the last upload.
+                result.append ("  bool offloadDirty = true;\n");  // Parts hold the current state, so the columns must be gathered again before the next kernel.
+            }
         }
         if (bed.poll >= 0)
         {
@@ -1973,6 +2447,10 @@ public class JobC extends Thread
         {
             result.append ("  String " + columnName + ";\n");
         }
+        for (String columnHandle : bed.globalHandles)
+        {
+            result.append ("  int " + columnHandle + " = -1;\n");
+        }
         if (! bed.globalFlagType.isEmpty ())
         {
             // This should come last, because it can affect alignment.
@@ -1992,14 +2470,27 @@ public class JobC extends Thread
         if (! bed.singleton)
         {
             result.append ("  virtual Part<" + T + "> * create ();\n");
-            if (bed.index != null  ||  bed.poll >= 0)
+            boolean batch = batch (s);
+            if (bed.index != null  ||  bed.poll >= 0  ||  batch  ||  bed.parallelInit)
             {
                 result.append ("  virtual void add (Part<" + T + "> * part);\n");
-                if (bed.trackInstances  ||  bed.poll >= 0)
+                if (bed.trackInstances  ||  bed.poll >= 0  ||  batch)
                 {
                     result.append ("  virtual void remove (Part<" + T + "> * part);\n");
                 }
             }
+            if (batch)
+            {
+                result.append ("  virtual void integrateAll (" + T + " dt, int begin, int end);\n");
+            }
+            if (bed.offload)
+            {
+                result.append ("  void offloadSync ();\n");  // Scatter columns back into parts, before batch membership changes.
+            }
+            if (contiguous (s))
+            {
+                result.append ("  virtual void reserveStorage (int n);\n");
+            }
         }
         if (bed.needGlobalInit)
         {
@@ -2038,12 +2529,22 @@ public class JobC extends Thread
             result.append ("  virtual void snapshot ();\n");
             result.append ("  virtual void restore ();\n");
         }
+        if (checkpoint > 0)
+        {
+            result.append ("  virtual void serialize (Checkpoint<" + T + "> & c);\n");
+        }
         if (bed.needGlobalDerivative)
         {
             result.append ("  virtual void pushDerivative ();\n");
             result.append ("  virtual void multiplyAddToStack (" + T + " scalar);\n");
             result.append ("  virtual void multiply (" + T + " scalar);\n");
             result.append ("  virtual void addToMembers ();\n");
+            if (adaptive)
+            {
+                result.append ("  virtual void stageCombine (int count, const " + T + " * a, " + T + " h);\n");
+                result.append ("  virtual " + T + " stageError (int count, const " + T + " * e, " + T + " h, " + T + " atol, " + T + " rtol);\n");
+                result.append ("  virtual void popDerivative (int count);\n");
+            }
         }
         if (bed.populationCanBeInactive  ||  bed.poll >= 0)
         {
@@ -2144,6 +2645,10 @@ public class JobC extends Thread
         {
             result.append ("  int refcount;\n");
         }
+        if (batch (s))
+        {
+            result.append ("  int batchIndex;\n");  // Position in population's batch list
+        }
         if (bed.index != null)
         {
             result.append ("  int " + mangle ("$index") + ";\n");
@@ -2168,11 +2673,15 @@ public class JobC extends Thread
         {
             result.append ("  String " + columnName + ";\n");
         }
+        for (String columnHandle : bed.localHandles)
+        {
+            result.append ("  int " + columnHandle + " = -1;\n");
+        }
         for (EventSource es : bed.eventSources)
         {
             String eventMonitor = "eventMonitor_" + prefix (es.target.container);
             if (es.monitorIndex > 0) eventMonitor += "_" + es.monitorIndex;
-            result.append ("  std::vector<Part<" + T + "> *> " + eventMonitor + ";\n");
+            result.append ("  SynapseRow<" + T + "> " + eventMonitor + ";\n");
         }
         for (EventTarget et : bed.eventTargets)
         {
@@ -2193,11 +2702,18 @@ public class JobC extends Thread
         for (Delay d : bed.delays)
         {
             d.index = i++;
-            result.append ("  DelayBuffer<" + T + "> delay" + d.index + ";\n");
+            String buffer = delaySteps (d, s) > 0 ? "DelayBufferRing" : "DelayBuffer";
+            result.append ("  " + buffer + "<" + T + "> delay" + d.index + ";\n");
         }
         result.append ("\n");
 
         // Unit functions
+        if (contiguous (s))
+        {
+            result.append ("  static PartArena arena;\n");
+            result.append ("  static void * operator new    (size_t size) {return arena.allocate ();}\n");
+            result.append ("  static void   operator delete (void * p)    {arena.release (p);}\n");
+        }
         if (bed.needLocalCtor)
         {
             result.append ("  " + prefix (s) + " ();\n");
@@ -2226,16 +2742,18 @@ public class JobC extends Thread
         if (bed.refcount)
         {
             result.append ("  virtual bool isFree ();\n");
+            result.append ("  void release ();\n");  // Drop one reference. Not virtual because caller always knows our exact class.
         }
         if (bed.needLocalInit)
         {
             result.append ("  virtual void init ();\n");
         }
-        if (bed.needLocalIntegrate)
+        if (bed.needLocalIntegrate  &&  ! bed.offload)  // An offloaded population integrates its instances inside the kernel.
         {
-            result.append ("  virtual void integrate ();\n");
+            if (batch (s)) result.append ("  void integrateBatch (" + T + " dt);\n");  // Called only by population's integrateAll().
+            else           result.append ("  virtual void integrate ();\n");
         }
-        if (bed.needLocalUpdate)
+        if (bed.needLocalUpdate  &&  (! bed.offload  ||  ! bed.offloadHost.isEmpty ()))
         {
             result.append ("  virtual void update ();\n");
         }
@@ -2256,12 +2774,22 @@ public class JobC extends Thread
             result.append ("  virtual void snapshot ();\n");
             result.append ("  virtual void restore ();\n");
         }
+        if (checkpoint > 0)
+        {
+            result.append ("  virtual void serialize (Checkpoint<" + T + "> & c);\n");
+        }
         if (bed.needLocalDerivative)
         {
             result.append ("  virtual void pushDerivative ();\n");
             result.append ("  virtual void multiplyAddToStack (" + T + " scalar);\n");
             result.append ("  virtual void multiply (" + T + " scalar);\n");
             result.append ("  virtual void addToMembers ();\n");
+            if (adaptive)
+            {
+                result.append ("  virtual void stageCombine (int count, const " + T + " * a, " + T + " h);\n");
+                result.append ("  virtual " + T + " stageError (int count, const " + T + " * e, " + T + " h, " + T + " atol, " + T + " rtol);\n");
+                result.append ("  virtual void popDerivative (int count);\n");
+            }
         }
         if (bed.connectionCanBeInactive)
         {
@@ -2287,6 +2815,10 @@ public class JobC extends Thread
             }
             result.append ("  virtual void setPart (int i, Part<" + T + "> * part);\n");
             result.append ("  virtual Part<" + T + "> * getPart (int i);\n");
+            if (mpi  &&  bed.eventTargets.size () > 0)
+            {
+                result.append ("  virtual void getMonitors (std::vector<std::pair<Part<" + T + "> *, SynapseRow<" + T + "> *>> & result);\n");
+            }
         }
         if (bed.newborn >= 0)
         {
@@ -2405,6 +2937,10 @@ public class JobC extends Thread
                 {
                     result.append ("  firstborn = 0;\n");
                 }
+                if (bed.parallelInit)
+                {
+                    result.append ("  parallelInit = true;\n");
+                }
             }
             if (bed.needGlobalDerivative)
             {
@@ -2450,14 +2986,26 @@ public class JobC extends Thread
             result.append ("  return p;\n");
             result.append ("}\n");
             result.append ("\n");
+
+            if (contiguous (s))
+            {
+                result.append ("void " + ns + "reserveStorage (int n)\n");
+                result.append ("{\n");
+                result.append ("  " + ps + "::arena.reserve (n);\n");
+                result.append ("}\n");
+                result.append ("\n");
+            }
         }
 
         // Population add / remove
-        if (! bed.singleton  &&  (bed.index != null  ||  bed.poll >= 0))
+        boolean batch = batch (s);
+        if (! bed.singleton  &&  (bed.index != null  ||  bed.poll >= 0  ||  batch  ||  bed.parallelInit))
         {
             result.append ("void " + ns + "add (Part<" + T + "> * part)\n");
             result.append ("{\n");
-            result.append ("  " + ps + " * p = (" + ps + " *) part;\n");
+            if (bed.index != null  ||  bed.poll >= 0  ||  batch) result.append ("  " + ps + " * p = (" + ps + " *) part;\n");
+            if (bed.offload) result.append ("  offloadSync ();\n");
+            if (bed.parallelInit  &&  bed.trackN) result.append ("  n++;\n");
             if (bed.trackInstances)
             {
                 result.append ("  if (p->" + mangle ("$index") + " < 0)\n");
@@ -2483,17 +3031,31 @@ public class JobC extends Thread
             {
                 result.append ("  pollSorted.insert (p);\n");
             }
+            if (batch)
+            {
+                Variable dt = s.findDt ();
+                result.append ("  p->batchIndex = addBatch (p, " + context.print (((Scalar) dt.type).value, dt.exponent) + (bed.offload ? ", true" : "") + ");\n");
+            }
             result.append ("}\n");
             result.append ("\n");
 
-            if (bed.trackInstances  ||  bed.poll >= 0)
+            if (bed.trackInstances  ||  bed.poll >= 0  ||  batch)
             {
                 result.append ("void " + ns + "remove (Part<" + T + "> * part)\n");
                 result.append ("{\n");
                 result.append ("  " + ps + " * p = (" + ps + " *) part;\n");
+                if (bed.offload) result.append ("  offloadSync ();\n");
+                if (batch)
+                {
+                    result.append ("  Part<" + T + "> * moved = removeBatch (p->batchIndex);\n");
+                    result.append ("  if (moved) ((" + ps + " *) moved)->batchIndex = p->batchIndex;\n");
+                }
                 if (bed.trackInstances)
                 {
                     result.append ("  instances[p->" + mangle ("$index") + "] = 0;\n");
+                }
+                if (bed.trackInstances  ||  batch)
+                {
                     result.append ("  Population<" + T + ">::remove (part);\n");
                 }
                 if (bed.poll >= 0)
@@ -2505,35 +3067,172 @@ public class JobC extends Thread
             }
         }
 
-        // Population init
-        if (bed.needGlobalInit)
+        // Population offloadSync / integrateAll
+        if (bed.offload)
         {
-            bed.defined.clear ();
-            result.append ("void " + ns + "init ()\n");
+            // Only columns that the kernel changes need to be copied back.
+            // Traced columns are copied back after every kernel, while the rest wait for offloadSync().
+            List<Variable> traced   = new ArrayList<Variable> ();
+            List<Variable> untraced = new ArrayList<Variable> ();
+            for (Variable v : bed.offloadColumns)
+            {
+                if (! bed.localIntegrated.contains (v)  &&  ! bed.offloadDevice.contains (v)) continue;
+                if (bed.offloadTraced.contains (v)) traced  .add (v);
+                else                                untraced.add (v);
+            }
+
+            result.append ("void " + ns + "offloadSync ()\n");
             result.append ("{\n");
-            s.setInit (1);
-            //   Zero out members
-            for (Variable v : bed.globalMembers)
+            result.append ("  if (offloadDirty) return;\n");
+            if (! untraced.isEmpty ())
             {
-                result.append ("  " + zero (mangle (v), v) + ";\n");
+                for (Variable v : untraced)
+                {
+                    result.append ("  " + mangle ("column_", v) + ".download (offloadCount);\n");
+                }
+                result.append ("  for (int i = 0; i < offloadCount; i++)\n");
+                result.append ("  {\n");
+                result.append ("    " + ps + " * p = (" + ps + " *) batch[i];\n");
+                for (Variable v : untraced)
+                {
+                    result.append ("    p->" + mangle (v) + " = " + mangle ("column_", v) + ".data[i];\n");
+                }
+                result.append ("  }\n");
             }
-            for (Variable v : bed.globalBufferedExternal)
+            result.append ("  offloadDirty = true;\n");
+            result.append ("}\n");
+            result.append ("\n");
+
+            result.append ("void " + ns + "integrateAll (" + T + " dt, int begin, int end)\n");  // begin and end always cover the whole batch. See Population::offload in runtime.h.
+            result.append ("{\n");
+            if (kokkos  ||  profile) result.append ("  push_region (\"" + ns + "integrateAll()\");\n");
+            result.append ("  int count = batch.size ();\n");
+            result.append ("  if (offloadDirty)\n");
+            result.append ("  {\n");
+            for (Variable v : bed.offloadColumns)
             {
-                result.append ("  " + clearAccumulator (mangle ("next_", v), v, context) + ";\n");
-                result.append ("  " + clearAccumulator (mangle (         v), v, context) + ";\n");
+                result.append ("    " + mangle ("column_", v) + ".reserve (count);\n");
             }
-            if (! bed.globalFlagType.isEmpty ())
+            result.append ("    for (int i = 0; i < count; i++)\n");
+            result.append ("    {\n");
+            result.append ("      " + ps + " * p = (" + ps + " *) batch[i];\n");
+            for (Variable v : bed.offloadColumns)
             {
-                result.append ("  flags = 0;\n");
+                result.append ("      " + mangle ("column_", v) + ".data[i] = p->" + mangle (v) + ";\n");
             }
-            //   Compute variables
-            if (bed.nInitOnly)  // $n is not stored, so we need to declare a local variable to receive its value.
+            result.append ("    }\n");
+            for (Variable v : bed.offloadColumns)
             {
-                result.append ("  " + type (bed.n) + " " + mangle (bed.n) + ";\n");
+                result.append ("    " + mangle ("column_", v) + ".upload (count);\n");
             }
-            s.simplify ("$init", bed.globalInit);
-            if (T.contains ("int")) EquationSet.determineExponentsSimplified (bed.globalInit);
-            EquationSet.determineOrderInit (bed.globalInit);
+            result.append ("    offloadCount = count;\n");
+            result.append ("    offloadDirty = false;\n");
+            result.append ("  }\n");
+            for (Variable v : bed.offloadColumns)
+            {
+                result.append ("  " + type (v) + " * " + mangle ("device_", v) + " = " + mangle ("column_", v) + ".data;\n");
+            }
+
+            // Kernel
+            // The body is rendered as if it were in the part, with each member replaced by a local variable of the same name.
+            context.global = false;
+            bed.defined.clear ();
+            result.append ("  #pragma omp target teams distribute parallel for\n");
+            result.append ("  for (int i = 0; i < count; i++)\n");
+            result.append ("  {\n");
+            for (Variable v : bed.offloadColumns)
+            {
+                result.append ("    " + type (v) + " " + mangle (v) + " = " + mangle ("device_", v) + "[i];\n");
+            }
+            for (Variable v : bed.localIntegrated)
+            {
+                result.append ("    " + resolve (v.reference, context, false) + " += " + resolve (v.derivative.reference, context, false) + " * dt;\n");
+            }
+            List<Variable> buffered = new ArrayList<Variable> (bed.localBufferedInternalUpdate);
+            buffered.retainAll (bed.offloadDevice);
+            for (Variable v : buffered)
+            {
+                result.append ("    " + type (v) + " " + mangle ("next_", v) + ";\n");
+            }
+            List<Variable> update = new ArrayList<Variable> (bed.offloadDevice);
+            s.simplify ("$live", update);
+            for (Variable v : update)
+            {
+                multiconditional (v, context, "    ");
+            }
+            for (Variable v : buffered)
+            {
+                result.append ("    " + mangle (v) + " = " + mangle ("next_", v) + ";\n");
+            }
+            for (Variable v : traced)
+            {
+                result.append ("    " + mangle ("device_", v) + "[i] = " + mangle (v) + ";\n");
+            }
+            for (Variable v : untraced)
+            {
+                result.append ("    " + mangle ("device_", v) + "[i] = " + mangle (v) + ";\n");
+            }
+            result.append ("  }\n");
+            context.global = true;
+
+            // Copy back state needed by update() on the host.
+            if (! traced.isEmpty ())
+            {
+                for (Variable v : traced)
+                {
+                    result.append ("  " + mangle ("column_", v) + ".download (count);\n");
+                }
+                result.append ("  for (int i = 0; i < count; i++)\n");
+                result.append ("  {\n");
+                result.append ("    " + ps + " * p = (" + ps + " *) batch[i];\n");
+                for (Variable v : traced)
+                {
+                    result.append ("    p->" + mangle (v) + " = " + mangle ("column_", v) + ".data[i];\n");
+                }
+                result.append ("  }\n");
+            }
+            if (kokkos  ||  profile) result.append ("  pop_region ();\n");
+            result.append ("}\n");
+            result.append ("\n");
+        }
+        else if (batch)
+        {
+            result.append ("void " + ns + "integrateAll (" + T + " dt, int begin, int end)\n");
+            result.append ("{\n");
+            result.append ("  for (int i = begin; i < end; i++) ((" + ps + " *) batch[i])->integrateBatch (dt);\n");  // Non-virtual call, so compiler can inline body into loop.
+            result.append ("}\n");
+            result.append ("\n");
+        }
+
+        // Population init
+        if (bed.needGlobalInit)
+        {
+            bed.defined.clear ();
+            result.append ("void " + ns + "init ()\n");
+            result.append ("{\n");
+            s.setInit (1);
+            //   Zero out members
+            for (Variable v : bed.globalMembers)
+            {
+                result.append ("  " + zero (mangle (v), v) + ";\n");
+            }
+            for (Variable v : bed.globalBufferedExternal)
+            {
+                result.append ("  " + clearAccumulator (mangle ("next_", v), v, context) + ";\n");
+                result.append ("  " + clearAccumulator (mangle (         v), v, context) + ";\n");
+            }
+            if (! bed.globalFlagType.isEmpty ())
+            {
+                result.append ("  flags = 0;\n");
+            }
+            //   Compute variables
+            if (bed.nInitOnly)  // $n is not stored, so we need to declare a local variable to receive its value.
+            {
+                result.append ("  " + type (bed.n) + " " + mangle (bed.n) + ";\n");
+            }
+            s.simplify ("$init", bed.globalInit);
+            if (T.contains ("int")) EquationSet.determineExponentsSimplified (bed.globalInit);
+            EquationSet.determineOrderInit (bed.globalInit);
             for (Variable v : bed.globalInit)
             {
                 multiconditional (v, context, "  ");
@@ -2553,6 +3252,7 @@ public class JobC extends Thread
             {
                 if (bed.n != null)  // and not singleton, so trackN is true
                 {
+                    if (partitioned (s)) result.append ("  " + SIMULATOR + "distributed.add (this);\n");
                     result.append ("  resize (" + resolve (bed.n.reference, context, bed.nInitOnly));
                     if (context.useExponent) result.append (RendererC.printShift (bed.n.exponent - Operator.MSB));
                     result.append (");\n");
@@ -2573,7 +3273,7 @@ public class JobC extends Thread
         {
             result.append ("void " + ns + "integrate ()\n");
             result.append ("{\n");
-            if (kokkos) result.append ("  push_region (\"" + ns + "integrate()\");\n");
+            if (kokkos  ||  profile) result.append ("  push_region (\"" + ns + "integrate()\");\n");
             result.append ("  EventStep<" + T + "> * event = getEvent ();\n");
             context.hasEvent = true;
             result.append ("  " + T + " dt = event->dt;\n");
@@ -2613,7 +3313,7 @@ public class JobC extends Thread
             }
             result.append ("  }\n");
             context.hasEvent = false;
-            if (kokkos) result.append ("  pop_region ();\n");
+            if (kokkos  ||  profile) result.append ("  pop_region ();\n");
             result.append ("}\n");
             result.append ("\n");
         }
@@ -2624,7 +3324,7 @@ public class JobC extends Thread
             bed.defined.clear ();
             result.append ("void " + ns + "update ()\n");
             result.append ("{\n");
-            if (kokkos) result.append ("  push_region (\"" + ns + "update()\");\n");
+            if (kokkos  ||  profile) result.append ("  push_region (\"" + ns + "update()\");\n");
             for (Variable v : bed.globalBufferedInternalUpdate)
             {
                 result.append ("  " + type (v) + " " + mangle ("next_", v) + ";\n");
@@ -2639,7 +3339,7 @@ public class JobC extends Thread
             {
                 result.append ("  " + mangle (v) + " = " + mangle ("next_", v) + ";\n");
             }
-            if (kokkos) result.append ("  pop_region ();\n");
+            if (kokkos  ||  profile) result.append ("  pop_region ();\n");
             result.append ("}\n");
             result.append ("\n");
         }
@@ -2799,7 +3499,7 @@ public class JobC extends Thread
             bed.defined.clear ();
             result.append ("void " + ns + "updateDerivative ()\n");
             result.append ("{\n");
-            if (kokkos) result.append ("  push_region (\"" + ns + "updateDerivative()\");\n");
+            if (kokkos  ||  profile) result.append ("  push_region (\"" + ns + "updateDerivative()\");\n");
             for (Variable v : bed.globalBufferedInternalDerivative)
             {
                 result.append ("  " + type (v) + " " + mangle ("next_", v) + ";\n");
@@ -2814,7 +3514,7 @@ public class JobC extends Thread
             {
                 result.append ("  " + mangle (v) + " = " + mangle ("next_", v) + ";\n");
             }
-            if (kokkos) result.append ("  pop_region ();\n");
+            if (kokkos  ||  profile) result.append ("  pop_region ();\n");
             result.append ("}\n");
             result.append ("\n");
         }
@@ -2875,13 +3575,77 @@ public class JobC extends Thread
             result.append ("\n");
         }
 
+        if (checkpoint > 0)
+        {
+            // Population serialize
+            result.append ("void " + ns + "serialize (Checkpoint<" + T + "> & c)\n");
+            result.append ("{\n");
+            if (bed.offload)
+            {
+                result.append ("  if (! c.loading) offloadSync ();\n");  // Parts must hold the current state before they are written.
+            }
+            result.append ("  Population<" + T + ">::serialize (c);\n");
+            if (bed.singleton)
+            {
+                result.append ("  c.part (&instance);\n");
+                result.append ("  instance.serialize (c);\n");
+            }
+            else
+            {
+                if (bed.trackN)
+                {
+                    result.append ("  c.io (n);\n");
+                }
+                if (bed.trackInstances)
+                {
+                    result.append ("  c.instances (instances, this);\n");
+                }
+                else if (bed.index != null)
+                {
+                    result.append ("  c.io (nextIndex);\n");
+                }
+                if (bed.newborn >= 0)
+                {
+                    result.append ("  c.io (firstborn);\n");
+                }
+            }
+            if (bed.poll >= 0)
+            {
+                result.append ("  c.io (pollDeadline);\n");
+                // The hash of each entry depends on its endpoints, so wait until they are translated.
+                result.append ("  if (c.loading) c.deferred.push_back ([this] () {for (auto p : instances) if (p) pollSorted.insert (p);});\n");
+            }
+            for (Variable v : bed.globalMembers)
+            {
+                result.append ("  c.io (" + mangle (v) + ");\n");
+            }
+            for (Variable v : bed.globalBufferedExternal)
+            {
+                result.append ("  c.io (" + mangle ("next_", v) + ");\n");
+            }
+            for (String columnName : bed.globalColumns)
+            {
+                result.append ("  c.io (" + columnName + ");\n");
+            }
+            for (String columnHandle : bed.globalHandles)
+            {
+                result.append ("  c.io (" + columnHandle + ");\n");
+            }
+            if (! bed.globalFlagType.isEmpty ())
+            {
+                result.append ("  c.io (flags);\n");
+            }
+            result.append ("}\n");
+            result.append ("\n");
+        }
+
         if (bed.needGlobalDerivative)
         {
             // Population pushDerivative
             result.append ("void " + ns + "pushDerivative ()\n");
             result.append ("{\n");
             result.append ("  Derivative * temp = new Derivative;\n");
-            result.append ("  temp->_next = stackDerivative;\n");
+            result.append ("  temp->next = stackDerivative;\n");
             result.append ("  stackDerivative = temp;\n");
             for (Variable v : bed.globalDerivative)
             {
@@ -2937,6 +3701,8 @@ public class JobC extends Thread
             result.append ("  delete temp;\n");
             result.append ("}\n");
             result.append ("\n");
+
+            if (adaptive) generateStages (context, ns, bed.globalIntegrated, bed.globalDerivative);
         }
 
         // Population connect (override for polling or inactive testing)
@@ -2984,6 +3750,19 @@ public class JobC extends Thread
                 result.append ("    outer->setProbe (c);\n");
                 result.append ("    while (outer->next ())\n");
                 result.append ("    {\n");
+                if (mpi)
+                {
+                    result.append ("      int placement = " + SIMULATOR + "distributed.place (c);\n");
+                    result.append ("      if (placement != Distributed<" + T + ">::local)\n");
+                    result.append ("      {\n");
+                    result.append ("        if (placement == Distributed<" + T + ">::tester)\n");  // c now belongs to distributed
+                    result.append ("        {\n");
+                    result.append ("          c = (" + ps + " *) create ();\n");
+                    result.append ("          outer->setProbe (c);\n");
+                    result.append ("        }\n");
+                    result.append ("        continue;\n");
+                    result.append ("      }\n");
+                }
                 result.append ("      " + T + " p = c->getP ();\n");
                 result.append ("      if (p <= 0) continue;\n");
                 result.append ("      if (p < 1  &&  p < uniform<" + T + "> ()");
@@ -2995,6 +3774,7 @@ public class JobC extends Thread
                 result.append ("      c->enterSimulation ();\n");
                 result.append ("      event->enqueue (c);\n");
                 result.append ("      c->init ();\n");
+                if (mpi) result.append ("      " + SIMULATOR + "distributed.subscribe (c);\n");
                 result.append ("\n");
                 result.append ("      c = (" + ps + " *) create ();\n");
                 result.append ("      outer->setProbe (c);\n");
@@ -3086,6 +3866,8 @@ public class JobC extends Thread
                     else
                     {
                         result.append ("      result = new ConnectPopulationNN<" + T + "> (i, poll);\n");  // Pulls in KDTree dependencies, for full NN support.
+                        // Existing instances don't move, so the KDTree can be kept and updated with only the newborn parts.
+                        if (s.metadata.getOrDefault ("", "backend", "c", "nn").equals ("incremental")) result.append ("      result->incremental = true;\n");
                     }
 
                     boolean testK      = false;
@@ -3340,6 +4122,12 @@ public class JobC extends Thread
         context.global = false;
         String ns = prefix (s) + "::";
 
+        if (contiguous (s))
+        {
+            result.append ("PartArena " + ns + "arena (sizeof (" + prefix (s) + "));\n");
+            result.append ("\n");
+        }
+
         // Unit ctor
         if (bed.needLocalCtor)
         {
@@ -3503,7 +4291,7 @@ public class JobC extends Thread
             for (VariableReference r : bed.localReference)
             {
                 String container = resolveContainer (r, context, "");
-                if (touched.add (container)) result.append ("  " + container + "refcount--;\n");
+                if (touched.add (container)) result.append ("  " + container + "release ();\n");
             }
             result.append ("}\n");
             result.append ("\n");
@@ -3517,6 +4305,20 @@ public class JobC extends Thread
             result.append ("  return refcount == 0;\n");
             result.append ("}\n");
             result.append ("\n");
+
+            // If we already left the simulation, then the last reference going away lets our population reuse us.
+            result.append ("void " + ns + "release ()\n");
+            result.append ("{\n");
+            if (bed.singleton)
+            {
+                result.append ("  refcount--;\n");
+            }
+            else
+            {
+                result.append ("  if (--refcount == 0) " + containerOf (s, false, "") + mangle (s.name) + ".reclaim (this);\n");
+            }
+            result.append ("}\n");
+            result.append ("\n");
         }
 
         // Unit init
@@ -3619,7 +4421,7 @@ public class JobC extends Thread
             }
 
             // instance counting
-            if (bed.trackN) result.append ("  " + containerOf (s, false, "") + mangle (s.name) + ".n++;\n");
+            if (bed.trackN  &&  ! bed.parallelInit) result.append ("  " + containerOf (s, false, "") + mangle (s.name) + ".n++;\n");  // Otherwise done by Population::add(). See analyzeParallelInit().
 
             for (String alias : bed.accountableEndpoints)
             {
@@ -3659,14 +4461,20 @@ public class JobC extends Thread
         }
 
         // Unit integrate
-        if (bed.needLocalIntegrate)
+        if (bed.needLocalIntegrate  &&  ! bed.offload)
         {
-            result.append ("void " + ns + "integrate ()\n");
+            boolean batch = batch (s);
+            if (batch) result.append ("void " + ns + "integrateBatch (" + T + " dt)\n");
+            else       result.append ("void " + ns + "integrate ()\n");
             result.append ("{\n");
-            if (kokkos) result.append ("  push_region (\"" + ns + "integrate()\");\n");
+            if (kokkos  ||  profile) result.append ("  push_region (\"" + ns + "integrate()\");\n");
             if (bed.localIntegrated.size () > 0)
             {
-                if (bed.lastT)
+                if (batch)
+                {
+                    // dt is passed in by population
+                }
+                else if (bed.lastT)
                 {
                     result.append ("  " + T + " dt = " + SIMULATOR + "currentEvent->t - lastT;\n");
                 }
@@ -3739,31 +4547,43 @@ public class JobC extends Thread
                 }
             }
             context.hasEvent = false;
-            if (kokkos) result.append ("  pop_region ();\n");
+            if (kokkos  ||  profile) result.append ("  pop_region ();\n");
             result.append ("}\n");
             result.append ("\n");
         }
 
         // Unit update
-        if (bed.needLocalUpdate)
+        if (bed.needLocalUpdate  &&  (! bed.offload  ||  ! bed.offloadHost.isEmpty ()))
         {
             bed.defined.clear ();
             result.append ("void " + ns + "update ()\n");
             result.append ("{\n");
-            if (kokkos) result.append ("  push_region (\"" + ns + "update()\");\n");
-            for (Variable v : bed.localBufferedInternalUpdate)
-            {
-                result.append ("  " + type (v) + " " + mangle ("next_", v) + ";\n");
-            }
-            s.simplify ("$live", bed.localUpdate);
-            if (T.contains ("int")) EquationSet.determineExponentsSimplified (bed.localUpdate);
-            for (Variable v : bed.localUpdate)
+            if (kokkos  ||  profile) result.append ("  push_region (\"" + ns + "update()\");\n");
+            if (bed.offload)  // Only the variables that could not go into the kernel. None of them are buffered. See analyzeOffload().
             {
-                multiconditional (v, context, "  ");
+                List<Variable> update = new ArrayList<Variable> (bed.offloadHost);
+                s.simplify ("$live", update);
+                for (Variable v : update)
+                {
+                    multiconditional (v, context, "  ");
+                }
             }
-            for (Variable v : bed.localBufferedInternalUpdate)
+            else
             {
-                result.append ("  " + mangle (v) + " = " + mangle ("next_", v) + ";\n");
+                for (Variable v : bed.localBufferedInternalUpdate)
+                {
+                    result.append ("  " + type (v) + " " + mangle ("next_", v) + ";\n");
+                }
+                s.simplify ("$live", bed.localUpdate);
+                if (T.contains ("int")) EquationSet.determineExponentsSimplified (bed.localUpdate);
+                for (Variable v : bed.localUpdate)
+                {
+                    multiconditional (v, context, "  ");
+                }
+                for (Variable v : bed.localBufferedInternalUpdate)
+                {
+                    result.append ("  " + mangle (v) + " = " + mangle ("next_", v) + ";\n");
+                }
             }
             // contained populations
             for (EquationSet e : s.parts)
@@ -3773,7 +4593,7 @@ public class JobC extends Thread
                     result.append ("  " + mangle (e.name) + ".update ();\n");
                 }
             }
-            if (kokkos) result.append ("  pop_region ();\n");
+            if (kokkos  ||  profile) result.append ("  pop_region ();\n");
             result.append ("}\n");
             result.append ("\n");
         }
@@ -3825,7 +4645,14 @@ public class JobC extends Thread
                 }
                 else  // All monitors share same condition, so only test one.
                 {
-                    result.append ("  if (! " + eventMonitor + ".empty ()  &&  " + eventMonitor + "[0]->eventTest (" + et.valueIndex + "))\n");
+                    if (mpi  &&  ! es.delayEach)  // The tester stands in when all monitors are on other ranks.
+                    {
+                        result.append ("  if (" + eventMonitor + ".listened ()  &&  " + eventMonitor + ".probe ()->eventTest (" + et.valueIndex + "))\n");
+                    }
+                    else
+                    {
+                        result.append ("  if (! " + eventMonitor + ".empty ()  &&  " + eventMonitor + ".first ()->eventTest (" + et.valueIndex + "))\n");
+                    }
                     result.append ("  {\n");
                     if (es.delayEach)  // Each target instance may require a different delay.
                     {
@@ -4016,7 +4843,7 @@ public class JobC extends Thread
             bed.defined.clear ();
             result.append ("void " + ns + "updateDerivative ()\n");
             result.append ("{\n");
-            if (kokkos) result.append ("  push_region (\"" + ns + "updateDerivative()\");\n");
+            if (kokkos  ||  profile) result.append ("  push_region (\"" + ns + "updateDerivative()\");\n");
             for (Variable v : bed.localBufferedInternalDerivative)
             {
                 result.append ("  " + type (v) + " " + mangle ("next_", v) + ";\n");
@@ -4039,7 +4866,7 @@ public class JobC extends Thread
                     result.append ("  " + mangle (e.name) + ".updateDerivative ();\n");
                 }
             }
-            if (kokkos) result.append ("  pop_region ();\n");
+            if (kokkos  ||  profile) result.append ("  pop_region ();\n");
             result.append ("}\n");
             result.append ("\n");
         }
@@ -4128,6 +4955,90 @@ public class JobC extends Thread
             result.append ("\n");
         }
 
+        if (checkpoint > 0)
+        {
+            // Unit serialize
+            result.append ("void " + ns + "serialize (Checkpoint<" + T + "> & c)\n");
+            result.append ("{\n");
+            if (s.connectionBindings != null)
+            {
+                for (ConnectionBinding c : s.connectionBindings)
+                {
+                    result.append ("  c.pointer (" + mangle (c.alias) + ");\n");
+                }
+            }
+            if (s.accountableConnections != null)
+            {
+                for (EquationSet.AccountableConnection ac : s.accountableConnections)
+                {
+                    result.append ("  c.io (" + prefix (ac.connection) + "_" + mangle (ac.alias) + "_count);\n");
+                }
+            }
+            if (bed.refcount)
+            {
+                result.append ("  c.io (refcount);\n");
+            }
+            if (batch (s))
+            {
+                result.append ("  c.io (batchIndex);\n");
+            }
+            if (bed.index != null)
+            {
+                result.append ("  c.io (" + mangle ("$index") + ");\n");
+            }
+            if (bed.lastT)
+            {
+                result.append ("  c.io (lastT);\n");
+            }
+            for (Variable v : bed.localMembers)
+            {
+                result.append ("  c.io (" + mangle (v) + ");\n");
+            }
+            for (Variable v : bed.localBufferedExternal)
+            {
+                result.append ("  c.io (" + mangle ("next_", v) + ");\n");
+            }
+            for (String columnName : bed.localColumns)
+            {
+                result.append ("  c.io (" + columnName + ");\n");
+            }
+            for (String columnHandle : bed.localHandles)
+            {
+                result.append ("  c.io (" + columnHandle + ");\n");
+            }
+            for (EventSource es : bed.eventSources)
+            {
+                String eventMonitor = "eventMonitor_" + prefix (es.target.container);
+                if (es.monitorIndex > 0) eventMonitor += "_" + es.monitorIndex;
+                result.append ("  c.io (" + eventMonitor + ");\n");
+            }
+            for (EventTarget et : bed.eventTargets)
+            {
+                if (! et.trackOne  &&  et.edge != EventTarget.NONZERO)
+                {
+                    result.append ("  c.io (" + mangle (et.track.name) + ");\n");
+                }
+                if (et.timeIndex >= 0)
+                {
+                    result.append ("  c.io (eventTime" + et.timeIndex + ");\n");
+                }
+            }
+            if (! bed.localFlagType.isEmpty ())
+            {
+                result.append ("  c.io (flags);\n");
+            }
+            for (Delay d : bed.delays)
+            {
+                result.append ("  c.io (delay" + d.index + ");\n");
+            }
+            for (EquationSet p : s.parts)
+            {
+                result.append ("  " + mangle (p.name) + ".serialize (c);\n");
+            }
+            result.append ("}\n");
+            result.append ("\n");
+        }
+
         if (bed.needLocalDerivative)
         {
             // Unit pushDerivative
@@ -4224,6 +5135,8 @@ public class JobC extends Thread
             }
             result.append ("}\n");
             result.append ("\n");
+
+            if (adaptive) generateStages (context, ns, bed.localIntegrated, bed.localDerivative);
         }
 
         // Unit setPart
@@ -4259,6 +5172,28 @@ public class JobC extends Thread
             result.append ("\n");
         }
 
+        // Unit getMonitors
+        if (mpi  &&  s.connectionBindings != null  &&  bed.eventTargets.size () > 0)
+        {
+            result.append ("void " + ns + "getMonitors (std::vector<std::pair<Part<" + T + "> *, SynapseRow<" + T + "> *>> & result)\n");
+            result.append ("{\n");
+            for (EventTarget et : bed.eventTargets)
+            {
+                for (EventSource es : et.sources)
+                {
+                    if (es.reference == null) continue;
+                    String part = resolveContainer (es.reference, context, "");
+                    if (! part.endsWith ("->")) continue;  // Only a separate instance can live on another rank.
+                    part = part.substring (0, part.length () - 2);
+                    String eventMonitor = "eventMonitor_" + prefix (s);
+                    if (es.monitorIndex > 0) eventMonitor += "_" + es.monitorIndex;
+                    result.append ("  result.emplace_back (" + part + ", &" + part + "->" + eventMonitor + ");\n");
+                }
+            }
+            result.append ("}\n");
+            result.append ("\n");
+        }
+
         // Unit getCount
         if (bed.accountableEndpoints.size () > 0)
         {
@@ -4828,12 +5763,12 @@ public class JobC extends Thread
         {
             if (et.delay < 0)  // timing is no-care
             {
-                result.append (pad + eventSpike + " * spike = new " + eventSpikeLatch + ";\n");
+                result.append (pad + eventSpike + " * spike = " + allocateSpike (eventSpikeLatch) + ";\n");
                 result.append (pad + "spike->t = " + SIMULATOR + "currentEvent->t;\n");  // queue immediately after current cycle, so latches get set for next full cycle
             }
             else if (et.delay == 0)  // process as close to current cycle as possible
             {
-                result.append (pad + eventSpike + " * spike = new " + eventSpike + ";\n");  // fully execute the event (not latch it)
+                result.append (pad + eventSpike + " * spike = " + allocateSpike (eventSpike) + ";\n");  // fully execute the event (not latch it)
                 result.append (pad + "spike->t = " + SIMULATOR + "currentEvent->t;\n");  // queue immediately
             }
             else
@@ -4849,7 +5784,7 @@ public class JobC extends Thread
                     if (quantizedConstant)
                     {
                         double delay = step * quantum;
-                        result.append (pad + eventSpike + " * spike = new " + (during ? eventSpikeLatch : eventSpike) + ";\n");
+                        result.append (pad + eventSpike + " * spike = " + allocateSpike (during ? eventSpikeLatch : eventSpike) + ";\n");
                         result.append (pad + "spike->t = " + SIMULATOR + "currentEvent->t + " + context.print (delay, dt.exponent) + ";\n");
                     }
                 }
@@ -4869,12 +5804,12 @@ public class JobC extends Thread
             result.append (pad + eventSpike + " * spike;\n");
             result.append (pad + "if (delay < 0)\n");
             result.append (pad + "{\n");
-            result.append (pad + "  " + eventSpike + " * spike = new " + eventSpikeLatch + ";\n");
+            result.append (pad + "  spike = " + allocateSpike (eventSpikeLatch) + ";\n");
             result.append (pad + "  spike->t = " + SIMULATOR + "currentEvent->t;\n");
             result.append (pad + "}\n");
             result.append (pad + "else if (delay == 0)\n");
             result.append (pad + "{\n");
-            result.append (pad + "  " + eventSpike + " * spike = new " + eventSpike + ";\n");
+            result.append (pad + "  spike = " + allocateSpike (eventSpike) + ";\n");
             result.append (pad + "  spike->t = " + SIMULATOR + "currentEvent->t;\n");
             result.append (pad + "}\n");
             result.append (pad + "else\n");
@@ -4884,9 +5819,16 @@ public class JobC extends Thread
         }
 
         result.append (pad + "spike->latch = " + et.valueIndex + ";\n");
-        if (multi) result.append (pad + "spike->targets = &eventMonitor_" + prefix (et.container) + ";\n");
-        else       result.append (pad + "spike->target = p;\n");
-        result.append (pad + "" + SIMULATOR + "queueEvent.push (spike);\n");
+        if (multi)
+        {
+            result.append (pad + "spike->targets = &eventMonitor_" + prefix (et.container) + ";\n");
+            result.append (pad + SIMULATOR + "queueSpike (spike);\n");  // may coalesce with another pending spike
+        }
+        else
+        {
+            result.append (pad + "spike->target = p;\n");
+            result.append (pad + SIMULATOR + "queueEvent.push (spike);\n");
+        }
     }
 
     public void eventGenerate (String pad, EventTarget et, RendererC context, String eventSpike, String eventSpikeLatch)
@@ -4909,11 +5851,11 @@ public class JobC extends Thread
         result.append (pad + "{\n");
         if (during)
         {
-            result.append (pad + "  spike = new " + eventSpikeLatch + ";\n");
+            result.append (pad + "  spike = " + allocateSpike (eventSpikeLatch) + ";\n");
         }
         else
         {
-            result.append (pad + "  spike = new " + eventSpike + ";\n");
+            result.append (pad + "  spike = " + allocateSpike (eventSpike) + ";\n");
         }
         if (T.contains ("int"))
         {
@@ -4926,11 +5868,482 @@ public class JobC extends Thread
         result.append (pad + "}\n");
         result.append (pad + "else\n");
         result.append (pad + "{\n");
-        result.append (pad + "  spike = new " + eventSpike + ";\n");
+        result.append (pad + "  spike = " + allocateSpike (eventSpike) + ";\n");
         result.append (pad + "}\n");
         result.append (pad + "spike->t = " + SIMULATOR + "currentEvent->t + delay;\n");
     }
 
+    /**
+        Emits the functions used by DormandPrince to form stage inputs and estimate error.
+        Shared by population and unit, each passing its own lists of integrated and derivative variables.
+        The derivative stack is only pushed for variables in the derivative list. Any other
+        integrated variable has a derivative that stays fixed across stages, so it contributes
+        to each stage in proportion to the sum of the coefficients, and not at all to the error
+        (both sets of weights sum to 1).
+    **/
+    public void generateStages (RendererC context, String ns, List<Variable> integrated, List<Variable> derivative)
+    {
+        EquationSet   s      = context.part;
+        StringBuilder result = context.result;
+
+        List<Variable> stacked = new ArrayList<Variable> ();
+        List<Variable> fixed   = new ArrayList<Variable> ();
+        for (Variable v : integrated)
+        {
+            if (derivative.contains (v.derivative)) stacked.add (v);
+            else                                    fixed  .add (v);
+        }
+        List<EquationSet> children = new ArrayList<EquationSet> ();
+        if (! context.global)
+        {
+            for (EquationSet e : s.parts)
+            {
+                if (((BackendDataC) e.backendData).needGlobalDerivative) children.add (e);
+            }
+        }
+
+        // stageCombine
+        result.append ("void " + ns + "stageCombine (int count, const " + T + " * a, " + T + " h)\n");
+        result.append ("{\n");
+        for (Variable v : integrated)
+        {
+            result.append ("  " + resolve (v.reference, context, false) + " = preserve->" + mangle (v) + ";\n");
+        }
+        if (! fixed.isEmpty ()) result.append ("  " + T + " sum = 0;\n");
+        if (! stacked.isEmpty ()  ||  ! fixed.isEmpty ())
+        {
+            if (! stacked.isEmpty ()) result.append ("  Derivative * d = stackDerivative;\n");
+            result.append ("  for (int j = count - 1; j >= 0; j--)\n");
+            result.append ("  {\n");
+            result.append ("    " + T + " w = h * a[j];\n");
+            for (Variable v : stacked)
+            {
+                result.append ("    " + resolve (v.reference, context, false) + " += d->" + mangle (v.derivative) + " * w;\n");
+            }
+            if (! fixed.isEmpty ()) result.append ("    sum += w;\n");
+            if (! stacked.isEmpty ()) result.append ("    d = d->next;\n");
+            result.append ("  }\n");
+        }
+        for (Variable v : fixed)
+        {
+            result.append ("  " + resolve (v.reference, context, false) + " += " + resolve (v.derivative.reference, context, false) + " * sum;\n");
+        }
+        for (EquationSet e : children)
+        {
+            result.append ("  " + mangle (e.name) + ".stageCombine (count, a, h);\n");
+        }
+        result.append ("}\n");
+        result.append ("\n");
+
+        // stageError
+        result.append (T + " " + ns + "stageError (int count, const " + T + " * e, " + T + " h, " + T + " atol, " + T + " rtol)\n");
+        result.append ("{\n");
+        result.append ("  " + T + " result = 0;\n");
+        if (! stacked.isEmpty ()) result.append ("  if (count < 1) return result;\n");
+        for (Variable v : stacked)
+        {
+            String name = resolve (v.reference, context, false);
+            result.append ("  {\n");
+            result.append ("    Derivative * d = stackDerivative;\n");
+            result.append ("    " + type (v) + " error = d->" + mangle (v.derivative) + " * (h * e[count-1]);\n");
+            result.append ("    for (int j = count - 2; j >= 0; j--)\n");
+            result.append ("    {\n");
+            result.append ("      d = d->next;\n");
+            result.append ("      error += d->" + mangle (v.derivative) + " * (h * e[j]);\n");
+            result.append ("    }\n");
+            if (v.type instanceof Matrix)
+            {
+                result.append ("    result = std::max (result, norm (error, (" + T + ") INFINITY) / (atol + rtol * norm (" + name + ", (" + T + ") INFINITY)));\n");
+            }
+            else
+            {
+                result.append ("    result = std::max (result, std::abs (error) / (atol + rtol * std::abs (" + name + ")));\n");
+            }
+            result.append ("  }\n");
+        }
+        for (EquationSet e : children)
+        {
+            result.append ("  result = std::max (result, " + mangle (e.name) + ".stageError (count, e, h, atol, rtol));\n");
+        }
+        result.append ("  return result;\n");
+        result.append ("}\n");
+        result.append ("\n");
+
+        // popDerivative
+        result.append ("void " + ns + "popDerivative (int count)\n");
+        result.append ("{\n");
+        if (! derivative.isEmpty ())
+        {
+            result.append ("  for (int j = 0; j < count; j++)\n");
+            result.append ("  {\n");
+            result.append ("    Derivative * temp = stackDerivative;\n");
+            result.append ("    stackDerivative = stackDerivative->next;\n");
+            result.append ("    delete temp;\n");
+            result.append ("  }\n");
+        }
+        for (EquationSet e : children)
+        {
+            result.append ("  " + mangle (e.name) + ".popDerivative (count);\n");
+        }
+        result.append ("}\n");
+        result.append ("\n");
+    }
+
+    /**
+        Determines whether the given part can be integrated by a population-level batch loop
+        rather than a virtual integrate() call on each instance. Requires a homogeneous population:
+        Euler integration, constant $t', and no connections, events or sub-parts that would need
+        per-instance treatment. Requested the same way as contiguous().
+    **/
+    public boolean batch (EquationSet s)
+    {
+        BackendDataC bed = (BackendDataC) s.backendData;
+        if (bed.singleton  ||  bed.lastT  ||  bed.needLocalPreserve) return false;
+        if (bed.localIntegrated.isEmpty ()  ||  ! s.parts.isEmpty ()) return false;
+        if (s.connectionBindings != null  ||  ! bed.eventTargets.isEmpty ()  ||  ! bed.eventSources.isEmpty ()) return false;
+        Variable dt = s.findDt ();
+        if (dt == null  ||  ! dt.hasAttribute ("constant")) return false;
+        if (! s.metadata.getFlag ("backend", "c", "batch")  &&  ! s.getRoot ().metadata.getFlag ("backend", "c", "batch")) return false;
+
+        // Only Euler::run() calls Simulator::integrateBatches(). Any other integrator would skip the population entirely.
+        if (! euler)
+        {
+            if (! warnedBatch) Backend.err.get ().println ("WARNING: backend.c.batch requires the Euler integrator. Populations will be integrated one instance at a time.");
+            warnedBatch = true;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+        Determines which batched populations run their batch loop as a single kernel on an OpenMP
+        target device, and divides their update variables between the kernel and the host.
+        Requested the same way as batch(), with the flag "offload". Only floating-point models qualify,
+        because the fixed-point math library is not compiled for the device.
+        <p>While a population is offloaded, its instance state lives in device columns (structure of arrays).
+        A variable that reaches outside its own instance, or that calls anything beyond basic math, stays on
+        the host in the regular Part::update(). After each kernel, only the columns read by those
+        host variables are copied back. Typically these are the operands of output().
+        The population is rejected if host code would have to feed a value back into the kernel.
+    **/
+    public void analyzeOffload (EquationSet s)
+    {
+        for (EquationSet p : s.parts) analyzeOffload (p);
+
+        if (T.contains ("int")  ||  ! batch (s)) return;
+        if (! s.metadata.getFlag ("backend", "c", "offload")  &&  ! s.getRoot ().metadata.getFlag ("backend", "c", "offload")) return;
+        BackendDataC bed = (BackendDataC) s.backendData;
+        if (bed.needLocalFinalize  ||  ! bed.localFlagType.isEmpty ()  ||  ! bed.localBufferedExternal.isEmpty ()) return;  // These require a visit to each instance on the host every cycle.
+        for (Variable v : bed.localMembers)
+        {
+            if (v.hasAttribute ("externalRead")  ||  ! (v.type instanceof Scalar)) return;
+        }
+
+        // Collect host variables, along with everything that depends on them.
+        Set<Variable> host = new HashSet<Variable> ();
+        for (Variable v : bed.localUpdate) if (! offloadSafe (s, v)) host.add (v);
+        boolean changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (Variable v : bed.localUpdate)
+            {
+                if (host.contains (v)  ||  v.uses == null) continue;
+                for (Variable u : v.uses.keySet ())
+                {
+                    if (! host.contains (u)) continue;
+                    host.add (v);
+                    changed = true;
+                    break;
+                }
+            }
+        }
+        for (Variable v : bed.localIntegrated)
+        {
+            if (host.contains (v)  ||  host.contains (v.derivative)) return;
+        }
+        for (Variable v : host)
+        {
+            if (bed.localBufferedInternalUpdate.contains (v)) return;  // The buffered value would have to be copied back to the device.
+            if (v.uses == null) continue;
+            for (Variable u : v.uses.keySet ())
+            {
+                if (bed.localBufferedInternalUpdate.contains (u)) return;  // Host would see the new value rather than the one from start of cycle.
+            }
+        }
+
+        // Host code recomputes any temporaries it needs, rather than fetching them from the device.
+        Set<Variable> hostRendered = new HashSet<Variable> (host);
+        List<Variable> pending = new ArrayList<Variable> (host);
+        while (! pending.isEmpty ())
+        {
+            Variable v = pending.remove (pending.size () - 1);
+            if (v.uses == null) continue;
+            for (Variable u : v.uses.keySet ())
+            {
+                if (u.hasAttribute ("temporary")  &&  bed.localUpdate.contains (u)  &&  hostRendered.add (u)) pending.add (u);
+            }
+        }
+
+        for (Variable v : bed.localUpdate)
+        {
+            if (! host.contains (v))       bed.offloadDevice.add (v);
+            if (hostRendered.contains (v)) bed.offloadHost.add (v);
+        }
+        for (Variable v : bed.localMembers)
+        {
+            if (host.contains (v)) continue;
+            bed.offloadColumns.add (v);
+            for (Variable h : bed.offloadHost)
+            {
+                if (h.uses == null  ||  ! h.uses.containsKey (v)) continue;
+                bed.offloadTraced.add (v);
+                break;
+            }
+        }
+        bed.offload = true;
+        offload      = true;
+    }
+
+    /**
+        Determines whether the given update variable can be evaluated inside an offload kernel.
+        It may only write itself, and may only read constants and scalar members of the same instance,
+        combined by operators and basic math functions.
+    **/
+    public boolean offloadSafe (EquationSet s, Variable v)
+    {
+        if (v.reference == null  ||  v.reference.variable != v  ||  ! (v.type instanceof Scalar)) return false;
+        BackendDataC bed = (BackendDataC) s.backendData;
+
+        class VisitorOffload implements Visitor
+        {
+            public boolean safe = true;
+            public boolean visit (Operator op)
+            {
+                if (op instanceof AccessVariable)
+                {
+                    VariableReference r = ((AccessVariable) op).reference;
+                    if      (r == null  ||  r.variable == null)         safe = false;
+                    else if (r.variable.hasAttribute ("constant"))      safe = r.variable.type instanceof Scalar;
+                    else if (! r.resolution.isEmpty ()  ||  r.variable.container != s) safe = false;
+                    else if (r.variable.hasAny ("global", "MatrixPointer")  ||  ! (r.variable.type instanceof Scalar)) safe = false;
+                    else if (r.variable.name.startsWith ("$")  &&  ! bed.localMembers.contains (r.variable)) safe = false;  // Such as $t and $index, which are not plain members.
+                }
+                else if (op instanceof Constant)
+                {
+                    if (! (((Constant) op).value instanceof Scalar)) safe = false;
+                }
+                else if (op instanceof Function)
+                {
+                    // Each of these renders as a call to <cmath> or an inline template.
+                    if (! (   op instanceof AbsoluteValue
+                           || op instanceof Atan
+                           || op instanceof Ceil
+                           || op instanceof Cosine
+                           || op instanceof Exp
+                           || op instanceof Floor
+                           || op instanceof HyperbolicTangent
+                           || op instanceof Log
+                           || op instanceof Max
+                           || op instanceof Min
+                           || op instanceof Round
+                           || op instanceof Sat
+                           || op instanceof Signum
+                           || op instanceof Sine
+                           || op instanceof SquareRoot
+                           || op instanceof Tangent))
+                    {
+                        safe = false;
+                    }
+                }
+                else if (op instanceof Split  ||  op instanceof BuildMatrix  ||  op instanceof AccessElement)
+                {
+                    safe = false;
+                }
+                return safe;
+            }
+        }
+        VisitorOffload visitor = new VisitorOffload ();
+        v.visit (visitor);
+        return visitor.safe;
+    }
+
+    /**
+        Determines whether every member of s and its children can be written to a checkpoint.
+        A matrix pointer refers into a holder that only gets bound during init, so it can't be restored.
+    **/
+    public boolean checkpointSafe (EquationSet s)
+    {
+        for (EquationSet p : s.parts) if (! checkpointSafe (p)) return false;
+        BackendDataC bed = (BackendDataC) s.backendData;
+        for (Variable v : bed.localMembers)  if (v.hasAttribute ("MatrixPointer")) return false;
+        for (Variable v : bed.globalMembers) if (v.hasAttribute ("MatrixPointer")) return false;
+        return true;
+    }
+
+    /**
+        Determines which populations may run init() of their new instances concurrently, as requested by
+        $meta.backend.c.init=parallel. Each instance may only write its own members: no connections, events,
+        sub-parts, external writes, change of period, or IO. Random draws come from a separate stream for each
+        fixed block of instances, so the result still doesn't depend on thread count.
+        <p>Incrementing $n would be a race, so these populations count an instance in add() rather than init().
+    **/
+    public void analyzeParallelInit (EquationSet s)
+    {
+        for (EquationSet p : s.parts) analyzeParallelInit (p);
+
+        BackendDataC bed = (BackendDataC) s.backendData;
+        if (bed.singleton  ||  ! bed.needLocalInit  ||  ! s.parts.isEmpty ()) return;
+        if (s.connectionBindings != null  ||  ! bed.eventTargets.isEmpty ()) return;
+        if (! bed.localBufferedExternalWrite.isEmpty ()  ||  bed.setDt  ||  bed.localInit.contains (bed.dt)) return;
+
+        class VisitorInit implements Visitor
+        {
+            public boolean safe = true;
+            public boolean visit (Operator op)
+            {
+                if (op instanceof Function)
+                {
+                    // Pure math, plus the random generators, which draw from the stream installed for the current block.
+                    if (! (   op instanceof AbsoluteValue
+                           || op instanceof Atan
+                           || op instanceof Ceil
+                           || op instanceof Cosine
+                           || op instanceof Exp
+                           || op instanceof Floor
+                           || op instanceof Gaussian
+                           || op instanceof Grid
+                           || op instanceof HyperbolicTangent
+                           || op instanceof Log
+                           || op instanceof Max
+                           || op instanceof Min
+                           || op instanceof Norm
+                           || op instanceof Pulse
+                           || op instanceof Round
+                           || op instanceof Sat
+                           || op instanceof Signum
+                           || op instanceof Sine
+                           || op instanceof SquareRoot
+                           || op instanceof SumSquares
+                           || op instanceof Tangent
+                           || op instanceof Uniform))
+                    {
+                        safe = false;
+                    }
+                }
+                return safe;
+            }
+        }
+        VisitorInit visitor = new VisitorInit ();
+        for (Variable v : bed.localInit)
+        {
+            v.visit (visitor);
+            if (! visitor.safe) return;
+        }
+        bed.parallelInit = true;
+    }
+
+    /**
+        Determines whether instances of the given part are divided among MPI ranks.
+        Only populations directly under the top-level model are partitioned. Connections are
+        placed by Distributed::place() according to their endpoints. Batched populations
+        integrate every instance in one loop, so they can't hold proxies.
+    **/
+    public boolean partitioned (EquationSet s)
+    {
+        if (! mpi  ||  s.container == null  ||  s.container.container != null) return false;
+        BackendDataC bed = (BackendDataC) s.backendData;
+        return ! bed.singleton  &&  s.connectionBindings == null  &&  ! batch (s);
+    }
+
+    /**
+        Determines whether the set of instances and connections is settled once init is done.
+        That is the case when no partitioned population can change size, and no connection
+        population polls. Then a rank can release the proxies that none of its connections use.
+    **/
+    public boolean fixedNetwork (EquationSet s)
+    {
+        BackendDataC bed = (BackendDataC) s.backendData;
+        if (partitioned (s)  &&  (bed.canGrowOrDie  ||  bed.canResize  &&  ! bed.nInitOnly)) return false;  // Same test as needGlobalFinalize for a change in $n
+        if (s.connectionBindings != null  &&  bed.poll >= 0) return false;
+        for (EquationSet p : s.parts) if (! fixedNetwork (p)) return false;
+        return true;
+    }
+
+    /**
+        Determines the time between spike exchanges in a distributed run.
+        This is the shortest constant delay of any event that can cross parts.
+        Events without a fixed positive delay are limited to $t', so they arrive at least by the
+        target's next cycle.
+        @return The given bound, reduced as needed by events in s and its descendants.
+    **/
+    public double mpiInterval (EquationSet s, double result)
+    {
+        BackendDataC bed = (BackendDataC) s.backendData;
+        for (EventTarget et : bed.eventTargets)
+        {
+            boolean crosses = false;
+            for (EventSource es : et.sources)
+            {
+                if (es.reference == null) continue;
+                crosses = true;
+                if (es.testEach  ||  es.delayEach)
+                {
+                    Backend.err.get ().println ("WARNING: Event in " + s.name + " is tested separately for each target, so it only reaches targets on the same MPI rank as its source.");
+                }
+            }
+            if (! crosses) continue;
+            double delay = et.delay;
+            if (delay <= 0)
+            {
+                Variable dt = s.findDt ();
+                if (dt != null  &&  dt.hasAttribute ("constant")) delay = ((Scalar) dt.type).value;
+                else                                              delay = 1e-4;  // Same as default in Simulator::init()
+            }
+            result = Math.min (result, delay);
+        }
+        for (EquationSet p : s.parts) result = mpiInterval (p, result);
+        return result;
+    }
+
+    /**
+        Determines whether instances of the given part should be packed into a PartArena.
+        Can be requested on individual parts, or for all parts by setting it on the top-level model.
+        Singletons are excluded, since there is only one instance.
+    **/
+    public boolean contiguous (EquationSet s)
+    {
+        BackendDataC bed = (BackendDataC) s.backendData;
+        if (bed.singleton) return false;
+        return s.metadata.getFlag ("backend", "c", "contiguous")  ||  s.getRoot ().metadata.getFlag ("backend", "c", "contiguous");
+    }
+
+    /**
+        Determines whether the given delay() can use the ring-buffer implementation.
+        This requires a constant delay and a constant $t', with the delay falling on a whole number of steps.
+        @return Length of delay in units of $t', or 0 if the general DelayBuffer is required.
+    **/
+    public int delaySteps (Delay d, EquationSet s)
+    {
+        if (d.operands.length < 2  ||  ! d.operands[1].isScalar ()) return 0;
+        Variable dt = s.findDt ();
+        if (dt == null  ||  ! dt.hasAttribute ("constant")) return 0;
+        double ratio = d.operands[1].getDouble () / ((Scalar) dt.type).value;
+        int    steps = (int) Math.round (ratio);
+        if (steps < 1  ||  Math.abs (ratio - steps) > 1e-3) return 0;
+        return steps;
+    }
+
+    /**
+        Emits an expression that fetches a recycled spike event of the given class from the simulator's pool.
+        @param eventClass Full C++ class name, including template argument. For example, "EventSpikeSingleLatch<float>".
+    **/
+    public String allocateSpike (String eventClass)
+    {
+        String kind = eventClass.substring ("EventSpike".length (), eventClass.indexOf ('<'));
+        return SIMULATOR + "spikes.allocate" + kind + " ()";
+    }
+
     /**
         Emit the equations associated with a variable.
         Assumes that phase indicators have already been factored out by simplify().
@@ -5178,6 +6591,10 @@ public class JobC extends Thread
                             context.result.append (pad + o.columnName + " = \"" + o.variableName + "\";\n");
                         }
                     }
+                    if (o.columnHandle != null  &&  ! context.global)  // A recycled instance may have a different path, so look up column again.
+                    {
+                        context.result.append (pad + o.columnHandle + " = -1;\n");
+                    }
                     if (o.operands[0] instanceof Constant  &&  o.getKeywordFlag ("raw"))  // Apply "raw" attribute now, if set.
                     {
                         context.result.append (pad + o.name + "->raw = true;\n");
@@ -5333,6 +6750,7 @@ public class JobC extends Thread
 
                         boolean smooth =             i.getKeywordFlag ("smooth");
                         boolean time   = smooth  ||  i.getKeywordFlag ("time");
+                        if (i.getKeywordFlag ("index")) context.result.append (pad + i.name + "->indexed = true;\n");
                         if (time)
                         {
                             if (time)   context.result.append (pad + i.name + "->time = true;\n");
@@ -5433,6 +6851,8 @@ public class JobC extends Thread
                     if (ffmpegLibDir == null) continue;  // "timeScale" and "codec" only apply to FFmpeg.
                 case "hold":
                 case "format":
+                case "async":
+                case "drop":
                     context.result.append (pad + d.name + "->" + key);
                     break;
                 default:  // "raw" and any invalid keywords
@@ -225,8 +225,17 @@ public class RendererC extends Renderer
                 return true;
             }
             result.append ("delay" + d.index + ".step (" + job.SIMULATOR + "currentEvent->t, ");
-            d.operands[1].render (this);
-            result.append (", ");
+            int steps = job.delaySteps (d, part);
+            if (steps > 0)  // DelayBufferRing
+            {
+                Variable dt = part.findDt ();
+                result.append (print (((Scalar) dt.type).value, dt.exponent) + ", " + steps + ", ");
+            }
+            else
+            {
+                d.operands[1].render (this);
+                result.append (", ");
+            }
             d.operands[0].render (this);
             result.append (", ");
             if (d.operands.length > 2) d.operands[2].render (this);
@@ -279,9 +288,10 @@ public class RendererC extends Renderer
         {
             Exp e = (Exp) op;
             Operator a = e.operands[0];
-            result.append ("exp (");
+            result.append ("exp");
+            if (useExponent) result.append ("<" + e.exponentNext + ">");  // Compile-time exponent form from fixedpoint.tcc
+            result.append (" (");
             a.render (this);
-            if (useExponent) result.append (", " + e.exponentNext);
             result.append (")");
             return true;
         }
@@ -359,9 +369,10 @@ public class RendererC extends Renderer
         {
             Log l = (Log) op;
             Operator a = l.operands[0];
-            result.append ("log (");
+            result.append ("log");
+            if (useExponent) result.append ("<" + a.exponentNext + "," + l.exponentNext + ">");
+            result.append (" (");
             a.render (this);
-            if (useExponent) result.append (", " + a.exponentNext + ", " + l.exponentNext);
             result.append (")");
             return true;
         }
@@ -458,11 +469,12 @@ public class RendererC extends Renderer
         {
             Norm n = (Norm) op;
             Operator A = n.operands[0];
-            result.append ("norm (");
+            result.append ("norm");
+            if (useExponent) result.append ("<" + A.exponentNext + "," + n.exponentNext + ">");
+            result.append (" (");
             A.render (this);
             result.append (", ");
             renderType (n.operands[1]);
-            if (useExponent) result.append (", " + A.exponentNext + ", " + n.exponentNext);
             result.append (")");
             return true;
         }
@@ -470,6 +482,7 @@ public class RendererC extends Renderer
         {
             Output o = (Output) op;
             result.append (o.name + "->trace (" + job.SIMULATOR + "currentEvent->t, ");
+            if (o.columnHandle != null) result.append (o.columnHandle + ", ");
 
             if (o.hasColumnName)  // column name is explicit
             {
@@ -478,6 +491,7 @@ public class RendererC extends Renderer
             else  // column name is generated, so use prepared string value
             {
                 result.append (o.columnName);
+                if (o.columnHandle != null) result.append (".c_str ()");
             }
             result.append (", ");
 
@@ -543,11 +557,12 @@ public class RendererC extends Renderer
             Power p = (Power) op;
             Operator a = p.operand0;
             Operator b = p.operand1;
-            result.append ("pow (");
+            result.append ("pow");
+            if (useExponent) result.append ("<" + a.exponentNext + "," + p.exponentNext + ">");
+            result.append (" (");
             a.render (this);
             result.append (", ");
             b.render (this);
-            if (useExponent) result.append (", " + a.exponentNext + ", " + p.exponentNext);
             result.append (")");
             return true;
         }
@@ -620,9 +635,10 @@ public class RendererC extends Renderer
         {
             SquareRoot s = (SquareRoot) op;
             Operator a = s.operands[0];
-            result.append ("sqrt (");
+            result.append ("sqrt");
+            if (useExponent) result.append ("<" + a.exponentNext + "," + s.exponentNext + ">");
+            result.append (" (");
             a.render (this);
-            if (useExponent) result.append (", " + a.exponentNext + ", " + s.exponentNext);
             result.append (")");
             return true;
         }
@@ -640,9 +656,10 @@ public class RendererC extends Renderer
         {
             Tangent t = (Tangent) op;
             Operator a = t.operands[0];
-            result.append ("tan (");
+            result.append ("tan");
+            if (useExponent) result.append ("<" + a.exponentNext + "," + t.exponentNext + ">");
+            result.append (" (");
             a.render (this);
-            if (useExponent) result.append (", " + a.exponentNext + ", " + t.exponentNext);
             result.append (")");
             return true;
         }
@@ -433,9 +433,9 @@ public class RendererCfp extends RendererC
             Operator a = c.operands[0];
             int shift = c.exponent - c.exponentNext;
             if (shift != 0) result.append ("(");
-            result.append ("cos (");
+            result.append ("cos<" + a.exponentNext + "> (");  // Compile-time exponent form from fixedpoint.tcc
             a.render (this);
-            result.append (", " + a.exponentNext + ")");
+            result.append (")");
             if (shift != 0) result.append (printShift (shift) + ")");
             return true;
         }
@@ -491,9 +491,9 @@ public class RendererCfp extends RendererC
             Operator a = ht.operands[0];
             int shift = ht.exponent - ht.exponentNext;
             if (shift != 0) result.append ("(");
-            result.append ("tanh (");
+            result.append ("tanh<" + a.exponentNext + "> (");  // Compile-time exponent form from fixedpoint.tcc
             a.render (this);
-            result.append (", " + a.exponentNext + ")");
+            result.append (")");
             if (shift != 0) result.append (printShift (shift) + ")");
             return true;
         }
@@ -543,9 +543,9 @@ public class RendererCfp extends RendererC
             Operator a = s.operands[0];
             int shift = s.exponent - s.exponentNext;
             if (shift != 0) result.append ("(");
-            result.append ("sin (");
+            result.append ("sin<" + a.exponentNext + "> (");  // Compile-time exponent form from fixedpoint.tcc
             a.render (this);
-            result.append (", " + a.exponentNext + ")");
+            result.append (")");
             if (shift != 0) result.append (printShift (shift) + ")");
             return true;
         }
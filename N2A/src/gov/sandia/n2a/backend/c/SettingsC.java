@@ -26,6 +26,10 @@ public class SettingsC extends SettingsBackend
     protected MTextField fieldCpp      = new MTextField (40);
     protected MTextField fieldFFmpeg   = new MTextField (40);
     protected MTextField fieldJNI      = new MTextField (40);
+    protected MTextField fieldBLAS     = new MTextField (40);
+    protected MTextField fieldMPI      = new MTextField (40);
+    protected MTextField fieldMPIrun   = new MTextField (40);
+    protected MTextField fieldOffload  = new MTextField (40);
     protected JButton    buttonRebuild = new JButton ("Rebuild Runtime");
 
     public SettingsC ()
@@ -71,6 +75,30 @@ public class SettingsC extends SettingsBackend
             }
         });
 
+        fieldBLAS.addChangeListener (new ChangeListener ()
+        {
+            public void stateChanged (ChangeEvent e)
+            {
+                Host h = (Host) list.getSelectedValue ();
+                h.objects.remove ("blasLibDir");
+                h.objects.remove ("blasIncDir");
+                h.objects.remove ("blasLib");
+                h.config.set ("", "backend", "c", "compilerChanged");  // Runtime objects are compiled with or without n2a_BLAS, so force rebuild.
+            }
+        });
+
+        fieldMPI.addChangeListener (new ChangeListener ()
+        {
+            public void stateChanged (ChangeEvent e)
+            {
+                Host h = (Host) list.getSelectedValue ();
+                h.objects.remove ("mpiLibDir");
+                h.objects.remove ("mpiIncDir");
+                h.objects.remove ("mpiLib");
+                // MPI runtime objects have their own names, so no need to force a rebuild of the others.
+            }
+        });
+
         buttonRebuild.setToolTipText ("<html>In case the build system get out of sync, this will clean out all intermediate object files and start over.<br>Note, however, that this will not release a runtime library locked down by JNI on Windows. In that case, please restart the app.</html>");
         buttonRebuild.addActionListener (new ActionListener ()
         {
@@ -94,6 +122,10 @@ public class SettingsC extends SettingsBackend
         fieldCpp   .bind (parent, "cxx",    "g++");
         fieldFFmpeg.bind (parent, "ffmpeg", "");
         fieldJNI   .bind (parent, "jni_md", "");
+        fieldBLAS  .bind (parent, "blas",   "");
+        fieldMPI   .bind (parent, "mpi",    "");
+        fieldMPIrun.bind (parent, "mpirun", "mpirun");
+        fieldOffload.bind (parent, "offload", "");
     }
 
     @Override
@@ -103,6 +135,10 @@ public class SettingsC extends SettingsBackend
             Lay.FL (new JLabel ("Compiler path"), fieldCpp),
             Lay.FL (new JLabel ("Directory that contains FFmpeg libraries"), fieldFFmpeg),
             Lay.FL (new JLabel ("Directory that contains jni_md.h"), fieldJNI),
+            Lay.FL (new JLabel ("Directory that contains BLAS library (blank for built-in multiply)"), fieldBLAS),
+            Lay.FL (new JLabel ("Directory that contains MPI library (blank to search typical locations)"), fieldMPI),
+            Lay.FL (new JLabel ("MPI launcher"), fieldMPIrun),
+            Lay.FL (new JLabel ("OpenMP offload target (blank to run offloaded populations on host)"), fieldOffload),
             Lay.FL (buttonRebuild)
         );
     }
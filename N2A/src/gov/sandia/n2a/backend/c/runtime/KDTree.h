@@ -19,18 +19,24 @@ the U.S. Government retains certain rights in this software.
 #include "matrix.h"
 
 #include <vector>
-#include <queue>
+#include <algorithm>
 #include <climits>
 
 
 template<class T> class Part;
 
+/**
+    The tree is stored as a flat array of nodes, with children referenced by index.
+    Points are reordered into buckets so that each leaf covers a contiguous range,
+    and their coordinates are copied into a separate dense array. Neither nodes nor
+    coordinates carry a vtable, so a search walks only a few cache lines per leaf.
+    A Query holds all the scratch space for one search. It may be reused across calls
+    to avoid allocation, and each thread doing searches should have its own.
+**/
 template<class T>
 class KDTree
 {
 public:
-    // Note: All the inner classes are defined first, then the main class members come at the bottom of this file.
-
     typedef MatrixFixed<T,3,1> Vector3;
 
     class Entry : public Vector3
@@ -39,10 +45,8 @@ public:
         Part<T> * part;
     };
 
-    class Node;
-
-    typedef std::pair<T, Node *>  PairNode;
-    typedef std::pair<T, Entry *> PairEntry;
+    typedef std::pair<T, int> PairNode;   ///< distance, index into nodes
+    typedef std::pair<T, int> PairEntry;  ///< distance, index into points
 
     class Reverse
     {
@@ -62,132 +66,34 @@ public:
         }
     };
 
-    /// Helper class for passing search-related info down the tree.
+    /// Scratch space for a single search. Both lists are maintained as heaps.
     class Query
     {
     public:
-        int             k;
-        T               radius;
-        const Vector3 * point;
-        std::priority_queue<PairEntry, std::vector<PairEntry>, Forward> sorted;
-        std::priority_queue<PairNode,  std::vector<PairNode>,  Reverse> queue;
+        int                    k;
+        T                      radius;
+        const T *              point;
+        std::vector<PairEntry> sorted;  ///< max-heap of best points found so far
+        std::vector<PairNode>  queue;   ///< min-heap of nodes waiting to be searched
     };
 
     class Node
     {
     public:
-        virtual ~Node () {}
-        virtual void search (T distance, Query & q) const = 0;
-#       ifndef N2A_SPINNAKER
-        virtual void dump (std::ostream & out, const String & pad = "") const = 0;
-#       endif
+        int dimension; ///< Split dimension, or -1 if this is a leaf.
+        int low;       ///< Branch: index of node below mid, or -1. Leaf: index of first point.
+        int high;      ///< Branch: index of node above mid, or -1. Leaf: one past last point.
+        T   lo;        ///< Lowest value along the dimension
+        T   hi;        ///< Highest value along the dimension
+        T   mid;       ///< The cut point along the dimension
     };
 
-    class Branch : public Node
-    {
-    public:
-        int    dimension;
-        T      lo;        ///< Lowest value along the dimension
-        T      hi;        ///< Highest value along the dimension
-        T      mid;       ///< The cut point along the dimension
-        Node * lowNode;   ///< below mid
-        Node * highNode;  ///< above mid
-
-        virtual ~Branch ()
-        {
-            delete lowNode;
-            delete highNode;
-        }
-
-        virtual void search (T distance, Query & q) const
-        {
-            T qmid = (*q.point)[dimension];
-            T newOffset = qmid - mid;
-            if (newOffset < 0)  // lowNode is closer
-            {
-                // We don't do any special testing on nearer node, because it has already been
-                // tested as part of the containing node.
-                if (lowNode) lowNode->search (distance, q);
-                if (highNode)
-                {
-                    T oldOffset = std::max (lo - qmid, (T) 0);
-                    distance += newOffset * newOffset - oldOffset * oldOffset;
-                    q.queue.push (std::make_pair (distance, highNode));
-                }
-            }
-            else  // newOffset >= 0, so highNode is closer
-            {
-                if (highNode) highNode->search (distance, q);
-                if (lowNode)
-                {
-                    T oldOffset = std::max (qmid - hi, (T) 0);
-                    distance += newOffset * newOffset - oldOffset * oldOffset;
-                    q.queue.push (std::make_pair (distance, lowNode));
-                }
-            }
-        }
-
-#       ifndef N2A_SPINNAKER
-        virtual void dump (std::ostream & out, const String & pad = "") const
-        {
-            out << pad << "Branch: " << dimension << " " << lo << " " << mid << " " << hi << std::endl;
-            if (lowNode)
-            {
-                out << pad << "lowNode:" << std::endl;
-                lowNode->dump (out, pad + "  ");
-            }
-            if (highNode)
-            {
-                out << pad << "highNode:" << std::endl;
-                highNode->dump (out, pad + "  ");
-            }
-        }
-#       endif
-    };
-
-    class Leaf : public Node
-    {
-    public:
-        std::vector<Entry *> points;
-
-        virtual void search (T distance, Query & q) const
-        {
-            int count = points.size ();
-            for (int i = 0; i < count; i++)
-            {
-                Entry * p = points[i];
-
-                // Measure distance using early-out method. Might save operations in
-                // high-dimensional spaces.
-                // Here we make the assumption that the values are stored contiguously in
-                // memory.  This is a good place to check for bugs if using more exotic
-                // matrix types (not recommended).
-                T * x = &(*p)[0];
-                T * y = &(*q.point)[0];
-                T * end = x + 3;  // 3 dimensions in Vector3
-                T total = 0;
-                while (x < end  &&  total < q.radius)
-                {
-                    T t = *x++ - *y++;
-                    total += t * t;
-                }
-
-                if (total >= q.radius) continue;
-                q.sorted.push (std::make_pair (total, p));
-                if (q.sorted.size () > q.k) q.sorted.pop ();
-                if (q.sorted.size () == q.k) q.radius = std::min (q.radius, q.sorted.top ().first);
-            }
-        }
-
-#       ifndef N2A_SPINNAKER
-        virtual void dump (std::ostream & out, const String & pad = "") const
-        {
-            for (int i = 0; i < points.size (); i++) out << pad << *points[i] << std::endl;
-        }
-#       endif
-    };
-
-    Node * root;
+    std::vector<Node>    nodes;   ///< nodes[0] is root, if tree is not empty.
+    std::vector<Entry *> points;  ///< In bucket order.
+    std::vector<T>       coords;  ///< 3 values for each entry in points.
+    std::vector<Entry *> extra;        ///< Entries added since the tree was last built. Searched by brute force.
+    std::vector<T>        extraCoords;  ///< 3 values for each entry in extra.
+    int                  removed;      ///< Number of entries marked dead since the tree was last built.
     Vector3 lo;
     Vector3 hi;
 
@@ -199,27 +105,27 @@ public:
 
     KDTree ()
     {
-        root       = 0;
         bucketSize = 5;
         k          = 5;  // it doesn't make sense for k to be less than bucketSize
         radius     = INFINITY;
         epsilon    = 1e-4;
         maxNodes   = INT_MAX;
-    }
-
-    ~KDTree ()
-    {
-        clear ();
+        removed    = 0;
     }
 
     void clear ()
     {
-        delete root;
-        root = 0;
+        nodes .clear ();
+        points.clear ();
+        coords.clear ();
+        extra .clear ();
+        extraCoords.clear ();
+        removed = 0;
     }
 
     void set (std::vector<Entry *> & data)
     {
+        clear ();
         ::clear (lo, (T)  INFINITY);
         ::clear (hi, (T) -INFINITY);
 
@@ -240,11 +146,33 @@ public:
             }
         }
 
-        root = construct (data);
+        int count = data.size ();
+        points = data;
+        nodes.reserve (2 * count / std::max (1, bucketSize) + 1);
+        construct (0, count);
+
+        coords.resize (3 * count);
+        T * c = coords.data ();
+        for (Entry * e : points)
+        {
+            const T * a = e->base ();
+            *c++ = a[0];
+            *c++ = a[1];
+            *c++ = a[2];
+        }
     }
 
     void find (const Vector3 & query, std::vector<Entry *> & result) const
     {
+        Query q;
+        find (query, result, q);
+    }
+
+    /// Same as above, but uses caller-supplied scratch space.
+    void find (const Vector3 & query, std::vector<Entry *> & result, Query & q) const
+    {
+        result.clear ();
+
         // Determine distance of query from bounding rectangle for entire tree
         T distance = 0;
         for (int i = 0; i < 3; i++)
@@ -253,35 +181,59 @@ public:
             distance += d * d;
         }
 
-        // Recursively collect closest points
-        Query q;
         q.k      = k;
         q.radius = radius * radius;  // this may shrink monotonically once we find enough neighbors
-        q.point  = &query;
+        q.point  = query.base ();
+        q.sorted.clear ();
+        q.queue .clear ();
 
         T oneEpsilon = (1 + epsilon) * (1 + epsilon);
-        q.queue.push (std::make_pair (distance, root));
+        if (nodes.size ()) q.queue.push_back (std::make_pair (distance, 0));
         int visited = 0;
+        Reverse reverse;
         while (q.queue.size ())
         {
-            const PairNode & it = q.queue.top ();
-            distance = it.first;
-            Node * n = it.second;
-            q.queue.pop ();
+            std::pop_heap (q.queue.begin (), q.queue.end (), reverse);
+            distance = q.queue.back ().first;
+            int n    = q.queue.back ().second;
+            q.queue.pop_back ();
             if (distance * oneEpsilon > q.radius) break;
-            n->search (distance, q);
+            search (n, distance, q);
             if (++visited >= maxNodes) break;
         }
+        int count = points.size ();
+        if (extra.size ()) scan (extraCoords.data (), count, count + extra.size (), q);
+
+        // Transfer results to vector, nearest first. No need to limit number of results,
+        // because this has already been done by search().
+        std::sort_heap (q.sorted.begin (), q.sorted.end (), Forward ());
+        result.reserve (q.sorted.size ());
+        for (auto & it : q.sorted) result.push_back (entry (it.second));
+    }
 
-        // Transfer results to vector. No need to limit number of results, because this has
-        // already been done by Leaf::search().
-        int count = q.sorted.size ();
-        result.resize (count);
-        for (int i = count - 1; i >= 0; i--)
+    /**
+        Answers count queries at once. Each thread reuses one Query for its entire share of the batch.
+        The batch is split into contiguous ranges over the threads lent by matrixThreads, if any.
+        @param results Must have room for count entries. results[i] receives the answer for queries[i].
+    **/
+    void findBatch (const Vector3 * queries, int count, std::vector<Entry *> * results) const
+    {
+        auto work = [=] (int begin, int end)
+        {
+            Query q;
+            for (int i = begin; i < end; i++) find (queries[i], results[i], q);
+        };
+
+        int threads = matrixThreads ? std::min (matrixThreads->available (), count / 64) : 1;  // Don't bother with threads unless each one has a decent amount of work.
+        if (threads > 1)
         {
-            result[i] = q.sorted.top ().second;
-            q.sorted.pop ();
+            matrixThreads->run ([&] (int t)
+            {
+                if (t < threads) work ((int) ((int64_t) count * t / threads), (int) ((int64_t) count * (t + 1) / threads));
+            });
+            return;
         }
+        work (0, count);
     }
 
 #   ifndef N2A_SPINNAKER
@@ -290,86 +242,206 @@ public:
         out << pad << "KDTree: " << bucketSize << " " << k << " " << radius << " " << epsilon << std::endl;
         out << pad << "lo = " << lo << std::endl;
         out << pad << "hi = " << hi << std::endl;
-        if (root)
+        if (nodes.size ())
         {
             out << pad << "root:" << std::endl;
-            root->dump (out, pad + "  ");
+            dump (out, 0, pad + "  ");
         }
     }
-#   endif
 
-    /// Recursively construct a tree that handles the given volume of points.
-    Node * construct (std::vector<Entry *> & points)
+    void dump (std::ostream & out, int n, const String & pad) const
     {
-        int count = points.size ();
-        if (count == 0)
+        const Node & node = nodes[n];
+        if (node.dimension < 0)
         {
-            return 0;
+            for (int i = node.low; i < node.high; i++) out << pad << *points[i] << std::endl;
+            return;
         }
-        else if (count <= bucketSize)
+        out << pad << "Branch: " << node.dimension << " " << node.lo << " " << node.mid << " " << node.hi << std::endl;
+        if (node.low >= 0)
         {
-            Leaf * result = new Leaf;
-            result->points = points;
-            return result;
+            out << pad << "lowNode:" << std::endl;
+            dump (out, node.low, pad + "  ");
         }
-        else  // count > bucketSize
+        if (node.high >= 0)
         {
-            // todo: pass the split method as a function pointer
-            int d = 0;
-            T longest = 0;
-            for (int i = 0; i < 3; i++)
+            out << pad << "highNode:" << std::endl;
+            dump (out, node.high, pad + "  ");
+        }
+    }
+#   endif
+
+    /**
+        Descends from node n toward the query point, queueing the farther child at each branch,
+        then scans the leaf it reaches.
+    **/
+    void search (int n, T distance, Query & q) const
+    {
+        Reverse reverse;
+        while (n >= 0)
+        {
+            const Node & node = nodes[n];
+            if (node.dimension < 0) break;
+
+            // We don't do any special testing on nearer node, because it has already been
+            // tested as part of the containing node.
+            T qmid = q.point[node.dimension];
+            T newOffset = qmid - node.mid;
+            int far;
+            T   oldOffset;
+            if (newOffset < 0)  // low node is closer
             {
-                T length = hi[i] - lo[i];
-                if (length > longest)
-                {
-                    d = i;
-                    longest = length;
-                }
+                far       = node.high;
+                oldOffset = std::max (node.lo - qmid, (T) 0);
+                n         = node.low;
             }
-            sort (points, d);
-            int cut = count / 2;
-            typename std::vector<Entry *>::iterator b = points.begin ();
-            typename std::vector<Entry *>::iterator c = b + cut;
-            typename std::vector<Entry *>::iterator e = points.end ();
-
-            Branch * result = new Branch;
-            result->dimension = d;
-            result->lo = lo[d];
-            result->hi = hi[d];
-            result->mid = (**c)[d];
-
-            hi[d] = result->mid;
-            std::vector<Entry *> tempPoints (b, c);
-            result->lowNode = construct (tempPoints);
-            hi[d] = result->hi;
-
-            lo[d] = result->mid;
-            tempPoints.clear ();
-            tempPoints.insert (tempPoints.begin (), c, e);
-            result->highNode = construct (tempPoints);
-            lo[d] = result->lo;  // it is important to restore lo[d] so that when recursion unwinds the vector is still correct
+            else  // newOffset >= 0, so high node is closer
+            {
+                far       = node.low;
+                oldOffset = std::max (qmid - node.hi, (T) 0);
+                n         = node.high;
+            }
+            if (far >= 0)
+            {
+                q.queue.push_back (std::make_pair (distance + newOffset * newOffset - oldOffset * oldOffset, far));
+                std::push_heap (q.queue.begin (), q.queue.end (), reverse);
+            }
+        }
+        if (n < 0) return;
 
-            return result;
+        scan (coords.data () + 3 * nodes[n].low, nodes[n].low, nodes[n].high, q);
+    }
+
+    /// Measures distance to points [begin,end), given their coordinates in x, and collects those that qualify.
+    void scan (const T * x, int begin, int end, Query & q) const
+    {
+        Forward forward;
+        const T * y = q.point;
+        for (int i = begin; i < end; i++, x += 3)
+        {
+            // Measure distance using early-out method.
+            T t = x[0] - y[0];
+            T total = t * t;
+            if (total >= q.radius) continue;
+            t = x[1] - y[1];
+            total += t * t;
+            if (total >= q.radius) continue;
+            t = x[2] - y[2];
+            total += t * t;
+            if (total >= q.radius) continue;
+
+            if (! entry (i)->part) continue;  // removed
+
+            q.sorted.push_back (std::make_pair (total, i));
+            std::push_heap (q.sorted.begin (), q.sorted.end (), forward);
+            if (q.sorted.size () > q.k)
+            {
+                std::pop_heap (q.sorted.begin (), q.sorted.end (), forward);
+                q.sorted.pop_back ();
+            }
+            if (q.sorted.size () == q.k) q.radius = std::min (q.radius, q.sorted.front ().first);
         }
     }
 
-    /// Rearrange points so they are in ascending order along the given dimension.
-    void sort (std::vector<Entry *> & points, int dimension)
+    /// @return The entry with the given index. Indices past the end of points refer to extra.
+    Entry * entry (int i) const
+    {
+        int count = points.size ();
+        if (i < count) return points[i];
+        return extra[i - count];
+    }
+
+    /**
+        Inserts e without rebuilding the whole tree. It goes into the side buffer, which is searched
+        by brute force. The tree is rebuilt once the buffer grows beyond a fraction of the tree size.
+        Caller must keep e at a stable address until it is removed or the tree is cleared.
+    **/
+    void add (Entry * e)
+    {
+        extra.push_back (e);
+        const T * a = e->base ();
+        extraCoords.insert (extraCoords.end (), a, a + 3);
+        if (extra.size () > std::max (64, (int) points.size () / 8)) rebuild ();
+    }
+
+    /// Marks e as dead by clearing its part. Dead entries are skipped by search and dropped at the next rebuild.
+    void remove (Entry * e)
+    {
+        if (! e->part) return;
+        e->part = 0;
+        if (++removed > std::max (64, (int) points.size () / 4)) rebuild ();
+    }
+
+    /// Constructs a fresh tree from all live entries, including the side buffer.
+    void rebuild ()
     {
-        // Effectively we do a heap sort, since priority_queue is typically implemented with a heap structure.
-        std::priority_queue<PairEntry, std::vector<PairEntry>, Forward> sorted;
-        typename std::vector<Entry *>::iterator it = points.begin ();
-        for (; it != points.end (); it++)
+        std::vector<Entry *> data;
+        data.reserve (points.size () + extra.size ());
+        for (Entry * e : points) if (e->part) data.push_back (e);
+        for (Entry * e : extra)  if (e->part) data.push_back (e);
+        set (data);
+    }
+
+    /**
+        Recursively construct a tree that handles the given range of points.
+        @return Index of new node, or -1 if range is empty.
+    **/
+    int construct (int begin, int end)
+    {
+        int count = end - begin;
+        if (count == 0) return -1;
+
+        int result = nodes.size ();
+        nodes.emplace_back ();
+        if (count <= bucketSize)
         {
-            sorted.push (std::make_pair ((**it)[dimension], *it));
+            Node & leaf = nodes[result];
+            leaf.dimension = -1;
+            leaf.low       = begin;
+            leaf.high      = end;
+            return result;
         }
 
-        int count = sorted.size ();
-        for (int i = count - 1; i >= 0; i--)
+        // todo: pass the split method as a function pointer
+        int d = 0;
+        T longest = 0;
+        for (int i = 0; i < 3; i++)
         {
-            points[i] = sorted.top ().second;
-            sorted.pop ();
+            T length = hi[i] - lo[i];
+            if (length > longest)
+            {
+                d = i;
+                longest = length;
+            }
         }
+
+        // Partial sort is enough to split the range at its median.
+        typename std::vector<Entry *>::iterator b = points.begin () + begin;
+        typename std::vector<Entry *>::iterator c = b + count / 2;
+        typename std::vector<Entry *>::iterator e = points.begin () + end;
+        std::nth_element (b, c, e, [d] (const Entry * x, const Entry * y) {return (*x)[d] < (*y)[d];});
+
+        T nodeLo  = lo[d];
+        T nodeHi  = hi[d];
+        T nodeMid = (**c)[d];
+        int cut = begin + count / 2;
+
+        hi[d] = nodeMid;
+        int low = construct (begin, cut);
+        hi[d] = nodeHi;
+
+        lo[d] = nodeMid;
+        int high = construct (cut, end);
+        lo[d] = nodeLo;  // it is important to restore lo[d] so that when recursion unwinds the vector is still correct
+
+        Node & branch = nodes[result];  // nodes may have been reallocated during recursion
+        branch.dimension = d;
+        branch.lo        = nodeLo;
+        branch.hi        = nodeHi;
+        branch.mid       = nodeMid;
+        branch.low       = low;
+        branch.high      = high;
+        return result;
     }
 };
 
@@ -387,11 +459,8 @@ public:
         Part<int> * part;
     };
 
-    class Node;
-
-    typedef std::pair<int64_t, Node *>  LongNode;
-    typedef std::pair<int64_t, Entry *> LongEntry;
-    typedef std::pair<int,     Entry *> ShortEntry;
+    typedef std::pair<int64_t, int> LongNode;   ///< distance, index into nodes
+    typedef std::pair<int64_t, int> LongEntry;  ///< distance, index into points
 
     class LongReverse
     {
@@ -411,114 +480,34 @@ public:
         }
     };
 
-    class ShortForward
-    {
-    public:
-        bool operator() (const ShortEntry & a, const ShortEntry & b) const
-        {
-            return a.first < b.first;
-        }
-    };
-
-    /// Helper class for passing search-related info down the tree.
+    /// Scratch space for a single search. Both lists are maintained as heaps.
     class Query
     {
     public:
-        int             k;
-        int64_t         radius;
-        const Vector3 * point;
-        std::priority_queue<LongEntry, std::vector<LongEntry>, LongForward> sorted;
-        std::priority_queue<LongNode,  std::vector<LongNode>,  LongReverse> queue;
+        int                    k;
+        int64_t                radius;
+        const int *            point;
+        std::vector<LongEntry> sorted;  ///< max-heap of best points found so far
+        std::vector<LongNode>  queue;   ///< min-heap of nodes waiting to be searched
     };
 
     class Node
     {
     public:
-        virtual ~Node () {}
-        virtual void search (int64_t distance, Query & q) const = 0;
+        int dimension; ///< Split dimension, or -1 if this is a leaf.
+        int low;       ///< Branch: index of node below mid, or -1. Leaf: index of first point.
+        int high;      ///< Branch: index of node above mid, or -1. Leaf: one past last point.
+        int lo;        ///< Lowest value along the dimension
+        int hi;        ///< Highest value along the dimension
+        int mid;       ///< The cut point along the dimension
     };
 
-    class Branch : public Node
-    {
-    public:
-        int    dimension;
-        int    lo;        ///< Lowest value along the dimension
-        int    hi;        ///< Highest value along the dimension
-        int    mid;       ///< The cut point along the dimension
-        Node * lowNode;   ///< below mid
-        Node * highNode;  ///< above mid
-
-        virtual ~Branch ()
-        {
-            delete lowNode;
-            delete highNode;
-        }
-
-        virtual void search (int64_t distance, Query & q) const
-        {
-            int qmid = (*q.point)[dimension];
-            int newOffset = qmid - mid;
-            if (newOffset < 0)  // lowNode is closer
-            {
-                // We don't do any special testing on nearer node, because it has already been
-                // tested as part of the containing node.
-                if (lowNode) lowNode->search (distance, q);
-                if (highNode)
-                {
-                    int oldOffset = std::max (lo - qmid, 0);
-                    distance += (int64_t) newOffset * newOffset - (int64_t) oldOffset * oldOffset;
-                    q.queue.push (std::make_pair (distance, highNode));
-                }
-            }
-            else  // newOffset >= 0, so highNode is closer
-            {
-                if (highNode) highNode->search (distance, q);
-                if (lowNode)
-                {
-                    int oldOffset = std::max (qmid - hi, 0);
-                    distance += (int64_t) newOffset * newOffset - (int64_t) oldOffset * oldOffset;
-                    q.queue.push (std::make_pair (distance, lowNode));
-                }
-            }
-        }
-    };
-
-    class Leaf : public Node
-    {
-    public:
-        std::vector<Entry *> points;
-
-        virtual void search (int64_t distance, Query & q) const
-        {
-            int count = points.size ();
-            for (int i = 0; i < count; i++)
-            {
-                Entry * p = points[i];
-
-                // Measure distance using early-out method. Might save operations in
-                // high-dimensional spaces.
-                // Here we make the assumption that the values are stored contiguously in
-                // memory.  This is a good place to check for bugs if using more exotic
-                // matrix types (not recommended).
-                int * x = &(*p)[0];
-                int * y = &(*q.point)[0];
-                int * end = x + 3;
-                int64_t total = 0;
-                while (x < end  &&  total < q.radius)
-                {
-                    int t = *x++ - *y++;
-                    total += (int64_t) t * t;
-                }
-
-                if (total >= q.radius) continue;
-                q.sorted.push (std::make_pair (total, p));
-                if (q.sorted.size () > q.k) q.sorted.pop ();
-                if (q.sorted.size () == q.k) q.radius = std::min (q.radius, q.sorted.top ().first);
-            }
-        }
-    };
-
-    Node * root;
+    std::vector<Node>    nodes;   ///< nodes[0] is root, if tree is not empty.
+    std::vector<Entry *> points;  ///< In bucket order.
+    std::vector<int>     coords;  ///< 3 values for each entry in points.
+    std::vector<Entry *> extra;        ///< Entries added since the tree was last built. Searched by brute force.
+    std::vector<int>      extraCoords;  ///< 3 values for each entry in extra.
+    int                  removed;      ///< Number of entries marked dead since the tree was last built.
     Vector3 lo;
     Vector3 hi;
 
@@ -530,27 +519,27 @@ public:
 
     KDTree ()
     {
-        root       = 0;
         bucketSize = 5;
         k          = 5;  // it doesn't make sense for k to be less than bucketSize
         radius     = INFINITY;
         epsilon    = 0x3;  // exponent=MSB/2; (1<<MSB/2)*1e-4 = 32768/10000 ~= 3
         maxNodes   = INT_MAX;
-    }
-
-    ~KDTree ()
-    {
-        clear ();
+        removed    = 0;
     }
 
     void clear ()
     {
-        delete root;
-        root = 0;
+        nodes .clear ();
+        points.clear ();
+        coords.clear ();
+        extra .clear ();
+        extraCoords.clear ();
+        removed = 0;
     }
 
     void set (std::vector<Entry *> & data)
     {
+        clear ();
         ::clear (lo,  INFINITY);
         ::clear (hi, -INFINITY);
 
@@ -571,11 +560,33 @@ public:
             }
         }
 
-        root = construct (data);
+        int count = data.size ();
+        points = data;
+        nodes.reserve (2 * count / std::max (1, bucketSize) + 1);
+        construct (0, count);
+
+        coords.resize (3 * count);
+        int * c = coords.data ();
+        for (Entry * e : points)
+        {
+            const int * a = e->base ();
+            *c++ = a[0];
+            *c++ = a[1];
+            *c++ = a[2];
+        }
     }
 
     void find (const Vector3 & query, std::vector<Entry *> & result) const
     {
+        Query q;
+        find (query, result, q);
+    }
+
+    /// Same as above, but uses caller-supplied scratch space.
+    void find (const Vector3 & query, std::vector<Entry *> & result, Query & q) const
+    {
+        result.clear ();
+
         // Determine distance of query from bounding rectangle for entire tree
         int64_t distance = 0;
         for (int i = 0; i < 3; i++)
@@ -584,110 +595,221 @@ public:
             distance += (int64_t) d * d;
         }
 
-        // Recursively collect closest points
-        Query q;
         q.k      = k;
         q.radius = (int64_t) radius * radius;  // this may shrink monotonically once we find enough neighbors
-        q.point  = &query;
+        q.point  = query.base ();
+        q.sorted.clear ();
+        q.queue .clear ();
 
         int oneEpsilon = (1 << FP_MSB2) + epsilon;  // exponent=MSB/2
         oneEpsilon = oneEpsilon * oneEpsilon >> FP_MSB2;  // This multiplication fits in 32-bit word, so no need for upcast.
-        q.queue.push (std::make_pair (distance, root));
+        if (nodes.size ()) q.queue.push_back (std::make_pair (distance, 0));
         int visited = 0;
+        LongReverse reverse;
         while (q.queue.size ())
         {
-            const LongNode & it = q.queue.top ();
-            distance = it.first;
-            Node * n = it.second;
-            q.queue.pop ();
+            std::pop_heap (q.queue.begin (), q.queue.end (), reverse);
+            distance = q.queue.back ().first;
+            int n    = q.queue.back ().second;
+            q.queue.pop_back ();
             if (distance * oneEpsilon >> FP_MSB2 > q.radius) break;
-            n->search (distance, q);
+            search (n, distance, q);
             if (++visited >= maxNodes) break;
         }
+        int count = points.size ();
+        if (extra.size ()) scan (extraCoords.data (), count, count + extra.size (), q);
 
-        // Transfer results to vector. No need to limit number of results, because this has
-        // already been done by Leaf::search().
-        int count = q.sorted.size ();
-        result.resize (count);
-        for (int i = count - 1; i >= 0; i--)
-        {
-            result[i] = q.sorted.top ().second;
-            q.sorted.pop ();
-        }
+        // Transfer results to vector, nearest first. No need to limit number of results,
+        // because this has already been done by search().
+        std::sort_heap (q.sorted.begin (), q.sorted.end (), LongForward ());
+        result.reserve (q.sorted.size ());
+        for (auto & it : q.sorted) result.push_back (entry (it.second));
     }
 
-    /// Recursively construct a tree that handles the given volume of points.
-    Node * construct (std::vector<Entry *> & points)
+    /// @see KDTree::findBatch()
+    void findBatch (const Vector3 * queries, int count, std::vector<Entry *> * results) const
     {
-        int count = points.size ();
-        if (count == 0)
+        auto work = [=] (int begin, int end)
         {
-            return 0;
-        }
-        else if (count <= bucketSize)
+            Query q;
+            for (int i = begin; i < end; i++) find (queries[i], results[i], q);
+        };
+
+        int threads = matrixThreads ? std::min (matrixThreads->available (), count / 64) : 1;
+        if (threads > 1)
         {
-            Leaf * result = new Leaf;
-            result->points = points;
-            return result;
+            matrixThreads->run ([&] (int t)
+            {
+                if (t < threads) work ((int) ((int64_t) count * t / threads), (int) ((int64_t) count * (t + 1) / threads));
+            });
+            return;
         }
-        else  // count > bucketSize
-        {
-            // todo: pass the split method as a function pointer
-            int d = 0;
-            int longest = 0;
-            for (int i = 0; i < 3; i++)
+        work (0, count);
+    }
+
+    void search (int n, int64_t distance, Query & q) const
+    {
+        LongReverse reverse;
+        while (n >= 0)
+        {
+            const Node & node = nodes[n];
+            if (node.dimension < 0) break;
+
+            // We don't do any special testing on nearer node, because it has already been
+            // tested as part of the containing node.
+            int qmid = q.point[node.dimension];
+            int newOffset = qmid - node.mid;
+            int far;
+            int oldOffset;
+            if (newOffset < 0)  // low node is closer
             {
-                int length = hi[i] - lo[i];
-                if (length > longest)
-                {
-                    d = i;
-                    longest = length;
-                }
+                far       = node.high;
+                oldOffset = std::max (node.lo - qmid, 0);
+                n         = node.low;
             }
-            sort (points, d);
-            int cut = count / 2;
-            typename std::vector<Entry *>::iterator b = points.begin ();
-            typename std::vector<Entry *>::iterator c = b + cut;
-            typename std::vector<Entry *>::iterator e = points.end ();
-
-            Branch * result = new Branch;
-            result->dimension = d;
-            result->lo = lo[d];
-            result->hi = hi[d];
-            result->mid = (**c)[d];
-
-            hi[d] = result->mid;
-            std::vector<Entry *> tempPoints (b, c);
-            result->lowNode = construct (tempPoints);
-            hi[d] = result->hi;
-
-            lo[d] = result->mid;
-            tempPoints.clear ();
-            tempPoints.insert (tempPoints.begin (), c, e);
-            result->highNode = construct (tempPoints);
-            lo[d] = result->lo;  // it is important to restore lo[d] so that when recursion unwinds the vector is still correct
+            else  // newOffset >= 0, so high node is closer
+            {
+                far       = node.low;
+                oldOffset = std::max (qmid - node.hi, 0);
+                n         = node.high;
+            }
+            if (far >= 0)
+            {
+                q.queue.push_back (std::make_pair (distance + (int64_t) newOffset * newOffset - (int64_t) oldOffset * oldOffset, far));
+                std::push_heap (q.queue.begin (), q.queue.end (), reverse);
+            }
+        }
+        if (n < 0) return;
 
-            return result;
+        scan (coords.data () + 3 * nodes[n].low, nodes[n].low, nodes[n].high, q);
+    }
+
+    /// Measures distance to points [begin,end), given their coordinates in x, and collects those that qualify.
+    void scan (const int * x, int begin, int end, Query & q) const
+    {
+        LongForward forward;
+        const int * y = q.point;
+        for (int i = begin; i < end; i++, x += 3)
+        {
+            // Measure distance using early-out method.
+            int t = x[0] - y[0];
+            int64_t total = (int64_t) t * t;
+            if (total >= q.radius) continue;
+            t = x[1] - y[1];
+            total += (int64_t) t * t;
+            if (total >= q.radius) continue;
+            t = x[2] - y[2];
+            total += (int64_t) t * t;
+            if (total >= q.radius) continue;
+
+            if (! entry (i)->part) continue;  // removed
+
+            q.sorted.push_back (std::make_pair (total, i));
+            std::push_heap (q.sorted.begin (), q.sorted.end (), forward);
+            if (q.sorted.size () > q.k)
+            {
+                std::pop_heap (q.sorted.begin (), q.sorted.end (), forward);
+                q.sorted.pop_back ();
+            }
+            if (q.sorted.size () == q.k) q.radius = std::min (q.radius, q.sorted.front ().first);
         }
     }
 
-    /// Rearrange points so they are in ascending order along the given dimension.
-    void sort (std::vector<Entry *> & points, int dimension)
+    /// @return The entry with the given index. Indices past the end of points refer to extra.
+    Entry * entry (int i) const
+    {
+        int count = points.size ();
+        if (i < count) return points[i];
+        return extra[i - count];
+    }
+
+    /**
+        Inserts e without rebuilding the whole tree. It goes into the side buffer, which is searched
+        by brute force. The tree is rebuilt once the buffer grows beyond a fraction of the tree size.
+        Caller must keep e at a stable address until it is removed or the tree is cleared.
+    **/
+    void add (Entry * e)
+    {
+        extra.push_back (e);
+        const int * a = e->base ();
+        extraCoords.insert (extraCoords.end (), a, a + 3);
+        if (extra.size () > std::max (64, (int) points.size () / 8)) rebuild ();
+    }
+
+    /// Marks e as dead by clearing its part. Dead entries are skipped by search and dropped at the next rebuild.
+    void remove (Entry * e)
+    {
+        if (! e->part) return;
+        e->part = 0;
+        if (++removed > std::max (64, (int) points.size () / 4)) rebuild ();
+    }
+
+    /// Constructs a fresh tree from all live entries, including the side buffer.
+    void rebuild ()
+    {
+        std::vector<Entry *> data;
+        data.reserve (points.size () + extra.size ());
+        for (Entry * e : points) if (e->part) data.push_back (e);
+        for (Entry * e : extra)  if (e->part) data.push_back (e);
+        set (data);
+    }
+
+    /// Recursively construct a tree that handles the given range of points.
+    int construct (int begin, int end)
     {
-        // Effectively we do a heap sort, since priority_queue is typically implemented with a heap structure.
-        std::priority_queue<ShortEntry, std::vector<ShortEntry>, ShortForward> sorted;
-        typename std::vector<Entry *>::iterator it = points.begin ();
-        for (; it != points.end (); it++)
+        int count = end - begin;
+        if (count == 0) return -1;
+
+        int result = nodes.size ();
+        nodes.emplace_back ();
+        if (count <= bucketSize)
         {
-            sorted.push (std::make_pair ((**it)[dimension], *it));
+            Node & leaf = nodes[result];
+            leaf.dimension = -1;
+            leaf.low       = begin;
+            leaf.high      = end;
+            return result;
         }
 
-        int count = sorted.size ();
-        for (int i = count - 1; i >= 0; i--)
+        // todo: pass the split method as a function pointer
+        int d = 0;
+        int longest = 0;
+        for (int i = 0; i < 3; i++)
         {
-            points[i] = sorted.top ().second;
-            sorted.pop ();
+            int length = hi[i] - lo[i];
+            if (length > longest)
+            {
+                d = i;
+                longest = length;
+            }
         }
+
+        typename std::vector<Entry *>::iterator b = points.begin () + begin;
+        typename std::vector<Entry *>::iterator c = b + count / 2;
+        typename std::vector<Entry *>::iterator e = points.begin () + end;
+        std::nth_element (b, c, e, [d] (const Entry * x, const Entry * y) {return (*x)[d] < (*y)[d];});
+
+        int nodeLo  = lo[d];
+        int nodeHi  = hi[d];
+        int nodeMid = (**c)[d];
+        int cut = begin + count / 2;
+
+        hi[d] = nodeMid;
+        int low = construct (begin, cut);
+        hi[d] = nodeHi;
+
+        lo[d] = nodeMid;
+        int high = construct (cut, end);
+        lo[d] = nodeLo;  // it is important to restore lo[d] so that when recursion unwinds the vector is still correct
+
+        Node & branch = nodes[result];  // nodes may have been reallocated during recursion
+        branch.dimension = d;
+        branch.lo        = nodeLo;
+        branch.hi        = nodeHi;
+        branch.mid       = nodeMid;
+        branch.low       = low;
+        branch.high      = high;
+        return result;
     }
 };
 
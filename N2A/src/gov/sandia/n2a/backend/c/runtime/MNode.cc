@@ -20,6 +20,8 @@ the U.S. Government retains certain rights in this software.
 #include <unordered_set>
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <atomic>
 #include <sys/stat.h>
 #ifdef _MSC_VER
 #  define WIN32_LEAN_AND_MEAN
@@ -31,6 +33,7 @@ the U.S. Government retains certain rights in this software.
 #  include <dirent.h>
 #  include <unistd.h>
 #endif
+#include "mappedfile.h"
 
 
 // Utility functions ---------------------------------------------------------
@@ -112,6 +115,43 @@ n2a::is_directory (const String & path)
     return buffer.st_mode & S_IFDIR;
 }
 
+/**
+    Read-only view of an entire file, for parsing directly from memory.
+    Maps the file where possible. Otherwise reads it with a single call.
+    If the file can't be opened, data is null.
+**/
+class FileView
+{
+public:
+    const char *    data;
+    size_t          size;
+    n2a::MappedFile map;
+    String          buffer;  ///< Holds contents when file is not mapped.
+
+    FileView (const String & path)
+    {
+        data = 0;
+        size = 0;
+        if (map.open (path.c_str (), true)  &&  map.data)
+        {
+            data = map.data;
+            size = map.size;
+            return;
+        }
+
+        // Fall back on reading the whole file.
+        std::ifstream ifs (path.c_str (), std::ios::binary | std::ios::ate);
+        if (! ifs.good ()) return;
+        std::streamoff length = ifs.tellg ();
+        if (length < 0) return;
+        ifs.seekg (0);
+        this->buffer.resize (length);
+        ifs.read ((char *) this->buffer.c_str (), length);
+        data = this->buffer.c_str ();
+        size = ifs.gcount ();
+    }
+};
+
 void
 n2a::mkdirs (const String & file)
 {
@@ -1078,9 +1118,8 @@ n2a::MDoc::load ()
     String file = path ();
     try
     {
-        std::ifstream ifs (file.c_str ());
-        Schema::readAll (*this, ifs);
-        ifs.close ();
+        FileView view (file);
+        Schema::readAll (*this, view.data, view.data + view.size);
     }
     catch (...)  // An exception is common for a newly created doc that has not yet been flushed to disk.
     {
@@ -1313,6 +1352,48 @@ n2a::MDocGroup::unload (n2a::MDoc * doc)
     children[key] = nullptr;
 }
 
+void
+n2a::MDocGroup::preload (int threads)
+{
+    // Collect documents. Iterating creates an MDoc for each key, but does not read it.
+    // In the case of MDir, it also scans the directory.
+    std::vector<MDoc *> docs;
+    {
+        std::lock_guard<std::recursive_mutex> lock (mutex);
+        for (auto & c : *this) docs.push_back ((MDoc *) &c);
+    }
+
+    if (threads < 1) threads = std::max (1u, std::thread::hardware_concurrency ());
+    threads = std::min (threads, (int) docs.size ());
+    std::atomic<size_t> next (0);
+    const char * error = 0;
+    std::mutex errorMutex;
+    auto work = [&] ()
+    {
+        while (true)
+        {
+            size_t i = next++;
+            if (i >= docs.size ()) break;
+            // Each MDoc has its own lock, and load() does not touch this group,
+            // so documents can be parsed without holding our mutex.
+            try
+            {
+                docs[i]->load ();
+            }
+            catch (const char * message)  // Only happens when setMissingFileException(2) is in effect.
+            {
+                std::lock_guard<std::mutex> lock (errorMutex);
+                if (! error) error = message;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++) workers.emplace_back (work);
+    work ();  // The calling thread also participates.
+    for (auto & w : workers) w.join ();
+    if (error) throw error;
+}
+
 
 // class MDir ----------------------------------------------------------------
 
@@ -1466,13 +1547,20 @@ n2a::MDir::childGet (const String & key, bool create)
 
     if (! result)  // Doc is not currently loaded
     {
-        String path = pathForDoc (key);
-        bool exists = n2a::exists (path);
-        if (! exists  &&  ! create)
+        // A null entry comes either from the directory scan in load() or from unload(),
+        // which saves the doc before dropping it. Either way the entry should be on disk,
+        // so a plain lookup can skip the file-system query.
+        bool exists =  ! create  &&  it != children.end ();
+        if (! exists)
         {
-            if (suffix.empty ()) return none;
-            // Allow the possibility that the dir exists but lacks its special file.
-            if (! n2a::exists (pathForFile (key))) return none;
+            String path = pathForDoc (key);
+            exists = n2a::exists (path);
+            if (! exists  &&  ! create)
+            {
+                if (suffix.empty ()) return none;
+                // Allow the possibility that the dir exists but lacks its special file.
+                if (! n2a::exists (pathForFile (key))) return none;
+            }
         }
         result = new MDoc (*this, key);  // Assumes key==path.
         children[key] = result;
@@ -1505,12 +1593,33 @@ n2a::Schema::readAll (MNode & node, std::istream & reader, Schema ** schema)
     else        delete result;
 }
 
+void
+n2a::Schema::readAll (MNode & node, const char * begin, const char * end, Schema ** schema)
+{
+    if (begin >= end) throw "File is empty.";
+    const char * newline = (const char *) memchr (begin, '\n', end - begin);
+    if (! newline) throw "File is empty.";  // Same as stream version, which requires at least one full line.
+    String line;
+    line.assign (begin, newline - begin);
+    Schema * result = read (line);
+    LineReader reader (newline + 1, end);
+    result->read (node, reader);
+    if (schema) *schema = result;
+    else        delete result;
+}
+
 n2a::Schema *
 n2a::Schema::read (std::istream & reader)
 {
     String line;
     getline (reader, line);
     if (! reader.good ()) throw "File is empty.";
+    return read (line);
+}
+
+n2a::Schema *
+n2a::Schema::read (String line)
+{
     line.trim ();
     if (line.size () < 12) throw "Malformed schema line.";
     if (line.substr (0, 11) != "N2A.schema=") throw "Schema line missing or malformed.";
@@ -1547,14 +1656,25 @@ n2a::Schema::write (MNode & node, std::ostream & writer)
     write (node, writer, "");
 }
 
+
+
+// class LineReader ----------------------------------------------------------
+
 n2a::LineReader::LineReader (std::istream & reader)
-:   reader (reader)
+:   reader (&reader),
+    next   (0),
+    end    (0)
 {
     getNextLine ();
 }
 
-
-// class LineReader ----------------------------------------------------------
+n2a::LineReader::LineReader (const char * begin, const char * end)
+:   reader (0),
+    next   (begin),
+    end    (end)
+{
+    getNextLine ();
+}
 
 void
 n2a::LineReader::getNextLine ()
@@ -1562,11 +1682,26 @@ n2a::LineReader::getNextLine ()
     // Scan for non-empty line
     while (true)
     {
-        getline (reader, line);  // default line ending is NL
-        if (! reader.good ())
+        if (reader)
         {
-            whitespaces = -1;
-            return;
+            getline (*reader, line);  // default line ending is NL
+            if (! reader->good ())
+            {
+                whitespaces = -1;
+                return;
+            }
+        }
+        else
+        {
+            if (next >= end)
+            {
+                whitespaces = -1;
+                return;
+            }
+            const char * newline = (const char *) memchr (next, '\n', end - next);
+            const char * lineEnd = newline ? newline : end;
+            line.assign (next, lineEnd - next);  // No allocation once line has grown to fit the longest line so far.
+            next = newline ? newline + 1 : end;
         }
 
         int count = line.size ();
@@ -1592,9 +1727,15 @@ n2a::Schema2::Schema2 (int version, const String & type)
 void
 n2a::Schema2::read (MNode & node, std::istream & reader)
 {
-    node.clear ();
     LineReader lineReader (reader);
-    read (node, lineReader, 0);
+    read (node, lineReader);
+}
+
+void
+n2a::Schema2::read (MNode & node, LineReader & reader)
+{
+    node.clear ();
+    read (node, reader, 0);
 }
 
 void
@@ -767,6 +767,12 @@ namespace n2a
             If the document has unsaved changes, they will be written before the memory is freed.
         **/
         void unload (MDoc * doc);
+        /**
+            Reads every document now, rather than one at a time on first access.
+            Documents are independent, so they are parsed concurrently.
+            @param threads Number of threads to use. A count less than 1 means use all available hardware threads.
+        **/
+        void preload (int threads = 0);
 
         using MNode::clear;
         using MNode::getOrDefault;
@@ -856,10 +862,23 @@ namespace n2a
         **/
         static Schema * read (std::istream & reader);
 
+        /**
+            Same as readAll(MNode,istream,Schema), but reads from a block of memory,
+            such as a mapped file. Avoids the overhead of stream I/O for each line.
+        **/
+        static void readAll (MNode & node, const char * begin, const char * end, Schema ** schema = nullptr);
+
+        /**
+            Interprets the header line, and returns an object capable of reading the rest.
+            The caller must delete this object when done, or memory will leak.
+        **/
+        static Schema * read (String line);
+
         /**
             Low-level routine to interpret contents of stream.
         **/
         virtual void read (MNode & node, std::istream & reader) = 0;
+        virtual void read (MNode & node, LineReader & reader) = 0;
 
         /**
             Convenience method which writes the header and all the children of the given node.
@@ -890,6 +909,7 @@ namespace n2a
         Schema2 (int version, const String & type);
 
         virtual void read (MNode & node, std::istream & reader);
+        virtual void read (MNode & node, LineReader & reader);
         void read (MNode & node, LineReader & reader, int whitespaces);  ///< Subroutine of read(MNode,istream)
         virtual void write (MNode & node, std::ostream & writer, const String & indent);
     };
@@ -897,11 +917,14 @@ namespace n2a
     class LineReader
     {
     public:
-        std::istream & reader;
-        String         line;
+        std::istream * reader;  ///< Null when reading from memory.
+        const char *   next;    ///< Start of next line in memory.
+        const char *   end;     ///< End of memory block.
+        String         line;    ///< Reuses its buffer from line to line.
         int            whitespaces;
 
         LineReader (std::istream & reader);
+        LineReader (const char * begin, const char * end);  ///< Reads lines directly from a block of memory, which must remain valid for the life of this object.
         void getNextLine ();
     };
 
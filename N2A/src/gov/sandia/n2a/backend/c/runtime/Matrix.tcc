@@ -19,6 +19,10 @@ the U.S. Government retains certain rights in this software.
 #include "matrix.h"
 #include "StringLite.h"
 
+#ifdef n2a_BLAS
+#  include <cblas.h>
+#endif
+
 
 // class MatrixAbstract<T> --------------------------------------------------
 
@@ -1192,6 +1196,127 @@ operator & (const MatrixStrided<T> & A, const MatrixAbstract<T> & B)
     return result;
 }
 
+// Dense multiply kernels ----------------------------------------------------
+
+// Below n2a_BLOCK_MIN multiply-adds, the plain dot-product loop is faster than the
+// blocked kernel. Below n2a_BLAS_MIN, the cost of a library call is not repaid.
+#ifndef n2a_BLOCK_MIN
+#  define n2a_BLOCK_MIN 4096
+#endif
+#ifndef n2a_BLAS_MIN
+#  define n2a_BLAS_MIN 32768
+#endif
+
+/**
+    Hands the product to the BLAS library, if one was configured and the element type
+    and layout permit. Each operand must have one unit stride. The other stride becomes
+    the leading dimension, and the operand is transposed if its rows are the contiguous side.
+    @return true if the result was computed. Otherwise the caller must do the work.
+**/
+template<class T>
+inline bool
+multiplyBLAS (int h, int w, int bw, const T * a, int sc, int sr, const T * b, int bsc, int bsr, T * c)
+{
+    return false;
+}
+
+#ifdef n2a_BLAS
+inline bool
+layoutBLAS (int rows, int columns, int sc, int sr, CBLAS_TRANSPOSE & transpose, int & ld)
+{
+    if (sr == 1  &&  sc >= rows)    {transpose = CblasNoTrans; ld = std::max (1, sc); return true;}
+    if (sc == 1  &&  sr >= columns) {transpose = CblasTrans;   ld = std::max (1, sr); return true;}
+    return false;
+}
+
+template<>
+inline bool
+multiplyBLAS (int h, int w, int bw, const float * a, int sc, int sr, const float * b, int bsc, int bsr, float * c)
+{
+    CBLAS_TRANSPOSE ta, tb;
+    int lda, ldb;
+    if (! layoutBLAS (h, w,  sc,  sr,  ta, lda)) return false;
+    if (! layoutBLAS (w, bw, bsc, bsr, tb, ldb)) return false;
+    cblas_sgemm (CblasColMajor, ta, tb, h, bw, w, 1.0f, a, lda, b, ldb, 0.0f, c, h);
+    return true;
+}
+
+template<>
+inline bool
+multiplyBLAS (int h, int w, int bw, const double * a, int sc, int sr, const double * b, int bsc, int bsr, double * c)
+{
+    CBLAS_TRANSPOSE ta, tb;
+    int lda, ldb;
+    if (! layoutBLAS (h, w,  sc,  sr,  ta, lda)) return false;
+    if (! layoutBLAS (w, bw, bsc, bsr, tb, ldb)) return false;
+    cblas_dgemm (CblasColMajor, ta, tb, h, bw, w, 1.0, a, lda, b, ldb, 0.0, c, h);
+    return true;
+}
+#endif
+
+/**
+    Cache-blocked product for the case where columns of A are contiguous (strideR==1),
+    which is the normal layout of Matrix. Accumulates whole result columns as
+    c += a * b[k], so the innermost loop is a unit-stride multiply-add that the
+    compiler can vectorize. Four result columns share each pass over a block of A,
+    so every element of A that is loaded feeds four outputs. Blocks are sized so the
+    slice of A stays in L2 while the four result segments stay in L1.
+    @param c Column-major with leading dimension h. Must be cleared by caller.
+**/
+template<class T>
+void
+multiplyBlocked (int h, int w, int bw, const T * a, int sc, const T * b, int bsc, int bsr, T * c)
+{
+    const int blockR = 256;  // rows of A and C per pass
+    const int blockK = 128;  // columns of A per pass
+
+    for (int k0 = 0; k0 < w; k0 += blockK)
+    {
+        int k1 = std::min (w, k0 + blockK);
+        for (int r0 = 0; r0 < h; r0 += blockR)
+        {
+            int n = std::min (h, r0 + blockR) - r0;
+            int j = 0;
+            for (; j + 4 <= bw; j += 4)
+            {
+                T * c0 = c + j * h + r0;
+                T * c1 = c0 + h;
+                T * c2 = c1 + h;
+                T * c3 = c2 + h;
+                const T * bj = b + j * bsc;
+                for (int k = k0; k < k1; k++)
+                {
+                    const T * ak = a + k * sc + r0;
+                    const T * bk = bj + k * bsr;
+                    const T b0 = bk[0];
+                    const T b1 = bk[bsc];
+                    const T b2 = bk[2 * bsc];
+                    const T b3 = bk[3 * bsc];
+                    for (int i = 0; i < n; i++)
+                    {
+                        const T e = ak[i];
+                        c0[i] += e * b0;
+                        c1[i] += e * b1;
+                        c2[i] += e * b2;
+                        c3[i] += e * b3;
+                    }
+                }
+            }
+            for (; j < bw; j++)  // Leftover columns, including the matrix-vector case.
+            {
+                T * c0 = c + j * h + r0;
+                const T * bj = b + j * bsc;
+                for (int k = k0; k < k1; k++)
+                {
+                    const T * ak = a + k * sc + r0;
+                    const T b0 = bj[k * bsr];
+                    for (int i = 0; i < n; i++) c0[i] += ak[i] * b0;
+                }
+            }
+        }
+    }
+}
+
 template<class T>
 Matrix<T>
 operator * (const MatrixStrided<T> & A, const MatrixAbstract<T> & B)
@@ -1214,6 +1339,20 @@ operator * (const MatrixStrided<T> & A, const MatrixAbstract<T> & B)
     T * aa  = A.base ();
     T * b   = MB.base ();
     T * c   = result.base ();
+
+    if (h > 0  &&  ow > 0  &&  bw > 0)
+    {
+        int64_t work = (int64_t) h * ow * bw;
+        if (work >= n2a_BLAS_MIN  &&  multiplyBLAS (h, ow, bw, aa, sc, sr, b, bsc, bsr, c)) return result;
+        if (work >= n2a_BLOCK_MIN  &&  sr == 1)
+        {
+            clear (result);
+            multiplyBlocked (h, ow, bw, aa, sc, b, bsc, bsr, c);
+            return result;
+        }
+    }
+
+    // General strides, or too small to benefit from blocking.
     T * end = c + h * bw;
     while (c < end)
     {
@@ -1670,4 +1809,228 @@ column (const Matrix<T> & A, int column)
     return Matrix<T> (A.data, A.offset + column * A.strideC_, A.rows_, 1, A.strideR_, A.strideC_);
 }
 
+
+// Operators on temporaries -------------------------------------------------
+
+/**
+    Replaces each element a of A that overlaps B with f(a,b).
+    Elements of A outside the overlap keep their value, which is what the
+    binary operators do with the non-overlapping part of their left operand.
+    A must be dense.
+**/
+template<class T, class F>
+inline void
+combineInPlace (Matrix<T> & A, const MatrixStrided<T> & B, F f)
+{
+    int h   = A.rows_;
+    int oh  = std::min (h,          B.rows ());
+    int ow  = std::min (A.columns_, B.columns ());
+    int bsr = B.strideR ();
+    int stepB = B.strideC () - oh * bsr;
+    T * a = A.base ();
+    T * b = B.base ();
+    for (int c = 0; c < ow; c++)
+    {
+        T * overlapEnd = a + oh;
+        while (a < overlapEnd)
+        {
+            *a = f (*a, *b);
+            a++;
+            b += bsr;
+        }
+        a += h - oh;
+        b += stepB;
+    }
+}
+
+/// Replaces each element a of A with f(a). A must be dense.
+template<class T, class F>
+inline void
+mapInPlace (Matrix<T> & A, F f)
+{
+    T * a   = A.base ();
+    T * end = a + A.rows_ * A.columns_;
+    while (a < end)
+    {
+        *a = f (*a);
+        a++;
+    }
+}
+
+template<class T>
+Matrix<T>
+visit (Matrix<T> && A, T (*function) (const T &))
+{
+    if (! canReuse (A)) return visit ((const MatrixStrided<T> &) A, function);
+    mapInPlace (A, function);
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+visit (Matrix<T> && A, T (*function) (const T))
+{
+    if (! canReuse (A)) return visit ((const MatrixStrided<T> &) A, function);
+    mapInPlace (A, function);
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+operator & (Matrix<T> && A, const MatrixAbstract<T> & B)
+{
+    if (! canReuse (A)  ||  (B.classID () & MatrixStridedID) == 0) return operator & ((const MatrixStrided<T> &) A, B);
+    combineInPlace (A, (const MatrixStrided<T> &) B, [] (T a, T b) {return a * b;});
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+operator & (const MatrixStrided<T> & A, Matrix<T> && B)
+{
+    if (! canReuse (B)  ||  B.rows_ != A.rows ()  ||  B.columns_ != A.columns ()) return operator & (A, (const MatrixAbstract<T> &) B);
+    combineInPlace (B, A, [] (T b, T a) {return a * b;});
+    return std::move (B);
+}
+
+template<class T>
+Matrix<T>
+operator & (Matrix<T> && A, Matrix<T> && B)
+{
+    if (canReuse (A)) return std::move (A) & (const MatrixAbstract<T> &) B;
+    return (const MatrixStrided<T> &) A & std::move (B);
+}
+
+template<class T>
+Matrix<T>
+operator * (Matrix<T> && A, const T scalar)
+{
+    if (! canReuse (A)) return (const MatrixStrided<T> &) A * scalar;
+    mapInPlace (A, [=] (T a) {return a * scalar;});
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+operator / (Matrix<T> && A, const MatrixAbstract<T> & B)
+{
+    if (! canReuse (A)  ||  (B.classID () & MatrixStridedID) == 0) return operator / ((const MatrixStrided<T> &) A, B);
+    combineInPlace (A, (const MatrixStrided<T> &) B, [] (T a, T b) {return a / b;});
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+operator / (const MatrixStrided<T> & A, Matrix<T> && B)
+{
+    if (! canReuse (B)  ||  B.rows_ != A.rows ()  ||  B.columns_ != A.columns ()) return operator / (A, (const MatrixAbstract<T> &) B);
+    combineInPlace (B, A, [] (T b, T a) {return a / b;});
+    return std::move (B);
+}
+
+template<class T>
+Matrix<T>
+operator / (Matrix<T> && A, Matrix<T> && B)
+{
+    if (canReuse (A)) return std::move (A) / (const MatrixAbstract<T> &) B;
+    return (const MatrixStrided<T> &) A / std::move (B);
+}
+
+template<class T>
+Matrix<T>
+operator / (Matrix<T> && A, const T scalar)
+{
+    if (! canReuse (A)) return (const MatrixStrided<T> &) A / scalar;
+    mapInPlace (A, [=] (T a) {return a / scalar;});
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+operator / (const T scalar, Matrix<T> && A)
+{
+    if (! canReuse (A)) return scalar / (const MatrixStrided<T> &) A;
+    mapInPlace (A, [=] (T a) {return scalar / a;});
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+operator + (Matrix<T> && A, const MatrixAbstract<T> & B)
+{
+    if (! canReuse (A)  ||  (B.classID () & MatrixStridedID) == 0) return operator + ((const MatrixStrided<T> &) A, B);
+    combineInPlace (A, (const MatrixStrided<T> &) B, [] (T a, T b) {return a + b;});
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+operator + (const MatrixStrided<T> & A, Matrix<T> && B)
+{
+    if (! canReuse (B)  ||  B.rows_ != A.rows ()  ||  B.columns_ != A.columns ()) return operator + (A, (const MatrixAbstract<T> &) B);
+    combineInPlace (B, A, [] (T b, T a) {return a + b;});
+    return std::move (B);
+}
+
+template<class T>
+Matrix<T>
+operator + (Matrix<T> && A, Matrix<T> && B)
+{
+    if (canReuse (A)) return std::move (A) + (const MatrixAbstract<T> &) B;
+    return (const MatrixStrided<T> &) A + std::move (B);
+}
+
+template<class T>
+Matrix<T>
+operator + (Matrix<T> && A, const T scalar)
+{
+    if (! canReuse (A)) return (const MatrixStrided<T> &) A + scalar;
+    mapInPlace (A, [=] (T a) {return a + scalar;});
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+operator - (Matrix<T> && A, const MatrixAbstract<T> & B)
+{
+    if (! canReuse (A)  ||  (B.classID () & MatrixStridedID) == 0) return operator - ((const MatrixStrided<T> &) A, B);
+    combineInPlace (A, (const MatrixStrided<T> &) B, [] (T a, T b) {return a - b;});
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+operator - (const MatrixStrided<T> & A, Matrix<T> && B)
+{
+    if (! canReuse (B)  ||  B.rows_ != A.rows ()  ||  B.columns_ != A.columns ()) return operator - (A, (const MatrixAbstract<T> &) B);
+    combineInPlace (B, A, [] (T b, T a) {return a - b;});
+    return std::move (B);
+}
+
+template<class T>
+Matrix<T>
+operator - (Matrix<T> && A, Matrix<T> && B)
+{
+    if (canReuse (A)) return std::move (A) - (const MatrixAbstract<T> &) B;
+    return (const MatrixStrided<T> &) A - std::move (B);
+}
+
+template<class T>
+Matrix<T>
+operator - (Matrix<T> && A, const T scalar)
+{
+    if (! canReuse (A)) return (const MatrixStrided<T> &) A - scalar;
+    mapInPlace (A, [=] (T a) {return a - scalar;});
+    return std::move (A);
+}
+
+template<class T>
+Matrix<T>
+operator - (const T scalar, Matrix<T> && A)
+{
+    if (! canReuse (A)) return scalar - (const MatrixStrided<T> &) A;
+    mapInPlace (A, [=] (T a) {return scalar - a;});
+    return std::move (A);
+}
+
 #endif
@@ -17,17 +17,21 @@ the U.S. Government retains certain rights in this software.
 
 #include "matrix.h"
 
+#include <algorithm>
+
 
 template<class T>
 MatrixSparse<T>::MatrixSparse ()
-:   data (std::make_shared<std::vector<std::map<int,T>>> ())
+:   data (std::make_shared<std::vector<std::map<int,T>>> ()),
+    csc  (std::make_shared<Compressed> ())
 {
     rows_ = 0;
 }
 
 template<class T>
 MatrixSparse<T>::MatrixSparse (const int rows, const int columns)
-:   data (std::make_shared<std::vector<std::map<int,T>>> ())
+:   data (std::make_shared<std::vector<std::map<int,T>>> ()),
+    csc  (std::make_shared<Compressed> ())
 {
     rows_ = rows;
     data->resize (columns);
@@ -41,6 +45,7 @@ MatrixSparse<T>::MatrixSparse (const MatrixAbstract<T> & that)
         const MatrixSparse<T> & S = (const MatrixSparse<T> &) that;
         rows_ = S.rows_;
         data  = S.data;
+        csc   = S.csc;
     }
     else
     {
@@ -48,6 +53,7 @@ MatrixSparse<T>::MatrixSparse (const MatrixAbstract<T> & that)
         int n = that.columns ();
         rows_ = m;
         data = std::make_shared<std::vector<std::map<int,T>>> ();
+        csc  = std::make_shared<Compressed> ();
         data->resize (n);
         for (int c = 0; c < n; c++)
         {
@@ -70,6 +76,7 @@ template<class T>
 void
 MatrixSparse<T>::set (const int row, const int column, const T value)
 {
+    if (compressed ()) decompress ();
     if (value == (T) 0)
     {
         if (column < data->size ())
@@ -95,7 +102,18 @@ template<class T>
 T &
 MatrixSparse<T>::operator () (const int row, const int column) const
 {
-    if (column < data->size ())
+    if (compressed ())
+    {
+        if (column >= 0  &&  column < data->size ())
+        {
+            const int * r     = csc->row.data ();
+            const int * begin = r + csc->start[column];
+            const int * end   = r + csc->start[column+1];
+            const int * i     = std::lower_bound (begin, end, row);
+            if (i != end  &&  *i == row) return csc->value[i - r];
+        }
+    }
+    else if (column < data->size ())
     {
         std::map<int, T> & c = (*data)[column];
         typename std::map<int, T>::iterator i = c.find (row);
@@ -120,4 +138,203 @@ MatrixSparse<T>::columns () const
     return data->size ();
 }
 
+template<class T>
+void
+MatrixSparse<T>::compress ()
+{
+    if (compressed ()) return;
+
+    int count = 0;
+    for (auto & c : *data) count += c.size ();
+    Compressed & C = *csc;
+    C.start.reserve (data->size () + 1);
+    C.row  .reserve (count);
+    C.value.reserve (count);
+    for (auto & c : *data)
+    {
+        C.start.push_back (C.row.size ());
+        for (auto & e : c)
+        {
+            C.row  .push_back (e.first);
+            C.value.push_back (e.second);
+        }
+        c.clear ();
+    }
+    C.start.push_back (count);
+}
+
+template<class T>
+void
+MatrixSparse<T>::compress (int rows, int columns, const std::vector<int> & r, const std::vector<int> & c, const std::vector<T> & v)
+{
+    int count = r.size ();
+    for (int i = 0; i < count; i++)
+    {
+        rows    = std::max (rows,    r[i] + 1);
+        columns = std::max (columns, c[i] + 1);
+    }
+    rows_ = rows;
+    data->clear ();
+    data->resize (columns);
+
+    // Order by column then row. Stable, so among duplicates the last one given comes last.
+    std::vector<int> order (count);
+    for (int i = 0; i < count; i++) order[i] = i;
+    std::stable_sort (order.begin (), order.end (), [&] (int a, int b)
+    {
+        if (c[a] != c[b]) return c[a] < c[b];
+        return r[a] < r[b];
+    });
+
+    Compressed & C = *csc;
+    C.start.assign (columns + 1, 0);
+    C.row  .clear ();
+    C.value.clear ();
+    C.row  .reserve (count);
+    C.value.reserve (count);
+    for (int i = 0; i < count; i++)
+    {
+        int o = order[i];
+        if (i + 1 < count)  // Skip any element overridden by a later duplicate.
+        {
+            int p = order[i+1];
+            if (r[p] == r[o]  &&  c[p] == c[o]) continue;
+        }
+        if (v[o] == (T) 0) continue;
+        C.row  .push_back (r[o]);
+        C.value.push_back (v[o]);
+        C.start[c[o]+1]++;
+    }
+    for (int i = 0; i < columns; i++) C.start[i+1] += C.start[i];
+}
+
+template<class T>
+void
+MatrixSparse<T>::decompress ()
+{
+    if (! compressed ()) return;
+    Compressed & C = *csc;
+    int columns = data->size ();
+    for (int c = 0; c < columns; c++)
+    {
+        std::map<int,T> & m = (*data)[c];
+        int end = C.start[c+1];
+        for (int i = C.start[c]; i < end; i++) m.emplace_hint (m.end (), C.row[i], C.value[i]);
+    }
+    std::vector<int> ().swap (C.start);
+    std::vector<int> ().swap (C.row);
+    std::vector<T>   ().swap (C.value);
+}
+
+/// Accumulator type for multiply kernels. Fixed-point products need the extra width.
+template<class T>
+class SparseAccumulator
+{
+public:
+    typedef T type;
+    static T finish (T a, int shift) {return a;}
+};
+
+#ifdef n2a_FP
+template<>
+class SparseAccumulator<int>
+{
+public:
+    typedef int64_t type;
+    static int finish (int64_t a, int shift) {return a >> shift;}
+};
+#endif
+
+/// Splits [0,count) into contiguous ranges and calls f(begin,end,t) for each, with range t on thread t of matrixThreads. If threads is 1, makes one call on the current thread.
+template<class F>
+void
+sparseParallel (int count, int threads, const F & f)
+{
+    threads = std::min (threads, count);
+    if (threads > 1)
+    {
+        matrixThreads->run ([&] (int t)
+        {
+            if (t < threads) f ((int) ((int64_t) count * t / threads), (int) ((int64_t) count * (t + 1) / threads), t);
+        });
+        return;
+    }
+    f (0, count, 0);
+}
+
+/**
+    Kernel shared by operator* and fixed-point multiply().
+    A vector operand is split across columns of A, with a private accumulator for each thread.
+    A dense matrix operand is split across its own columns, so each thread writes a disjoint part of the result.
+**/
+template<class T>
+Matrix<T>
+multiplySparse (const MatrixSparse<T> & A, const MatrixAbstract<T> & B, int shift)
+{
+    typedef typename SparseAccumulator<T>::type Acc;
+
+    int h  = A.rows ();
+    int w  = std::min (A.columns (), B.rows ());
+    int bw = B.columns ();
+    Matrix<T> result (h, bw);
+
+    // Adds column c of A, scaled by b, into acc.
+    bool compressed = A.compressed ();
+    const typename MatrixSparse<T>::Compressed & C = *A.csc;
+    auto column = [&] (int c, T b, Acc * acc)
+    {
+        if (b == (T) 0) return;
+        if (compressed)
+        {
+            const int * r   = C.row.data ();
+            const T *   v   = C.value.data ();
+            int         end = C.start[c+1];
+            for (int i = C.start[c]; i < end; i++) acc[r[i]] += (Acc) v[i] * b;
+        }
+        else
+        {
+            for (auto & e : (*A.data)[c]) acc[e.first] += (Acc) e.second * b;
+        }
+    };
+    int threads = compressed  &&  matrixThreads ? std::max (1, matrixThreads->available ()) : 1;  // The map form is not worth splitting.
+
+    if (bw == 1)
+    {
+        std::vector<std::vector<Acc>> partial (threads);
+        sparseParallel (w, threads, [&] (int begin, int end, int t)
+        {
+            std::vector<Acc> & acc = partial[t];
+            acc.assign (h, (Acc) 0);
+            for (int c = begin; c < end; c++) column (c, B(c,0), acc.data ());
+        });
+        T * y = result.base ();
+        for (int r = 0; r < h; r++)
+        {
+            Acc total = 0;
+            for (auto & p : partial) if (p.size ()) total += p[r];
+            y[r] = SparseAccumulator<T>::finish (total, shift);
+        }
+        return result;
+    }
+
+    sparseParallel (bw, threads, [&] (int begin, int end, int t)
+    {
+        std::vector<Acc> acc (h);
+        for (int j = begin; j < end; j++)
+        {
+            std::fill (acc.begin (), acc.end (), (Acc) 0);
+            for (int c = 0; c < w; c++) column (c, B(c,j), acc.data ());
+            for (int r = 0; r < h; r++) result(r,j) = SparseAccumulator<T>::finish (acc[r], shift);
+        }
+    });
+    return result;
+}
+
+template<class T>
+Matrix<T>
+operator * (const MatrixSparse<T> & A, const MatrixAbstract<T> & B)
+{
+    return multiplySparse (A, B, 0);
+}
+
 #endif
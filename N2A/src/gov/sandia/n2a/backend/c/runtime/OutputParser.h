@@ -16,6 +16,12 @@ the U.S. Government retains certain rights in this software.
 #include <limits>
 #include <fstream>
 #include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+
+#include "mappedfile.h"
 
 #include <iostream>  // for testing
 
@@ -33,6 +39,7 @@ namespace n2a
         std::vector<float> values;
         float              value;  // For most recent row
         int                startRow;
+        int                firstRow;  // In streaming mode, the first row that holds data, or -1 if none. startRow then refers to the block of rows currently loaded.
         int                textWidth;
         double             minimum;
         double             maximum;
@@ -45,6 +52,7 @@ namespace n2a
         {
             index     = 0;
             startRow  = 0;
+            firstRow  = -1;
             textWidth = 0;
             minimum   =  std::numeric_limits<double>::infinity ();
             maximum   = -std::numeric_limits<double>::infinity ();
@@ -53,12 +61,23 @@ namespace n2a
 
         void computeStats ()
         {
-            for (auto f : values)
-            {
-                if (std::isinf (f)  ||  std::isnan (f)) continue;
-                minimum = std::min (minimum, (double) f);
-                maximum = std::max (maximum, (double) f);
-            }
+            for (auto f : values) accumulateStats (f);
+            finishStats ();
+        }
+
+        /**
+            Incremental form of computeStats(), for values that are not held in memory.
+            Call finishStats() after the last value.
+        **/
+        void accumulateStats (float f)
+        {
+            if (std::isinf (f)  ||  std::isnan (f)) return;
+            minimum = std::min (minimum, (double) f);
+            maximum = std::max (maximum, (double) f);
+        }
+
+        void finishStats ()
+        {
             if (std::isinf (maximum))  // There was no good data. If max is infinite, then so is min.
             {
                 // Set defensive values.
@@ -126,6 +145,12 @@ namespace n2a
         The row-by-row interface uses the open(), nextRow() functions.
         It's a good idea not to mix these usages. Note that the parse() function is
         actually built on top of the row-by-row functions.
+
+        A third interface, for very large files, combines features of both.
+        index() maps the file into memory and makes a single pass over it.
+        This gathers headers, column stats and a sparse table of row positions,
+        but keeps no values. load() then decodes selected columns over a range
+        of rows, on demand. findRow() locates a time window via the row table.
     **/
     class OutputParser
     {
@@ -140,10 +165,25 @@ namespace n2a
         bool                  timeFound;  // Indicates that time is a properly-labeled column, rather than a fallback.
         int                   rows;       // Total number of rows successfully read by nextRow()
         float                 defaultValue;
+        bool                  binary;     // File is in the column-packed binary format. See OutputHolder::writeBlock() in the C runtime.
+        std::vector<std::vector<float>> block;  // Decoded values of current binary block, one vector per column.
+        int                   blockRow;   // Next row to return from current binary block.
+        int                   blockRows;  // Number of rows in current binary block.
+
+        /// Entry in row table built by index(). For binary, one per block. For text, one per "stride" rows.
+        struct Segment
+        {
+            uint64_t offset;  // Position in file of first row.
+            int      row;     // Index of first row.
+            float    t;       // Value in time column at first row. Only valid if time is the first column (after Index for Xyce).
+        };
+        MappedFile *          map;
+        std::vector<Segment>  segments;
 
         OutputParser ()
         {
             in           = 0;
+            map          = 0;
             defaultValue = 0;
         }
 
@@ -159,7 +199,7 @@ namespace n2a
         void open (const std::string & fileName)
         {
             close ();
-            in           = new std::ifstream (fileName.c_str ());
+            in           = new std::ifstream (fileName.c_str (), std::ios::binary);  // Harmless for text, since nextRow() strips CR.
             raw          = true;  // Will be negated if any non-empty column name is found.
             isXycePRN    = false;
             time         = 0;
@@ -167,12 +207,78 @@ namespace n2a
             rows         = 0;
             delimiter    = ' ';
             delimiterSet = false;
+            binary       = false;
+            blockRow     = 0;
+            blockRows    = 0;
+
+            char header[12];
+            in->read (header, 12);
+            if (in->gcount () == 12  &&  memcmp (header, "N2Ab", 4) == 0)
+            {
+                binary = true;
+                raw    = getInt (header + 8) & 1;
+            }
+            else
+            {
+                in->clear ();
+                in->seekg (0);
+            }
+        }
+
+        static uint32_t getInt (const char * p)
+        {
+            const unsigned char * u = (const unsigned char *) p;
+            return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t) u[3] << 24;
+        }
+
+        /**
+            Reads and unpacks the next block of a binary file.
+            @return false if there are no more complete blocks.
+        **/
+        bool nextBlock ()
+        {
+            char header[12];
+            in->read (header, 12);
+            if (in->gcount () < 12) return false;
+            blockRows      = getInt (header);
+            int count      = getInt (header + 4);
+            uint32_t bytes = getInt (header + 8);
+            std::vector<unsigned char> payload (bytes);
+            in->read ((char *) payload.data (), bytes);
+            if (in->gcount () < bytes) return false;
+
+            block.resize (count);
+            const unsigned char * p   = payload.data ();
+            const unsigned char * end = p + bytes;
+            for (auto & b : block)
+            {
+                b.resize (blockRows);
+                uint32_t previous = 0;
+                for (int i = 0; i < blockRows; i += 2)
+                {
+                    if (p >= end) return false;  // corrupt block
+                    int control = *p++;
+                    for (int j = 0; j < 2  &&  i + j < blockRows; j++)
+                    {
+                        int n = j ? control >> 4 : control & 0xF;
+                        uint32_t x = 0;
+                        for (int k = 0; k < n; k++) x |= (uint32_t) *p++ << 8 * k;
+                        previous ^= x;
+                        memcpy (&b[i+j], &previous, 4);
+                    }
+                }
+            }
+            blockRow = 0;
+            return true;
         }
 
         void close ()
         {
             if (in) delete in;
             in = 0;
+            if (map) delete map;
+            map = 0;
+            segments.clear ();
             for (Column * c : columns) delete c;
             columns.clear ();
         }
@@ -186,6 +292,20 @@ namespace n2a
         int nextRow ()
         {
             if (! in) return 0;
+            if (binary)
+            {
+                while (blockRow >= blockRows) if (! nextBlock ()) return 0;
+                int count = block.size ();
+                while (columns.size () < count) columns.push_back (new Column (""));
+                for (int c = 0; c < count; c++)
+                {
+                    float v = block[c][blockRow];
+                    columns[c]->value = std::isnan (v) ? defaultValue : v;  // NaN marks a value that was not set, like an empty field in text.
+                }
+                blockRow++;
+                rows++;
+                return count;
+            }
             std::string line;
             while (true)
             {
@@ -289,6 +409,15 @@ namespace n2a
                     column->values.push_back (defaultValue);  // Because the structure is not sparse, we must fill out every row.
                 }
             }
+            finish (fileName);
+        }
+
+        /**
+            Subroutine of parse() and index(). Applies the separate columns file, if any,
+            and identifies the time column.
+        **/
+        void finish (const std::string & fileName)
+        {
             if (columns.empty ()) return;
 
             // If there is a separate columns file, open and parse it.
@@ -347,6 +476,398 @@ namespace n2a
             if (isXycePRN) columns.erase (columns.begin ());
         }
 
+        /**
+            Builds the row table and column stats for a file without retaining any values.
+            Use load() afterward to retrieve the values of selected columns.
+            @param stride For text files, number of rows between entries in the row table.
+            Reading a given row requires scanning up to this many lines.
+            @return false if the file could not be mapped.
+        **/
+        bool index (const std::string & fileName, float defaultValue = 0, int stride = 256)
+        {
+            close ();
+            this->defaultValue = defaultValue;
+            stride       = std::max (1, stride);
+            raw          = true;
+            isXycePRN    = false;
+            time         = 0;
+            timeFound    = false;
+            rows         = 0;
+            delimiter    = ' ';
+            delimiterSet = false;
+            binary       = false;
+
+            map = new MappedFile;
+            if (! map->open (fileName.c_str (), true)) return false;
+            const char * begin = map->data;
+            const char * end   = begin + map->size;
+
+            if (map->size >= 12  &&  memcmp (begin, "N2Ab", 4) == 0)
+            {
+                binary = true;
+                raw    = getInt (begin + 8) & 1;
+                const char * p = begin + 12;
+                while (end - p >= 12)
+                {
+                    int      blockRows = getInt (p);
+                    int      count     = getInt (p + 4);
+                    uint64_t bytes     = getInt (p + 8);
+                    if ((uint64_t) (end - p - 12) < bytes) break;  // Incomplete block, probably still being written.
+
+                    Segment g;
+                    g.offset = p - begin;
+                    g.row    = rows;
+                    g.t      = 0;
+
+                    while (columns.size () < count) columns.push_back (new Column (""));
+                    const unsigned char * q = (const unsigned char *) p + 12;
+                    std::vector<float> values (blockRows);
+                    for (int c = 0; c < count; c++)
+                    {
+                        q = unpack (q, values);
+                        Column * column = columns[c];
+                        if (column->firstRow < 0) column->firstRow = rows;
+                        for (float v : values) column->accumulateStats (std::isnan (v) ? defaultValue : v);
+                        if (c == 0  &&  blockRows) g.t = values[0];
+                    }
+                    segments.push_back (g);
+                    rows += blockRows;
+                    p += 12 + bytes;
+                }
+            }
+            else
+            {
+                std::vector<float> values;
+                const char * p = begin;
+                while (p < end)
+                {
+                    const char * eol = (const char *) memchr (p, '\n', end - p);
+                    if (! eol) eol = end;
+                    const char * line = p;
+                    p = eol + 1;
+                    if (eol > line  &&  eol[-1] == '\r') eol--;
+                    if (eol == line) continue;
+                    if (eol - line >= 6  &&  memcmp (line, "End of", 6) == 0) break;
+
+                    if (! delimiterSet)
+                    {
+                        if      (memchr (line, '\t', eol - line)) delimiter = '\t';
+                        else if (memchr (line, ',',  eol - line)) delimiter = ',';
+                        for (const char * c = line; c < eol  &&  ! delimiterSet; c++) delimiterSet =  delimiter != ' '  ||  *c != ' ';
+                    }
+
+                    if (isHeader (line))
+                    {
+                        raw = false;
+                        int c = 0;
+                        for (const char * start = line; start <= eol; c++)
+                        {
+                            const char * next = (const char *) memchr (start, delimiter, eol - start);
+                            if (! next) next = eol;
+                            if (c == columns.size ()) columns.push_back (new Column (std::string (start, next)));
+                            start = next + 1;
+                        }
+                        isXycePRN =  columns[0]->header == "Index";
+                        continue;
+                    }
+
+                    if (rows % stride == 0)
+                    {
+                        Segment g;
+                        g.offset = line - begin;
+                        g.row    = rows;
+                        g.t      = 0;
+                        segments.push_back (g);
+                    }
+                    int count = split (line, eol, values);
+                    while (columns.size () < count) columns.push_back (new Column (""));
+                    int c = 0;
+                    for (; c < count; c++)
+                    {
+                        Column * column = columns[c];
+                        if (column->firstRow < 0) column->firstRow = rows;
+                        column->accumulateStats (values[c]);
+                    }
+                    for (; c < columns.size (); c++)
+                    {
+                        Column * column = columns[c];
+                        if (column->firstRow >= 0) column->accumulateStats (defaultValue);  // same as padding done by parse()
+                    }
+                    if (rows % stride == 0)
+                    {
+                        int t = isXycePRN ? 1 : 0;
+                        if (t < count) segments.back ().t = values[t];
+                    }
+                    rows++;
+                }
+                // Text width is only collected during load(), since it would require keeping the text of every field.
+            }
+
+            for (Column * c : columns) c->finishStats ();
+            finish (fileName);
+            return true;
+        }
+
+        static bool isHeader (const char * line)
+        {
+            char l = line[0];
+            return (l < '0'  ||  l > '9')  &&  l != '+'  &&  l != '-';
+        }
+
+        /**
+            Subroutine of index() and load(). Converts one line of text into values.
+            Unlike nextRow(), this works directly from mapped memory.
+            @param limit Only convert this many fields.
+            @return Number of fields in the line.
+        **/
+        int split (const char * line, const char * eol, std::vector<float> & values, int limit = -1, int * widths = 0)
+        {
+            int c = 0;
+            for (const char * start = line; start <= eol; c++)
+            {
+                const char * next = (const char *) memchr (start, delimiter, eol - start);
+                if (! next) next = eol;
+                if (limit < 0  ||  c < limit)
+                {
+                    if (c >= values.size ()) values.resize (c + 1);
+                    int length = next - start;
+                    if (length == 0)
+                    {
+                        values[c] = defaultValue;
+                    }
+                    else
+                    {
+                        char buffer[64];  // Copy out field so number parser does not run past end of mapped memory.
+                        length = std::min (length, 63);
+                        memcpy (buffer, start, length);
+                        buffer[length] = 0;
+                        values[c] = atof (buffer);
+                        if (widths) widths[c] = std::max (widths[c], length);
+                    }
+                }
+                start = next + 1;
+            }
+            return c;
+        }
+
+        /**
+            Decodes one column of a binary block.
+            @param values Must already be sized to the number of rows in the block.
+            @return Position just past the column.
+        **/
+        static const unsigned char * unpack (const unsigned char * p, std::vector<float> & values)
+        {
+            int count = values.size ();
+            uint32_t previous = 0;
+            for (int i = 0; i < count; i += 2)
+            {
+                int control = *p++;
+                for (int j = 0; j < 2  &&  i + j < count; j++)
+                {
+                    int n = j ? control >> 4 : control & 0xF;
+                    uint32_t x = 0;
+                    for (int k = 0; k < n; k++) x |= (uint32_t) *p++ << 8 * k;
+                    previous ^= x;
+                    memcpy (&values[i+j], &previous, 4);
+                }
+            }
+            return p;
+        }
+
+        /// Like unpack(), but only finds the end of the column.
+        static const unsigned char * skip (const unsigned char * p, int count)
+        {
+            for (int i = 0; i < count; i += 2)
+            {
+                int control = *p++;
+                p += control & 0xF;
+                if (i + 1 < count) p += control >> 4;
+            }
+            return p;
+        }
+
+        /// @return Index of the segment that contains the given row.
+        int findSegment (int row)
+        {
+            int lo = 0;
+            int hi = segments.size () - 1;
+            while (lo < hi)
+            {
+                int mid = (lo + hi + 1) / 2;
+                if (segments[mid].row <= row) lo = mid;
+                else                          hi = mid - 1;
+            }
+            return lo;
+        }
+
+        /**
+            Decodes the given columns over a range of rows, replacing whatever they held
+            before. Rows outside the range are not kept, so get() returns the default for them.
+            Requires an earlier call to index().
+            @param count Number of rows to load. -1 means through end of file.
+        **/
+        void load (const std::vector<Column *> & which, int start = 0, int count = -1)
+        {
+            std::vector<int> positions;
+            for (Column * c : which) positions.push_back (position (c));
+            start = std::max (0, start);
+            int end = count < 0 ? rows : std::min (rows, start + count);
+            load (which, positions, start, end);
+        }
+
+        void load (Column * c, int start = 0, int count = -1)
+        {
+            std::vector<Column *> which (1, c);
+            load (which, start, count);
+        }
+
+        /// @return Index of field in file that holds the given column, or -1 if not found.
+        int position (Column * c)
+        {
+            int result = std::find (columns.begin (), columns.end (), c) - columns.begin ();
+            if (result == columns.size ()) return -1;
+            if (isXycePRN) result++;  // finish() drops the Index column, so positions are shifted.
+            return result;
+        }
+
+        /**
+            Subroutine of load() and findRow().
+            @param positions Field in file that supplies each of the target columns.
+            @param end One past the last row to load.
+        **/
+        void load (const std::vector<Column *> & which, const std::vector<int> & positions, int start, int end)
+        {
+            if (! map  ||  segments.empty ()) return;
+
+            std::vector<int> slot;  // from file position to index in "which"
+            for (int i = 0; i < which.size (); i++)
+            {
+                Column * c = which[i];
+                c->values.clear ();
+                int first = std::max (start, c->firstRow);
+                c->startRow = first;
+                if (c->firstRow < 0  ||  first >= end  ||  positions[i] < 0) continue;
+                c->values.resize (end - first, defaultValue);
+
+                int position = positions[i];
+                if (position >= slot.size ()) slot.resize (position + 1, -1);
+                slot[position] = i;
+            }
+            if (slot.empty ()) return;
+
+            const char * begin   = map->data;
+            const char * fileEnd = begin + map->size;
+            if (binary)
+            {
+                std::vector<float> values;
+                for (int s = findSegment (start); s < segments.size (); s++)
+                {
+                    Segment & g = segments[s];
+                    if (g.row >= end) break;
+                    const char * p = begin + g.offset;
+                    int blockRows = getInt (p);
+                    int count     = std::min ((int) getInt (p + 4), (int) slot.size ());
+                    const unsigned char * q = (const unsigned char *) p + 12;
+                    values.resize (blockRows);
+                    for (int position = 0; position < count; position++)
+                    {
+                        int i = slot[position];
+                        if (i < 0)
+                        {
+                            q = skip (q, blockRows);
+                            continue;
+                        }
+                        q = unpack (q, values);
+                        Column * c = which[i];
+                        int r0 = std::max (g.row, c->startRow);
+                        int r1 = std::min (g.row + blockRows, end);
+                        for (int r = r0; r < r1; r++)
+                        {
+                            float v = values[r - g.row];
+                            c->values[r - c->startRow] = std::isnan (v) ? defaultValue : v;
+                        }
+                    }
+                }
+                return;
+            }
+
+            std::vector<float> values;
+            std::vector<int>   widths (slot.size (), 0);
+            Segment & g = segments[findSegment (start)];
+            const char * p = begin + g.offset;
+            int row = g.row;
+            while (p < fileEnd  &&  row < end)
+            {
+                const char * eol = (const char *) memchr (p, '\n', fileEnd - p);
+                if (! eol) eol = fileEnd;
+                const char * line = p;
+                p = eol + 1;
+                if (eol > line  &&  eol[-1] == '\r') eol--;
+                if (eol == line) continue;
+                if (eol - line >= 6  &&  memcmp (line, "End of", 6) == 0) break;
+                if (isHeader (line)) continue;
+
+                if (row >= start)
+                {
+                    int count = std::min (split (line, eol, values, slot.size (), widths.data ()), (int) slot.size ());
+                    for (int position = 0; position < count; position++)
+                    {
+                        int i = slot[position];
+                        if (i < 0) continue;
+                        Column * c = which[i];
+                        if (row >= c->startRow) c->values[row - c->startRow] = values[position];
+                    }
+                }
+                row++;
+            }
+            for (int position = 0; position < slot.size (); position++)
+            {
+                int i = slot[position];
+                if (i >= 0) which[i]->textWidth = std::max (which[i]->textWidth, widths[position]);
+            }
+        }
+
+        /**
+            Locates the first row whose time is at or after the given value, assuming time
+            increases monotonically. Requires an earlier call to index().
+            @return Row index, or total row count if t is beyond the end of the file.
+        **/
+        int findRow (float t)
+        {
+            if (segments.empty ()  ||  ! time) return 0;
+            std::vector<int> positions (1, position (time));
+
+            int s = 0;
+            if (positions[0] == (isXycePRN ? 1 : 0))  // Segment table holds time values, so narrow the search.
+            {
+                int lo = 0;
+                int hi = segments.size () - 1;
+                while (lo < hi)
+                {
+                    int mid = (lo + hi + 1) / 2;
+                    if (segments[mid].t < t) lo = mid;
+                    else                     hi = mid - 1;
+                }
+                s = lo;
+            }
+
+            // Scan forward one segment at a time. Use a scratch column so as not to disturb whatever is loaded in time.
+            Column scratch ("");
+            scratch.firstRow = time->firstRow;
+            std::vector<Column *> which (1, &scratch);
+            for (; s < segments.size (); s++)
+            {
+                int start = segments[s].row;
+                int end   = s + 1 < segments.size () ? segments[s+1].row : rows;
+                load (which, positions, start, end);
+                for (int i = 0; i < scratch.values.size (); i++)
+                {
+                    if (scratch.values[i] >= t) return scratch.startRow + i;
+                }
+            }
+            return rows;
+        }
+
         /**
             Optional post-processing step to give columns their position in a spike raster.
         **/
@@ -18,8 +18,17 @@ the U.S. Government retains certain rights in this software.
 
 #include <algorithm>
 #include <set>
+#include <vector>
 #include <typeinfo>
 
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define n2a_AVX2
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define n2a_NEON
+#endif
+
 
 // Include for tracing
 //#include <iostream>
@@ -29,6 +38,169 @@ using namespace n2a;
 using namespace std;
 
 
+// Vector kernels ------------------------------------------------------------
+//
+// Row-at-a-time inner loops for the most common conversions, such as decoded video
+// frames going to float formats. Each SIMD version performs exactly the same integer
+// arithmetic (or table lookup) as the scalar tail, so results do not depend on which
+// instruction set the runtime was compiled for. SIMD paths are only active when the
+// compiler targets that ISA (for example, -mavx2 or -march=native).
+
+/**
+    Converts one row of YCbCr to sRGB bytes, using the same fixed-point matrix as
+    PixelFormatPlanarYCbCr::getRGBA(). Cb and Cr must already be upsampled to one
+    value per pixel.
+**/
+static inline void
+ycbcr2rgb (uint8_t * r, uint8_t * g, uint8_t * b, const uint8_t * Y, const uint8_t * Cb, const uint8_t * Cr, int n)
+{
+    int i = 0;
+#   if defined(n2a_AVX2)
+    const __m256i c16   = _mm256_set1_epi32 (16);
+    const __m256i c128  = _mm256_set1_epi32 (128);
+    const __m256i cY    = _mm256_set1_epi32 (0x12A15);
+    const __m256i cRV   = _mm256_set1_epi32 (0x19895);
+    const __m256i cGU   = _mm256_set1_epi32 (0x644A);
+    const __m256i cGV   = _mm256_set1_epi32 (0xD01F);
+    const __m256i cBU   = _mm256_set1_epi32 (0x20469);
+    const __m256i round = _mm256_set1_epi32 (0x8000);
+    const __m256i zero  = _mm256_setzero_si256 ();
+    const __m256i top   = _mm256_set1_epi32 (0xFFFFFF);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i y = _mm256_mullo_epi32 (_mm256_sub_epi32 (_mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *) (Y  + i))), c16), cY);
+        __m256i u =                     _mm256_sub_epi32 (_mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *) (Cb + i))), c128);
+        __m256i v =                     _mm256_sub_epi32 (_mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *) (Cr + i))), c128);
+        y = _mm256_add_epi32 (y, round);
+        __m256i R = _mm256_add_epi32 (y, _mm256_mullo_epi32 (cRV, v));
+        __m256i G = _mm256_sub_epi32 (y, _mm256_add_epi32 (_mm256_mullo_epi32 (cGU, u), _mm256_mullo_epi32 (cGV, v)));
+        __m256i B = _mm256_add_epi32 (y, _mm256_mullo_epi32 (cBU, u));
+        R = _mm256_srli_epi32 (_mm256_min_epi32 (_mm256_max_epi32 (R, zero), top), 16);
+        G = _mm256_srli_epi32 (_mm256_min_epi32 (_mm256_max_epi32 (G, zero), top), 16);
+        B = _mm256_srli_epi32 (_mm256_min_epi32 (_mm256_max_epi32 (B, zero), top), 16);
+        // Narrow 32-bit lanes to bytes. Packing works within each 128-bit half, so the
+        // first four results land in the low dword of the low half and the rest in the
+        // low dword of the high half.
+        __m256i p;
+        int32_t lo, hi;
+#       define n2a_STORE8(to, x) \
+        p  = _mm256_packus_epi16 (_mm256_packus_epi32 (x, x), zero); \
+        lo = _mm_cvtsi128_si32 (_mm256_castsi256_si128 (p)); \
+        hi = _mm256_extract_epi32 (p, 4); \
+        memcpy (to + i,     &lo, 4); \
+        memcpy (to + i + 4, &hi, 4);
+        n2a_STORE8 (r, R)
+        n2a_STORE8 (g, G)
+        n2a_STORE8 (b, B)
+#       undef n2a_STORE8
+    }
+#   elif defined(n2a_NEON)
+    const int32x4_t round = vdupq_n_s32 (0x8000);
+    const int32x4_t top   = vdupq_n_s32 (0xFFFFFF);
+    const int32x4_t zero  = vdupq_n_s32 (0);
+    for (; i + 8 <= n; i += 8)
+    {
+        int16x8_t y8 = vsubq_s16 (vreinterpretq_s16_u16 (vmovl_u8 (vld1_u8 (Y  + i))), vdupq_n_s16 (16));
+        int16x8_t u8 = vsubq_s16 (vreinterpretq_s16_u16 (vmovl_u8 (vld1_u8 (Cb + i))), vdupq_n_s16 (128));
+        int16x8_t v8 = vsubq_s16 (vreinterpretq_s16_u16 (vmovl_u8 (vld1_u8 (Cr + i))), vdupq_n_s16 (128));
+        uint16x4_t out[3][2];
+        for (int h = 0; h < 2; h++)
+        {
+            int32x4_t y = h ? vmovl_s16 (vget_high_s16 (y8)) : vmovl_s16 (vget_low_s16 (y8));
+            int32x4_t u = h ? vmovl_s16 (vget_high_s16 (u8)) : vmovl_s16 (vget_low_s16 (u8));
+            int32x4_t v = h ? vmovl_s16 (vget_high_s16 (v8)) : vmovl_s16 (vget_low_s16 (v8));
+            y = vaddq_s32 (vmulq_n_s32 (y, 0x12A15), round);
+            int32x4_t R = vaddq_s32 (y, vmulq_n_s32 (v, 0x19895));
+            int32x4_t G = vsubq_s32 (y, vaddq_s32 (vmulq_n_s32 (u, 0x644A), vmulq_n_s32 (v, 0xD01F)));
+            int32x4_t B = vaddq_s32 (y, vmulq_n_s32 (u, 0x20469));
+            out[0][h] = vmovn_u32 (vreinterpretq_u32_s32 (vshrq_n_s32 (vminq_s32 (vmaxq_s32 (R, zero), top), 16)));
+            out[1][h] = vmovn_u32 (vreinterpretq_u32_s32 (vshrq_n_s32 (vminq_s32 (vmaxq_s32 (G, zero), top), 16)));
+            out[2][h] = vmovn_u32 (vreinterpretq_u32_s32 (vshrq_n_s32 (vminq_s32 (vmaxq_s32 (B, zero), top), 16)));
+        }
+        vst1_u8 (r + i, vmovn_u16 (vcombine_u16 (out[0][0], out[0][1])));
+        vst1_u8 (g + i, vmovn_u16 (vcombine_u16 (out[1][0], out[1][1])));
+        vst1_u8 (b + i, vmovn_u16 (vcombine_u16 (out[2][0], out[2][1])));
+    }
+#   endif
+    for (; i < n; i++)
+    {
+        int y = (Y[i] - 16) * 0x12A15;
+        int u = Cb[i] - 128;
+        int v = Cr[i] - 128;
+        r[i] = min (max (y               + 0x19895 * v + 0x8000, 0), 0xFFFFFF) >> 16;
+        g[i] = min (max (y -  0x644A * u -  0xD01F * v + 0x8000, 0), 0xFFFFFF) >> 16;
+        b[i] = min (max (y + 0x20469 * u               + 0x8000, 0), 0xFFFFFF) >> 16;
+    }
+}
+
+/// to[i] = lut[from[i]]
+static inline void
+lookup (float * to, const uint8_t * from, int n, const float * lut)
+{
+    int i = 0;
+#   if defined(n2a_AVX2)
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *) (from + i)));
+        _mm256_storeu_ps (to + i, _mm256_i32gather_ps (lut, index, 4));
+    }
+#   endif
+    for (; i < n; i++) to[i] = lut[from[i]];
+}
+
+/**
+    Scratch space for converting planar YCbCr one row at a time.
+    Chroma is upsampled to full width, then converted to sRGB bytes.
+**/
+struct YCbCrRows
+{
+    const PixelBufferPlanar * buffer;
+    int                       width;
+    std::vector<uint8_t>      storage;
+    uint8_t *                 Cb;
+    uint8_t *                 Cr;
+    uint8_t *                 r;
+    uint8_t *                 g;
+    uint8_t *                 b;
+
+    YCbCrRows (const Image & image)
+    {
+        buffer = (const PixelBufferPlanar *) image.buffer;
+        assert (buffer);
+        width  = image.width;
+        storage.resize (5 * width);
+        Cb = &storage[0];
+        Cr = Cb + width;
+        r  = Cr + width;
+        g  = r  + width;
+        b  = g  + width;
+    }
+
+    const uint8_t * convert (int y)  ///< Fills r, g and b for the given row. @return Pointer to the row of Y values.
+    {
+        const uint8_t * Y  = (const uint8_t *) buffer->plane0 + y * buffer->stride0;
+        const uint8_t * cb = (const uint8_t *) buffer->plane1 + y / buffer->ratioV * buffer->stride12;
+        const uint8_t * cr = (const uint8_t *) buffer->plane2 + y / buffer->ratioV * buffer->stride12;
+        const int ratioH = buffer->ratioH;
+        if (ratioH == 1)
+        {
+            memcpy (Cb, cb, width);
+            memcpy (Cr, cr, width);
+        }
+        else
+        {
+            for (int x = 0; x < width; x++)
+            {
+                Cb[x] = cb[x / ratioH];
+                Cr[x] = cr[x / ratioH];
+            }
+        }
+        ycbcr2rgb (r, g, b, Y, Cb, Cr, width);
+        return Y;
+    }
+};
+
+
 // Tables for packed YUV formats
 
 PixelFormatPackedYUV::YUVindex tableUYVY[] =
@@ -1772,16 +1944,11 @@ PixelFormatGrayFloat::fromGrayChar (const Image & image, Image & result) const
 
   uint8_t * fromPixel = (uint8_t *) i->base ();
   float *   toPixel   = (float *)   o->base ();
-  float *   end       = toPixel + result.width * result.height;
-  const int step = i->stride - image.width;
-  while (toPixel < end)
+  for (int y = 0; y < result.height; y++)
   {
-	float * rowEnd = toPixel + result.width;
-	while (toPixel < rowEnd)
-	{
-	  *toPixel++ = lutChar2Float[*fromPixel++];
-	}
-	fromPixel += step;
+	lookup (toPixel, fromPixel, result.width, lutChar2Float);
+	toPixel   += result.width;
+	fromPixel += i->stride;
   }
 }
 
@@ -2026,16 +2193,11 @@ PixelFormatGrayFloat::fromYCbCr (const Image & image, Image & result) const
 
   uint8_t * fromPixel = (uint8_t *) i->plane0;
   float *   toPixel   = (float *)   o->base ();
-  float *   end       = toPixel + result.width * result.height;
-  const int step = i->stride0 - image.width;
-  while (toPixel < end)
+  for (int y = 0; y < result.height; y++)
   {
-	float * rowEnd = toPixel + result.width;
-	while (toPixel < rowEnd)
-	{
-	  *toPixel++ = PixelFormatPlanarYCbCr::lutGrayOut[*fromPixel++];
-	}
-	fromPixel += step;
+	lookup (toPixel, fromPixel, result.width, PixelFormatPlanarYCbCr::lutGrayOut);
+	toPixel   += result.width;
+	fromPixel += i->stride0;
   }
 }
 
@@ -3797,7 +3959,11 @@ PixelFormatRGBAChar::filter (const Image & image)
   {
 	fromRGBChar (image, result);
   }
-  else if ((const PixelFormatRGBABits *) image.format)
+  else if (typeid (* image.format) == typeid (PixelFormatRGBAFloat))
+  {
+	fromRGBAFloat (image, result);
+  }
+  else if (dynamic_cast<const PixelFormatRGBABits *> (&* image.format))
   {
 	fromRGBABits (image, result);
   }
@@ -3817,6 +3983,59 @@ PixelFormatRGBAChar::filter (const Image & image)
   return result;
 }
 
+void
+PixelFormatRGBAChar::fromRGBAFloat (const Image & image, Image & result) const
+{
+    PixelBufferPacked * i = (PixelBufferPacked *) image.buffer;
+    PixelBufferPacked * o = (PixelBufferPacked *) result.buffer;
+    assert (i  &&  o);
+
+    // Same arithmetic as PixelFormatRGBAFloat::getRGBA(), but without a virtual call and byte swap per pixel.
+    uint8_t * toRow   = (uint8_t *) o->base ();
+    uint8_t * fromRow = (uint8_t *) i->base ();
+    for (int y = 0; y < result.height; y++)
+    {
+        const float * from = (const float *) fromRow;
+        uint8_t *     to   = toRow;
+        uint8_t *     end  = to + result.width * 4;
+        while (to < end)
+        {
+            to[0] = lutFloat2Char[(uint16_t) (65535 * min (max (from[0], 0.0f), 1.0f))];
+            to[1] = lutFloat2Char[(uint16_t) (65535 * min (max (from[1], 0.0f), 1.0f))];
+            to[2] = lutFloat2Char[(uint16_t) (65535 * min (max (from[2], 0.0f), 1.0f))];
+            to[3] = (uint8_t) (255 * min (max (from[3], 0.0f), 1.0f));
+            to   += 4;
+            from += 4;
+        }
+        toRow   += o->stride;
+        fromRow += i->stride;
+    }
+}
+
+void
+PixelFormatRGBAChar::fromYCbCr (const Image & image, Image & result) const
+{
+    PixelBufferPacked * o = (PixelBufferPacked *) result.buffer;
+    assert (o);
+
+    YCbCrRows rows (image);
+    uint8_t * toRow = (uint8_t *) o->base ();
+    for (int y = 0; y < result.height; y++)
+    {
+        rows.convert (y);
+        uint8_t * to = toRow;
+        for (int x = 0; x < result.width; x++)
+        {
+            to[0] = rows.r[x];
+            to[1] = rows.g[x];
+            to[2] = rows.b[x];
+            to[3] = 0xFF;
+            to += 4;
+        }
+        toRow += o->stride;
+    }
+}
+
 void
 PixelFormatRGBAChar::fromGrayChar (const Image & image, Image & result) const
 {
@@ -4374,6 +4593,71 @@ PixelFormatRGBAFloat::PixelFormatRGBAFloat ()
   hasAlpha   = true;
 }
 
+Image
+PixelFormatRGBAFloat::filter (const Image & image)
+{
+    Image result (*this);
+
+    if (*image.format == *this)
+    {
+        result = image;
+        return result;
+    }
+
+    result.resize (image.width, image.height);
+    result.timestamp = image.timestamp;
+    if (result.width <= 0  ||  result.height <= 0) return result;
+
+    if      (typeid (* image.format) == typeid (PixelFormatRGBAChar))    fromRGBAChar (image, result);
+    else if (typeid (* image.format) == typeid (PixelFormatPlanarYCbCr)) fromYCbCr    (image, result);
+    else                                                                 fromAny      (image, result);
+
+    return result;
+}
+
+void
+PixelFormatRGBAFloat::fromRGBAChar (const Image & image, Image & result) const
+{
+    PixelBufferPacked * i = (PixelBufferPacked *) image.buffer;
+    PixelBufferPacked * o = (PixelBufferPacked *) result.buffer;
+    assert (i  &&  o);
+
+    // Treat the row as a flat array of channels. Color goes through the linearizing table,
+    // then alpha is patched up, since it is already linear.
+    float *   to   = (float *)   o->base ();
+    uint8_t * from = (uint8_t *) i->base ();
+    const int n = result.width * 4;
+    for (int y = 0; y < result.height; y++)
+    {
+        lookup (to, from, n, lutChar2Float);
+        for (int c = 3; c < n; c += 4) to[c] = from[c] / 255.0f;
+        to   += n;
+        from += i->stride;
+    }
+}
+
+void
+PixelFormatRGBAFloat::fromYCbCr (const Image & image, Image & result) const
+{
+    PixelBufferPacked * o = (PixelBufferPacked *) result.buffer;
+    assert (o);
+
+    YCbCrRows rows (image);
+    float * to = (float *) o->base ();
+    for (int y = 0; y < result.height; y++)
+    {
+        rows.convert (y);
+        for (int x = 0; x < result.width; x++)
+        {
+            to[0] = lutChar2Float[rows.r[x]];
+            to[1] = lutChar2Float[rows.g[x]];
+            to[2] = lutChar2Float[rows.b[x]];
+            to[3] = 1;
+            to += 4;
+        }
+    }
+}
+
 void
 PixelFormatRGBAFloat::fromAny (const Image & image, Image & result) const
 {
@@ -4489,6 +4773,73 @@ PixelFormatRGBFloat::PixelFormatRGBFloat ()
     hasAlpha   = false;
 }
 
+Image
+PixelFormatRGBFloat::filter (const Image & image)
+{
+    Image result (*this);
+
+    if (*image.format == *this)
+    {
+        result = image;
+        return result;
+    }
+
+    result.resize (image.width, image.height);
+    result.timestamp = image.timestamp;
+    if (result.width <= 0  ||  result.height <= 0) return result;
+
+    if      (typeid (* image.format) == typeid (PixelFormatRGBAChar))    fromRGBAChar (image, result);
+    else if (typeid (* image.format) == typeid (PixelFormatPlanarYCbCr)) fromYCbCr    (image, result);
+    else                                                                 fromAny      (image, result);
+
+    return result;
+}
+
+void
+PixelFormatRGBFloat::fromRGBAChar (const Image & image, Image & result) const
+{
+    PixelBufferPacked * i = (PixelBufferPacked *) image.buffer;
+    PixelBufferPacked * o = (PixelBufferPacked *) result.buffer;
+    assert (i  &&  o);
+
+    float *   to      = (float *)   o->base ();
+    uint8_t * fromRow = (uint8_t *) i->base ();
+    for (int y = 0; y < result.height; y++)
+    {
+        uint8_t * from = fromRow;
+        for (int x = 0; x < result.width; x++)
+        {
+            to[0] = lutChar2Float[from[0]];
+            to[1] = lutChar2Float[from[1]];
+            to[2] = lutChar2Float[from[2]];
+            to   += 3;
+            from += 4;
+        }
+        fromRow += i->stride;
+    }
+}
+
+void
+PixelFormatRGBFloat::fromYCbCr (const Image & image, Image & result) const
+{
+    PixelBufferPacked * o = (PixelBufferPacked *) result.buffer;
+    assert (o);
+
+    YCbCrRows rows (image);
+    float * to = (float *) o->base ();
+    for (int y = 0; y < result.height; y++)
+    {
+        rows.convert (y);
+        for (int x = 0; x < result.width; x++)
+        {
+            to[0] = lutChar2Float[rows.r[x]];
+            to[1] = lutChar2Float[rows.g[x]];
+            to[2] = lutChar2Float[rows.b[x]];
+            to += 3;
+        }
+    }
+}
+
 void
 PixelFormatRGBFloat::fromAny (const Image & image, Image & result) const
 {
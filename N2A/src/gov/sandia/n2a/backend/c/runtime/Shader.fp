@@ -27,6 +27,7 @@ uniform Material material;
 
 varying vec3 vN; // normal direction
 varying vec3 vP; // position in eye space
+varying vec4 vD; // diffuse color, supplied per instance
 
 void main()
 {
@@ -65,17 +66,17 @@ void main()
         color += material.ambient * light[i].ambient;
         if (light[i].infinite)
         {
-            color += vec3(material.diffuse) * light[i].diffuse  * diffuseFactor;
+            color += vec3(vD) * light[i].diffuse  * diffuseFactor;
             color +=      material.specular * light[i].specular * specularFactor;
         }
         else if (theta >= light[i].spotCutoff)
         {
             float attenuation = pow (theta, light[i].spotExponent);
             attenuation /= light[i].attenuation0 + (light[i].attenuation1 + light[i].attenuation2 * distance) * distance;
-            color += vec3(material.diffuse) * light[i].diffuse  * diffuseFactor  * attenuation;
+            color += vec3(vD) * light[i].diffuse  * diffuseFactor  * attenuation;
             color +=      material.specular * light[i].specular * specularFactor * attenuation;
         }
     }
 
-    gl_FragColor = vec4(clamp (color, 0, 1), material.diffuse.a);
+    gl_FragColor = vec4(clamp (color, 0, 1), vD.a);
 }
@@ -30,6 +30,7 @@ extern "C"
 {
 # include <libavcodec/avcodec.h>
 # include <libavformat/avformat.h>
+# include <libavutil/hwcontext.h>
 }
 
 using namespace n2a;
@@ -65,6 +66,11 @@ protected:
     AVCodecContext *  cc;
     AVPacket *        packet;        ///< Ensure that if nextImage() attaches image to packet, the memory won't be freed before next read.
     AVFrame *         frame;
+    AVFrame *         swFrame;       ///< Destination for frames transferred back from a hardware decoder.
+    AVBufferRef *     hwDevice;      ///< Hardware decoding device, if one was requested and is available.
+    int               threads;       ///< Number of decoder threads. 0 means let FFmpeg choose based on core count. Takes effect at next open().
+    String            hwaccel;       ///< Name of hardware device type, such as "cuda", "vaapi", "videotoolbox" or "d3d11va". Empty means software decoding. Takes effect at next open().
+    Pointer           chroma;        ///< Holds deinterleaved chroma planes when converting NV12 to planar YCbCr.
     int               state;         ///< state == 0 means good; anything else means we can't read more frames
     bool              gotPicture;    ///< indicates that the image in "frame" should be return on next call to readNext().
     bool              timestampMode; ///< Indicates that image.timestamp should be frame number rather than presentation time.
@@ -86,10 +92,18 @@ VideoInFileFFMPEG::VideoInFileFFMPEG (const String & fileName)
     cc            = 0;
     packet        = av_packet_alloc ();
     frame         = av_frame_alloc ();
+    swFrame       = av_frame_alloc ();
+    hwDevice      = 0;
+    threads       = 0;
     timestampMode = false;
     interleaveRTP = true;
     paused        = true;
 
+    // Hardware decoding has to be chosen before the codec opens, and open() happens right here,
+    // so the default comes from the environment.
+    const char * env = getenv ("N2A_HWACCEL");
+    if (env) hwaccel = env;
+
     open (fileName);
 }
 
@@ -98,6 +112,7 @@ VideoInFileFFMPEG::~VideoInFileFFMPEG ()
     close ();
 
     av_frame_free (&frame);
+    av_frame_free (&swFrame);
     av_packet_free (&packet);
 }
 
@@ -152,6 +167,24 @@ VideoInFileFFMPEG::open (const String & fileName)
         cc->flags |= AV_CODEC_FLAG_TRUNCATED;
     }
 
+    // Decode on multiple threads. Frame threading adds a few frames of latency but scales best;
+    // FFmpeg falls back on whatever the codec supports.
+    cc->thread_count = threads;
+    cc->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    if (! hwaccel.empty ())
+    {
+        AVHWDeviceType type = av_hwdevice_find_type_by_name (hwaccel.c_str ());
+        if (type != AV_HWDEVICE_TYPE_NONE  &&  av_hwdevice_ctx_create (&hwDevice, type, 0, 0, 0) == 0)
+        {
+            cc->hw_device_ctx = av_buffer_ref (hwDevice);  // The default get_format() then picks the hardware surface format.
+        }
+        else
+        {
+            cerr << "WARNING: hardware decoder '" << hwaccel << "' is not available, so using software" << endl;
+        }
+    }
+
     state = avcodec_open2 (cc, codec, 0);
     if (state < 0) return;
 
@@ -181,8 +214,10 @@ void
 VideoInFileFFMPEG::close ()
 {
     av_frame_unref (frame);
+    av_frame_unref (swFrame);
     av_packet_unref (packet);
     avcodec_free_context (&cc);  // These functions guard against null.
+    av_buffer_unref (&hwDevice);
     codec = 0;
     stream = 0;
     avformat_close_input (&fc);
@@ -405,40 +440,74 @@ VideoInFileFFMPEG::readNext (Image * image)
     }
 
     if (! image) return;
-    switch (cc->pix_fmt)
+
+    AVFrame * f = frame;
+    if (frame->hw_frames_ctx)  // Frame lives on the GPU, so bring it back to main memory. Generally arrives as NV12.
+    {
+        av_frame_unref (swFrame);
+        if (av_hwframe_transfer_data (swFrame, frame, 0) < 0) throw "Failed to transfer frame from hardware decoder";
+        f = swFrame;
+    }
+
+    switch (f->format)
     {
         case AV_PIX_FMT_YUV420P:   // any AVColorRange
         case AV_PIX_FMT_YUVJ420P:  // specifically AVCOL_RANGE_JPEG
-            assert (frame->linesize[1] == frame->linesize[2]);
+            assert (f->linesize[1] == f->linesize[2]);
             image->format = &YUV420;
-            image->buffer = new PixelBufferPlanar (frame->data[0], frame->data[1], frame->data[2], frame->linesize[0], frame->linesize[1], cc->height, YUV420.ratioH, YUV420.ratioV);
+            image->buffer = new PixelBufferPlanar (f->data[0], f->data[1], f->data[2], f->linesize[0], f->linesize[1], cc->height, YUV420.ratioH, YUV420.ratioV);
             image->width = cc->width;
             image->height = cc->height;
             break;
+        case AV_PIX_FMT_NV12:
+        {
+            // Split interleaved chroma into the two planes that YUV420 expects. Luma stays in place.
+            int w2 = (cc->width  + 1) / 2;
+            int h2 = (cc->height + 1) / 2;
+            chroma.grow (2 * w2 * h2);
+            uint8_t * Cb = (uint8_t *) chroma.memory;
+            uint8_t * Cr = Cb + w2 * h2;
+            for (int y = 0; y < h2; y++)
+            {
+                const uint8_t * from = f->data[1] + y * f->linesize[1];
+                uint8_t * cb = Cb + y * w2;
+                uint8_t * cr = Cr + y * w2;
+                for (int x = 0; x < w2; x++)
+                {
+                    cb[x] = *from++;
+                    cr[x] = *from++;
+                }
+            }
+            image->format = &YUV420;
+            image->buffer = new PixelBufferPlanar (f->data[0], Cb, Cr, f->linesize[0], w2, cc->height, YUV420.ratioH, YUV420.ratioV);
+            image->width = cc->width;
+            image->height = cc->height;
+            break;
+        }
         case AV_PIX_FMT_YUV411P:
-            assert (frame->linesize[1] == frame->linesize[2]);
+            assert (f->linesize[1] == f->linesize[2]);
             image->format = &YUV411;
-            image->buffer = new PixelBufferPlanar (frame->data[0], frame->data[1], frame->data[2], frame->linesize[0], frame->linesize[1], cc->height, YUV411.ratioH, YUV411.ratioV);
+            image->buffer = new PixelBufferPlanar (f->data[0], f->data[1], f->data[2], f->linesize[0], f->linesize[1], cc->height, YUV411.ratioH, YUV411.ratioV);
             image->width = cc->width;
             image->height = cc->height;
             break;
         case AV_PIX_FMT_YUYV422:
-            image->attach (frame->data[0], cc->width, cc->height, YUYV);
+            image->attach (f->data[0], cc->width, cc->height, YUYV);
             break;
         case AV_PIX_FMT_UYVY422:
-            image->attach (frame->data[0], cc->width, cc->height, UYVY);
+            image->attach (f->data[0], cc->width, cc->height, UYVY);
             break;
         case AV_PIX_FMT_RGB24:
-            image->attach (frame->data[0], cc->width, cc->height, RGBChar);
+            image->attach (f->data[0], cc->width, cc->height, RGBChar);
             break;
         case AV_PIX_FMT_BGR24:
-            image->attach (frame->data[0], cc->width, cc->height, BGRChar);
+            image->attach (f->data[0], cc->width, cc->height, BGRChar);
             break;
         case AV_PIX_FMT_GRAY8:
-            image->attach (frame->data[0], cc->width, cc->height, GrayChar);
+            image->attach (f->data[0], cc->width, cc->height, GrayChar);
             break;
         default:
-            cerr << "Unsupported AV_PIX_FMT (see enumeration in libavutil/pixfmt.h): " << cc->pix_fmt << endl;
+            cerr << "Unsupported AV_PIX_FMT (see enumeration in libavutil/pixfmt.h): " << f->format << endl;
             throw "Unsupported AV_PIX_FMT";
     }
 
@@ -530,6 +599,15 @@ VideoInFileFFMPEG::get (const String & name) const
         if (timestampMode) return "1";
         else               return "0";
     }
+    if (name == "threads")
+    {
+        return threads;
+    }
+    if (name == "hwaccel")
+    {
+        if (hwDevice) return hwaccel;  // Only report the device if it is actually in use.
+        return "";
+    }
     return "";
 }
 
@@ -546,6 +624,16 @@ VideoInFileFFMPEG::set (const String & name, const String & value)
         timestampMode = atoi (value.c_str ());
         return;
     }
+    if (name == "threads")
+    {
+        threads = atoi (value.c_str ());
+        return;
+    }
+    if (name == "hwaccel")
+    {
+        hwaccel = value;
+        return;
+    }
 }
 
 #ifdef HAVE_JNI
@@ -0,0 +1,1065 @@
+/*
+Copyright 2023 National Technology & Engineering Solutions of Sandia, LLC (NTESS).
+Under the terms of Contract DE-NA0003525 with NTESS,
+the U.S. Government retains certain rights in this software.
+*/
+
+
+/**
+    Throughput benchmarks for the hot paths of the C runtime.
+    Not part of the runtime library. It stands in for generated code, so it links against the
+    same objects a model does. Build in the runtime directory, once for each numeric type:
+
+        g++ -O3 -std=c++11 -Dn2a_T=float -I. -o benchmark_float benchmark.cc runtime.cc holder.cc MNode.cc profiling.cc CanvasImage.cc Image.cc ImageFileFormat.cc ImageFileFormatBMP.cc PixelBuffer.cc PixelFormat.cc -lpthread -ldl
+        g++ -O3 -std=c++11 -Dn2a_T=int -Dn2a_FP -I. -o benchmark_int benchmark.cc fixedpoint.cc runtime.cc holder.cc ...
+
+    Usage: benchmark [-c] [-s scale] [-r repeats] [name ...]
+    Runs every benchmark whose name contains one of the given strings, or all of them if none are given.
+    scale multiplies the problem size (default 1). Each benchmark runs "repeats" times (default 3)
+    and reports its fastest run.
+    -c runs the kernel self-checks instead, selected by name in the same way. See "Checks" below.
+
+    Output is tab-separated with a header row, one row per benchmark:
+        name, type, items, seconds, rate (items per second)
+    Diagnostics go to stderr, so stdout can be collected directly into a table.
+**/
+
+
+#include "runtime.h"
+#include "MatrixFixed.tcc"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+
+
+using namespace std;
+
+
+// Fixed-point exponents used below. These follow what the code generator would pick for the same magnitudes.
+// Ignored by floating-point.
+static const int exponentV  = 0;  ///< Membrane-like state in [0,1]
+static const int exponentVp = 4;  ///< Its derivative, up to about 10/s
+static const int exponentT  = 0;  ///< Time. Matches the default period set up by Simulator::init().
+
+#ifdef n2a_FP
+static inline int fx (double value, int exponent) {return (int) round (value * pow (2.0, FP_MSB - exponent));}
+#else
+static inline n2a_T fx (double value, int exponent) {return (n2a_T) value;}
+#endif
+
+#define n2a_STR(x)  #x
+#define n2a_XSTR(x) n2a_STR(x)
+static const char * typeName = n2a_XSTR(n2a_T);
+
+static double scale   = 1;
+static int    repeats = 3;
+
+#ifdef n2a_TLS
+# define SIM Simulator<n2a_T>::instance
+#else
+# define SIM (&Simulator<n2a_T>::instance)
+#endif
+
+
+// Synthetic model -----------------------------------------------------------
+// Hand-written equivalents of what JobC emits for a few simple models.
+// Each class carries only the members those models would need.
+
+/**
+    One state variable relaxing toward 1: V' = (1 - V) * 10
+    Has the full set of functions needed by RungeKutta.
+**/
+template<class T>
+class Compartment : public PartTime<T>
+{
+public:
+    struct Derivative
+    {
+        T            Vp;
+        Derivative * next;
+    };
+    struct Preserve
+    {
+        T V;
+    };
+
+    T            V;
+    T            Vp;
+    Derivative * stackDerivative;
+    Preserve *   preserve;
+
+    Compartment ()
+    {
+        stackDerivative = 0;
+        preserve        = 0;
+        V               = 0;
+        Vp              = 0;
+    }
+
+    virtual ~Compartment ()
+    {
+        while (stackDerivative)
+        {
+            Derivative * temp = stackDerivative;
+            stackDerivative = stackDerivative->next;
+            delete temp;
+        }
+        if (preserve) delete preserve;
+    }
+
+    virtual void init ()
+    {
+        V = 0;
+        updateDerivative ();
+    }
+
+    virtual void integrate ()
+    {
+        T dt = this->getEvent ()->dt;
+#       ifdef n2a_FP
+        int shift = exponentVp + exponentT - FP_MSB - exponentV;  // negative, so right shift
+        if (preserve) V = preserve->V + (int) ((int64_t) Vp * dt >> -shift);
+        else          V +=              (int) ((int64_t) Vp * dt >> -shift);
+#       else
+        if (preserve) V = preserve->V + Vp * dt;
+        else          V +=              Vp * dt;
+#       endif
+    }
+
+    virtual void update ()
+    {
+        updateDerivative ();
+    }
+
+    virtual void updateDerivative ()
+    {
+        static const T one = fx (1,  exponentV);
+        static const T ten = fx (10, exponentVp);
+#       ifdef n2a_FP
+        Vp = (int64_t) (one - V) * ten >> FP_MSB;
+#       else
+        Vp = (one - V) * ten;
+#       endif
+    }
+
+    virtual void snapshot ()
+    {
+        preserve = new Preserve;
+        preserve->V = V;
+    }
+
+    virtual void restore ()
+    {
+        delete preserve;
+        preserve = 0;
+    }
+
+    virtual void pushDerivative ()
+    {
+        Derivative * temp = new Derivative;
+        temp->next = stackDerivative;
+        stackDerivative = temp;
+        temp->Vp = Vp;
+    }
+
+    virtual void multiplyAddToStack (T scalar)
+    {
+#       ifdef n2a_FP
+        stackDerivative->Vp += (int) ((int64_t) Vp * scalar >> (FP_MSB - 1));
+#       else
+        stackDerivative->Vp += Vp * scalar;
+#       endif
+    }
+
+    virtual void multiply (T scalar)
+    {
+#       ifdef n2a_FP
+        Vp = (int64_t) Vp * scalar >> (FP_MSB - 1);
+#       else
+        Vp *= scalar;
+#       endif
+    }
+
+    virtual void addToMembers ()
+    {
+        Vp += stackDerivative->Vp;
+        Derivative * temp = stackDerivative;
+        stackDerivative = stackDerivative->next;
+        delete temp;
+    }
+};
+
+static uint64_t delivered;  ///< Count of calls to Neuron::setLatch(), which is once per target of each spike.
+
+/**
+    Integrate-and-fire with constant drive. Each spike adds a small increment to
+    every target, so activity stays near the rate set by drive.
+    Since it receives events, integration is over the time since it last ran (lastT).
+**/
+template<class T>
+class Neuron : public PartTime<T>
+{
+public:
+    T             V;
+    T             drive;
+    T             lastT;
+    int           flags;     ///< Bit 0 is the latch for incoming spikes.
+    int           index;
+    SynapseRow<T> monitors;  ///< Parts that receive our spikes.
+
+    virtual void init ()
+    {
+        lastT = SIMULATOR currentEvent->t;
+    }
+
+    virtual void integrate ()
+    {
+        T dt = SIMULATOR currentEvent->t - lastT;
+        lastT = SIMULATOR currentEvent->t;
+#       ifdef n2a_FP
+        int shift = exponentVp + exponentT - FP_MSB - exponentV;
+        V += (int) ((int64_t) drive * dt >> -shift);
+#       else
+        V += drive * dt;
+#       endif
+    }
+
+    virtual void update ()
+    {
+        static const T weight = fx (0.001, exponentV);
+        if (flags & 0x1)
+        {
+            V += weight;
+            flags &= ~0x1;
+        }
+    }
+
+    virtual bool finalize ()
+    {
+        static const T threshold = fx (1, exponentV);
+        if (V > threshold)
+        {
+            V = 0;
+            if (! monitors.empty ())
+            {
+                EventSpikeMulti<T> * spike = SIMULATOR spikes.allocateMulti ();
+                spike->t = SIMULATOR currentEvent->t + 2 * this->getEvent ()->dt;
+                spike->latch = 0;
+                spike->targets = &monitors;
+                SIMULATOR queueSpike (spike);
+            }
+        }
+        return true;
+    }
+
+    virtual void setLatch (int i)
+    {
+        flags |= 0x1 << i;
+        delivered++;
+    }
+
+    virtual bool getNewborn ()
+    {
+        return true;  // connect() only runs right after the population is created, when every instance is new.
+    }
+
+    virtual void getXYZ (MatrixFixed<T,3,1> & xyz);
+};
+
+template<class T>
+class Cells;
+
+/**
+    Connection between two Neurons. Only exists to give Population::connect() realistic work.
+    The accept/reject decision is a hash of both indices, so the same pairs are chosen for every
+    numeric type without spending time in the random number generator.
+**/
+template<class T>
+class Synapse : public PartTime<T>
+{
+public:
+    Neuron<T> * A;
+    Neuron<T> * B;
+    int         divisor;  ///< Accept 1 in divisor candidates. 1 means accept all.
+    int *       made;     ///< Count of connections in our population.
+
+    virtual void init ()
+    {
+        (*made)++;
+    }
+
+    virtual void setPart (int i, Part<T> * part)
+    {
+        if (i == 0) A = (Neuron<T> *) part;
+        else        B = (Neuron<T> *) part;
+    }
+
+    virtual Part<T> * getPart (int i)
+    {
+        return i == 0 ? A : B;
+    }
+
+    virtual T getP ()
+    {
+        if (divisor <= 1) return fx (1, 0);
+        uint32_t h = A->index * 2654435761u ^ B->index * 2246822519u;
+        return h % divisor ? 0 : fx (1, 0);
+    }
+};
+
+/**
+    Population that keeps a list of its instances, as JobC does when $index is in use.
+**/
+template<class T>
+class Cells : public Population<T>
+{
+public:
+    std::function<Part<T> * ()> factory;
+    std::vector<Part<T> *>      instances;
+    int                         n;
+    int                         count;  ///< Number to create at init.
+
+    Cells ()
+    {
+        n     = 0;
+        count = 0;
+    }
+
+    virtual Part<T> * create ()
+    {
+        return factory ();
+    }
+
+    virtual void add (Part<T> * part)
+    {
+        instances.push_back (part);
+        n++;
+    }
+
+    virtual int getN ()
+    {
+        return n;
+    }
+
+    virtual void init ()
+    {
+        this->resize (count);
+    }
+};
+
+template<class T>
+void
+Neuron<T>::getXYZ (MatrixFixed<T,3,1> & xyz)
+{
+    // Deterministic scatter in the unit cube, so NN search has real structure to work with.
+    uint32_t h = index * 2654435761u;
+    xyz[0] = fx ((h         & 0x3FF) / 1024.0, 0);
+    xyz[1] = fx ((h >> 10   & 0x3FF) / 1024.0, 0);
+    xyz[2] = fx ((h >> 20   & 0x3FF) / 1024.0, 0);
+}
+
+template<class T>
+class Connections : public Population<T>
+{
+public:
+    Cells<T> * endpoints;
+    int        k;        ///< When positive, use nearest-neighbor filtering on endpoint 0.
+    int        divisor;
+    int        n;        ///< Number of connections made.
+
+    Connections ()
+    {
+        k       = 0;
+        divisor = 1;
+        n       = 0;
+    }
+
+    virtual Part<T> * create ()
+    {
+        Synapse<T> * result = new Synapse<T>;
+        result->A       = 0;
+        result->B       = 0;
+        result->divisor = divisor;
+        result->made    = &n;
+        return result;
+    }
+
+    virtual ConnectIterator<T> * getIterators (bool poll)
+    {
+        if (k > 0) return this->getIteratorsNN (poll);
+        return this->getIteratorsSimple (poll);
+    }
+
+    virtual ConnectPopulation<T> * getIterator (int i, bool poll)
+    {
+        ConnectPopulation<T> * result = 0;
+        switch (i)
+        {
+            case 0:
+            {
+                if (k > 0)
+                {
+                    result = new ConnectPopulationNN<T> (i, poll);
+                    result->k = k;
+                    result->rank -= 2;
+                }
+                else
+                {
+                    result = new ConnectPopulation<T> (i, poll);
+                }
+                break;
+            }
+            case 1:
+            {
+                result = new ConnectPopulation<T> (i, poll);
+                break;
+            }
+            default:
+                return 0;
+        }
+        result->firstborn = 0;
+        result->instances = &endpoints->instances;
+        result->size      = result->instances->size ();
+        return result;
+    }
+};
+
+template<class T>
+class Wrapper : public WrapperBase<T>
+{
+public:
+    Cells<T>       cells;
+    Connections<T> connections;
+
+    Wrapper ()
+    {
+        this->population  = &cells;
+        cells.container   = this;
+        connections.container = this;
+        connections.endpoints = &cells;
+    }
+};
+
+
+// Harness -------------------------------------------------------------------
+
+struct Result
+{
+    double items;
+    double seconds;
+};
+
+typedef std::function<Result ()> Benchmark;
+
+static std::vector<String> filters;
+
+static bool selected (const char * name)
+{
+    if (filters.empty ()) return true;
+    for (auto & f : filters) if (strstr (name, f.c_str ())) return true;
+    return false;
+}
+
+static void run (const char * name, const Benchmark & b)
+{
+    if (! selected (name)) return;
+    Result best = {0, INFINITY};
+    for (int i = 0; i < repeats; i++)
+    {
+        Result r;
+        try
+        {
+            r = b ();
+        }
+        catch (const char * error)
+        {
+            cerr << name << ": " << error << endl;
+            return;
+        }
+        if (r.seconds < best.seconds) best = r;
+    }
+    cout << name << "\t" << typeName << "\t" << best.items << "\t" << best.seconds << "\t" << best.items / best.seconds << endl;
+}
+
+class Timer
+{
+public:
+    std::chrono::steady_clock::time_point start;
+
+    Timer () {start = std::chrono::steady_clock::now ();}
+    double seconds () const
+    {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now () - start;
+        return elapsed.count ();
+    }
+};
+
+static int scaled (int n)
+{
+    return std::max (1, (int) (n * scale));
+}
+
+/// Prevents the optimizer from discarding a computed result.
+static volatile double sink;
+
+/**
+    Sets up a fresh simulator holding one Wrapper, the same way generated main() does.
+    The wrapper is owned by the simulator, which deletes it (along with all parts still queued) on clear().
+**/
+template<class T>
+static Wrapper<T> * startSimulator (Integrator<T> * integrator)
+{
+#   ifdef n2a_TLS
+    if (! Simulator<T>::instance) Simulator<T>::instance = new Simulator<T>;
+#   endif
+#   ifdef n2a_FP
+    Event<T>::exponent = exponentT;
+#   endif
+    SIM->integrator = integrator;
+    Wrapper<T> * wrapper = new Wrapper<T>;
+    return wrapper;
+}
+
+template<class T>
+static void stopSimulator ()
+{
+    SIM->clear ();
+}
+
+
+// Benchmarks ----------------------------------------------------------------
+
+/// Items are part-steps: instances times cycles.
+template<class T>
+static Result simulateCompartments (Integrator<T> * integrator, int count, double seconds)
+{
+    Wrapper<T> * wrapper = startSimulator<T> (integrator);
+    wrapper->cells.count   = count;
+    wrapper->cells.factory = [](){return new Compartment<T>;};
+    SIM->init (wrapper);
+
+    T until = fx (seconds, exponentT);
+    Timer timer;
+    SIM->run (until);
+    Result result;
+    result.seconds = timer.seconds ();
+    result.items   = (double) count * seconds / 1e-4;
+    stopSimulator<T> ();
+    return result;
+}
+
+/// Items are spike deliveries, counted as each target is visited.
+template<class T>
+static Result simulateSpikes (int count, int fanout, double seconds)
+{
+    Wrapper<T> * wrapper = startSimulator<T> (new Euler<T>);
+    int nextIndex = 0;
+    wrapper->cells.count   = count;
+    wrapper->cells.factory = [&nextIndex]()
+    {
+        Neuron<T> * n = new Neuron<T>;
+        n->V     = 0;
+        n->flags = 0;
+        n->index = nextIndex++;
+        n->drive = fx (5 + (n->index % 11), exponentVp);  // 5 to 15 Hz
+        return n;
+    };
+    SIM->init (wrapper);
+
+    // Random fan-out. Fixed seed keeps the network the same across runs and types.
+    std::mt19937 random (1);
+    std::vector<Part<T> *> & instances = wrapper->cells.instances;
+    for (auto p : instances)
+    {
+        Neuron<T> * n = (Neuron<T> *) p;
+        for (int i = 0; i < fanout; i++) n->monitors.push_back (instances[random () % count]);
+    }
+    SIM->updatePopulations ();  // Packs the synapse table.
+
+    // Initial phases spread over one period, so firing is asynchronous.
+    for (auto p : instances) ((Neuron<T> *) p)->V = fx ((random () % 1000) / 1000.0, exponentV);
+
+    delivered = 0;
+    T until = fx (seconds, exponentT);
+    Timer timer;
+    SIM->run (until);
+    Result result;
+    result.seconds = timer.seconds ();
+    result.items   = delivered;
+    stopSimulator<T> ();
+    return result;
+}
+
+/// Items are candidate pairs visited (simple) or connections made (NN).
+template<class T>
+static Result connect (int count, int k, int divisor)
+{
+    Wrapper<T> * wrapper = startSimulator<T> (new Euler<T>);
+    int nextIndex = 0;
+    wrapper->cells.count   = count;
+    wrapper->cells.factory = [&nextIndex]()
+    {
+        Neuron<T> * n = new Neuron<T>;
+        n->V     = 0;
+        n->flags = 0;
+        n->index = nextIndex++;
+        n->drive = 0;
+        return n;
+    };
+    SIM->init (wrapper);
+    wrapper->connections.k       = k;
+    wrapper->connections.divisor = divisor;
+
+    Timer timer;
+    wrapper->connections.connect ();
+    Result result;
+    result.seconds = timer.seconds ();
+    if (k > 0) result.items = wrapper->connections.n;
+    else       result.items = (double) count * count;
+    if (wrapper->connections.n == 0) cerr << "WARNING: connect made no connections" << endl;
+    stopSimulator<T> ();
+    return result;
+}
+
+template<class T>
+static MatrixSparse<T> sparseMatrix (int rows, int columns, double density)
+{
+    std::mt19937 random (2);
+    std::uniform_real_distribution<double> u (0, 1);
+    std::vector<int> r;
+    std::vector<int> c;
+    std::vector<T>   v;
+    int total = (int) (rows * (double) columns * density);
+    r.reserve (total);
+    c.reserve (total);
+    v.reserve (total);
+    for (int i = 0; i < total; i++)
+    {
+        r.push_back (random () % rows);
+        c.push_back (random () % columns);
+        v.push_back (fx (u (random) + 0.001, 0));
+    }
+    MatrixSparse<T> result;
+    result.compress (rows, columns, r, c, v);
+    return result;
+}
+
+/// Items are nonzero elements visited.
+template<class T>
+static Result sparseIterate (int size, double density)
+{
+    MatrixSparse<T> A = sparseMatrix<T> (size, size, density);
+    Timer timer;
+    IteratorSparse<T> it (&A);
+    double sum = 0;
+    int    count = 0;
+    while (it.next ())
+    {
+        sum += it.value;
+        count++;
+    }
+    Result result;
+    result.seconds = timer.seconds ();
+    result.items   = count;
+    sink = sum;
+    return result;
+}
+
+/// Items are multiply-adds, one per nonzero element per column of B.
+template<class T>
+static Result sparseMultiply (int size, double density, int columns)
+{
+    MatrixSparse<T> A = sparseMatrix<T> (size, size, density);
+    Matrix<T> B (size, columns);
+    for (int c = 0; c < columns; c++) for (int r = 0; r < size; r++) B(r,c) = fx ((r + c) % 7 / 8.0, 0);
+
+    Timer timer;
+#   ifdef n2a_FP
+    Matrix<T> C = multiply (A, B, FP_MSB);
+#   else
+    Matrix<T> C = A * B;
+#   endif
+    Result result;
+    result.seconds = timer.seconds ();
+    result.items   = (double) A.csc->value.size () * columns;
+    sink = C(0,0);
+    return result;
+}
+
+/// Items are calls to step().
+template<class T>
+static Result delayBuffer (int steps, bool ring)
+{
+    T dt    = fx (1e-4, 10);  // A run this long overflows exponentT, so fixed-point needs more integer bits for time.
+    T delay = 5 * dt;
+    DelayBuffer<T>     general;
+    DelayBufferRing<T> fixed;
+    Timer timer;
+    T now   = 0;
+    T value = 0;
+    T total = 0;
+    for (int i = 0; i < steps; i++)
+    {
+        value = (T) (i & 0xFF);
+        if (ring) total += fixed  .step (now, dt, 5, value, 0);
+        else      total += general.step (now, delay,  value, 0);
+        now += dt;
+    }
+    Result result;
+    result.seconds = timer.seconds ();
+    result.items   = steps;
+    sink = total;
+    return result;
+}
+
+/// Items are calls to trace().
+template<class T>
+static Result outputTrace (int rows, int columns)
+{
+    startSimulator<T> (0);
+    const char * fileName = "benchmark.out";
+    OutputHolder<T> * output = outputHelper<T> (fileName);
+    std::vector<int>    handles (columns, -1);
+    std::vector<String> names;
+    for (int c = 0; c < columns; c++) names.push_back (String ("c") + std::to_string (c).c_str ());
+
+    Timer timer;
+    T dt = fx (1e-4, 10);  // Same reasoning as delayBuffer(): keep t from overflowing in fixed-point.
+    T t  = 0;
+    for (int r = 0; r < rows; r++)
+    {
+        for (int c = 0; c < columns; c++)
+        {
+            T value = fx ((r + c) % 100 / 128.0, 0);
+#           ifdef n2a_FP
+            output->trace (t, handles[c], names[c].c_str (), value, 0);
+#           else
+            output->trace (t, handles[c], names[c].c_str (), value);
+#           endif
+        }
+        t += dt;
+    }
+    stopSimulator<T> ();  // Flushes and closes output.
+    Result result;
+    result.seconds = timer.seconds ();
+    result.items   = (double) rows * columns;
+    remove (fileName);
+    remove ((String (fileName) + ".columns").c_str ());
+    return result;
+}
+
+/// Items are values retrieved.
+template<class T>
+static Result inputRead (int rows, int columns, bool random)
+{
+    const char * fileName = "benchmark.in";
+    {
+        ofstream out (fileName);
+        for (int r = 0; r < rows; r++)
+        {
+            for (int c = 0; c < columns; c++)
+            {
+                if (c) out << "\t";
+                out << (r * columns + c) % 1000 / 100.0;
+            }
+            out << "\n";
+        }
+    }
+
+    startSimulator<T> (0);
+#   ifdef n2a_FP
+    InputHolder<T> * input = inputHelper<T> (fileName, 4);
+#   else
+    InputHolder<T> * input = inputHelper<T> (fileName);
+#   endif
+    input->indexed = random;
+
+    std::mt19937 generator (3);
+    Timer timer;
+    double sum = 0;
+    for (int i = 0; i < rows; i++)
+    {
+        int r = random ? generator () % rows : i;
+        for (int c = 0; c < columns; c++) sum += input->get ((T) r, (T) c);
+    }
+    Result result;
+    result.seconds = timer.seconds ();
+    result.items   = (double) rows * columns;
+    sink = sum;
+    stopSimulator<T> ();
+    remove (fileName);
+    return result;
+}
+
+/**
+    Scalar math kernels. For fixed-point, these are the implementations in fixedpoint.cc.
+    For floating-point, the same calls resolve to the standard library, as a baseline.
+    Items are function evaluations.
+**/
+template<class T>
+static Result mathKernel (const char * which, int count)
+{
+    std::vector<T> a (1024);
+    std::vector<T> b (1024);
+    for (int i = 0; i < 1024; i++)
+    {
+        a[i] = fx (0.01 + i / 1024.0, 0);  // (0,1], valid for every function below
+        b[i] = fx (0.5  + i / 2048.0, 0);
+    }
+
+    std::function<T (T, T)> f;
+#   ifdef n2a_FP
+    if      (! strcmp (which, "exp"  )) f = [](T x, T y) {return ::exp   (x, 4);};  // Input exponent is fixed at 7, so x is small.
+    else if (! strcmp (which, "log"  )) f = [](T x, T y) {return ::log   (x, 0, 5);};
+    else if (! strcmp (which, "sqrt" )) f = [](T x, T y) {return ::sqrt  (x, 0, 0);};
+    else if (! strcmp (which, "pow"  )) f = [](T x, T y) {return ::pow   (x, y, 0, 0);};
+    else if (! strcmp (which, "sin"  )) f = [](T x, T y) {return ::sin   (x, 0);};
+    else if (! strcmp (which, "cos"  )) f = [](T x, T y) {return ::cos   (x, 0);};
+    else if (! strcmp (which, "tanh" )) f = [](T x, T y) {return ::tanh  (x, 0);};
+    else if (! strcmp (which, "atan2")) f = [](T x, T y) {return ::atan2 (x, y);};
+#   else
+    if      (! strcmp (which, "exp"  )) f = [](T x, T y) {return std::exp   (x);};
+    else if (! strcmp (which, "log"  )) f = [](T x, T y) {return std::log   (x);};
+    else if (! strcmp (which, "sqrt" )) f = [](T x, T y) {return std::sqrt  (x);};
+    else if (! strcmp (which, "pow"  )) f = [](T x, T y) {return std::pow   (x, y);};
+    else if (! strcmp (which, "sin"  )) f = [](T x, T y) {return std::sin   (x);};
+    else if (! strcmp (which, "cos"  )) f = [](T x, T y) {return std::cos   (x);};
+    else if (! strcmp (which, "tanh" )) f = [](T x, T y) {return std::tanh  (x);};
+    else if (! strcmp (which, "atan2")) f = [](T x, T y) {return std::atan2 (x, y);};
+#   endif
+
+    Timer timer;
+    T total = 0;
+    for (int i = 0; i < count; i++) total += f (a[i & 0x3FF], b[i & 0x3FF]);
+    Result result;
+    result.seconds = timer.seconds ();
+    result.items   = count;
+    sink = total;
+    return result;
+}
+
+
+// Checks --------------------------------------------------------------------
+
+/**
+    Self-checks of the vectorized matrix kernels. Each one compares the fast path for contiguous
+    operands against a plain scalar loop over the same data, and the two must agree bit for bit.
+    For fixed-point, the fast paths are the SIMD kernels in fixedpoint.cc, so build once more
+    with the target ISA enabled (for example -mavx2 or -march=native) to cover them.
+    For floating-point, they are the strided and in-place operators in Matrix.tcc.
+    Each result goes to stderr. The exit status is the number of checks that failed.
+**/
+
+static int failures = 0;
+
+static void check (const char * name, const std::function<bool ()> & c)
+{
+    if (! selected (name)) return;
+    bool pass;
+    try
+    {
+        pass = c ();
+    }
+    catch (const char * error)
+    {
+        cerr << name << ": " << error << endl;
+        pass = false;
+    }
+    cerr << name << "\t" << typeName << "\t" << (pass ? "ok" : "FAILED") << endl;
+    if (! pass) failures++;
+}
+
+/// Rows in each case. Chosen to leave every possible tail after the 8-wide and 4-wide loops.
+static const int checkRows[] = {1, 3, 4, 7, 8, 13, 37};
+
+#ifdef n2a_FP
+/// Shifts on both sides of 32, which is the most that the AVX2 kernels do without falling back to scalar.
+static const int checkShifts[] = {0, 1, 15, 31, 32, 33, 47};
+#endif
+
+/// Fills a new matrix with values uniform in [-limit,limit]. Each call returns a matrix with its own buffer, so the in-place operators may take it over.
+template<class T>
+static Matrix<T> checkMatrix (int rows, int columns, double limit, std::mt19937 & g)
+{
+    Matrix<T> result (rows, columns);
+#   ifdef n2a_FP
+    std::uniform_int_distribution<int> d ((int) -limit, (int) limit);
+#   else
+    std::uniform_real_distribution<T> d ((T) -limit, (T) limit);
+#   endif
+    for (int c = 0; c < columns; c++) for (int r = 0; r < rows; r++) result(r,c) = d (g);
+    return result;
+}
+
+template<class T>
+static Matrix<T> copyOf (const Matrix<T> & A)
+{
+    Matrix<T> result (A.rows (), A.columns ());
+    for (int c = 0; c < A.columns (); c++) for (int r = 0; r < A.rows (); r++) result(r,c) = A(r,c);
+    return result;
+}
+
+/// Compares representations rather than values, so even a difference such as -0 versus 0 counts.
+template<class T>
+static bool same (const Matrix<T> & A, const Matrix<T> & B)
+{
+    if (A.rows () != B.rows ()  ||  A.columns () != B.columns ()) return false;
+    for (int c = 0; c < A.columns (); c++)
+    {
+        for (int r = 0; r < A.rows (); r++)
+        {
+            T a = A(r,c);
+            T b = B(r,c);
+            if (memcmp (&a, &b, sizeof (T))) return false;
+        }
+    }
+    return true;
+}
+
+template<class T>
+static bool checkElementwise ()
+{
+    std::mt19937 g (1);
+    bool pass = true;
+    for (int h : checkRows)
+    {
+#       ifdef n2a_FP
+        for (int s : checkShifts)
+        {
+            Matrix<int> A = checkMatrix<int> (h, 3, INT_MAX, g);
+            Matrix<int> B = checkMatrix<int> (h, 3, INT_MAX, g);
+            Matrix<int> expected (h, 3);
+            for (int c = 0; c < 3; c++) for (int r = 0; r < h; r++) expected(r,c) = (int64_t) A(r,c) * B(r,c) >> s;
+            pass &= same (multiplyElementwise (A,           B, s), expected);
+            pass &= same (multiplyElementwise (copyOf (A), B, s), expected);
+        }
+#       else
+        Matrix<T> A = checkMatrix<T> (h, 3, 10, g);
+        Matrix<T> B = checkMatrix<T> (h, 3, 10, g);
+        Matrix<T> expected (h, 3);
+        for (int c = 0; c < 3; c++) for (int r = 0; r < h; r++) expected(r,c) = A(r,c) * B(r,c);
+        pass &= same<T> (A          & B,          expected);
+        pass &= same<T> (copyOf (A) & B,          expected);
+        pass &= same<T> (A          & copyOf (B), expected);
+        pass &= same<T> (copyOf (A) & copyOf (B), expected);
+#       endif
+    }
+    return pass;
+}
+
+template<class T>
+static bool checkScalar ()
+{
+    std::mt19937 g (2);
+    bool pass = true;
+    for (int h : checkRows)
+    {
+#       ifdef n2a_FP
+        for (int s : checkShifts)
+        {
+            Matrix<int> A = checkMatrix<int> (h, 3, INT_MAX, g);
+            int         b = checkMatrix<int> (1, 1, INT_MAX, g)(0,0);
+            Matrix<int> expected (h, 3);
+            for (int c = 0; c < 3; c++) for (int r = 0; r < h; r++) expected(r,c) = (int64_t) b * A(r,c) >> s;
+            pass &= same (multiply (A,           b, s), expected);
+            pass &= same (multiply (copyOf (A), b, s), expected);
+        }
+#       else
+        Matrix<T> A = checkMatrix<T> (h, 3, 10, g);
+        T         b = (T) 0.3;
+        Matrix<T> expected (h, 3);
+        for (int c = 0; c < 3; c++) for (int r = 0; r < h; r++) expected(r,c) = A(r,c) * b;
+        pass &= same<T> (A          * b, expected);
+        pass &= same<T> (copyOf (A) * b, expected);
+#       endif
+    }
+    return pass;
+}
+
+#ifdef n2a_FP
+/// Only fixed-point has a vectorized product kernel. Integer sums are exact, so the reference may accumulate in any order.
+static bool checkProduct ()
+{
+    std::mt19937 g (3);
+    bool pass = true;
+    const int k = 9;
+    for (int h : checkRows)
+    {
+        for (int s : checkShifts)
+        {
+            // Keep operands to 26 bits, so k products can't overflow a 64-bit sum.
+            Matrix<int> A = checkMatrix<int> (h, k, 1 << 26, g);
+            Matrix<int> B = checkMatrix<int> (k, 2, 1 << 26, g);
+            Matrix<int> expected (h, 2);
+            for (int c = 0; c < 2; c++)
+            {
+                for (int r = 0; r < h; r++)
+                {
+                    int64_t sum = 0;
+                    for (int i = 0; i < k; i++) sum += (int64_t) A(r,i) * B(i,c);
+                    expected(r,c) = sum >> s;
+                }
+            }
+            pass &= same (multiply (A, B, s), expected);
+        }
+    }
+    return pass;
+}
+#endif
+
+
+// Main ----------------------------------------------------------------------
+
+int main (int argc, char * argv[])
+{
+    bool checks = false;
+    for (int i = 1; i < argc; i++)
+    {
+        if      (! strcmp (argv[i], "-c"))                    checks  = true;
+        else if (! strcmp (argv[i], "-s")  &&  i + 1 < argc) scale   = atof (argv[++i]);
+        else if (! strcmp (argv[i], "-r")  &&  i + 1 < argc) repeats = std::max (1, atoi (argv[++i]));
+        else filters.push_back (argv[i]);
+    }
+
+    typedef n2a_T T;
+    if (checks)
+    {
+        check ("check.elementwise", checkElementwise<T>);
+        check ("check.scalar",      checkScalar<T>);
+#       ifdef n2a_FP
+        check ("check.product",     checkProduct);
+#       endif
+        return failures;
+    }
+
+    cout << "name\ttype\titems\tseconds\trate" << endl;
+
+    run ("simulate.euler",      [](){return simulateCompartments<T> (new Euler<T>,      scaled (10000), 0.1);});
+    run ("simulate.rungekutta", [](){return simulateCompartments<T> (new RungeKutta<T>, scaled (10000), 0.05);});
+    run ("simulate.spikes",     [](){return simulateSpikes<T> (scaled (2000), 100, 0.2);});
+    run ("connect.simple",      [](){return connect<T> (scaled (1000), 0, 100);});
+    run ("connect.nn",          [](){return connect<T> (scaled (5000), 8, 1);});
+    run ("sparse.iterate",      [](){return sparseIterate<T>  (scaled (4000), 0.01);});
+    run ("sparse.multiply",     [](){return sparseMultiply<T> (scaled (4000), 0.01, 16);});
+    run ("delay.map",           [](){return delayBuffer<T> (scaled (1000000), false);});
+    run ("delay.ring",          [](){return delayBuffer<T> (scaled (1000000), true);});
+    run ("output.trace",        [](){return outputTrace<T> (scaled (20000), 64);});
+    run ("input.sequential",    [](){return inputRead<T> (scaled (20000), 16, false);});
+    run ("input.random",        [](){return inputRead<T> (scaled (20000), 16, true);});
+
+    const char * kernels[] = {"exp", "log", "sqrt", "pow", "sin", "cos", "tanh", "atan2"};
+    for (const char * k : kernels)
+    {
+        String name = String ("math.") + k;
+        run (name.c_str (), [k](){return mathKernel<T> (k, scaled (10000000));});
+    }
+
+    return 0;
+}
@@ -7,6 +7,185 @@ the U.S. Government retains certain rights in this software.
 
 #include "math.h"
 #include "Matrix.tcc"
+#include "MatrixSparse.tcc"
+#include "fixedpoint.tcc"
+
+#if defined(__AVX512F__)
+#  include <immintrin.h>
+#  define n2a_AVX512
+#elif defined(__AVX2__)
+#  include <immintrin.h>
+#  define n2a_AVX2
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define n2a_NEON
+#endif
+
+
+// Vector kernels ------------------------------------------------------------
+//
+// Contiguous inner loops of the matrix functions below. Each SIMD version widens to
+// 64 bits, multiplies, shifts and truncates exactly as the scalar tail does, so
+// results are bit-identical regardless of which instruction set the runtime was
+// compiled for. SIMD paths are only active when the compiler targets that ISA
+// (for example, -mavx2 or -march=native).
+//
+// AVX2 has no 64-bit arithmetic shift. When shift <= 32, the low 32 bits of a logical
+// shift are the same as those of an arithmetic shift, so that case is vectorized
+// and larger shifts fall back to scalar code.
+
+/// r[i] = a[i] * b[i] >> shift
+static inline void
+multiplyShift (int * r, const int * a, const int * b, int n, int shift)
+{
+    int i = 0;
+#   if defined(n2a_AVX512)
+    __m128i s = _mm_cvtsi32_si128 (shift);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512i x = _mm512_cvtepi32_epi64 (_mm256_loadu_si256 ((const __m256i *) (a + i)));
+        __m512i y = _mm512_cvtepi32_epi64 (_mm256_loadu_si256 ((const __m256i *) (b + i)));
+        __m512i p = _mm512_sra_epi64 (_mm512_mul_epi32 (x, y), s);
+        _mm256_storeu_si256 ((__m256i *) (r + i), _mm512_cvtepi64_epi32 (p));
+    }
+#   elif defined(n2a_AVX2)
+    if (shift <= 32)
+    {
+        __m128i s    = _mm_cvtsi32_si128 (shift);
+        __m256i pack = _mm256_setr_epi32 (0, 2, 4, 6, 0, 0, 0, 0);
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i x = _mm256_cvtepi32_epi64 (_mm_loadu_si128 ((const __m128i *) (a + i)));
+            __m256i y = _mm256_cvtepi32_epi64 (_mm_loadu_si128 ((const __m128i *) (b + i)));
+            __m256i p = _mm256_srl_epi64 (_mm256_mul_epi32 (x, y), s);
+            _mm_storeu_si128 ((__m128i *) (r + i), _mm256_castsi256_si128 (_mm256_permutevar8x32_epi32 (p, pack)));
+        }
+    }
+#   elif defined(n2a_NEON)
+    int64x2_t s = vdupq_n_s64 (-shift);  // Negative count gives arithmetic right shift.
+    for (; i + 4 <= n; i += 4)
+    {
+        int32x4_t x  = vld1q_s32 (a + i);
+        int32x4_t y  = vld1q_s32 (b + i);
+        int64x2_t lo = vshlq_s64 (vmull_s32 (vget_low_s32  (x), vget_low_s32  (y)), s);
+        int64x2_t hi = vshlq_s64 (vmull_s32 (vget_high_s32 (x), vget_high_s32 (y)), s);
+        vst1q_s32 (r + i, vcombine_s32 (vmovn_s64 (lo), vmovn_s64 (hi)));
+    }
+#   endif
+    for (; i < n; i++) r[i] = (int64_t) a[i] * b[i] >> shift;
+}
+
+/// r[i] = a[i] * b >> shift
+static inline void
+multiplyShift (int * r, const int * a, int b, int n, int shift)
+{
+    int i = 0;
+#   if defined(n2a_AVX512)
+    __m128i s = _mm_cvtsi32_si128 (shift);
+    __m512i y = _mm512_set1_epi64 (b);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512i x = _mm512_cvtepi32_epi64 (_mm256_loadu_si256 ((const __m256i *) (a + i)));
+        __m512i p = _mm512_sra_epi64 (_mm512_mul_epi32 (x, y), s);
+        _mm256_storeu_si256 ((__m256i *) (r + i), _mm512_cvtepi64_epi32 (p));
+    }
+#   elif defined(n2a_AVX2)
+    if (shift <= 32)
+    {
+        __m128i s    = _mm_cvtsi32_si128 (shift);
+        __m256i y    = _mm256_set1_epi64x (b);
+        __m256i pack = _mm256_setr_epi32 (0, 2, 4, 6, 0, 0, 0, 0);
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i x = _mm256_cvtepi32_epi64 (_mm_loadu_si128 ((const __m128i *) (a + i)));
+            __m256i p = _mm256_srl_epi64 (_mm256_mul_epi32 (x, y), s);
+            _mm_storeu_si128 ((__m128i *) (r + i), _mm256_castsi256_si128 (_mm256_permutevar8x32_epi32 (p, pack)));
+        }
+    }
+#   elif defined(n2a_NEON)
+    int64x2_t s = vdupq_n_s64 (-shift);
+    int32x2_t y = vdup_n_s32 (b);
+    for (; i + 4 <= n; i += 4)
+    {
+        int32x4_t x  = vld1q_s32 (a + i);
+        int64x2_t lo = vshlq_s64 (vmull_s32 (vget_low_s32  (x), y), s);
+        int64x2_t hi = vshlq_s64 (vmull_s32 (vget_high_s32 (x), y), s);
+        vst1q_s32 (r + i, vcombine_s32 (vmovn_s64 (lo), vmovn_s64 (hi)));
+    }
+#   endif
+    for (; i < n; i++) r[i] = (int64_t) b * a[i] >> shift;
+}
+
+/// acc[i] += a[i] * b, with full 64-bit products. Integer sums are exact, so order does not matter.
+static inline void
+multiplyAccumulate (int64_t * acc, const int * a, int b, int n)
+{
+    int i = 0;
+#   if defined(n2a_AVX512)
+    __m512i y = _mm512_set1_epi64 (b);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512i x = _mm512_cvtepi32_epi64 (_mm256_loadu_si256 ((const __m256i *) (a + i)));
+        __m512i c = _mm512_loadu_si512 (acc + i);
+        _mm512_storeu_si512 (acc + i, _mm512_add_epi64 (c, _mm512_mul_epi32 (x, y)));
+    }
+#   elif defined(n2a_AVX2)
+    __m256i y = _mm256_set1_epi64x (b);
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i x = _mm256_cvtepi32_epi64 (_mm_loadu_si128 ((const __m128i *) (a + i)));
+        __m256i c = _mm256_loadu_si256 ((const __m256i *) (acc + i));
+        _mm256_storeu_si256 ((__m256i *) (acc + i), _mm256_add_epi64 (c, _mm256_mul_epi32 (x, y)));
+    }
+#   elif defined(n2a_NEON)
+    int32x2_t y = vdup_n_s32 (b);
+    for (; i + 4 <= n; i += 4)
+    {
+        int32x4_t x = vld1q_s32 (a + i);
+        vst1q_s64 (acc + i,     vmlal_s32 (vld1q_s64 (acc + i),     vget_low_s32  (x), y));
+        vst1q_s64 (acc + i + 2, vmlal_s32 (vld1q_s64 (acc + i + 2), vget_high_s32 (x), y));
+    }
+#   endif
+    for (; i < n; i++) acc[i] += (int64_t) a[i] * b;
+}
+
+/// r[i] = acc[i] >> shift
+static inline void
+shiftStore (int * r, const int64_t * acc, int n, int shift)
+{
+    int i = 0;
+#   if defined(n2a_AVX512)
+    __m128i s = _mm_cvtsi32_si128 (shift);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512i p = _mm512_sra_epi64 (_mm512_loadu_si512 (acc + i), s);
+        _mm256_storeu_si256 ((__m256i *) (r + i), _mm512_cvtepi64_epi32 (p));
+    }
+#   elif defined(n2a_AVX2)
+    if (shift <= 32)
+    {
+        __m128i s    = _mm_cvtsi32_si128 (shift);
+        __m256i pack = _mm256_setr_epi32 (0, 2, 4, 6, 0, 0, 0, 0);
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i p = _mm256_srl_epi64 (_mm256_loadu_si256 ((const __m256i *) (acc + i)), s);
+            _mm_storeu_si128 ((__m128i *) (r + i), _mm256_castsi256_si128 (_mm256_permutevar8x32_epi32 (p, pack)));
+        }
+    }
+#   elif defined(n2a_NEON)
+    int64x2_t s = vdupq_n_s64 (-shift);
+    for (; i + 4 <= n; i += 4)
+    {
+        int64x2_t lo = vshlq_s64 (vld1q_s64 (acc + i),     s);
+        int64x2_t hi = vshlq_s64 (vld1q_s64 (acc + i + 2), s);
+        vst1q_s32 (r + i, vcombine_s32 (vmovn_s64 (lo), vmovn_s64 (hi)));
+    }
+#   endif
+    for (; i < n; i++) r[i] = acc[i] >> shift;
+}
+
+
+// Matrix functions ----------------------------------------------------------
 
 
 Matrix<int>
@@ -87,6 +266,23 @@ multiplyElementwise (const MatrixStrided<int> & A, const MatrixStrided<int> & B,
     Matrix<int> result (h, w);
     int oh = std::min (h, bh);
     int ow = std::min (w, bw);
+    if (sr == 1  &&  bsr == 1)
+    {
+        int * a = A.base ();
+        int * b = B.base ();
+        int * r = result.base ();
+        for (int c = 0; c < ow; c++)
+        {
+            multiplyShift (r, a, b, oh, shift);
+            std::fill (r + oh, r + h, 0);
+            a += sc;
+            b += bsc;
+            r += h;
+        }
+        std::fill (r, result.base () + h * w, 0);
+        return result;
+    }
+
     int stepA = sc  - h  * sr;
     int stepB = bsc - oh * bsr;
     int * a   = A.base ();
@@ -144,6 +340,24 @@ multiply (const MatrixStrided<int> & A, const MatrixStrided<int> & B, int shift)
     int * aa  = A.base ();
     int * b   = B.base ();
     int * c   = result.base ();
+    if (sr == 1)  // Columns of A are contiguous, so accumulate whole result columns.
+    {
+        std::vector<int64_t> acc (h);
+        for (int j = 0; j < bw; j++)
+        {
+            std::fill (acc.begin (), acc.end (), 0);
+            int * a  = aa;
+            int * bj = b + j * bsc;
+            for (int k = 0; k < ow; k++)
+            {
+                multiplyAccumulate (acc.data (), a, bj[k * bsr], h);
+                a += sc;
+            }
+            shiftStore (c + j * h, acc.data (), h, shift);
+        }
+        return result;
+    }
+
     int * end = c + h * bw;
     while (c < end)
     {
@@ -178,6 +392,14 @@ multiply (const MatrixStrided<int> & A, int scalar, int shift)
     int sr = A.strideR ();
 
     Matrix<int> result (h, w);
+    if (sr == 1)
+    {
+        int * a = A.base ();
+        int * r = result.base ();
+        for (int c = 0; c < w; c++) multiplyShift (r + c * h, a + c * sc, scalar, h, shift);
+        return result;
+    }
+
     int stepC = sc - h * sr;
     int * i   = A.base ();
     int * r   = result.base ();
@@ -195,6 +417,76 @@ multiply (const MatrixStrided<int> & A, int scalar, int shift)
     return result;
 }
 
+// Forms that overwrite a temporary operand. See canReuse() in matrix.h.
+
+Matrix<int>
+shift (Matrix<int> && A, int shift)
+{
+    if (shift == 0) return std::move (A);
+    if (shift > 0) return std::move (A) * (0x1 << shift);
+    return std::move (A) / (0x1 << -shift);
+}
+
+Matrix<int>
+visit (Matrix<int> && A, int (*function) (int, int), int exponent1)
+{
+    if (! canReuse (A)) return visit ((const MatrixStrided<int> &) A, function, exponent1);
+    int * a   = A.base ();
+    int * end = a + A.rows_ * A.columns_;
+    for (; a < end; a++) *a = (*function) (*a, exponent1);
+    return std::move (A);
+}
+
+Matrix<int>
+visit (Matrix<int> && A, int (*function) (int, int, int), int exponent1, int exponent2)
+{
+    if (! canReuse (A)) return visit ((const MatrixStrided<int> &) A, function, exponent1, exponent2);
+    int * a   = A.base ();
+    int * end = a + A.rows_ * A.columns_;
+    for (; a < end; a++) *a = (*function) (*a, exponent1, exponent2);
+    return std::move (A);
+}
+
+Matrix<int>
+multiplyElementwise (Matrix<int> && A, const MatrixStrided<int> & B, int shift)
+{
+    if (! canReuse (A)) return multiplyElementwise ((const MatrixStrided<int> &) A, B, shift);
+
+    int h   = A.rows_;
+    int w   = A.columns_;
+    int oh  = std::min (h, B.rows ());
+    int ow  = std::min (w, B.columns ());
+    int bsc = B.strideC ();
+    int bsr = B.strideR ();
+    int * a = A.base ();
+    int * b = B.base ();
+    for (int c = 0; c < ow; c++)
+    {
+        if (bsr == 1)
+        {
+            multiplyShift (a, a, b, oh, shift);
+        }
+        else
+        {
+            int * t = b;
+            for (int r = 0; r < oh; r++, t += bsr) a[r] = (int64_t) a[r] * *t >> shift;
+        }
+        std::fill (a + oh, a + h, 0);
+        a += h;
+        b += bsc;
+    }
+    std::fill (a, A.base () + h * w, 0);
+    return std::move (A);
+}
+
+Matrix<int>
+multiply (Matrix<int> && A, int scalar, int shift)
+{
+    if (! canReuse (A)) return multiply ((const MatrixStrided<int> &) A, scalar, shift);
+    multiplyShift (A.base (), A.base (), scalar, A.rows_ * A.columns_, shift);
+    return std::move (A);
+}
+
 Matrix<int>
 divide (const MatrixStrided<int> & A, const MatrixStrided<int> & B, int shift)
 {
@@ -302,30 +594,6 @@ divide (int scalar, const MatrixStrided<int> & A, int shift)
     return result;
 }
 
-/**
-    Breaks for shifts less than -2*MSB
-    Could add an extra guard here, or be careful in calling code.
-    Current approach is to minimize cases in favor of compactness and efficiency.
-**/
-inline int
-multiplyRound (int a, int b, int shift)
-{
-    int64_t temp = (int64_t) a * b;
-    if (shift < 0) return (temp + ((int64_t) 1 << -shift - 1)) >> -shift;
-    if (shift > 0) return  temp                                <<  shift;
-    return temp;
-}
-
-// See comments on multiplyRound()
-inline int
-multiplyCeil (int a, int b, int shift)
-{
-    int64_t temp = (int64_t) a * b;
-    if (shift < 0) return (temp + ~(0xFFFFFFFFFFFFFFFF << -shift)) >> -shift;   // The constant here is a 64-bit unsigned integer, all 1s.
-    if (shift > 0) return  temp                                    <<  shift;
-    return temp;
-}
-
 // exponentResult = 1, to accommodate [-pi, pi]
 // exponentY == exponentX, but it doesn't matter what the exponent is; only ratio matters
 int
@@ -441,109 +709,13 @@ ceil (int a, int exponentA, int exponentResult)
 int
 cos (int a, int exponentA)
 {
-    // We want to add PI/2 to a. M_PI exponent=1. To induce down-shift, claim it is 0.
-    // Thus, shift is exactly exponentA.
-    if (exponentA >= 0) return sin (a + (M_PI >> exponentA), exponentA);
-    // If exponentA is negative, then a is too small to use as-is.
-    if (exponentA < -FP_MSB) return 0x20000000;  // one, with exponent=1
-    return sin ((a >> -exponentA) + M_PI, 0);
+    return cosFixed (a, exponentA);
 }
 
 int
 exp (int a, int exponentResult)
 {
-    const int exponentA = 7;  // Hard-coded value established in gov.sandia.n2a.language.function.Exp class.
-
-    if (a == 0)
-    {
-        int shift = FP_MSB - exponentResult;
-        if (shift < 0) return 0;
-        return 1 << shift;
-    }
-    const int one = 1 << FP_MSB - exponentA;
-    if (a == one)
-    {
-        int shift = 1 - exponentResult;  // M_E exponent=1
-        if (shift < 0) return M_E >> -shift;
-        if (shift > 0) return INFINITY;  // Up-shifting M_E is nonsense, since it already uses all the bits.
-        return M_E;
-    }
-
-    // Algorithm:
-    // exp(a) = sum_0^inf (a^k / k!)
-    // term_n = term_(n-1) * (a/n)
-    // Stop when term loses significance.
-    // exp(-a) = 1/exp(a), but positive terms converge faster
-
-    bool negate = a < 0;
-    if (negate) a = -a;
-
-    uint32_t result = one + a;  // zeroth and first term
-    int exponentWork = exponentA;
-
-    // Shift for inner loop:
-    // i has exponent=MSB
-    // a has exponent=7 per above comment
-    // term and result have exponentWork
-    // raw multiply = exponentA+exponentWork at bit 60
-    // raw divide = (exponentA+exponentWork)-MSB at bit 30
-    // We want exponentWork at bit 30, so shift = raw-exponentWork = (exponentA+exponentWork-MSB)-exponentWork = exponentA-MSB
-    const int shift = FP_MSB - exponentA;  // preemtively flip the sign, since this is always used in the positive form
-    const int round = 1 << shift - 1;
-    const int maximum = 1 << FP_MSB;
-
-    uint32_t term = a;
-    for (int i = 2; i < 30; i++)
-    {
-        uint64_t temp = (uint64_t) term * a / i + round >> shift;
-        if (temp == 0) break;
-        while (temp >= maximum  ||  result >= maximum)  // Potential overflow, so down-shift
-        {
-            temp >>= 1;
-            result++;  // rounding
-            result >>= 1;
-            exponentWork++;
-        }
-        term = temp;
-        result += term;
-    }
-
-    if (negate)
-    {
-        // Let 1 have exponent=0 at bit 60 (2*MSB)
-        // raw result of inversion = 0-exponentWork at bit 30
-        uint64_t temp = ((uint64_t) 1 << 2 * FP_MSB) / result;
-        int shift = -exponentWork - exponentResult;
-        if (shift < 0)
-        {
-            if (shift < -60) return 0;  // Prevent weird effects from modulo arithmetic on size of shift.
-            return temp >> -shift;
-        }
-        if (shift > 0)
-        {
-            if (shift > FP_MSB) return INFINITY;
-            temp <<= shift;
-            if (temp > INFINITY) return INFINITY;
-            return temp;
-        }
-        return temp;
-    }
-    else
-    {
-        int shift = exponentWork - exponentResult;
-        if (shift < 0)
-        {
-            if (shift < -FP_MSB) return 0;
-            return result >> -shift;
-        }
-        if (shift > 0)
-        {
-            if (shift > FP_MSB) return INFINITY;
-            // Don't bother trapping overflow with 32-bit math. Our fixed-point analysis should keep numbers in range in any case.
-            return result <<= shift;
-        }
-        return result;
-    }
+    return expFixed (a, exponentResult);
 }
 
 int
@@ -570,89 +742,13 @@ floor (int a, int exponentA, int exponentResult)
 int
 log (int a, int exponentA, int exponentResult)
 {
-    // We use the simple identity log_e(a) = log_2(a) / log_2(e)
-    // exponentRaw = exponentResult - 0 + MSB
-    // shift = exponentRaw - exponentResult = MSB
-    return ((int64_t) log2 (a, exponentA, exponentResult) << FP_MSB) / M_LOG2E;
+    return logFixed (a, exponentA, exponentResult);
 }
 
 int
 log2 (int a, int exponentA, int exponentResult)
 {
-    if (a <  0) return NAN;
-    if (a == 0) return -INFINITY;
-
-    // If a<1, then the result is -log2(1/a)
-    bool negate = false;
-    if (exponentA < 0  ||  (exponentA < FP_MSB  &&  a < 1 << FP_MSB - exponentA))
-    {
-        negate = true;
-
-        // The intention of this code is that only about half the word is occupied
-        // by significant bits. That way, it will still have half a word worth of
-        // bits when inverted.
-        while (a & 0x7FFF0000)
-        {
-            a >>= 1;
-            exponentA++;
-        }
-
-        // compute 1/a
-        // Let the numerator 1 have center power of 0, with center at MSB/2, for exponent=MSB/2
-        // Center of a is presumably at MSB/2
-        // Center of inverse should be at MSB/2
-        // Center power of a is exponentA-MSB/2
-        // Center power of inverse is 0-(exponentA-MSB/2) = MSB/2-exponentA
-        // Exponent of inverse = center power + MSB/2 = MSB-exponentA
-        // Exponent of unshifted division = exponentRaw = MSB/2-exponentA+MSB = 3*MSB/2-exponentA
-        // Needed shift for exponent of inverse = exponentRaw - (MSB-exponentA) = MSB/2
-        // If shifting 1 up to necessary position: (1 << MSB/2) << MSB/2 = 1 << MSB
-        a = (1 << FP_MSB) / a;
-        exponentA = FP_MSB - exponentA;
-    }
-
-    // At this point a >= 1
-    // Using the identity log(ab)=log(a)+log(b), we put a into normal form:
-    //   operand = a*2^exponentA
-    //   log2(operand) = log2(a)+log2(2^exponentA) = log2(a)+exponentA
-    int exponentWork = 15;
-    int one = 1 << FP_MSB - exponentWork;
-    while (a < one)
-    {
-        one >>= 1;
-        exponentWork++;
-    }
-    int result = exponentA - exponentWork;  // Represented as a pure integer, with exponent=MSB
-    int two = 2 * one;
-    while (a >= two)  // This could also be done with a bit mask that checks for any bits in the twos position or higher.
-    {
-        result++;
-        a = (a >> 1) + (a & 1);  // divide-by-2 with rounding
-    }
-
-    // TODO: Guard against large shifts.
-    int shift = FP_MSB - exponentResult;
-    if (a > one)  // Otherwise a==one, in which case the following algorithm will do nothing.
-    {
-        while (shift > 0)
-        {
-            a = multiplyRound (a, a, exponentWork - FP_MSB);  // exponentRaw - exponentWork = (2*exponentWork-MSB) - exponentWork
-            result <<= 1;
-            shift--;
-            if (a >= two)
-            {
-                result |= 1;
-                a = (a >> 1) + (a & 1);
-            }
-        }
-        a = multiplyRound (a, a, exponentWork - FP_MSB);
-        if (a >= two) result++;
-    }
-
-    if      (shift > 0) result <<=  shift;
-    else if (shift < 0) result >>= -shift;
-    if (negate) return -result;
-    return result;
+    return log2Fixed (a, exponentA, exponentResult);
 }
 
 int
@@ -718,155 +814,13 @@ modFloor (int a, int b, int exponentA, int exponentB)
 int
 norm (const MatrixStrided<int> & A, int n, int exponentA, int exponentResult)
 {
-    const int exponentN = 15;
-
-    int * a   = A.base ();
-    int * end = a + A.rows () * A.columns ();  // Assumes MatrixFixed, so that elements are dense in memory.
-    int result = 0;
-
-    if (n == INFINITY)
-    {
-        while (a < end) result = std::max (std::abs (*a++), result);
-        int shift = exponentA - exponentResult;
-        if (shift > 0) return result <<  shift;
-        if (shift < 0) return result >> -shift;
-        return result;
-    }
-    if (n == 0)
-    {
-        while (a < end) if (*a++) result++;
-        int shift = FP_MSB - exponentResult;
-        if (shift > 0) return result <<  shift;
-        if (shift < 0) return result >> -shift;
-        return result;
-    }
-    if (n == 0x1 << exponentN)
-    {
-        while (a < end) result += std::abs (*a++);
-        int shift = exponentA - exponentResult;
-        if (shift > 0) return result <<  shift;
-        if (shift < 0) return result >> -shift;
-        return result;
-    }
-
-    // Fully general form
-    // "result" will hold the sum, and exponentA will hold exponentSum when done.
-    int root;  // exponent=15
-    if (n == 0x2 << exponentN)
-    {
-        root = 0x4000;  // 0.5
-        exponentA = exponentA * 2 - FP_MSB;  // raw result of squaring elements of A
-        register uint64_t sum = 0;
-        while (a < end)
-        {
-            int t = *a++;
-            sum += (int64_t) t * t;
-        }
-        while (sum > INFINITY)
-        {
-            sum >>= 1;
-            exponentA++;
-        }
-        result = sum;  // truncate to 32 bits
-    }
-    else
-    {
-        // for root:
-        // raw division = exponentOne-exponentN+MSB = MSB-MSB/2+MSB
-        // want exponentN, so shift = raw-exponentN = (MSB-MSB/2+MSB)-MSB/2 = MSB
-        root = (0x1 << FP_MSB) / n;
-
-        // for exponentSum:
-        // assume center of A = MSB/2
-        // center power of A = centerA = exponentA - MSB/2
-        // center power of one term = centerTerm = centerA*n
-        // want center of term at MSB/2, so exponentSum = centerTerm+MSB/2 = (exponentA-MSB/2)*n+MSB/2 = exponentA*n+(1-n)*MSB/2
-        int exponentSum = ((exponentA - FP_MSB2) * n >> exponentN) + FP_MSB2;
-
-        while (a < end) result += pow (std::abs (*a++), n, exponentA, exponentSum);
-        exponentA = exponentSum;
-    }
-    return pow (result, root, exponentA, exponentResult);
+    return normFixed (A, n, exponentA, exponentResult);
 }
 
 int
 pow (int a, int b, int exponentA, int exponentResult)
 {
-    // exponentB = 15
-
-    // Use the identity: a^b = e^(b*ln(a))
-    // Most of the complexity of this function is in trapping special cases.
-    // For details, see man page for floating-point pow().
-    // We don't have signed zero, so ignore all distinctions based on that.
-    bool negate = false;
-    int blna = 1;  // exponent=7, as required by exp(); Nonzero indicates that blna needs to be calculated.
-    int shift = FP_MSB - exponentA;
-    int one;
-    if (shift < 0) one = 0;
-    else           one = 1 << shift;
-    if (a == one  ||  b == 0)
-    {
-        blna = 0;  // Zero indicates that we want to return 1, scaled according to exponentA.
-    }
-    else
-    {
-        if (a == NAN  ||  b == NAN) return NAN;
-        if (a == 0)
-        {
-            if (b > 0) return 0;
-            return INFINITY;
-        }
-        if (a == INFINITY  ||  a == -INFINITY)
-        {
-            if (b < 0) return 0;
-            if (a < 0  &&  ! (b & 0x7FFF)  &&  b & 0x8000) return -INFINITY;  // negative infinity to the power of an odd integer
-            return INFINITY;
-        }
-        if (b == INFINITY  ||  b == -INFINITY)
-        {
-            int absa = a > 0 ? a : -a;
-            if (absa > one)
-            {
-                if (b > 0) return INFINITY;
-                return 0;
-            }
-            else if (absa < one)
-            {
-                if (b > 0) return 0;
-                return INFINITY;
-            }
-            else
-            {
-                blna = 0;
-            }
-        }
-        else if (a < 0)
-        {
-            // Check for integer
-            if ((b & 0x7FFF) == 0)  // integer
-            {
-                a = -a;
-                negate = b & 0x8000;  // odd integer
-            }
-            else  // non-integer
-            {
-                return NAN;
-            }
-        }
-
-        if (blna)
-        {
-            // raw multiply = exponentB+7-MSB at bit 30
-            // shift = (exponentB+7-MSB)-7 = exponentB-MSB = -15
-            int64_t temp = (int64_t) b * log (a, exponentA, 7) >> 15;
-            if (temp >  INFINITY) return INFINITY;
-            if (temp < -INFINITY) return 0;
-            blna = temp;
-        }
-    }
-    int result = exp (blna, exponentResult);
-    if (negate) return -result;
-    return result;
+    return powFixed (a, b, exponentA, exponentResult);
 }
 
 int
@@ -903,175 +857,29 @@ sgn (int a, int exponentResult)
 int
 sqrt (int a, int exponentA, int exponentResult)
 {
-    if (a < 0) return NAN;
-
-    // Simple approach: apply the identity a^0.5=e^(ln(a^0.5))=e^(0.5*ln(a))
-    //int l = log (a, exponentA, MSB/2) >> 1;
-    //return exp (l, MSB/2, exponentResult);
-
-    // More efficient approach: Use digit-by-digit method described in
-    // https://en.wikipedia.org/wiki/Methods_of_computing_square_roots
-    // To handle exponentA, notice that sqrt(m*2^n) = 2^(n/2)*sqrt(m)
-    // If n is even, this is sqrt(m) << n/2
-    // If n is not even, we can leave remainder inside: sqrt(2m) << (n-1)/2
-    // If n is negative and uneven, this becomes:
-    //   sqrt(m/2)  >> -(n+1)/2
-    //   sqrt(2m/4) >> -(n+1)/2
-    //   sqrt(2m)/2 >> -(n+1)/2
-    //   sqrt(2m)   >> -(n+1)/2 + 1
-    //   sqrt(2m)   >> -(n-1)/2
-
-    uint32_t m = a;  // "m" for mantissa
-    int exponent0 = exponentA - FP_MSB;  // exponent at bit position 0
-    if (exponent0 % 2)  // Odd, so leave remainder inside sqrt()
-    {
-        m <<= 1;  // equivalent to "2m" in the comments above
-        exponent0--;
-    }
-    int exponentRaw = exponent0 / 2 + FP_MSB;  // exponent of raw result at MSB
-
-    uint32_t bit;
-    if (m & 0xFFFF0000) bit = 1 << 30;
-    else                bit = 1 << 16;  // For efficiency, don't scan upper bits if they're empty.
-    while (bit > m) bit >>= 2;  // Locate starting position, at or below msb of m.
-
-    uint32_t result = 0;
-    while (bit)
-    {
-        uint32_t temp = result + bit;
-        result >>= 1;
-        if (m >= temp)
-        {
-            m -= temp;
-            result += bit;
-        }
-        bit >>= 2;
-    }
-
-    // At this point, the exponent of the raw result is same as exponentA.
-    // If the requested exponent of the result requires it, compute more precision.
-    int shift = exponentRaw - exponentResult;
-    while (shift > 0)
-    {
-        m <<= 2;
-        result <<= 1;
-        shift--;
-        uint32_t temp = (result << 1) + 1;
-        if (m >= temp)
-        {
-            m -= temp;
-            result++;
-        }
-    }
-    if (shift < 0) result >>= -shift;
-    return result;
+    return sqrtFixed (a, exponentA, exponentResult);
 }
 
 int
 sin (int a, int exponentA)
 {
-    // Limit a to [0,pi/2)
-    // To create 2PI, we lie about the exponent of M_PI, increasing it by 1.
-    a = modFloor (a, M_PI, exponentA, 2);  // exponent = min (exponentA, 2)
-    int shift = exponentA - 2;
-    if (shift < 0) a >>= -shift;
-    const int PIat2 = M_PI >> 1;  // M_PI with exponent=2 rather than 1
-    bool negate = false;
-    if (a > PIat2)
-    {
-        a -= PIat2;
-        negate = true;
-    }
-    if (a > PIat2 >> 1) a = PIat2 - a;
-    a <<= 1;  // Now exponent=1, which matches our promised exponentResult.
-
-    // Use power-series to compute sine, similar to exp()
-    // sine(a) = sum_0^inf (-1)^n * x^(2n-1) / (2n+1)! = x - x^3/3! + x^5/5! - x^7/7! ...
-
-    int term = a;
-    int result = a;  // zeroth term
-    int n1 = 0;  // exponent=MSB
-    int n2 = 1;
-    for (int n = 1; n < 7; n++)
-    {
-        n1 = n2 + 1;
-        n2 = n1 + 1;
-        // raw exponent of operations below, in evaluation order:
-        // 2*exponentResult at bit 60
-        // 2*exponentResult-MSB at bit 30
-        // shift = (2*exponenetResult-MSB)-exponentResult = exponentResult-MSB = -29
-        // 2*exponentResult at bit 60
-        // 2*exponentResult-MSB at bit 30
-        // same shift again
-        term = ((int64_t) -term * a / n1 >> 29) * a / n2 >> 29;
-        if (term == 0) break;
-        result += term;
-    }
-    if (negate) return -result;
-    return result;
+    return sinFixed (a, exponentA);
 }
 
 int
 tan (int a, int exponentA, int exponentResult)
 {
-    // There is a power-series expansion for tan() which would be more efficient.
-    // See http://mathworld.wolfram.com/MaclaurinSeries.html
-    // However, to save space we simply compute sin()/cos().
-    // raw division exponent=0 at bit 0
-    return ((int64_t) sin (a, exponentA) << exponentResult) / cos (a, exponentA);  // Don't do any saturation checks. We are not really interested in infinity.
+    return tanFixed (a, exponentA, exponentResult);
 }
 
 int
 tanh (int a, int exponentA)
 {
-    // result = (exp(2a) - 1) / (exp(2a) + 1)
-    // exponentResult = 0
-
-    // tanh() is symmetric around 0, so only deal with one sign
-    bool negate = a < 0;
-    if (negate) a = -a;
-    if (a == 0) return 0;  // This also traps NAN
-
-    // Determine exponent desired from exp(2a). The result from exp(2a) is never smaller than 1, so exponent>=0
-    // We want enough bits to contain the msb of the output. This is
-    // exponent = log2(exp(2a)) = ln(exp(2a)) / ln(2) = 2a / (log2(2) / log2(e)) = 2a * log2(e)
-    // "exponent" should be expressed as a simple integer
-    // raw = exponentA + 1 + exponentLOG2E - MSB = exponentA + 1 - MSB
-    // shift = raw - MSB = exponentA + 1 - 2 * MSB
-    int exponent = 0;
-    if (exponentA >= -1)
-    {
-        exponent = multiplyCeil (a, M_LOG2E, exponentA + 1 - 2 * FP_MSB);
-        // If exponent gets too large, the result will always be 1 or -1
-        if (exponent > FP_MSB) return negate ? -0x40000000 : 0x40000000;
-    }
-
-    // Find true magnitude of a
-    while ((a & 0x40000000) == 0)
-    {
-        a <<= 1;
-        exponentA--;
-    }
-
-    // Require at least 16 bits for exp() after downshifting.
-    // Otherwise answer is not as accurate as simple linear.
-    if (exponentA < 22 - FP_MSB)  // Includes offset of 6 for the downshift.
-    {
-        // Return linear answer, if possible.
-        if (exponentA < -FP_MSB) return 0;  // Can't return result with correct magnitude, so only option is zero.
-        int result = a >> -exponentA;
-        if (negate) return -result;
-        return result;
-    }
-    // Set correct magnitude for exp().
-    // exp(a) expects exponentA=7, but we want exp(2a), so shift to exponentA=6 and lie about it
-    a >>= 6 - exponentA;
-
-    // call exp() and complete calculation
-    int result = exp (a, exponent);
-    int one = 1 << FP_MSB - exponent;
-    result = ((int64_t) result - one << FP_MSB) / ((int64_t) result + one);
+    return tanhFixed (a, exponentA);
+}
 
-    if (negate) return -result;
-    return result;
+Matrix<int>
+multiply (const MatrixSparse<int> & A, const MatrixAbstract<int> & B, int shift)
+{
+    return multiplySparse (A, B, shift);
 }
@@ -15,6 +15,15 @@ the U.S. Government retains certain rights in this software.
 #  include <jni.h>
 #endif
 
+#include <sys/stat.h>
+#ifdef _WIN32
+#  include <windows.h>
+#  undef min
+#  undef max
+#else
+#  include <unistd.h>
+#endif
+
 using namespace n2a;
 using namespace std;
 
@@ -27,6 +36,8 @@ template class Matrix<n2a_T>;
 template class MatrixFixed<n2a_T,3,1>;
 template class MatrixSparse<n2a_T>;
 
+MatrixThreads * matrixThreads = 0;
+
 // Most functions and operators are defined outside the matrix classes.
 // These must be individually instantiated.
 
@@ -86,6 +97,7 @@ template SHARED Matrix<n2a_T> visit (const MatrixStrided<n2a_T> & A, n2a_T (*fun
 template SHARED Matrix<n2a_T> operator & (const MatrixStrided<n2a_T> & A, const MatrixAbstract<n2a_T> & B);
 template SHARED Matrix<n2a_T> operator * (const MatrixStrided<n2a_T> & A, const MatrixAbstract<n2a_T> & B);
 template SHARED Matrix<n2a_T> operator * (const MatrixStrided<n2a_T> & A, const n2a_T scalar);
+template SHARED Matrix<n2a_T> operator * (const MatrixSparse<n2a_T> & A, const MatrixAbstract<n2a_T> & B);
 template SHARED Matrix<n2a_T> operator / (const MatrixStrided<n2a_T> & A, const MatrixAbstract<n2a_T> & B);
 template SHARED Matrix<n2a_T> operator / (const MatrixStrided<n2a_T> & A, const n2a_T scalar);
 template SHARED Matrix<n2a_T> operator / (const n2a_T scalar,             const MatrixStrided<n2a_T> & A);
@@ -97,6 +109,28 @@ template SHARED Matrix<n2a_T> operator - (const n2a_T scalar,             const
 
 template SHARED Matrix<n2a_T> operator ~ (const Matrix<n2a_T> & A);
 
+template SHARED Matrix<n2a_T> visit (Matrix<n2a_T> && A, n2a_T (*function) (const n2a_T &));
+template SHARED Matrix<n2a_T> visit (Matrix<n2a_T> && A, n2a_T (*function) (const n2a_T));
+
+template SHARED Matrix<n2a_T> operator & (Matrix<n2a_T> && A,             const MatrixAbstract<n2a_T> & B);
+template SHARED Matrix<n2a_T> operator & (const MatrixStrided<n2a_T> & A, Matrix<n2a_T> && B);
+template SHARED Matrix<n2a_T> operator & (Matrix<n2a_T> && A,             Matrix<n2a_T> && B);
+template SHARED Matrix<n2a_T> operator * (Matrix<n2a_T> && A,             const n2a_T scalar);
+template SHARED Matrix<n2a_T> operator / (Matrix<n2a_T> && A,             const MatrixAbstract<n2a_T> & B);
+template SHARED Matrix<n2a_T> operator / (const MatrixStrided<n2a_T> & A, Matrix<n2a_T> && B);
+template SHARED Matrix<n2a_T> operator / (Matrix<n2a_T> && A,             Matrix<n2a_T> && B);
+template SHARED Matrix<n2a_T> operator / (Matrix<n2a_T> && A,             const n2a_T scalar);
+template SHARED Matrix<n2a_T> operator / (const n2a_T scalar,             Matrix<n2a_T> && A);
+template SHARED Matrix<n2a_T> operator + (Matrix<n2a_T> && A,             const MatrixAbstract<n2a_T> & B);
+template SHARED Matrix<n2a_T> operator + (const MatrixStrided<n2a_T> & A, Matrix<n2a_T> && B);
+template SHARED Matrix<n2a_T> operator + (Matrix<n2a_T> && A,             Matrix<n2a_T> && B);
+template SHARED Matrix<n2a_T> operator + (Matrix<n2a_T> && A,             const n2a_T scalar);
+template SHARED Matrix<n2a_T> operator - (Matrix<n2a_T> && A,             const MatrixAbstract<n2a_T> & B);
+template SHARED Matrix<n2a_T> operator - (const MatrixStrided<n2a_T> & A, Matrix<n2a_T> && B);
+template SHARED Matrix<n2a_T> operator - (Matrix<n2a_T> && A,             Matrix<n2a_T> && B);
+template SHARED Matrix<n2a_T> operator - (Matrix<n2a_T> && A,             const n2a_T scalar);
+template SHARED Matrix<n2a_T> operator - (const n2a_T scalar,             Matrix<n2a_T> && A);
+
 #ifndef n2a_FP
 template SHARED n2a_T norm (const MatrixAbstract<n2a_T> & A, n2a_T n);
 template SHARED n2a_T norm (const MatrixStrided<n2a_T>  & A, n2a_T n);
@@ -108,12 +142,441 @@ template SHARED n2a_T norm (const MatrixStrided<n2a_T>  & A, n2a_T n);
 Holder::Holder (const String & fileName)
 :   fileName (fileName)
 {
+    references = 0;
 }
 
 Holder::~Holder ()
 {
 }
 
+static std::recursive_mutex                 sharedHoldersMutex;  // Recursive, because loading one holder may acquire another, such as a table behind an input.
+static std::unordered_map<String,Holder *>  sharedHolders;
+
+Holder *
+Holder::acquire (const String & key, const function<Holder * ()> & create)
+{
+    lock_guard<std::recursive_mutex> lock (sharedHoldersMutex);
+    auto it = sharedHolders.find (key);
+    if (it != sharedHolders.end ())
+    {
+        it->second->references++;
+        return it->second;
+    }
+
+    Holder * result = create ();
+    result->sharedKey  = key;
+    result->references = 1;
+    sharedHolders.emplace (key, result);
+    return result;
+}
+
+void
+Holder::release (Holder * holder)
+{
+    if (holder->sharedKey.empty ())
+    {
+        delete holder;
+        return;
+    }
+
+    lock_guard<std::recursive_mutex> lock (sharedHoldersMutex);
+    if (--holder->references > 0) return;
+    sharedHolders.erase (holder->sharedKey);
+    delete holder;
+}
+
+AsyncWriter::AsyncWriter (int capacity, bool drop)
+:   capacity (std::max (1, capacity)),
+    drop     (drop)
+{
+    ring.resize (this->capacity);
+    head     = 0;
+    tail     = 0;
+    dropped  = 0;
+    sleeping = false;
+    quit     = false;
+    error    = 0;
+    thread = std::thread (&AsyncWriter::work, this);
+}
+
+AsyncWriter::~AsyncWriter ()
+{
+    {
+        lock_guard<std::mutex> lock (mutex);
+        quit = true;
+    }
+    wake.notify_one ();
+    thread.join ();  // Writer thread only exits once the ring is empty.
+    if (error)   cerr << "WARNING: output writer failed: " << error << endl;
+    if (dropped) cerr << "WARNING: output writer dropped " << dropped << " items" << endl;
+}
+
+bool
+AsyncWriter::push (function<void ()> && item, bool droppable)
+{
+    size_t h = head.load (memory_order_relaxed);
+    while (h - tail.load (memory_order_acquire) >= (size_t) capacity)
+    {
+        if (drop  &&  droppable)
+        {
+            dropped++;
+            return false;
+        }
+        this_thread::yield ();
+    }
+    ring[h % capacity] = std::move (item);
+    head.store (h + 1);  // seq_cst, so that the check of "sleeping" below can't be reordered before it.
+    if (sleeping)
+    {
+        lock_guard<std::mutex> lock (mutex);
+        wake.notify_one ();
+    }
+    return true;
+}
+
+void
+AsyncWriter::drain ()
+{
+    size_t h = head.load (memory_order_relaxed);
+    while (tail.load (memory_order_acquire) != h) this_thread::yield ();
+}
+
+void
+AsyncWriter::work ()
+{
+    size_t t = 0;
+    while (true)
+    {
+        if (head.load (memory_order_acquire) == t)
+        {
+            unique_lock<std::mutex> lock (mutex);
+            sleeping = true;
+            wake.wait (lock, [this, t] {return quit  ||  head.load () != t;});
+            sleeping = false;
+            if (head.load () == t) return;  // quit, and nothing left to do
+        }
+
+        function<void ()> & item = ring[t % capacity];
+        try
+        {
+            item ();
+        }
+        catch (const char * message)
+        {
+            if (! error) error = message;
+        }
+        catch (...)
+        {
+            if (! error) error = "unknown exception";
+        }
+        item = nullptr;  // Release the data held by the item before making its slot available.
+        tail.store (++t, memory_order_release);
+    }
+}
+
+SharedMappedFile::SharedMappedFile ()
+{
+    references = 0;
+}
+
+static std::mutex                                    mappedFilesMutex;
+static std::unordered_map<String,SharedMappedFile *> mappedFiles;
+
+SharedMappedFile *
+SharedMappedFile::acquire (const String & fileName)
+{
+    lock_guard<std::mutex> lock (mappedFilesMutex);
+    auto it = mappedFiles.find (fileName);
+    if (it != mappedFiles.end ())
+    {
+        it->second->references++;
+        return it->second;
+    }
+
+    SharedMappedFile * result = new SharedMappedFile;
+    result->fileName = fileName;
+    if (! result->open (fileName.c_str ()))  // An empty file succeeds, even though it has no mapping.
+    {
+        delete result;
+        return 0;
+    }
+    result->references = 1;
+    mappedFiles.emplace (fileName, result);
+    return result;
+}
+
+void
+SharedMappedFile::release (SharedMappedFile * map)
+{
+    lock_guard<std::mutex> lock (mappedFilesMutex);
+    if (--map->references > 0) return;
+    mappedFiles.erase (map->fileName);
+    delete map;
+}
+
+static const char     cacheMagic[]  = "N2Ac";
+static const uint32_t cacheVersion  = 1;
+static const int      cacheHeader   = 48;  // bytes: magic, version, kind, type, exponent, variant, source size, source time, payload size
+
+InputCache::InputCache (const String & source, uint32_t kind, uint32_t type, int exponent, uint32_t variant)
+:   source   (source),
+    path     (source + ".n2ac"),
+    kind     (kind),
+    type     (type),
+    exponent (exponent),
+    variant  (variant)
+{
+    position = 0;
+}
+
+/**
+    Fetches identity of source file, for comparison with sidecar header.
+**/
+static bool
+sourceStamp (const String & source, uint64_t & size, int64_t & time)
+{
+    struct stat info;
+    if (stat (source.c_str (), &info)) return false;
+    size = info.st_size;
+    time = info.st_mtime;
+    return true;
+}
+
+bool
+InputCache::read ()
+{
+    uint64_t sourceSize;
+    int64_t  sourceTime;
+    if (! sourceStamp (source, sourceSize, sourceTime)) return false;
+    if (! map.open (path.c_str ())  ||  map.size < cacheHeader) return false;
+
+    const char * data = map.data;
+    uint32_t header[6];
+    memcpy (header, data, sizeof (header));
+    uint64_t stamp[3];
+    memcpy (stamp, data + sizeof (header), sizeof (stamp));
+    if (   memcmp (data, cacheMagic, 4)
+        || header[1]           != cacheVersion
+        || header[2]           != kind
+        || header[3]           != type
+        || (int32_t) header[4] != exponent
+        || header[5]           != variant
+        || stamp[0]            != sourceSize
+        || (int64_t) stamp[1]  != sourceTime
+        || stamp[2]            != map.size - cacheHeader)
+    {
+        map.close ();
+        return false;
+    }
+    position = data + cacheHeader;
+    return true;
+}
+
+const char *
+InputCache::get (size_t bytes)
+{
+    if (! position  ||  position + bytes > map.data + map.size) return 0;
+    const char * result = position;
+    position += bytes;
+    return result;
+}
+
+const char *
+InputCache::getArray (size_t bytes)
+{
+    if (! position) return 0;
+    size_t offset = position - map.data;
+    position = map.data + (offset + 7 & ~(size_t) 7);  // Header size is a multiple of 8, so offsets within file and within payload agree.
+    return get (bytes);
+}
+
+int32_t
+InputCache::getInt ()
+{
+    const char * p = get (sizeof (int32_t));
+    if (! p) return 0;
+    int32_t result;
+    memcpy (&result, p, sizeof (result));
+    return result;
+}
+
+String
+InputCache::getString ()
+{
+    int32_t length = getInt ();
+    const char * p = get (length);
+    String result;
+    if (p) result.assign (p, length);
+    return result;
+}
+
+void
+InputCache::put (const void * data, size_t bytes)
+{
+    const char * p = (const char *) data;
+    buffer.insert (buffer.end (), p, p + bytes);
+}
+
+void
+InputCache::putArray (const void * data, size_t bytes)
+{
+    buffer.resize (buffer.size () + 7 & ~(size_t) 7, 0);
+    put (data, bytes);
+}
+
+void
+InputCache::putInt (int32_t value)
+{
+    put (&value, sizeof (value));
+}
+
+void
+InputCache::putString (const String & value)
+{
+    putInt (value.size ());
+    put (value.c_str (), value.size ());
+}
+
+bool
+InputCache::write ()
+{
+    uint64_t sourceSize;
+    int64_t  sourceTime;
+    if (! sourceStamp (source, sourceSize, sourceTime)) return false;
+
+    char header[cacheHeader];
+    uint32_t fields[6] = {0, cacheVersion, kind, type, (uint32_t) exponent, variant};
+    uint64_t stamp[3]  = {sourceSize, (uint64_t) sourceTime, buffer.size ()};
+    memcpy (fields, cacheMagic, 4);
+    memcpy (header,                  fields, sizeof (fields));
+    memcpy (header + sizeof (fields), stamp, sizeof (stamp));
+
+    // Write under a name unique to this process and thread, then move into place.
+#   ifdef _WIN32
+    long process = GetCurrentProcessId ();
+#   else
+    long process = getpid ();
+#   endif
+    long thread = (long) (std::hash<std::thread::id> () (std::this_thread::get_id ()) & 0x7FFFFFFF);
+    String temp = path + "." + String (process) + "." + String (thread) + ".tmp";
+    {
+        ofstream out (temp.c_str (), ios::binary);
+        if (! out.good ()) return false;
+        out.write (header, cacheHeader);
+        if (buffer.size ()) out.write (buffer.data (), buffer.size ());
+        if (! out.good ())
+        {
+            out.close ();
+            remove (temp.c_str ());
+            return false;
+        }
+    }
+#   ifdef _WIN32
+    remove (path.c_str ());  // Windows won't rename over an existing file.
+#   endif
+    if (rename (temp.c_str (), path.c_str ()))
+    {
+        remove (temp.c_str ());
+        return false;
+    }
+    return true;
+}
+
+bool
+truncateFile (const String & fileName, uint64_t size)
+{
+#   ifdef _WIN32
+    HANDLE file = CreateFileA (fileName.c_str (), GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER length;
+    length.QuadPart = size;
+    bool result =  SetFilePointerEx (file, length, 0, FILE_BEGIN)  &&  SetEndOfFile (file);
+    CloseHandle (file);
+    return result;
+#   else
+    return ! truncate (fileName.c_str (), size);
+#   endif
+}
+
+double
+parseNumber (const char * begin, const char * end, const char ** next)
+{
+    // Exact powers of ten representable in a double.
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    const char * c = begin;
+    while (c < end  &&  (*c == ' '  ||  *c == '\t')) c++;
+    bool negate = false;
+    if (c < end  &&  (*c == '-'  ||  *c == '+')) negate = *c++ == '-';
+
+    uint64_t mantissa = 0;
+    int      digits   = 0;  // significant digits accumulated in mantissa
+    int      scale    = 0;  // power of ten to apply to mantissa
+    bool     any      = false;
+    for (; c < end  &&  *c >= '0'  &&  *c <= '9'; c++)
+    {
+        any = true;
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + *c - '0';
+            if (mantissa) digits++;
+        }
+        else
+        {
+            scale++;
+            if (*c != '0') digits = 20;  // Lost precision, so must fall back.
+        }
+    }
+    if (c < end  &&  *c == '.')
+    {
+        for (c++; c < end  &&  *c >= '0'  &&  *c <= '9'; c++)
+        {
+            any = true;
+            if (digits >= 19)
+            {
+                if (*c != '0') digits = 20;
+                continue;
+            }
+            mantissa = mantissa * 10 + *c - '0';
+            if (mantissa) digits++;
+            scale--;
+        }
+    }
+    if (any  &&  c < end  &&  (*c == 'e'  ||  *c == 'E'))
+    {
+        const char * e = c + 1;
+        bool negateExponent = false;
+        if (e < end  &&  (*e == '-'  ||  *e == '+')) negateExponent = *e++ == '-';
+        if (e < end  &&  *e >= '0'  &&  *e <= '9')
+        {
+            int exponent = 0;
+            for (; e < end  &&  *e >= '0'  &&  *e <= '9'; e++) if (exponent < 10000) exponent = exponent * 10 + *e - '0';
+            scale += negateExponent ? -exponent : exponent;
+            c = e;
+        }
+    }
+
+    // Fast path is exact when both mantissa and power of ten are exactly representable.
+    if (any  &&  digits <= 15  &&  scale >= -22  &&  scale <= 22)
+    {
+        if (next) *next = c;
+        double result = (double) mantissa;
+        if (scale < 0) result /= powers[-scale];
+        else           result *= powers[ scale];
+        return negate ? -result : result;
+    }
+
+    // Slow path, which also handles forms such as "nan" and "inf".
+    char buffer[64];
+    int length = std::min ((int) (end - begin), (int) sizeof (buffer) - 1);
+    memcpy (buffer, begin, length);
+    buffer[length] = 0;
+    char * stop;
+    double result = strtod (buffer, &stop);
+    if (next) *next = begin + (stop - buffer);
+    return result;
+}
+
 template class Parameters<n2a_T>;
 template class IteratorNonzero<n2a_T>;
 template class IteratorSkip<n2a_T>;
@@ -299,6 +762,32 @@ Material::setUniform ()
     glUniform1f  (locShininess,   shininess);
 }
 
+bool
+Material::sameSurface (const Material & that) const
+{
+    return  memcmp (ambient,  that.ambient,  sizeof (ambient))  == 0
+        &&  memcmp (emission, that.emission, sizeof (emission)) == 0
+        &&  memcmp (specular, that.specular, sizeof (specular)) == 0
+        &&  shininess == that.shininess;
+}
+
+void
+Batch::addInstance (const Matrix<float> & model, const Material & material)
+{
+    // Pad out to a full 4x4 affine transform, in case caller supplied something smaller.
+    int rows    = model.rows ();
+    int columns = model.columns ();
+    for (int c = 0; c < 4; c++)
+    {
+        for (int r = 0; r < 4; r++)
+        {
+            if (r < rows  &&  c < columns) instances.push_back (model(r,c));
+            else                           instances.push_back (r == c ? 1 : 0);
+        }
+    }
+    for (int i = 0; i < 4; i++) instances.push_back (material.diffuse[i]);
+}
+
 void
 put (std::vector<GLfloat> & vertices, float x, float y, float z, float[3] n)
 {
@@ -14,6 +14,7 @@ the U.S. Government retains certain rights in this software.
 #include "matrix.h"
 #include "MNode.h"
 #include "canvas.h"
+#include "mappedfile.h"
 #ifdef HAVE_FFMPEG
 #  include "video.h"
 #endif
@@ -22,7 +23,13 @@ the U.S. Government retains certain rights in this software.
 #endif
 
 #include <vector>
+#include <deque>
 #include <unordered_map>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include "shared.h"
 
@@ -50,8 +57,135 @@ class SHARED Holder
 {
 public:
     String fileName;
+    String sharedKey;   ///< Name of this holder in the shared registry. Empty if holder is private to one simulator.
+    int    references;  ///< Number of simulators using a shared holder. Guarded by registry mutex.
+
     Holder (const String & fileName);
     virtual ~Holder ();
+
+    /**
+        Process-wide registry of read-only holders, so that simulators running in the same
+        process (for example, thread-local simulators in an ensemble) can use the same input
+        without each loading its own copy.
+        @param key Identifies the file along with everything that affects its parsed form,
+        such as holder type and exponent.
+        @param create Makes and loads a new holder. Called with the registry locked, so a
+        file is only ever loaded once even when several simulators ask for it at the same time.
+        @return The shared holder, with its reference count incremented.
+    **/
+    static Holder * acquire (const String & key, const std::function<Holder * ()> & create);
+    static void     release (Holder * holder);  ///< Deletes the holder if it is private, or if this was its last reference.
+};
+
+/**
+    Background thread that performs slow output work (disk writes, image encoding)
+    on behalf of a holder, so the simulation does not stall on I/O.
+    Work items are closures that own the data they need, such as a completed row or
+    frame. They are passed through a bounded ring which is lock-free on the producer
+    side. Only one thread may call push(), generally the one running the simulator
+    that owns the holder. Items run in the order they were pushed.
+**/
+class SHARED AsyncWriter
+{
+public:
+    std::vector<std::function<void ()>> ring;
+    int                                 capacity;
+    std::atomic<size_t>                 head;     ///< Count of items pushed. Only modified by producer.
+    std::atomic<size_t>                 tail;     ///< Count of items completed. Only modified by writer thread.
+    bool                                drop;     ///< When ring is full, discard the item rather than wait for space.
+    long                                dropped;  ///< Number of items discarded because ring was full. Only accessed by producer.
+    std::atomic<bool>                   sleeping; ///< Writer thread is waiting for work.
+    std::atomic<bool>                   quit;
+    const char *                        error;    ///< First exception thrown by a work item, if any.
+    std::mutex                          mutex;
+    std::condition_variable             wake;
+    std::thread                         thread;
+
+    AsyncWriter (int capacity, bool drop = false);
+    ~AsyncWriter ();  ///< Finishes all pending items, then stops the thread.
+
+    /**
+        Queues an item for execution on the writer thread.
+        @param droppable Indicates that this item may be discarded under the drop policy.
+        Items that other items depend on, such as file headers, should set this false.
+        @return false if the item was discarded.
+    **/
+    bool push (std::function<void ()> && item, bool droppable = true);
+    void drain ();  ///< Waits until all queued items are complete.
+    void work ();   ///< Body of writer thread.
+};
+
+/**
+    Mapping of an entire file, reference counted and shared within the process,
+    so several holders (or several thread-local simulators) that read the same file
+    use a single copy of it.
+**/
+class SHARED SharedMappedFile : public n2a::MappedFile
+{
+public:
+    String fileName;
+    int    references;  ///< Guarded by the registry mutex in holder.cc.
+
+    SharedMappedFile ();
+
+    static SharedMappedFile * acquire (const String & fileName);  ///< @return Shared mapping of the file, or null if it could not be mapped. Caller must pass the result to release() when done.
+    static void               release (SharedMappedFile * map);
+};
+
+/**
+    Parses a decimal number spanning [begin,end), which need not be null-terminated.
+    Common forms (with at most 15 significant digits and a modest exponent) are converted
+    directly. Anything else falls back to strtod() on a bounded copy.
+    @param next If non-null, receives the position just past the last character consumed.
+**/
+extern SHARED double parseNumber (const char * begin, const char * end, const char ** next = 0);
+
+/// Cuts the named file down to the given size. @return false if the file could not be changed.
+extern SHARED bool truncateFile (const String & fileName, uint64_t size);
+
+/**
+    Binary sidecar that holds the parsed contents of a text input file, so later runs
+    can map it rather than parse the text again. The sidecar sits beside its source,
+    with ".n2ac" appended to the name. Its header records the size and modification
+    time of the source, along with the kind of content, the numeric type, the fixed-point
+    exponent and a variant code chosen by the holder. A sidecar that disagrees on any of
+    these is ignored, and replaced by the next write.
+    Sidecars are written to a temporary file which is then renamed, so a concurrent job
+    never sees a partial one. Failure to write (for example, a read-only directory) only
+    means the next run parses text again.
+**/
+class SHARED InputCache
+{
+public:
+    enum Kind
+    {
+        MATRIX = 1,  ///< One matrix. See putCacheMatrix().
+        TABLE  = 2,  ///< See InputHolder::writeCache().
+        TREE   = 3   ///< int32 count, then count entries, each a string key, int32 exponent and matrix. See Mfile::writeCache().
+    };
+
+    String            source;
+    String            path;      ///< of the sidecar itself
+    uint32_t          kind;
+    uint32_t          type;      ///< sizeof(T), plus 0x100 if T is an integer type
+    int32_t           exponent;
+    uint32_t          variant;
+    n2a::MappedFile   map;
+    const char *      position;  ///< Read cursor within map.
+    std::vector<char> buffer;    ///< Payload accumulated for write().
+
+    InputCache (const String & source, uint32_t kind, uint32_t type, int exponent = 0, uint32_t variant = 0);
+
+    bool         read      ();  ///< Maps sidecar and checks that it is current. @return true if payload can be read.
+    const char * get       (size_t bytes);  ///< @return Pointer to next item in payload. Null if payload is exhausted.
+    const char * getArray  (size_t bytes);  ///< Same as get(), but first skips to a multiple of 8 bytes, so element arrays can be used in place.
+    int32_t      getInt    ();
+    String       getString ();
+    void         put       (const void * data, size_t bytes);
+    void         putArray  (const void * data, size_t bytes);  ///< Pads to a multiple of 8 bytes before data.
+    void         putInt    (int32_t value);
+    void         putString (const String & value);
+    bool         write     ();  ///< Writes header and accumulated payload to the sidecar.
 };
 
 template<class T>
@@ -87,12 +221,15 @@ public:
     MatrixSparse<T> *                  A;
     int                                columns;
     typename std::map<int,T>::iterator it;
+    int                                i;    ///< Position in compressed arrays, when A is compressed.
+    int                                end;  ///< End of current column in compressed arrays.
 
     IteratorSparse (MatrixSparse<T> * A);
     virtual bool next ();
 };
 
 extern SHARED int convert (String input, int exponent);
+extern SHARED int convert (double input, int exponent);
 
 template<class T>
 class SHARED MatrixInput : public Holder
@@ -111,6 +248,15 @@ template<class T> extern SHARED MatrixInput<T> * matrixHelper (const String & fi
 
 template<class T> extern SHARED IteratorNonzero<T> * getIterator (MatrixAbstract<T> * A);  // Returns an object that iterates over nonzero elements of A.
 
+template<class T> uint32_t                           cacheType      ();  ///< Type code for InputCache
+template<class T> extern SHARED void                 putCacheMatrix (InputCache & cache, const MatrixAbstract<T> * A);  ///< Appends int32 form (0=dense, 1=sparse), int32 rows, int32 columns, then elements: dense in column-major order, sparse as int32 count and CSC arrays start[columns+1], row[count], value[count]. A sparse matrix must be compressed.
+template<class T> extern SHARED MatrixAbstract<T> *  getCacheMatrix (InputCache & cache);  ///< Reverses putCacheMatrix(). @return null if payload is malformed.
+#ifdef n2a_FP
+template<class T> extern SHARED Matrix<T> *          readNpy        (const String & fileName, int exponent);  ///< Loads a NumPy array file. Only 1D and 2D arrays of plain numbers are supported. @return null on failure.
+#else
+template<class T> extern SHARED Matrix<T> *          readNpy        (const String & fileName);
+#endif
+
 template<class T>
 class SHARED ImageInput : public Holder
 {
@@ -124,11 +270,35 @@ public:
     int                                  index;       ///< of current image in sequence
     T                                    t;           ///< next PTS for video, or next frame number for sequence
     double                               framePeriod; ///< for converting PTS to sequence number. Nonzero only when handling a sequence through FFmpeg.
-    std::unordered_map<String,Matrix<T>> channels;
+    std::unordered_map<String,Matrix<T>> channels;    ///< Converted planes of current image. Each color space is converted at most once per frame.
+
+#   ifdef HAVE_FFMPEG
+    /// A decoded frame waiting in the prefetch queue.
+    struct Frame
+    {
+        n2a::Image                           image;    ///< Private copy, so it does not depend on decoder memory.
+        double                               nextPTS;
+        std::unordered_map<String,Matrix<T>> channels; ///< Color spaces already converted by the prefetch thread.
+    };
+    int                     prefetch;       ///< Maximum number of decoded frames to hold ahead of the simulation. Zero means decode synchronously in get(). Takes effect at first get().
+    std::deque<Frame *>     ready;
+    bool                    prefetchQuit;
+    bool                    prefetchDone;   ///< Decoder reached end of stream (or failed). No more frames will arrive.
+    std::mutex              prefetchMutex;
+    std::condition_variable prefetchWake;   ///< Signals changes in both directions: a frame arrived, or space opened up.
+    std::thread             prefetchThread;
+    std::atomic<int>        colorSpaces;    ///< Bitmask of color spaces that get() has asked for, so the prefetch thread can convert them ahead of time.
+    int                     exponents[4];   ///< Exponent last requested for each color space. Only meaningful in FP mode.
+
+    void    prefetchLoop ();  ///< Body of prefetch thread. Only this thread touches "video" once it starts.
+    Frame * nextFrame    ();  ///< Waits for the next decoded frame. Caller takes ownership. Returns null at end of stream.
+#   endif
 
     ImageInput (const String & fileName);
     ~ImageInput ();
 
+    void convert (const n2a::Image & source, int colorSpace, std::unordered_map<String,Matrix<T>> & channels, int exponent) const;  ///< Adds the three planes of the given color space to channels. exponent is only used in FP mode.
+
 #   ifdef n2a_FP
     Matrix<T> get (String channelName, T now, int exponent);
 #   else
@@ -193,6 +363,25 @@ public:
 
     Material ();
     void setUniform ();
+    bool sameSurface (const Material & that) const;  ///< Compares everything except diffuse color, which is supplied per instance.
+};
+
+/**
+    Collects all primitives drawn during one frame that share geometry and surface properties,
+    so they can be submitted with a single instanced draw call.
+**/
+class Batch
+{
+public:
+    String               vertices;   ///< Name of cached vertex buffer. Empty means geometry is streamed in the two vectors below.
+    String               indices;    ///< Name of cached index buffer.
+    GLsizei              count;      ///< Number of indices per instance. For streamed geometry, taken from streamIndices at draw time.
+    Material             material;
+    std::vector<GLfloat> instances;  ///< 20 floats per instance: model matrix in column-major order, then diffuse RGBA.
+    std::vector<GLfloat> streamVertices;
+    std::vector<GLuint>  streamIndices;
+
+    void addInstance (const Matrix<float> & model, const Material & material);
 };
 
 void put       (std::vector<GLfloat> & vertices,                  float x, float y, float z, float[3] n);
@@ -241,9 +430,10 @@ public:
     GLuint                       rboDepth;
     GLint                        locVertexPosition;
     GLint                        locVertexNormal;
-    GLint                        locMatrixModelView;
-    GLint                        locMatrixNormal;
+    GLint                        locMatrixView;
     GLint                        locMatrixProjection;
+    GLint                        locInstanceModel;  // First of four consecutive attributes, one per column.
+    GLint                        locInstanceColor;
     std::vector<LightLocation *> locLights;
     GLint                        locEnabled;
     bool                         have3D;
@@ -257,9 +447,24 @@ public:
     int                          sphereStep;
     std::vector<GLfloat>         sphereVertices;
     std::vector<GLuint>          sphereIndices;
+    std::vector<Batch>           batches;     // Reused from frame to frame, so vectors keep their capacity.
+    int                          batchCount;  // Number of entries in batches that are active in the current frame.
+    std::vector<GLfloat>         instanceData;
+    static const int             readbackDepth = 3;       // Number of frames that may be in flight between render and readback.
+    GLuint                       pbo[readbackDepth];      // Pixel-pack buffers that receive glReadPixels() without stalling the pipeline.
+    GLsync                       fence[readbackDepth];    // Signals when the corresponding pbo has been filled.
+    n2a::Image                   pending[readbackDepth];  // 2D layer of each frame in flight, with timestamp already set.
+    int                          pboBytes;                // Current allocation of each pbo. Zero means buffers have not been created yet.
+    int                          readIssued;              // Count of readbacks started. Slot is readIssued % readbackDepth.
+    int                          readCollected;           // Count of readbacks finished and handed to writer.
+    std::vector<std::vector<uint32_t> *> spare;           // 3D scene buffers returned by writer thread, ready for reuse.
+    std::mutex                   spareMutex;
 #   endif
     Matrix<float>                nextProjection;  // Initialized to 4x4, all zeros. If all zeros a start of 3D drawing, then we generate a default matrix based on current view size.
     Matrix<float>                nextView;        // Initialized to 4x4 identity, which is also the default.
+    bool                         async;           // Encode and write frames on a background thread. Takes effect at first write to disk.
+    bool                         drop;            // With async, discard frames rather than wait when the writer falls behind.
+    AsyncWriter *                writer;
 
     ImageOutput (const String & fileName);
     virtual ~ImageOutput ();
@@ -280,15 +485,23 @@ public:
     T drawSegment (T now, bool raw, const MatrixFixed<T,3,1> & p1, const MatrixFixed<T,3,1> & p2, T thickness, uint32_t color);
 #   endif
     void writeImage ();
+    void writeFrame (n2a::Image & frame);  // Subroutine of writeImage(). Sends image to video or file. When async, runs on writer thread.
+#   ifdef HAVE_GL
+    void startReadback    ();                                   // Subroutine of writeImage(). Queues copy of 3D scene into next pbo, and parks the 2D layer until it completes.
+    void finishReadback   (int keep);                           // Collects completed readbacks until no more than "keep" remain in flight, then passes them to writer.
+    void compositeFrame   (n2a::Image & frame, uint32_t * scene); // Blends 2D layer over 3D scene (bottom-up rows), or over clearColor if scene is null. Runs on writer thread.
+#   endif
 
     // 3D drawing functions.
 #   ifdef HAVE_GL
-    bool next3D (const Matrix<T> & model, const Material & material);  // Additional setup work done by 3D draw functions. Does both one-time initialization and per-frame initialization, as needed.
+    bool next3D ();  // Additional setup work done by 3D draw functions. Does both one-time initialization and per-frame initialization, as needed.
     T drawCube     (T now, const Matrix<T> & model, const Material & material);
     T drawCylinder (T now,                          const Material & material, const MatrixFixed<T,3,1> & p1, T r1, const MatrixFixed<T,3,1> & p2, T r2 = -1, int steps = 6, int stepsCap = -1);
     T drawPlane    (T now, const Matrix<T> & model, const Material & material);
     T drawSphere   (T now, const Matrix<T> & model, const Material & material, int steps = 1);
-    GLuint getBuffer (String name, int size);
+    Batch & getBatch    (const String & vertices, const String & indices, GLsizei count, const Material & material);  // Finds or starts the batch for the given geometry and surface in the current frame.
+    void    drawBatches ();  // Submits all batches collected during the frame, one instanced draw call each. Subroutine of writeImage().
+    GLuint  getBuffer   (const String & name, GLenum target, bool & created);  // Binds the named buffer to target, creating it if needed. created indicates that caller should fill the buffer.
 #   endif
 };
 template<class T> extern SHARED ImageOutput<T> * imageOutputHelper (const String & fileName, ImageOutput<T> * oldHandle = 0);
@@ -298,11 +511,18 @@ class SHARED Mfile : public Holder
 {
 public:
     n2a::MDoc *                          doc;
-    std::map<String,MatrixAbstract<T> *> matrices;  // Could use unordered_map. Generally, there will be very few entries (like 1), so not sure which will cost the least.
+    std::map<String,MatrixAbstract<T> *> matrices;  // Could use unordered_map. Generally, there will be very few entries (like 1), so not sure which will cost the least. In fixed-point, key is path plus "|exponent".
+    std::map<String,int>                 exponents; ///< Of each entry in matrices. Only meaningful in fixed-point.
+    bool                                 cache;     ///< Keep matrices in a binary sidecar. See InputCache.
+    bool                                 cacheDirty;///< Some matrix was built from doc, so sidecar needs to be rewritten.
+    std::mutex                           mutex;     ///< Guards matrices when this holder is shared between simulators.
 
     Mfile (const String & fileName);
     virtual ~Mfile ();
 
+    void readCache  ();  ///< Loads all matrices held in sidecar, if it is current.
+    void writeCache ();
+
 #   ifdef n2a_FP
     MatrixAbstract<T> * getMatrix (const std::vector<String> & path, int exponent);
 #   else
@@ -314,6 +534,28 @@ template<class T> extern SHARED Mfile<T> * MfileHelper (const String & fileName,
 extern SHARED std::vector<String> keyPath (const std::vector<String> & path);  ///< Converts any path elements with delimiters (/) into separate elements.
 template<typename... Args> std::vector<String> keyPath (Args... keys) {return keyPath ({keys...});}
 
+/**
+    The immutable part of an indexed InputHolder: column layout and the parsed table.
+    Shared by all simulators that read the same file with the same modes. Each InputHolder
+    keeps its own cursor over the table.
+**/
+template<class T>
+class SHARED InputTable : public Holder
+{
+public:
+    int                            columnCount;
+    std::unordered_map<String,int> columnMap;
+    int                            timeColumn;
+    char                           delimiter;
+    int64_t                        rowCount;
+    std::vector<T>                 tableData;
+    const T *                      table;    ///< Null if the file could not be loaded.
+    InputCache *                   sidecar;
+
+    InputTable (const String & fileName);
+    virtual ~InputTable ();
+};
+
 template<class T>
 class SHARED InputHolder : public Holder
 {
@@ -340,9 +582,41 @@ public:
     int                            exponent;  ///< of value returned by get()
 #   endif
 
+    // Indexed mode
+    bool                           indexed;      ///< mode; map the whole file and index its rows, allowing random access. Must be set before first get(). Falls back to streaming if the file can't be mapped (for example, stdin).
+    SharedMappedFile *             map;
+    std::vector<uint64_t>          indexOffset;  ///< Start of every indexStride-th data row.
+    std::vector<T>                 indexTime;    ///< Time value of the same rows. Only filled in time mode.
+    int64_t                        rowCount;     ///< Total data rows in file.
+    int64_t                        currentRow;   ///< Data row held in currentValues, or -1 if before first row.
+    uint64_t                       nextPosition; ///< Just past the line that holds nextValues, or past currentValues when there is no next row.
+    static const int               indexStride = 64;
+    bool                           cache;        ///< mode; keep the parsed table in a binary sidecar (see InputCache). Implies indexed. Must be set before first get().
+    std::vector<T>                 tableData;    ///< Parsed values, when table was built during this run.
+    const T *                      table;        ///< All data rows, each columnCount wide. Points into sidecar mapping or tableData. Null unless cache is in effect.
+    InputCache *                   sidecar;      ///< Holds the mapping that backs table, when it was loaded from sidecar.
+    bool                           tabulate;     ///< mode; parse the whole file into table even when cache is off.
+    bool                           share;        ///< mode; take table from the process-wide registry (see Holder::acquire), so concurrent simulators parse the file only once. Implies indexed. Must be set before first get().
+    InputTable<T> *                shared;       ///< Source of table when share is in effect.
+
     InputHolder (const String & fileName);
     virtual ~InputHolder ();
 
+    void      detectDelimiter (const char * begin, const char * end);
+    bool      parseHeader     (const char * begin, const char * end);  ///< If the line is a header, records its columns. @return true if line was a header.
+    T         parseField      (const char * begin, const char * end, int index);
+    void      parseValues     (const char * begin, const char * end, T * values);  ///< values must have room for columnCount entries.
+    T         parseTime       (const char * begin, const char * end);  ///< Parses only the time column of a data line.
+    void      buildIndex      ();  ///< Subroutine of getRow(). One pass over the mapped file that collects all headers and row positions.
+    uint64_t  nextDataLine    (uint64_t position, uint64_t & lineEnd);  ///< Skips headers and blank lines. @return Start of data line at or after position, or map->size if none. lineEnd receives its end, excluding any line terminator.
+    uint64_t  seekRow         (int64_t row, uint64_t & lineEnd);  ///< @return Start of given data row in mapped file.
+    void      stepRow         ();  ///< Moves next row into current, then parses the following one.
+    void      loadRow         (int64_t row);  ///< Parses given row and its successor. -1 means before first row.
+    void      getRowIndexed   (T row);  ///< subroutine of getRow()
+    void      openIndexed     ();  ///< Subroutine of getRow(). Maps file or sidecar at first access.
+    bool      readCache       ();
+    void      buildTable      ();  ///< Parses every row into tableData.
+    void      writeCache      ();  ///< Saves table to sidecar.
     void      getRow (T row); ///< subroutine of get()
     T         get    (T row, const String & column);
     T         get    (T row, T column);
@@ -367,22 +641,36 @@ public:
     int                                    columnsPrevious; ///< Number of columns written in previous cycle.
     bool                                   traceReceived;   ///< Indicates that at least one column was touched during the current cycle.
     T                                      t;
-
-    OutputHolder (const String & fileName);
+    bool                                   binary;          ///< mode; write column-packed binary blocks rather than text. Only takes effect if set before first row is written.
+    int                                    blockSize;       ///< mode; number of rows per binary block
+    int                                    blockRows;       ///< Number of rows buffered for current binary block.
+    std::vector<std::vector<float>>        blockColumns;    ///< Buffered values of current binary block, one vector per column.
+    int                                    queue;           ///< mode; capacity of queue for background writer, in rows. Binary output rounds this to whole blocks. 0 means write synchronously.
+    bool                                   drop;            ///< mode; when queue is full, discard rows rather than wait
+    AsyncWriter *                          writer;          ///< Created at first write when queue > 0. Once it exists, only the writer thread touches "out".
+
+    OutputHolder (const String & fileName, int64_t resume = -1);  ///< @param resume If non-negative, the file is cut back to this length and extended from there, rather than replaced. See Checkpoint.
     virtual ~OutputHolder ();
 
     void trace (T now);               ///< Subroutine for other trace() functions.
     void addMode (const char * mode); ///< Subroutine for other trace() functions.
+    int  getHandle (const String & column, const char * mode = 0);  ///< Finds or creates the named column. @return Index into columnValues, which remains valid for the life of this holder.
 #   ifdef n2a_FP
+    T         trace (T now, int & handle, const char * column, T value, int exponent, const char * mode = 0);  ///< Looks up column only when handle is negative, then stores its index in handle for subsequent calls.
     T         trace (T now, const String & column, T                 value, int exponent, const char * mode = 0);
     Matrix<T> trace (T now, const String & column, const Matrix<T> & A,     int exponent, const char * mode = 0);
     T         trace (T now, T              column, T                 value, int exponent, const char * mode = 0);
 #   else
+    T         trace (T now, int & handle, const char * column, T value,                   const char * mode = 0);  ///< Looks up column only when handle is negative, then stores its index in handle for subsequent calls.
     T         trace (T now, const String & column, T                 value,               const char * mode = 0);
     Matrix<T> trace (T now, const String & column, const Matrix<T> & A,                   const char * mode = 0);
     T         trace (T now, T              column, T                 value,               const char * mode = 0);
 #   endif
     void writeTrace ();
+    void writeRow    (const String & header, std::vector<float> & values);  ///< Subroutine of writeTrace(). Emits one text row, preceded by header line if not empty.
+    void writeHeader ();  ///< Subroutine of writeTrace(). Starts binary file.
+    void writeBlock  ();  ///< Subroutine of writeTrace(). Packs and writes buffered binary rows.
+    void writeBlock  (std::vector<std::vector<float>> & columns, int rows);  ///< Subroutine of writeBlock(). When async, runs on writer thread.
     void writeModes ();
 };
 template<class T> extern SHARED OutputHolder<T> * outputHelper (const String & fileName, OutputHolder<T> * oldHandle = 0);
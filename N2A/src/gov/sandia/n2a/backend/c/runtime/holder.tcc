@@ -18,6 +18,8 @@ the U.S. Government retains certain rights in this software.
 #define WIN32_LEAN_AND_MEAN
 
 #include <fstream>
+#include <algorithm>
+#include <limits>
 #include <stdlib.h>
 #include <time.h>
 #include <sys/stat.h>
@@ -46,8 +48,16 @@ the U.S. Government retains certain rights in this software.
    X(PFNGLGENBUFFERSPROC,               glGenBuffers               ) \
    X(PFNGLBINDBUFFERPROC,               glBindBuffer               ) \
    X(PFNGLBUFFERDATAPROC,               glBufferData               ) \
+   X(PFNGLDELETEBUFFERSPROC,            glDeleteBuffers            ) \
+   X(PFNGLMAPBUFFERRANGEPROC,           glMapBufferRange           ) \
+   X(PFNGLUNMAPBUFFERPROC,              glUnmapBuffer              ) \
+   X(PFNGLFENCESYNCPROC,                glFenceSync                ) \
+   X(PFNGLCLIENTWAITSYNCPROC,           glClientWaitSync           ) \
+   X(PFNGLDELETESYNCPROC,               glDeleteSync               ) \
    X(PFNGLVERTEXATTRIBPOINTERPROC,      glVertexAttribPointer      ) \
    X(PFNGLENABLEVERTEXATTRIBARRAYPROC,  glEnableVertexAttribArray  ) \
+   X(PFNGLVERTEXATTRIBDIVISORPROC,      glVertexAttribDivisor      ) \
+   X(PFNGLDRAWELEMENTSINSTANCEDPROC,    glDrawElementsInstanced    ) \
    X(PFNGLGENRENDERBUFFERSPROC,         glGenRenderbuffers         ) \
    X(PFNGLBINDRENDERBUFFERPROC,         glBindRenderbuffer         ) \
    X(PFNGLRENDERBUFFERSTORAGEPROC,      glRenderbufferStorage      ) \
@@ -207,7 +217,15 @@ IteratorSparse<T>::IteratorSparse (MatrixSparse<T> * A)
     this->value  = 0;
 
     columns = (*A->data).size ();
-    if (columns > 0) it = (*A->data)[0].begin ();
+    if (A->compressed ())
+    {
+        i   = 0;
+        end = columns > 0 ? A->csc->start[1] : 0;
+    }
+    else if (columns > 0)
+    {
+        it = (*A->data)[0].begin ();
+    }
 }
 
 template<class T>
@@ -215,6 +233,19 @@ bool
 IteratorSparse<T>::next ()
 {
     if (columns == 0) return false;
+    if (A->compressed ())
+    {
+        const typename MatrixSparse<T>::Compressed & C = *A->csc;
+        while (i >= end)
+        {
+            if (++this->column >= columns) return false;
+            end = C.start[this->column+1];
+        }
+        this->row   = C.row[i];
+        this->value = C.value[i];
+        i++;
+        return true;
+    }
     while (true)
     {
         if (it != (*A->data)[this->column].end ()) break;
@@ -258,7 +289,12 @@ getIterator (MatrixAbstract<T> * A)
 int
 convert (String input, int exponent)
 {
-    const double d = atof (input.c_str ());
+    return convert (atof (input.c_str ()), exponent);
+}
+
+int
+convert (double d, int exponent)
+{
     if (d == 0) return 0;
     if (std::isnan (d)) return NAN;
     bool negate = d < 0;
@@ -278,173 +314,450 @@ convert (String input, int exponent)
 
 #endif
 
+/**
+    Parses a matrix from text, either dense (bracketed rows) or the homegrown "Sparse" format.
+**/
 template<class T>
-MatrixInput<T> *
+MatrixAbstract<T> *
 #ifdef n2a_FP
-matrixHelper (const String & fileName, int exponent, MatrixInput<T> * oldHandle)
+readMatrixText (const String & fileName, int exponent)
 #else
-matrixHelper (const String & fileName,               MatrixInput<T> * oldHandle)
+readMatrixText (const String & fileName)
 #endif
 {
-    MatrixInput<T> * handle = (MatrixInput<T> *) SIMULATOR getHolder (fileName, oldHandle);
-    if (! handle)
+    MatrixAbstract<T> * result = 0;
+    std::ifstream ifs (fileName.c_str ());
+    if (! ifs.good ()) std::cerr << "Failed to open matrix file: " << fileName << std::endl;
+    String line;
+    getline (ifs, line);
+    if (line == "Sparse")  // Homegrown sparse matrix format
     {
-        handle = new MatrixInput<T> (fileName);
-        SIMULATOR holders.push_back (handle);
-
-        std::ifstream ifs (fileName.c_str ());
-        if (! ifs.good ()) std::cerr << "Failed to open matrix file: " << fileName << std::endl;
-        String line;
-        getline (ifs, line);
-        if (line == "Sparse")  // Homegrown sparse matrix format
+        // Collect elements into flat lists, then build compressed form in one pass.
+        // Input matrices are read-only, so the map form is never needed.
+        std::vector<int> rows;
+        std::vector<int> columns;
+        std::vector<T>   values;
+        while (ifs.good ())
         {
-            MatrixSparse<T> * S = new MatrixSparse<T>;
-            handle->A = S;
-            while (ifs.good ())
-            {
-                getline (ifs, line);
-                line.trim ();
-                if (line.empty ()) continue;
+            getline (ifs, line);
+            line.trim ();
+            if (line.empty ()) continue;
 
-                String value;
-                split (line, ",", value, line);
-                value.trim ();
-                int row = atoi (value.c_str ());
+            String value;
+            split (line, ",", value, line);
+            value.trim ();
+            int row = atoi (value.c_str ());
 
-                split (line, ",", value, line);
-                value.trim ();
-                int col = atoi (value.c_str ());
+            split (line, ",", value, line);
+            value.trim ();
+            int col = atoi (value.c_str ());
 
-                line.trim ();
+            line.trim ();
 #               ifdef n2a_FP
-                T element = convert (line, exponent);
+            T element = convert (line, exponent);
 #               else
-                T element = (T) atof (line.c_str ());
+            T element = (T) atof (line.c_str ());
 #               endif
 
-                if (element) S->set (row, col, element);
-            }
+            if (! element) continue;
+            rows   .push_back (row);
+            columns.push_back (col);
+            values .push_back (element);
         }
-        else  // Dense matrix
-        {
-            // Re-open file to ensure that we get the first line.
-            ifs.close ();
-            ifs.open (fileName.c_str ());
+        MatrixSparse<T> * S = new MatrixSparse<T>;
+        S->compress (0, 0, rows, columns, values);
+        result = S;
+    }
+    else  // Dense matrix
+    {
+        // Re-open file to ensure that we get the first line.
+        ifs.close ();
+        ifs.open (fileName.c_str ());
 
-            std::vector<std::vector<T>> temp;
-            std::vector<T> row;
-            int columns = 0;
-            bool transpose = false;
+        std::vector<std::vector<T>> temp;
+        std::vector<T> row;
+        int columns = 0;
+        bool transpose = false;
 
-            // Scan for opening "["
-            char token;
-            do
-            {
-                ifs.get (token);
-                if (token == '~') transpose = true;
-            }
-            while (token != '['  &&  ifs.good ());
+        // Scan for opening "["
+        char token;
+        do
+        {
+            ifs.get (token);
+            if (token == '~') transpose = true;
+        }
+        while (token != '['  &&  ifs.good ());
 
-            // Read rows until closing "]"
-            String buffer;
-            bool done = false;
-            while (ifs.good ()  &&  ! done)
-            {
-                ifs.get (token);
+        // Read rows until closing "]"
+        String buffer;
+        bool done = false;
+        while (ifs.good ()  &&  ! done)
+        {
+            ifs.get (token);
 
-                bool processLine = false;
-                switch (token)
-                {
-                    case '\r':
-                        break;  // ignore CR characters
-                    case ' ':
-                    case '\t':
-                        if (buffer.size () == 0) break;  // ignore leading whitespace (equivalent to trim)
-                    case ',':
-                        // Process element
-                        if (buffer.size () == 0)
-                        {
-                            row.push_back (0);
-                        }
-                        else
-                        {
+            bool processLine = false;
+            switch (token)
+            {
+                case '\r':
+                    break;  // ignore CR characters
+                case ' ':
+                case '\t':
+                    if (buffer.size () == 0) break;  // ignore leading whitespace (equivalent to trim)
+                case ',':
+                    // Process element
+                    if (buffer.size () == 0)
+                    {
+                        row.push_back (0);
+                    }
+                    else
+                    {
 #                           ifdef n2a_FP
-                            row.push_back (convert (buffer, exponent));
+                        row.push_back (convert (buffer, exponent));
 #                           else
-                            row.push_back ((T) atof (buffer.c_str ()));
+                        row.push_back ((T) atof (buffer.c_str ()));
 #                           endif
-                            buffer.clear ();
-                        }
-                        break;
-                    case ']':
-                        done = true;
-                    case ';':
-                    case '\n':
+                        buffer.clear ();
+                    }
+                    break;
+                case ']':
+                    done = true;
+                case ';':
+                case '\n':
+                {
+                    // Process any final element
+                    if (buffer.size () > 0)
                     {
-                        // Process any final element
-                        if (buffer.size () > 0)
-                        {
 #                           ifdef n2a_FP
-                            row.push_back (convert (buffer, exponent));
+                        row.push_back (convert (buffer, exponent));
 #                           else
-                            row.push_back ((T) atof (buffer.c_str ()));
+                        row.push_back ((T) atof (buffer.c_str ()));
 #                           endif
-                            buffer.clear ();
-                        }
-                        // Process line
-                        int c = row.size ();
-                        if (c > 0)
-                        {
-                            temp.push_back (row);  // Duplicates row, rather than saving a reference to it, so row can be reused.
-                            columns = std::max (columns, c);
-                            row.clear ();
-                        }
-                        break;
+                        buffer.clear ();
+                    }
+                    // Process line
+                    int c = row.size ();
+                    if (c > 0)
+                    {
+                        temp.push_back (row);  // Duplicates row, rather than saving a reference to it, so row can be reused.
+                        columns = std::max (columns, c);
+                        row.clear ();
                     }
-                    default:
-                        buffer += token;
+                    break;
                 }
+                default:
+                    buffer += token;
             }
+        }
 
-            // Assign elements to A.
-            const int rows = temp.size ();
-            if (transpose)
+        // Assign elements to A.
+        const int rows = temp.size ();
+        if (transpose)
+        {
+            Matrix<T> * A = new Matrix<T> (columns, rows);
+            result = A;
+            clear (*A);
+            for (int r = 0; r < rows; r++)
             {
-                Matrix<T> * A = new Matrix<T> (columns, rows);
-                handle->A = A;
-                clear (*A);
-                for (int r = 0; r < rows; r++)
+                std::vector<T> & row = temp[r];
+                for (int c = 0; c < row.size (); c++)
                 {
-                    std::vector<T> & row = temp[r];
-                    for (int c = 0; c < row.size (); c++)
-                    {
-                        (*A)(c,r) = row[c];
-                    }
+                    (*A)(c,r) = row[c];
                 }
             }
-            else
+        }
+        else
+        {
+            Matrix<T> * A = new Matrix<T> (rows, columns);
+            result = A;
+            clear (*A);
+            for (int r = 0; r < rows; r++)
             {
-                Matrix<T> * A = new Matrix<T> (rows, columns);
-                handle->A = A;
-                clear (*A);
-                for (int r = 0; r < rows; r++)
+                std::vector<T> & row = temp[r];
+                for (int c = 0; c < row.size (); c++)
                 {
-                    std::vector<T> & row = temp[r];
-                    for (int c = 0; c < row.size (); c++)
-                    {
-                        (*A)(r,c) = row[c];
-                    }
+                    (*A)(r,c) = row[c];
                 }
             }
         }
-        if (handle->A->rows () == 0  ||  handle->A->columns () == 0)
+    }
+    return result;
+}
+
+template<class T>
+uint32_t
+cacheType ()
+{
+    return sizeof (T) | (std::numeric_limits<T>::is_integer ? 0x100 : 0);
+}
+
+template<class T>
+void
+putCacheMatrix (InputCache & cache, const MatrixAbstract<T> * A)
+{
+    int rows    = A->rows ();
+    int columns = A->columns ();
+    if (A->classID () & MatrixSparseID)
+    {
+        const MatrixSparse<T> * S = (const MatrixSparse<T> *) A;
+        const typename MatrixSparse<T>::Compressed & C = *S->csc;
+        int count = C.row.size ();
+        cache.putInt (1);
+        cache.putInt (rows);
+        cache.putInt (columns);
+        cache.putInt (count);
+        cache.putArray (C.start.data (), (columns + 1) * sizeof (int));
+        cache.putArray (C.row  .data (), count * sizeof (int));
+        cache.putArray (C.value.data (), count * sizeof (T));
+        return;
+    }
+
+    cache.putInt (0);
+    cache.putInt (rows);
+    cache.putInt (columns);
+    std::vector<T> values;
+    values.reserve (rows * columns);
+    for (int c = 0; c < columns; c++)
+    {
+        for (int r = 0; r < rows; r++) values.push_back (A->get (r, c));
+    }
+    cache.putArray (values.data (), values.size () * sizeof (T));
+}
+
+template<class T>
+MatrixAbstract<T> *
+getCacheMatrix (InputCache & cache)
+{
+    int form    = cache.getInt ();
+    int rows    = cache.getInt ();
+    int columns = cache.getInt ();
+    if (rows < 0  ||  columns < 0) return 0;
+    if (form == 1)
+    {
+        int count = cache.getInt ();
+        const int * start = (const int *) cache.getArray ((columns + 1) * sizeof (int));
+        const int * row   = (const int *) cache.getArray (count * sizeof (int));
+        const T *   value = (const T *)   cache.getArray (count * sizeof (T));
+        if (! value  ||  count < 0) return 0;
+        MatrixSparse<T> * S = new MatrixSparse<T>;
+        S->rows_ = rows;
+        S->data->resize (columns);
+        typename MatrixSparse<T>::Compressed & C = *S->csc;
+        C.start.assign (start, start + columns + 1);
+        C.row  .assign (row,   row   + count);
+        C.value.assign (value, value + count);
+        return S;
+    }
+
+    const T * values = (const T *) cache.getArray ((size_t) rows * columns * sizeof (T));
+    if (! values) return 0;
+    Matrix<T> * A = new Matrix<T> (rows, columns);
+    memcpy ((T *) A->data, values, (size_t) rows * columns * sizeof (T));
+    return A;
+}
+
+/**
+    NumPy format: magic "\x93NUMPY", major and minor version bytes, little-endian header
+    length (2 bytes in version 1, 4 bytes after), then a Python dict literal giving
+    descr, fortran_order and shape, then the raw elements.
+**/
+template<class T>
+Matrix<T> *
+#ifdef n2a_FP
+readNpy (const String & fileName, int exponent)
+#else
+readNpy (const String & fileName)
+#endif
+{
+    n2a::MappedFile map;
+    if (! map.open (fileName.c_str ())  ||  map.size < 10  ||  memcmp (map.data, "\x93NUMPY", 6))
+    {
+        std::cerr << "Failed to open NumPy file: " << fileName << std::endl;
+        return 0;
+    }
+    const unsigned char * data = (const unsigned char *) map.data;
+    uint64_t start;
+    uint64_t length;
+    if (data[6] == 1)
+    {
+        length = data[8] | data[9] << 8;
+        start  = 10;
+    }
+    else
+    {
+        if (map.size < 12) return 0;
+        length = data[8] | data[9] << 8 | data[10] << 16 | (uint64_t) data[11] << 24;
+        start  = 12;
+    }
+    if (start + length > map.size) return 0;
+    String header;
+    header.assign (map.data + start, length);
+    start += length;
+
+    // Written by NumPy in a fixed style, so a simple scan is enough.
+    size_t p = header.find ("'descr'");
+    if (p == String::npos) return 0;
+    p = header.find_first_of ('\'', header.find_first_of (':', p) + 1);
+    size_t q = header.find_first_of ('\'', p + 1);
+    if (p == String::npos  ||  q == String::npos  ||  q - p < 4) return 0;
+    char order = header[p+1];
+    char kind  = header[p+2];
+    int  bytes = atoi (header.substr (p + 3, q - p - 3).c_str ());
+
+    bool fortran = false;
+    p = header.find ("'fortran_order'");
+    if (p != String::npos)
+    {
+        p = header.find_first_not_of (' ', header.find_first_of (':', p) + 1);
+        fortran =  p != String::npos  &&  header[p] == 'T';
+    }
+
+    std::vector<int> shape;
+    p = header.find ("'shape'");
+    if (p == String::npos) return 0;
+    p = header.find_first_of ('(', p);
+    q = header.find_first_of (')', p);
+    if (p == String::npos  ||  q == String::npos) return 0;
+    String dimensions = header.substr (p + 1, q - p - 1);
+    while (! dimensions.empty ())
+    {
+        String d;
+        split (dimensions, ",", d, dimensions);
+        d.trim ();
+        if (! d.empty ()) shape.push_back (atoi (d.c_str ()));
+    }
+    if (shape.size () > 2)
+    {
+        std::cerr << "NumPy file has more than 2 dimensions: " << fileName << std::endl;
+        return 0;
+    }
+    int rows    = shape.size () > 0 ? shape[0] : 1;
+    int columns = shape.size () > 1 ? shape[1] : 1;
+
+    bool supported =  order == '<'  ||  order == '|'  ||  order == '='  ||  bytes == 1;
+    supported =  supported  &&  (   (kind == 'f'  &&  (bytes == 4  ||  bytes == 8))
+                                 || ((kind == 'i'  ||  kind == 'u')  &&  (bytes == 1  ||  bytes == 2  ||  bytes == 4  ||  bytes == 8)));
+    uint64_t count = (uint64_t) rows * columns;
+    if (! supported  ||  start + count * bytes > map.size)
+    {
+        std::cerr << "Unsupported NumPy array: " << fileName << std::endl;
+        return 0;
+    }
+
+    const char * elements = map.data + start;
+    Matrix<T> * A = new Matrix<T> (rows, columns);
+    T * to = (T *) A->data;
+#   ifndef n2a_FP
+    if (kind == 'f'  &&  bytes == sizeof (T)  &&  (fortran  ||  columns == 1  ||  rows == 1))  // Already in our layout.
+    {
+        memcpy (to, elements, count * sizeof (T));
+        return A;
+    }
+#   endif
+    for (int c = 0; c < columns; c++)
+    {
+        for (int r = 0; r < rows; r++)
         {
-            std::cerr << "Ill-formed matrix in file: " << fileName << std::endl;
-            delete handle->A;
-            handle->A = new Matrix<T> (1, 1);
-            clear (*handle->A); // set to 0
+            uint64_t i = fortran ? (uint64_t) c * rows + r : (uint64_t) r * columns + c;
+            const char * e = elements + i * bytes;
+            double value;
+            if (kind == 'f')
+            {
+                if (bytes == 4) {float  v; memcpy (&v, e, 4); value = v;}
+                else            {double v; memcpy (&v, e, 8); value = v;}
+            }
+            else if (kind == 'i')
+            {
+                switch (bytes)
+                {
+                    case 1:  {int8_t  v; memcpy (&v, e, 1); value = v; break;}
+                    case 2:  {int16_t v; memcpy (&v, e, 2); value = v; break;}
+                    case 4:  {int32_t v; memcpy (&v, e, 4); value = v; break;}
+                    default: {int64_t v; memcpy (&v, e, 8); value = v;}
+                }
+            }
+            else
+            {
+                switch (bytes)
+                {
+                    case 1:  {uint8_t  v; memcpy (&v, e, 1); value = v; break;}
+                    case 2:  {uint16_t v; memcpy (&v, e, 2); value = v; break;}
+                    case 4:  {uint32_t v; memcpy (&v, e, 4); value = v; break;}
+                    default: {uint64_t v; memcpy (&v, e, 8); value = v;}
+                }
+            }
+#           ifdef n2a_FP
+            *to++ = convert (value, exponent);
+#           else
+            *to++ = (T) value;
+#           endif
         }
     }
+    return A;
+}
+
+template<class T>
+MatrixInput<T> *
+#ifdef n2a_FP
+matrixHelper (const String & fileName, int exponent, MatrixInput<T> * oldHandle)
+#else
+matrixHelper (const String & fileName,               MatrixInput<T> * oldHandle)
+#endif
+{
+    MatrixInput<T> * handle = (MatrixInput<T> *) SIMULATOR getHolder (fileName, oldHandle);
+    if (! handle)
+    {
+        bool useCache = SIMULATOR cacheInputs;
+        auto create = [&] () -> Holder *
+        {
+            MatrixInput<T> * result = new MatrixInput<T> (fileName);
+
+            if (fileName.ends_with (".npy"))
+            {
+#               ifdef n2a_FP
+                result->A = readNpy<T> (fileName, exponent);
+#               else
+                result->A = readNpy<T> (fileName);
+#               endif
+            }
+            else
+            {
+#               ifdef n2a_FP
+                InputCache sidecar (fileName, InputCache::MATRIX, cacheType<T> (), exponent);
+#               else
+                InputCache sidecar (fileName, InputCache::MATRIX, cacheType<T> ());
+#               endif
+                if (useCache  &&  sidecar.read ()) result->A = getCacheMatrix<T> (sidecar);
+                if (! result->A)
+                {
+#                   ifdef n2a_FP
+                    result->A = readMatrixText<T> (fileName, exponent);
+#                   else
+                    result->A = readMatrixText<T> (fileName);
+#                   endif
+                    if (useCache  &&  result->A)
+                    {
+                        putCacheMatrix (sidecar, result->A);
+                        sidecar.write ();
+                    }
+                }
+            }
+            if (! result->A  ||  result->A->rows () == 0  ||  result->A->columns () == 0)
+            {
+                std::cerr << "Ill-formed matrix in file: " << fileName << std::endl;
+                if (result->A) delete result->A;
+                result->A = new Matrix<T> (1, 1);
+                clear (*result->A); // set to 0
+            }
+            return result;
+        };
+#       ifdef n2a_FP
+        if (SIMULATOR shareInputs) handle = (MatrixInput<T> *) Holder::acquire ("MatrixInput|" + fileName + "|" + exponent, create);
+#       else
+        if (SIMULATOR shareInputs) handle = (MatrixInput<T> *) Holder::acquire ("MatrixInput|" + fileName, create);
+#       endif
+        else                       handle = (MatrixInput<T> *) create ();
+        SIMULATOR holders.push_back (handle);
+    }
     return handle;
 }
 
@@ -466,6 +779,14 @@ ImageInput<T>::ImageInput (const String & fileName)
     index       = 0;
     t           = (T) -INFINITY;
     framePeriod = 0;
+#   ifdef HAVE_FFMPEG
+    video        = 0;
+    prefetch     = 3;  // Enough to hide jitter in decode time without holding much memory.
+    prefetchQuit = false;
+    prefetchDone = false;
+    colorSpaces  = 0;
+    for (int i = 0; i < 4; i++) exponents[i] = 0;
+#   endif
 
     // Determine if fileName is a directory
     String entryName;
@@ -536,10 +857,128 @@ template<class T>
 ImageInput<T>::~ImageInput ()
 {
 #   ifdef HAVE_FFMPEG
+    if (prefetchThread.joinable ())
+    {
+        {
+            std::lock_guard<std::mutex> lock (prefetchMutex);
+            prefetchQuit = true;
+        }
+        prefetchWake.notify_all ();
+        prefetchThread.join ();
+    }
+    for (auto f : ready) delete f;
     if (video) delete video;
 #   endif
 }
 
+#ifdef HAVE_FFMPEG
+
+template<class T>
+void
+ImageInput<T>::prefetchLoop ()
+{
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock (prefetchMutex);
+            prefetchWake.wait (lock, [this] {return prefetchQuit  ||  (int) ready.size () < prefetch;});
+            if (prefetchQuit) return;
+        }
+
+        Frame * f = 0;
+        try
+        {
+            n2a::Image temp;
+            (*video) >> temp;
+            if (temp.width)
+            {
+                f = new Frame;
+                f->image.copyFrom (temp);  // temp is attached to decoder memory, which gets reused by the next read.
+                f->nextPTS = atof (video->get ("nextPTS").c_str ());
+                int spaces = colorSpaces;
+                for (int c = 0; c < 4; c++) if (spaces & (1 << c)) convert (f->image, c, f->channels, exponents[c]);
+            }
+        }
+        catch (const char * message)
+        {
+            std::cerr << "ImageInput: " << message << std::endl;
+            delete f;
+            f = 0;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock (prefetchMutex);
+            if (f) ready.push_back (f);
+            else   prefetchDone = true;
+        }
+        prefetchWake.notify_all ();
+        if (! f) return;
+    }
+}
+
+template<class T>
+typename ImageInput<T>::Frame *
+ImageInput<T>::nextFrame ()
+{
+    if (! prefetchThread.joinable ()  &&  ! prefetchDone) prefetchThread = std::thread (&ImageInput<T>::prefetchLoop, this);
+
+    std::unique_lock<std::mutex> lock (prefetchMutex);
+    prefetchWake.wait (lock, [this] {return ! ready.empty ()  ||  prefetchDone;});
+    if (ready.empty ()) return 0;
+    Frame * result = ready.front ();
+    ready.pop_front ();
+    lock.unlock ();
+    prefetchWake.notify_all ();
+    return result;
+}
+
+#endif
+
+template<class T>
+void
+ImageInput<T>::convert (const n2a::Image & source, int colorSpace, std::unordered_map<String,Matrix<T>> & channels, int exponent) const
+{
+    n2a::Image image2;
+    String c0, c1, c2;
+    switch (colorSpace)
+    {
+        case 0:
+            image2 = source * n2a::RGBFloat;
+            c0 = "R"; c1 = "G"; c2 = "B";
+            break;
+        case 1:
+            image2 = source * n2a::sRGBFloat;
+            c0 = "R'"; c1 = "G'"; c2 = "B'";
+            break;
+        case 2:
+            image2 = source * n2a::XYZFloat;
+            c0 = "X"; c1 = "Y"; c2 = "Z";
+            break;
+        case 3:
+            image2 = source * n2a::HSVFloat;
+            c0 = "H"; c1 = "S"; c2 = "V";
+            break;
+    }
+
+    n2a::Pointer p = ((n2a::PixelBufferPacked *) image2.buffer)->memory;
+
+#   ifdef n2a_FP
+    // Convert buffer to int.
+    float conversion = pow (2.0f, FP_MSB - exponent);
+    int count = source.width * source.height * 3;
+    n2a::Pointer q (count * sizeof (T));
+    float * from = (float *) p;
+    T *     to   = (T *)     q;
+    T *     end  = to + count;
+    while (to < end) *to++ = (T) (*from++ * conversion);
+    p = q;
+#   endif
+
+    channels.emplace (c0, Matrix<T> (p, 0, source.width, source.height, 3, 3 * source.width));
+    channels.emplace (c1, Matrix<T> (p, 1, source.width, source.height, 3, 3 * source.width));
+    channels.emplace (c2, Matrix<T> (p, 2, source.width, source.height, 3, 3 * source.width));
+}
+
 template<class T>
 Matrix<T>
 #ifdef n2a_FP
@@ -562,7 +1001,16 @@ ImageInput<T>::get (String channelName, T now)
                 t = now;
                 n2a::Image temp;
 #               ifdef HAVE_FFMPEG
-                if (video)
+                if (video  &&  prefetch > 0)
+                {
+                    if (Frame * f = nextFrame ())
+                    {
+                        image = f->image;
+                        channels.swap (f->channels);
+                        delete f;
+                    }
+                }
+                else if (video)
                 {
                     (*video) >> temp;
                 }
@@ -585,7 +1033,23 @@ ImageInput<T>::get (String channelName, T now)
             {
                 n2a::Image temp;
 #               ifdef HAVE_FFMPEG
-                if (video)
+                if (video  &&  prefetch > 0)
+                {
+                    if (Frame * f = nextFrame ())
+                    {
+                        image = f->image;
+                        channels.swap (f->channels);
+                        double nextPTS = f->nextPTS;
+                        delete f;
+                        if (framePeriod) nextPTS /= framePeriod;
+#                       ifdef n2a_FP
+                        t = (T) (nextPTS * pow (2.0, FP_MSB - Event<T>::exponent));
+#                       else
+                        t = nextPTS;
+#                       endif
+                    }
+                }
+                else if (video)
                 {
                     (*video) >> temp;
                     if (temp.width)
@@ -632,49 +1096,20 @@ ImageInput<T>::get (String channelName, T now)
         colorSpace  = 2;
         channelName = "Y";
     }
+#   ifdef HAVE_FFMPEG
+    // Tell the prefetch thread which conversions to do ahead of time.
+    colorSpaces |= 1 << colorSpace;
+#     ifdef n2a_FP
+    exponents[colorSpace] = exponent;
+#     endif
+#   endif
+#   ifndef n2a_FP
+    const int exponent = 0;
+#   endif
     auto it = channels.find (channelName);
     if (it == channels.end ())
     {
-        n2a::Image image2;
-        String c0, c1, c2;
-        switch (colorSpace)
-        {
-            case 0:
-                image2 = image * n2a::RGBFloat;
-                c0 = "R"; c1 = "G"; c2 = "B";
-                break;
-            case 1:
-                image2 = image * n2a::sRGBFloat;
-                c0 = "R'"; c1 = "G'"; c2 = "B'";
-                break;
-            case 2:
-                image2 = image * n2a::XYZFloat;
-                c0 = "X"; c1 = "Y"; c2 = "Z";
-                break;
-            case 3:
-                image2 = image * n2a::HSVFloat;
-                c0 = "H"; c1 = "S"; c2 = "V";
-                break;
-        }
-
-        n2a::Pointer p = ((n2a::PixelBufferPacked *) image2.buffer)->memory;
-
-#       ifdef n2a_FP
-        // Convert buffer to int.
-        float conversion = pow (2.0f, PP_MSB - exponent);
-        int count = image.width * image.height * 3;
-        Pointer q (count * sizeof (T));
-        float * from = (float *) p
-        T *     to   = (T *)     q;
-        T *     end  = to + count;
-        while (to < end) *to++ = (T) (*from++ * conversion);
-        p = q;
-#       endif
-
-        channels.emplace (c0, Matrix<T> (p, 0, image.width, image.height, 3, 3 * image.width));
-        channels.emplace (c1, Matrix<T> (p, 1, image.width, image.height, 3, 3 * image.width));
-        channels.emplace (c2, Matrix<T> (p, 2, image.width, image.height, 3, 3 * image.width));
-
+        convert (image, colorSpace, channels, exponent);
         it = channels.find (channelName);  // This should always succeed.
     }
     return it->second;
@@ -734,11 +1169,19 @@ ImageOutput<T>::ImageOutput (const String & fileName)
     lastWidth     = -1;
     lastHeight    = -1;
     sphereStep    = -1;
+    batchCount    = 0;
+    pboBytes      = 0;
+    readIssued    = 0;
+    readCollected = 0;
     projection.resize (4, 4);
     view      .resize (4, 4);
 #   endif
     clear    (nextProjection);
     identity (nextView);
+
+    async  = false;
+    drop   = false;
+    writer = 0;
 }
 
 template<class T>
@@ -748,17 +1191,23 @@ ImageOutput<T>::~ImageOutput ()
     try
     {
         writeImage ();
+#       ifdef HAVE_GL
+        finishReadback (0);
+#       endif
     }
     catch (...)
     {
         std::cerr << "WARNING: last image might have been lost" << std::endl;
     }
+    if (writer) delete writer;  // Finishes all queued frames.
 #   ifdef HAVE_FFMPEG
     if (video) delete video;
 #   endif
 
     // Clean up GL resources
 #   ifdef HAVE_GL
+    for (auto b : spare) delete b;
+    if (pboBytes) glDeleteBuffers (readbackDepth, pbo);
 #     ifdef _WIN32
     wglMakeCurrent (0, 0);
     if (rc) wglDeleteContext (rc);  // This frees all GL resources
@@ -851,20 +1300,26 @@ template<class T>
 void
 ImageOutput<T>::setClearColor (const Matrix<T> & color)
 {
-    bool hasAlpha = color.rows () > 3;
+    float c[4] = {0, 0, 0, 1};
+    int count = std::min (4, color.rows ());
+    for (int i = 0; i < count; i++)
+    {
+#       ifdef n2a_FP
+        c[i] = color[i] / (float) (1 << FP_MSB);  // Color channels have exponent 0.
+#       else
+        c[i] = color[i];
+#       endif
+        c[i] = std::min (1.0f, std::max (0.0f, c[i]));
+    }
 
-    uint32_t r =  std::min (1.0f, std::max (0.0f, color[0])) * 255;
-    uint32_t g =  std::min (1.0f, std::max (0.0f, color[1])) * 255;
-    uint32_t b =  std::min (1.0f, std::max (0.0f, color[2])) * 255;
-    uint32_t a = 0xFF;
-    if (hasAlpha) std::min (1.0f, std::max (0.0f, color[3])) * 255;
+    uint32_t r = c[0] * 255;
+    uint32_t g = c[1] * 255;
+    uint32_t b = c[2] * 255;
+    uint32_t a = c[3] * 255;
     clearColor = r << 24 | g << 16 | b << 8 | a;
 
 #   ifdef HAVE_GL
-    cv[0] = color[0];
-    cv[1] = color[1];
-    cv[2] = color[2];
-    cv[3] = hasAlpha ? color[3] : 1;
+    for (int i = 0; i < 4; i++) cv[i] = c[i];
 #   endif
 }
 
@@ -1012,17 +1467,167 @@ ImageOutput<T>::writeImage  ()
     haveData = hold;
     if (hold) return;  // Don't write every frame. hold is set false in dtor, so at least one frame will be written.
 
-#   ifdef HAVE_GL
-    int w = canvas.width;
-    int h = canvas.height;
-    if (have3D)  // Composite 2D and 3D outputs.
-    {
+    if (! opened) open ();
+    if (! dirCreated)
+    {
+        n2a::mkdirs (path);
+        dirCreated = true;
+    }
+
+#   ifdef HAVE_FFMPEG
+    if (video)
+    {
+        if (timeScale)
+        {
+#           ifdef n2a_FP
+            canvas.timestamp = timeScale * t / pow (2.0, FP_MSB - Event<T>::exponent);
+#           else
+            canvas.timestamp = timeScale * t;
+#           endif
+        }
+        else
+        {
+            canvas.timestamp = 1e6;  // Exceeds 95443, the threshold at which VideoOut stops using the timestamp as PTS.
+        }
+    }
+#   endif
+
+#   ifdef HAVE_GL
+    if (have3D)
+    {
+        // The 3D scene is read back through a ring of pixel buffers, so the GPU keeps rendering
+        // the next frame while this one is in transit. Compositing and encoding always happen
+        // on the writer thread in this mode.
         have3D = false;
-        uint32_t * pixelData = new uint32_t[w * h];
-        glReadPixels (0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, pixelData);  // always in bottom-up order
-        uint32_t * g   = pixelData + (h - 1) * w;  // beginning of last row, which is at the top on screen
-        uint32_t * c   = (uint32_t *) canvas.buffer->pixel (0, 0);
-        uint32_t * end = to + w * h;
+        if (! writer) writer = new AsyncWriter (readbackDepth + 1, drop);
+        drawBatches ();
+        startReadback ();
+        finishReadback (readbackDepth - 1);
+        return;
+    }
+    finishReadback (0);  // Preserve frame order. Any 3D frames still in flight go out ahead of this one.
+#   endif
+
+    if (async  &&  ! writer) writer = new AsyncWriter (4, drop);  // A few frames is enough to absorb jitter in encoding time.
+    if (writer)
+    {
+        // Hand the current buffer to the writer thread. next() will allocate a fresh one for the following frame.
+        n2a::Image frame (canvas);
+        canvas.detach ();
+        writer->push ([this, frame] () mutable
+        {
+#           ifdef HAVE_GL
+            compositeFrame (frame, 0);
+#           endif
+            writeFrame (frame);
+        });
+    }
+    else
+    {
+#       ifdef HAVE_GL
+        compositeFrame (canvas, 0);
+#       endif
+        writeFrame (canvas);
+    }
+}
+
+#ifdef HAVE_GL
+
+template<class T>
+void
+ImageOutput<T>::startReadback ()
+{
+    int w = canvas.width;
+    int h = canvas.height;
+    int bytes = w * h * 4;
+    if (bytes != pboBytes)
+    {
+        finishReadback (0);  // About to reallocate the buffers, so everything in flight must come out first.
+        if (! pboBytes) glGenBuffers (readbackDepth, pbo);
+        for (int i = 0; i < readbackDepth; i++)
+        {
+            glBindBuffer (GL_PIXEL_PACK_BUFFER, pbo[i]);
+            glBufferData (GL_PIXEL_PACK_BUFFER, bytes, 0, GL_STREAM_READ);
+        }
+        pboBytes = bytes;
+    }
+
+    int slot = readIssued % readbackDepth;
+    glBindBuffer (GL_PIXEL_PACK_BUFFER, pbo[slot]);
+    glReadPixels (0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, 0);  // With a pack buffer bound, the last argument is an offset, and the call returns without waiting for the GPU.
+    glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+    fence[slot] = glFenceSync (GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush ();  // Make sure the fence actually reaches the GPU, so a later wait can't hang.
+
+    pending[slot] = canvas;  // Timestamp is already set.
+    canvas.detach ();        // next() will allocate a fresh 2D layer.
+    readIssued++;
+}
+
+template<class T>
+void
+ImageOutput<T>::finishReadback (int keep)
+{
+    while (readIssued - readCollected > keep)
+    {
+        int slot = readCollected++ % readbackDepth;
+        glClientWaitSync (fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);  // Generally already signaled, since later frames have been submitted since.
+        glDeleteSync (fence[slot]);
+
+        n2a::Image frame (pending[slot]);
+        pending[slot].detach ();
+
+        std::vector<uint32_t> * scene = 0;
+        {
+            std::lock_guard<std::mutex> lock (spareMutex);
+            if (! spare.empty ())
+            {
+                scene = spare.back ();
+                spare.pop_back ();
+            }
+        }
+        if (! scene) scene = new std::vector<uint32_t>;
+        scene->resize (pboBytes / 4);  // No-op unless the frame size changed.
+
+        glBindBuffer (GL_PIXEL_PACK_BUFFER, pbo[slot]);
+        void * mapped = glMapBufferRange (GL_PIXEL_PACK_BUFFER, 0, pboBytes, GL_MAP_READ_BIT);
+        if (mapped)
+        {
+            memcpy (&(*scene)[0], mapped, pboBytes);
+            glUnmapBuffer (GL_PIXEL_PACK_BUFFER);
+        }
+        else
+        {
+            std::fill (scene->begin (), scene->end (), 0);  // Transparent, so 2D layer still comes through.
+        }
+        glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+
+        bool queued = writer->push ([this, frame, scene] () mutable
+        {
+            compositeFrame (frame, &(*scene)[0]);
+            writeFrame (frame);
+            std::lock_guard<std::mutex> lock (spareMutex);
+            spare.push_back (scene);
+        });
+        if (! queued)
+        {
+            std::lock_guard<std::mutex> lock (spareMutex);
+            spare.push_back (scene);
+        }
+    }
+}
+
+template<class T>
+void
+ImageOutput<T>::compositeFrame (n2a::Image & frame, uint32_t * scene)
+{
+    int w = frame.width;
+    int h = frame.height;
+    uint32_t * c   = (uint32_t *) frame.buffer->pixel (0, 0);
+    uint32_t * end = c + w * h;
+    if (scene)  // Composite 2D and 3D outputs.
+    {
+        uint32_t * g = scene + (h - 1) * w;  // beginning of last row, which is at the top on screen
         while (c < end)
         {
             uint32_t * rowEnd = c + w;
@@ -1037,7 +1642,6 @@ ImageOutput<T>::writeImage  ()
             }
             g -= 2 * w;
         }
-        delete[] pixelData;
     }
     else  // Fill background with clear color, since this won't be provided by the 3D scene.
     {
@@ -1047,49 +1651,29 @@ ImageOutput<T>::writeImage  ()
         uint32_t color = clearColor;
 #       endif
         uint32_t temp;
-        uint32_t * c   = (uint32_t *) canvas.buffer->pixel (0, 0);
-        uint32_t * end = to + w * h;
         while (c < end)
         {
-            uint32_t * rowEnd = c + w;
-            while (c < rowEnd)
-            {
-                temp = color;
-#               if BYTE_ORDER == LITTLE_ENDIAN
-                alphaBlendOE (*c, temp);
-#               else
-                alphaBlend (*c, temp);
-#               endif
-                *c++ = temp;
-            }
-            g -= 2 * w;
+            temp = color;
+#           if BYTE_ORDER == LITTLE_ENDIAN
+            alphaBlendOE (*c, temp);
+#           else
+            alphaBlend (*c, temp);
+#           endif
+            *c++ = temp;
         }
     }
-#   endif
+}
 
-    if (! opened) open ();
-    if (! dirCreated)
-    {
-        n2a::mkdirs (path);
-        dirCreated = true;
-    }
+#endif
 
+template<class T>
+void
+ImageOutput<T>::writeFrame (n2a::Image & frame)
+{
 #   ifdef HAVE_FFMPEG
     if (video)
     {
-        if (timeScale)
-        {
-#           ifdef n2a_FP
-            canvas.timestamp = timeScale * t / pow (2.0, FP_MSB - Event<T>::exponent);
-#           else
-            canvas.timestamp = timeScale * t;
-#           endif
-        }
-        else
-        {
-            canvas.timestamp = 1e6;  // Exceeds 95443, the threshold at which VideoOut stops using the timestamp as PTS.
-        }
-        (*video) << canvas;
+        (*video) << frame;
         return;
     }
 #   endif
@@ -1100,7 +1684,7 @@ ImageOutput<T>::writeImage  ()
     filename += format;
     try
     {
-        canvas.write (filename);
+        frame.write (filename);
     }
     catch (const char * message)  // Our own exception message, generally that file format was not found.
     {
@@ -1109,7 +1693,7 @@ ImageOutput<T>::writeImage  ()
         filename += frameCount;
         filename += ".";
         filename += format;
-        canvas.write (filename);
+        frame.write (filename);
     }
     frameCount++;
 }
@@ -1118,7 +1702,7 @@ ImageOutput<T>::writeImage  ()
 
 template<class T>
 bool
-ImageOutput<T>::next3D (const Matrix<T> & model, const Material & material)
+ImageOutput<T>::next3D ()
 {
     // Plaform-specific create context...
 #   ifdef _WIN32
@@ -1226,8 +1810,10 @@ ImageOutput<T>::next3D (const Matrix<T> & model, const Material & material)
         locVertexPosition = glGetAttribLocation (program, "vertexPosition");
         locVertexNormal   = glGetAttribLocation (program, "vertexNormal");
 
-        locMatrixModelView  = glGetUniformLocation (program, "modelViewMatrix");
-        locMatrixNormal     = glGetUniformLocation (program, "normalMatrix");
+        locInstanceModel = glGetAttribLocation (program, "instanceModel");
+        locInstanceColor = glGetAttribLocation (program, "instanceColor");
+
+        locMatrixView       = glGetUniformLocation (program, "viewMatrix");
         locMatrixProjection = glGetUniformLocation (program, "projectionMatrix");
 
         for (int i = 0; i < 8; i++) locLights.push_back (new LightLocation (program, i));
@@ -1291,6 +1877,7 @@ ImageOutput<T>::next3D (const Matrix<T> & model, const Material & material)
 
         // load uniforms
         glUniformMatrix4fv (locMatrixProjection, 1, GL_FALSE, projection.base ());
+        glUniformMatrix4fv (locMatrixView,       1, GL_FALSE, view      .base ());
 
         if (lights.empty ()) lights.emplace (0);
         int i = 0;
@@ -1301,17 +1888,12 @@ ImageOutput<T>::next3D (const Matrix<T> & model, const Material & material)
         }
         glUniform1i (locEnabled, i);
 
+        batchCount = 0;
         have3D = true;
     }
 
-    // Set up for current drawX() call.
-    // This involves setting a couple of uniform values.
-    Matrix<float> modelView = view * model;  // The transorm into eye space.
-    Matrix<float> normal = modelView;  // TODO: implement inversion, so we can create the inverse transpose of the modelView.
-    glUniformMatrix4fv (locMatrixModelView, 1, GL_FALSE, modelView.base ());
-    glUniformMatrix4fv (locMatrixNormal, 1, GL_FALSE, normal.base ());
-    material.setUniform (*this);
-
+    // Nothing is drawn here. Each drawX() call only records an instance in a batch.
+    // All the batches get submitted together by drawBatches() at the end of the frame.
     return true;
 }
 
@@ -1320,16 +1902,17 @@ T
 ImageOutput<T>::drawCube (T now, const Matrix<T> & model, const Material & material)
 {
     next (now);
-    if (! next3D (model, material)) return 0;
+    if (! next3D ()) return 0;
 
     // Set up vertex buffers, if needed.
-    std::map<String,GLuint>::iterator it = buffers.find ("cubeVertices");  // We really want contains() here, but don't want to depend on c++20.
-    getBuffer ("cubeVertices");
-    getBuffer ("cubeIndices");
-    if (it == buffers.end ())
+    bool created;
+    getBuffer ("cubeVertices", GL_ARRAY_BUFFER, created);
+    if (created)
     {
-        std::vector<GLfloat> vertices (144); // six faces, four vertices per face, 6 floats per vertex
-        std::vector<GLuint>  indices  (36);  // six faces, 2 triangles per face, 3 vertices per triangle
+        std::vector<GLfloat> vertices;
+        std::vector<GLuint>  indices;
+        vertices.reserve (144);  // six faces, four vertices per face, 6 floats per vertex
+        indices .reserve (36);   // six faces, 2 triangles per face, 3 vertices per triangle
 
         // All vertices are specified in CCW order.
 
@@ -1392,11 +1975,12 @@ ImageOutput<T>::drawCube (T now, const Matrix<T> & model, const Material & mater
             indices.push_back (v + 3);
         }
 
-        glBufferData (GL_ARRAY_BUFFER,         vertices.size () * sizeof (GLfloat), &vertices[0], GL_STATIC_DRAW);
-        glBufferData (GL_ELEMENT_ARRAY_BUFFER, indices .size () * sizeof (GLuint),  &indices [0], GL_STATIC_DRAW);
+        glBufferData (GL_ARRAY_BUFFER, vertices.size () * sizeof (GLfloat), &vertices[0], GL_STATIC_DRAW);
+        getBuffer ("cubeIndices", GL_ELEMENT_ARRAY_BUFFER, created);
+        glBufferData (GL_ELEMENT_ARRAY_BUFFER, indices.size () * sizeof (GLuint), &indices[0], GL_STATIC_DRAW);
     }
 
-    glDrawElements (GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
+    getBatch ("cubeVertices", "cubeIndices", 36, material).addInstance (model, material);
     return 0;
 }
 
@@ -1405,7 +1989,7 @@ T
 ImageOutput<T>::drawCylinder (T now, const Material & material, const MatrixFixed<T,3,1> & p1, T r1, const MatrixFixed<T,3,1> & p2, T r2, int steps, int stepsCap)
 {
     next (now);
-    if (! next3D (model, material)) return 0;
+    if (! next3D ()) return 0;
 
     if (p1 == p2) return 0;
     if (r2 < 0) r2 = r1;
@@ -1413,12 +1997,20 @@ ImageOutput<T>::drawCylinder (T now, const Material & material, const MatrixFixe
     if (steps < 3) steps = 3;
     if (stepsCap < 0) stepsCap = steps / 4;  // Integer division, so 3/4==0, 4/4==1, etc.
 
-    std::map<String,GLuint>::iterator it = buffers.find ("cylinderVertices");
-    getBuffer ("cylinderVertices");
-    getBuffer ("cylinderIndices");
-    int count = 2 + steps * (2 + stepsCap);  // estimate of vertex count, based on rounded caps at both ends
-    std::vector<GLfloat> vertices (count);
-    std::vector<GLuint>  indices  (count * 3);
+    // Each cylinder has its own shape, so rather than caching geometry, its vertices are
+    // generated directly in world space and appended to a streamed batch. The whole batch
+    // is uploaded once per frame, with a single identity instance.
+    Batch & batch = getBatch ("", "", 0, material);
+    if (batch.instances.empty ())
+    {
+        Matrix<float> I (4, 4);
+        identity (I);
+        batch.addInstance (I, material);
+    }
+    std::vector<GLfloat> & vertices = batch.streamVertices;
+    std::vector<GLuint>  & indices  = batch.streamIndices;
+    GLuint base0 = vertices.size () / 6;  // Index of first vertex belonging to this cylinder.
+    size_t first = indices.size ();       // First index belonging to this cylinder.
 
     // Construct a local coordinate frame.
     // This frame will be anchored first at one end (p1), then at the other (p2).
@@ -1656,11 +2248,8 @@ ImageOutput<T>::drawCylinder (T now, const Material & material, const MatrixFixe
         }
     }
 
-    count = indices.size ();
-    glBufferData (GL_ARRAY_BUFFER,         vertices.size () * sizeof (GLfloat), &vertices[0], GL_STATIC_DRAW);
-    glBufferData (GL_ELEMENT_ARRAY_BUFFER, count            * sizeof (GLuint),  &indices [0], GL_STATIC_DRAW);
-
-    glDrawElements (GL_TRIANGLES, count, GL_UNSIGNED_INT, 0);
+    // Indices above were generated relative to this cylinder, so shift them to its position in the stream.
+    if (base0) for (size_t i = first; i < indices.size (); i++) indices[i] += base0;
     return 0;
 }
 
@@ -1669,16 +2258,17 @@ T
 ImageOutput<T>::drawPlane (T now, const Matrix<T> & model, const Material & material)
 {
     next (now);
-    if (! next3D (model, material)) return 0;
+    if (! next3D ()) return 0;
 
     // Set up vertex buffers, if needed.
-    std::map<String,GLuint>::iterator it = buffers.find ("planeVertices");
-    getBuffer ("planeVertices");
-    getBuffer ("planeIndices");
-    if (it == buffers.end ())
+    bool created;
+    getBuffer ("planeVertices", GL_ARRAY_BUFFER, created);
+    if (created)
     {
-        std::vector<GLfloat> vertices (24); // four vertices, 6 floats per vertex
-        std::vector<GLuint>  indices  (6);  // 2 triangles, 3 vertices per triangle
+        std::vector<GLfloat> vertices;
+        std::vector<GLuint>  indices;
+        vertices.reserve (24);  // four vertices, 6 floats per vertex
+        indices .reserve (6);   // 2 triangles, 3 vertices per triangle
 
         float[] n = new float[3];
         n[0] = 0;
@@ -1699,11 +2289,12 @@ ImageOutput<T>::drawPlane (T now, const Matrix<T> & model, const Material & mate
         indices.push_back (2);
         indices.push_back (3);
 
-        glBufferData (GL_ARRAY_BUFFER,         vertices.size () * sizeof (GLfloat), &vertices[0], GL_STATIC_DRAW);
-        glBufferData (GL_ELEMENT_ARRAY_BUFFER, indices .size () * sizeof (GLuint),  &indices [0], GL_STATIC_DRAW);
+        glBufferData (GL_ARRAY_BUFFER, vertices.size () * sizeof (GLfloat), &vertices[0], GL_STATIC_DRAW);
+        getBuffer ("planeIndices", GL_ELEMENT_ARRAY_BUFFER, created);
+        glBufferData (GL_ELEMENT_ARRAY_BUFFER, indices.size () * sizeof (GLuint), &indices[0], GL_STATIC_DRAW);
     }
 
-    glDrawElements (GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    getBatch ("planeVertices", "planeIndices", 6, material).addInstance (model, material);
     return 0;
 }
 
@@ -1712,75 +2303,152 @@ T
 ImageOutput<T>::drawSphere (T now, const Matrix<T> & model, const Material & material, int steps)
 {
     next (now);
-    if (! next3D (model, material)) return 0;
+    if (! next3D ()) return 0;
 
     if (steps > 10) steps = 10;  // defensive limit. ~20 million faces (20 * 4^10)
+    if (steps < 0)  steps = 0;
 
-    getBuffer ("sphereVertices");
+    // Each subdivision only adds vertices, so a single vertex buffer serves every level.
+    // Each level has its own index buffer.
     char name[16];
-    if (sphereStep >= step)
-    {
-        sprintf (name, "sphereIndices%i", step);
-        getBuffer ();
-    }
-    else
+    if (sphereStep < steps)
     {
+        bool created;
         if (sphereStep < 0)
         {
             sphereStep = 0;
             icosphere (sphereVertices, sphereIndices);
-            getBuffer ("sphereIndices0");
+            getBuffer ("sphereIndices0", GL_ELEMENT_ARRAY_BUFFER, created);
             glBufferData (GL_ELEMENT_ARRAY_BUFFER, sphereIndices.size () * sizeof (GLuint), &sphereIndices[0], GL_STATIC_DRAW);
         }
-        while (sphereStep < step)
+        while (sphereStep < steps)
         {
             sphereStep++;
             icosphereSubdivide (sphereVertices, sphereIndices);
             sprintf (name, "sphereIndices%i", sphereStep);
+            getBuffer (name, GL_ELEMENT_ARRAY_BUFFER, created);
             glBufferData (GL_ELEMENT_ARRAY_BUFFER, sphereIndices.size () * sizeof (GLuint), &sphereIndices[0], GL_STATIC_DRAW);
         }
-        glBufferData (GL_ARRAY_BUFFER, sphereVertices.size () * sizeof (GLfloat), &sphereVertices[0], GL_STATIC_DRAW);  // This only needs to be uploaded once, since it each step encompasses all the previous ones.
+        getBuffer ("sphereVertices", GL_ARRAY_BUFFER, created);
+        glBufferData (GL_ARRAY_BUFFER, sphereVertices.size () * sizeof (GLfloat), &sphereVertices[0], GL_STATIC_DRAW);  // Re-upload, since it gained vertices. Batches using lower levels remain valid.
     }
 
-    int count = 60 * pow (4, step);  // 20 triangles in base icosphere * 3 vertices per triangle * 4^subdivisions
-    glDrawElements (GL_TRIANGLES, count, GL_UNSIGNED_INT, 0);
+    sprintf (name, "sphereIndices%i", steps);
+    int count = 60 * pow (4, steps);  // 20 triangles in base icosphere * 3 vertices per triangle * 4^subdivisions
+    getBatch ("sphereVertices", name, count, material).addInstance (model, material);
     return 0;
 }
 
 template<class T>
-void
-ImageOutput<T>::getBuffer (String name, bool vertices)
+Batch &
+ImageOutput<T>::getBatch (const String & vertices, const String & indices, GLsizei count, const Material & material)
 {
-    std::map<String,GLuint>::iterator it = buffers.find (name);
-    bool found =  it != buffers.end ();
-
-    GLuint result;
-    if (found)
+    // Linear search is fine, since a frame generally has only a handful of distinct shapes and surfaces.
+    for (int i = 0; i < batchCount; i++)
     {
-        result = it.second;
+        Batch & b = batches[i];
+        if (b.vertices == vertices  &&  b.indices == indices  &&  b.material.sameSurface (material)) return b;
     }
-    else
+
+    if (batchCount >= batches.size ()) batches.resize (batchCount + 1);
+    Batch & result = batches[batchCount++];
+    result.vertices = vertices;
+    result.indices  = indices;
+    result.count    = count;
+    result.material = material;
+    result.instances     .clear ();  // Retains capacity from previous frames.
+    result.streamVertices.clear ();
+    result.streamIndices .clear ();
+    return result;
+}
+
+template<class T>
+void
+ImageOutput<T>::drawBatches ()
+{
+    if (! batchCount) return;
+
+    // Upload all per-instance data in one shot. Each batch then points at its own range.
+    instanceData.clear ();
+    for (int i = 0; i < batchCount; i++)
     {
-        glGenBuffers (1, &result);
-        buffers[name] = result;
+        std::vector<GLfloat> & v = batches[i].instances;
+        instanceData.insert (instanceData.end (), v.begin (), v.end ());
     }
+    bool created;
+    GLuint instanceBuffer = getBuffer ("instances", GL_ARRAY_BUFFER, created);
+    glBufferData (GL_ARRAY_BUFFER, instanceData.size () * sizeof (GLfloat), &instanceData[0], GL_STREAM_DRAW);
 
-    if (vertices)
+    const GLsizei stride = 20 * sizeof (GLfloat);
+    size_t offset = 0;  // in floats
+    for (int i = 0; i < batchCount; i++)
     {
-        glBindBuffer (GL_ARRAY_BUFFER, result);
-        if (found) return result;
+        Batch & b = batches[i];
+        GLsizei instanceCount = b.instances.size () / 20;
 
+        // Geometry
+        GLsizei count = b.count;
+        if (b.vertices.empty ())  // streamed
+        {
+            count = b.streamIndices.size ();
+            if (count == 0)
+            {
+                offset += b.instances.size ();
+                continue;
+            }
+            getBuffer ("streamVertices", GL_ARRAY_BUFFER, created);
+            glBufferData (GL_ARRAY_BUFFER, b.streamVertices.size () * sizeof (GLfloat), &b.streamVertices[0], GL_STREAM_DRAW);
+            getBuffer ("streamIndices", GL_ELEMENT_ARRAY_BUFFER, created);
+            glBufferData (GL_ELEMENT_ARRAY_BUFFER, count * sizeof (GLuint), &b.streamIndices[0], GL_STREAM_DRAW);
+            getBuffer ("streamVertices", GL_ARRAY_BUFFER, created);
+        }
+        else
+        {
+            getBuffer (b.indices,  GL_ELEMENT_ARRAY_BUFFER, created);
+            getBuffer (b.vertices, GL_ARRAY_BUFFER,         created);
+        }
+        // Attribute pointers capture the buffer bound at the time they are set, so must be redone for each batch.
         glVertexAttribPointer (locVertexPosition, 3, GL_FLOAT, GL_FALSE, 6 * sizeof (GLfloat), 0);
         glEnableVertexAttribArray (locVertexPosition);
-
-        glVertexAttribPointer (locVertexNormal, 3, GL_FLOAT, GL_FALSE, 6 * sizeof (GLfloat), (void *) (3 * sizeof (GLfloat)));
+        glVertexAttribPointer (locVertexNormal,   3, GL_FLOAT, GL_FALSE, 6 * sizeof (GLfloat), (void *) (3 * sizeof (GLfloat)));
         glEnableVertexAttribArray (locVertexNormal);
+
+        // Instances
+        glBindBuffer (GL_ARRAY_BUFFER, instanceBuffer);
+        for (int c = 0; c < 4; c++)
+        {
+            glVertexAttribPointer (locInstanceModel + c, 4, GL_FLOAT, GL_FALSE, stride, (void *) ((offset + 4 * c) * sizeof (GLfloat)));
+            glEnableVertexAttribArray (locInstanceModel + c);
+            glVertexAttribDivisor (locInstanceModel + c, 1);
+        }
+        glVertexAttribPointer (locInstanceColor, 4, GL_FLOAT, GL_FALSE, stride, (void *) ((offset + 16) * sizeof (GLfloat)));
+        glEnableVertexAttribArray (locInstanceColor);
+        glVertexAttribDivisor (locInstanceColor, 1);
+
+        b.material.setUniform ();
+        glDrawElementsInstanced (GL_TRIANGLES, count, GL_UNSIGNED_INT, 0, instanceCount);
+        offset += b.instances.size ();
+    }
+    batchCount = 0;
+}
+
+template<class T>
+GLuint
+ImageOutput<T>::getBuffer (const String & name, GLenum target, bool & created)
+{
+    GLuint result;
+    std::map<String,GLuint>::iterator it = buffers.find (name);
+    created =  it == buffers.end ();
+    if (created)
+    {
+        glGenBuffers (1, &result);
+        buffers[name] = result;
     }
-    else  // indices
+    else
     {
-        glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, result);
+        result = it->second;
     }
-
+    glBindBuffer (target, result);
     return result;
 }
 
@@ -1790,10 +2458,19 @@ template<class T>
 ImageOutput<T> *
 imageOutputHelper (const String & fileName, ImageOutput<T> * oldHandle)
 {
-    ImageOutput<T> * handle = (ImageOutput<T> *) SIMULATOR getHolder (fileName, oldHandle);
+    const String * path = &fileName;
+    String redirected;
+    if (! SIMULATOR outputDirectory.empty ())
+    {
+        if (fileName.empty ()) redirected = SIMULATOR outputDirectory + "/";  // Default frame names, inside the directory.
+        else                   redirected = SIMULATOR outputPath (fileName);
+        path = &redirected;
+    }
+
+    ImageOutput<T> * handle = (ImageOutput<T> *) SIMULATOR getHolder (*path, oldHandle);
     if (! handle)
     {
-        handle = new ImageOutput<T> (fileName);
+        handle = new ImageOutput<T> (*path);
         SIMULATOR holders.push_back (handle);
     }
     return handle;
@@ -1806,16 +2483,56 @@ template<class T>
 Mfile<T>::Mfile (const String & fileName)
 :   Holder (fileName)
 {
-    doc = new n2a::MDoc (fileName.c_str ());
+    doc        = new n2a::MDoc (fileName.c_str ());  // Does not read file until first access.
+    cache      = false;
+    cacheDirty = false;
 }
 
 template<class T>
 Mfile<T>::~Mfile ()
 {
+    if (cacheDirty) writeCache ();
     if (doc) delete doc;
     for (auto m : matrices) if (m.second) delete m.second;
 }
 
+template<class T>
+void
+Mfile<T>::readCache ()
+{
+    InputCache sidecar (fileName, InputCache::TREE, cacheType<T> ());
+    if (! sidecar.read ()) return;
+    int count = sidecar.getInt ();
+    for (int i = 0; i < count; i++)
+    {
+        String key      = sidecar.getString ();
+        int    exponent = sidecar.getInt ();
+        MatrixAbstract<T> * A = getCacheMatrix<T> (sidecar);
+        if (! A) break;
+        matrices [key] = A;
+        exponents[key] = exponent;
+    }
+}
+
+template<class T>
+void
+Mfile<T>::writeCache ()
+{
+    InputCache sidecar (fileName, InputCache::TREE, cacheType<T> ());
+    int count = 0;
+    for (auto & m : matrices) if (m.second) count++;
+    sidecar.putInt (count);
+    for (auto & m : matrices)
+    {
+        if (! m.second) continue;
+        sidecar.putString (m.first);
+        sidecar.putInt (exponents[m.first]);
+        putCacheMatrix (sidecar, m.second);
+    }
+    sidecar.write ();
+    cacheDirty = false;
+}
+
 std::vector<String>
 keyPath (const std::vector<String> & path)
 {
@@ -1844,7 +2561,16 @@ Mfile<T>::getMatrix (const std::vector<String> & path, int exponent)
 Mfile<T>::getMatrix (const std::vector<String> & path)
 #endif
 {
+    std::unique_lock<std::mutex> lock (mutex, std::defer_lock);
+    if (! sharedKey.empty ()) lock.lock ();
+
     String key = join ("/", path);
+#   ifdef n2a_FP
+    // The same path may be requested at several exponents. Each gets its own entry,
+    // since earlier callers may still hold the matrix built for their exponent.
+    key += "|";
+    key += std::to_string (exponent).c_str ();
+#   endif
     MatrixAbstract<T> * A = matrices[key];  // If key does not exist, then the c++ standard promises that the inserted value will be zero-initialized.
     if (A) return A;
 
@@ -1864,7 +2590,12 @@ Mfile<T>::getMatrix (const std::vector<String> & path)
 #           endif
         }
     }
+    S->compress ();
     matrices[key] = S;
+#   ifdef n2a_FP
+    exponents[key] = exponent;
+#   endif
+    if (cache) cacheDirty = true;
     return S;
 }
 
@@ -1875,7 +2606,21 @@ MfileHelper (const String & fileName, Mfile<T> * oldHandle)
     Mfile<T> * handle = (Mfile<T> *) SIMULATOR getHolder (fileName, oldHandle);
     if (! handle)
     {
-        handle = new Mfile<T> (fileName);
+        bool useCache = SIMULATOR cacheInputs;
+        bool share    = SIMULATOR shareInputs;
+        auto create = [&] () -> Holder *
+        {
+            Mfile<T> * result = new Mfile<T> (fileName);
+            if (useCache)
+            {
+                result->cache = true;
+                result->readCache ();
+            }
+            if (share) result->doc->load ();  // Generated code reads doc directly, so it must not change once other threads can see it.
+            return result;
+        };
+        if (share) handle = (Mfile<T> *) Holder::acquire ("Mfile|" + fileName, create);
+        else       handle = (Mfile<T> *) create ();
         SIMULATOR holders.push_back (handle);
     }
     return handle;
@@ -1884,6 +2629,24 @@ MfileHelper (const String & fileName, Mfile<T> * oldHandle)
 
 // InputHolder ---------------------------------------------------------------
 
+template<class T>
+InputTable<T>::InputTable (const String & fileName)
+:   Holder (fileName)
+{
+    columnCount = 0;
+    timeColumn  = 0;
+    delimiter   = ' ';
+    rowCount    = 0;
+    table       = 0;
+    sidecar     = 0;
+}
+
+template<class T>
+InputTable<T>::~InputTable ()
+{
+    if (sidecar) delete sidecar;
+}
+
 template<class T>
 InputHolder<T>::InputHolder (const String & fileName)
 :   Holder (fileName)
@@ -1909,6 +2672,17 @@ InputHolder<T>::InputHolder (const String & fileName)
 #   else
     epsilon          = (T) 1e-6;
 #   endif
+    indexed          = false;
+    map              = 0;
+    rowCount         = 0;
+    currentRow       = -1;
+    nextPosition     = 0;
+    cache            = false;
+    table            = 0;
+    sidecar          = 0;
+    tabulate         = false;
+    share            = false;
+    shared           = 0;
 
     if (fileName.empty ()) in = &std::cin;
     else                   in = new std::ifstream (fileName.c_str ());
@@ -1918,6 +2692,9 @@ template<class T>
 InputHolder<T>::~InputHolder ()
 {
     if (in  &&  in != &std::cin) delete in;
+    if (map)           SharedMappedFile::release (map);
+    if (sidecar)       delete sidecar;
+    if (shared)        Holder::release (shared);
     if (currentValues) delete[] currentValues;
     if (nextValues   ) delete[] nextValues;
     if (A)             delete A;
@@ -1925,208 +2702,269 @@ InputHolder<T>::~InputHolder ()
 
 template<class T>
 void
-InputHolder<T>::getRow (T row)
+InputHolder<T>::detectDelimiter (const char * begin, const char * end)
 {
-    while (true)
+    if (delimiterSet) return;
+    bool tab   = false;
+    bool comma = false;
+    bool other = false;
+    for (const char * c = begin; c < end; c++)
     {
-        // Read and process next line
-        if (std::isnan (nextLine)  &&  in->good ())
+        if      (*c == '\t') tab   = true;
+        else if (*c == ',' ) comma = true;
+        else if (*c != ' ' ) other = true;
+    }
+    if      (tab  ) delimiter = '\t'; // highest precedence
+    else if (comma) delimiter = ',';
+    // space character is lowest precedence
+    delimiterSet =  delimiter != ' '  ||  other;
+}
+
+template<class T>
+bool
+InputHolder<T>::parseHeader (const char * begin, const char * end)
+{
+    int tempCount = 1;
+    for (const char * c = begin; c < end; c++) if (*c == delimiter) tempCount++;
+    columnCount = std::max (columnCount, tempCount);
+
+    // Decide whether this is a header row or a value row
+    char firstCharacter = *begin;
+    if (firstCharacter >= '-'  &&  firstCharacter != '/'  &&  firstCharacter <= '9') return false;
+
+    // Not a number, so must be column header.
+    // Add any column headers. Generally, these will only be new headers as of this cycle.
+    int index = 0;
+    const char * i = begin;
+    while (i < end)
+    {
+        const char * j = std::find (i, end, delimiter);
+        String header;
+        header.assign (i, j - i);
+        header.trim ();
+        int last = header.size () - 1;
+        if (header[0] == '"'  &&  header[last] == '"') header = header.substr (1, last - 1);
+        if (j > i) columnMap.emplace (header, index);
+        i = j + 1;
+        index++;
+    }
+
+    // Make column count accessible to other code before first row of data is read.
+    if (! A)
+    {
+        if (time) currentLine = -INFINITY;
+        if (currentCount != columnCount)
         {
-            String line;
-            getline (*in, line);
-            if (! line.empty ())
+            delete[] currentValues;
+            currentValues = new T[columnCount];
+            currentCount = columnCount;
+            memset (&currentValues[0], 0, columnCount * sizeof (T));
+        }
+    }
+
+    // Select time column
+    if (time  &&  ! timeColumnSet)
+    {
+        int timeMatch = 0;
+        for (auto it : columnMap)
+        {
+            int potentialMatch = 0;
+            String header = it.first.toLowerCase ();
+            if      (header == "t"   ) potentialMatch = 2;
+            else if (header == "date") potentialMatch = 2;
+            else if (header == "time") potentialMatch = 3;
+            else if (header == "$t"  ) potentialMatch = 4;
+            else if (header.find ("time") != String::npos) potentialMatch = 1;
+            if (potentialMatch > timeMatch)
             {
-                if (! delimiterSet)
-                {
-                    if      (line.find_first_of ('\t') != String::npos) delimiter = '\t'; // highest precedence
-                    else if (line.find_first_of (',' ) != String::npos) delimiter = ',';
-                    // space character is lowest precedence
-                    delimiterSet =  delimiter != ' '  ||  line.find_first_not_of (' ') != String::npos;
-                }
+                timeMatch = potentialMatch;
+                timeColumn = it.second;
+            }
+        }
+        timeColumnSet = true;
+    }
 
-                int tempCount = 1;
-                for (auto it : line) if (it == delimiter) tempCount++;
-                columnCount = std::max (columnCount, tempCount);
+    return true;
+}
 
-                // Decide whether this is a header row or a value row
-                char firstCharacter = line[0];
-                if (firstCharacter < '-'  ||  firstCharacter == '/'  ||  firstCharacter > '9')  // not a number, so must be column header
-                {
-                    // Add any column headers. Generally, these will only be new headers as of this cycle.
-                    int index = 0;
-                    int i = 0;
-                    int end = line.size ();
-                    while (i < end)
-                    {
-                        int j;
-                        j = line.find_first_of (delimiter, i);
-                        if (j == String::npos) j = end;
-                        String header = line.substr (i, j - i);
-                        header.trim ();
-                        int last = header.size () - 1;
-                        if (header[0] == '"'  &&  header[last] == '"') header = header.substr (1, last - 1);
-                        if (j > i) columnMap.emplace (header, index);
-                        i = j + 1;
-                        index++;
-                    }
+template<class T>
+T
+InputHolder<T>::parseField (const char * begin, const char * end, int index)
+{
+    if (end == begin) return 0;
 
-                    // Make column count accessible to other code before first row of data is read.
-                    if (! A)
-                    {
-                        if (time) currentLine = -INFINITY;
-                        if (currentCount != columnCount)
-                        {
-                            delete[] currentValues;
-                            currentValues = new T[columnCount];
-                            currentCount = columnCount;
-                            memset (&currentValues[0], 0, columnCount * sizeof (T));
-                        }
-                    }
+    // Special case for ISO 8601 formatted date
+    // Convert date to Unix time. Dates before epoch will be negative.
+    if (index == timeColumn)
+    {
+        int year   = 1970;  // will be adjusted below for mktime()
+        int month  = 1;     // ditto
+        int day    = 1;
+        int hour   = 0;
+        int minute = 0;
+        int second = 0;
+
+        auto digits = [begin] (int start, int count)
+        {
+            int result = 0;
+            for (const char * c = begin + start; count > 0; c++, count--)
+            {
+                if (*c < '0'  ||  *c > '9') break;
+                result = result * 10 + *c - '0';
+            }
+            return result;
+        };
 
-                    // Select time column
-                    if (time  &&  ! timeColumnSet)
+        bool valid = false;
+        int length = end - begin;
+        if (length == 4)
+        {
+            year  = digits (0, 4);
+            valid =  year < 3000  &&  year > 1000;
+        }
+        else if (length >= 7  &&  begin[4] == '-')
+        {
+            valid = true;
+            year  = digits (0, 4);
+            month = digits (5, 2);
+            if (length >= 10  &&  begin[7] == '-')
+            {
+                day = digits (8, 2);
+                if (length >= 13  &&  begin[10] == 'T')
+                {
+                    hour = digits (11, 2);
+                    if (length >= 16  &&  begin[13] == ':')
                     {
-                        int timeMatch = 0;
-                        for (auto it : columnMap)
+                        minute = digits (14, 2);
+                        if (length >= 19  &&  begin[16] == ':')
                         {
-                            int potentialMatch = 0;
-                            String header = it.first.toLowerCase ();
-                            if      (header == "t"   ) potentialMatch = 2;
-                            else if (header == "date") potentialMatch = 2;
-                            else if (header == "time") potentialMatch = 3;
-                            else if (header == "$t"  ) potentialMatch = 4;
-                            else if (header.find ("time") != String::npos) potentialMatch = 1;
-                            if (potentialMatch > timeMatch)
-                            {
-                                timeMatch = potentialMatch;
-                                timeColumn = it.second;
-                            }
+                            second = digits (17, 2);
                         }
-                        timeColumnSet = true;
                     }
-
-                    continue;  // back to top of outer while loop, skipping any other processing below
                 }
+            }
+        }
 
-                if (nextCount < columnCount)
-                {
-                    if (nextValues) delete[] nextValues;
-                    nextValues = new T[columnCount];
-                    nextCount = columnCount;
-                }
-                int index = 0;
-                int i = 0;
-                for (; index < tempCount; index++)
-                {
-                    int j;
-                    j = line.find_first_of (delimiter, i);
-                    if (j == String::npos) j = line.size ();
-                    if (j == i)
-                    {
-                        nextValues[index] = 0;
-                    }
-                    else  // j > i
-                    {
-                        String field = line.substr (i, j - i);
+        if (valid)
+        {
+            month -= 1;
+            year  -= 1900;
+
+            struct tm date;
+            date.tm_isdst = 0;  // time is strictly UTC, with no DST
+            // ignoring tm_wday and tm_yday, as mktime() doesn't do anything with them
+
+            // Hack to adjust for mktime() that can't handle dates before posix epoch (1970/1/1).
+            // This simple hack only works for years after ~1900.
+            // Solution comes from https://bugs.php.net/bug.php?id=17123
+            // Alternate solution would be to implement a simple mktime() right here.
+            // Since we don't care about DST or timezones, all it has to do is handle Gregorion leap-years.
+            time_t offset = 0;
+            if (year <= 70)  // Yes, that includes 1970 itself.
+            {
+                // The referenced post suggested 56 years, which apparently makes week days align correctly.
+                year += 56;
+                date.tm_year = 70 + 56;
+                date.tm_mon  = 0;
+                date.tm_mday = 1;
+                date.tm_hour = 0;
+                date.tm_min  = 0;
+                date.tm_sec  = 0;
+                offset = mktime (&date);
+            }
 
-                        // Special case for ISO 8601 formatted date
-                        // Convert date to Unix time. Dates before epoch will be negative.
-                        bool valid = false;
-                        if (index == timeColumn)
-                        {
-                            int year   = 1970;  // will be adjusted below for mktime()
-                            int month  = 1;     // ditto
-                            int day    = 1;
-                            int hour   = 0;
-                            int minute = 0;
-                            int second = 0;
-
-                            int length = field.size ();
-                            if (length == 4)
-                            {
-                                year  = atoi (field.c_str ());
-                                valid =  year < 3000  &&  year > 1000;
-                            }
-                            else if (length >= 7  &&  field[4] == '-')
-                            {
-                                valid = true;
-                                year  = atoi (field.substr (0, 4).c_str ());
-                                month = atoi (field.substr (5, 2).c_str ());
-                                if (length >= 10  &&  field[7] == '-')
-                                {
-                                    day = atoi (field.substr (8, 2).c_str ());
-                                    if (length >= 13  &&  field[10] == 'T')
-                                    {
-                                        hour = atoi (field.substr (11, 2).c_str ());
-                                        if (length >= 16  &&  field[13] == ':')
-                                        {
-                                            minute = atoi (field.substr (14, 2).c_str ());
-                                            if (length >= 19  &&  field[16] == ':')
-                                            {
-                                                second = atoi (field.substr (17, 2).c_str ());
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-
-                            if (valid)
-                            {
-                                month -= 1;
-                                year  -= 1900;
-
-                                struct tm date;
-                                date.tm_isdst = 0;  // time is strictly UTC, with no DST
-                                // ignoring tm_wday and tm_yday, as mktime() doesn't do anything with them
-
-                                // Hack to adjust for mktime() that can't handle dates before posix epoch (1970/1/1).
-                                // This simple hack only works for years after ~1900.
-                                // Solution comes from https://bugs.php.net/bug.php?id=17123
-                                // Alternate solution would be to implement a simple mktime() right here.
-                                // Since we don't care about DST or timezones, all it has to do is handle Gregorion leap-years.
-                                time_t offset = 0;
-                                if (year <= 70)  // Yes, that includes 1970 itself.
-                                {
-                                    // The referenced post suggested 56 years, which apparently makes week days align correctly.
-                                    year += 56;
-                                    date.tm_year = 70 + 56;
-                                    date.tm_mon  = 0;
-                                    date.tm_mday = 1;
-                                    date.tm_hour = 0;
-                                    date.tm_min  = 0;
-                                    date.tm_sec  = 0;
-                                    offset = mktime (&date);
-                                }
-
-                                date.tm_year = year;
-                                date.tm_mon  = month;
-                                date.tm_mday = day;
-                                date.tm_hour = hour;
-                                date.tm_min  = minute;
-                                date.tm_sec  = second;
-
-                                nextValues[index] = mktime (&date) - offset;  // Unix time; an integer, so exponent=MSB
-#                               ifdef n2a_FP
-                                // Need to put value in expected exponent.
-                                int shift = FP_MSB - (time ? Event<T>::exponent : exponent);
-                                if (shift >= 0) nextValues[index] <<= shift;
-                                else            nextValues[index] >>= -shift;
-#                               endif
-                            }
-                        }
+            date.tm_year = year;
+            date.tm_mon  = month;
+            date.tm_mday = day;
+            date.tm_hour = hour;
+            date.tm_min  = minute;
+            date.tm_sec  = second;
 
-                        if (! valid)  // Not a date, so general case ...
-                        {
-#                           ifdef n2a_FP
-                            nextValues[index] = convert (field, time  &&  index == timeColumn ? Event<T>::exponent : exponent);
-#                           else
-                            nextValues[index] = (T) atof (field.c_str ());
-#                           endif
-                        }
-                    }
-                    i = j + 1;
+            T result = mktime (&date) - offset;  // Unix time; an integer, so exponent=MSB
+#           ifdef n2a_FP
+            // Need to put value in expected exponent.
+            int shift = FP_MSB - (time ? Event<T>::exponent : exponent);
+            if (shift >= 0) result <<= shift;
+            else            result >>= -shift;
+#           endif
+            return result;
+        }
+    }
+
+    // Not a date, so general case ...
+#   ifdef n2a_FP
+    return convert (parseNumber (begin, end), time  &&  index == timeColumn ? Event<T>::exponent : exponent);
+#   else
+    return (T) parseNumber (begin, end);
+#   endif
+}
+
+template<class T>
+void
+InputHolder<T>::parseValues (const char * begin, const char * end, T * values)
+{
+    int index = 0;
+    const char * i = begin;
+    while (index < columnCount)
+    {
+        const char * j = std::find (i, end, delimiter);
+        values[index] = parseField (i, j, index);
+        index++;
+        if (j >= end) break;
+        i = j + 1;
+    }
+    for (; index < columnCount; index++) values[index] = 0;
+}
+
+template<class T>
+T
+InputHolder<T>::parseTime (const char * begin, const char * end)
+{
+    const char * i = begin;
+    for (int c = 0; c < timeColumn  &&  i < end; c++)
+    {
+        i = std::find (i, end, delimiter);
+        if (i < end) i++;
+    }
+    return parseField (i, std::find (i, end, delimiter), timeColumn);
+}
+
+template<class T>
+void
+InputHolder<T>::getRow (T row)
+{
+    if (cache  ||  share) indexed = true;
+    if (indexed)
+    {
+        if (! map  &&  ! table) openIndexed ();
+        if (indexed)  // openIndexed() clears this if it fails, in which case we fall through to streaming code below.
+        {
+            getRowIndexed (row);
+            return;
+        }
+    }
+
+    while (true)
+    {
+        // Read and process next line
+        if (std::isnan (nextLine)  &&  in->good ())
+        {
+            String line;
+            getline (*in, line);
+            if (! line.empty ())
+            {
+                const char * begin = line.c_str ();
+                const char * end   = begin + line.size ();
+                detectDelimiter (begin, end);
+                if (parseHeader (begin, end)) continue;  // back to top of outer while loop, skipping any other processing below
+
+                if (nextCount < columnCount)
+                {
+                    if (nextValues) delete[] nextValues;
+                    nextValues = new T[columnCount];
+                    nextCount = columnCount;
                 }
-                for (; index < columnCount; index++) nextValues[index] = 0;
+                parseValues (begin, end, nextValues);
 
                 if (time) nextLine = nextValues[timeColumn];
                 else      nextLine = currentLine + 1;
@@ -2149,6 +2987,469 @@ InputHolder<T>::getRow (T row)
     }
 }
 
+/**
+    Scans the mapped file once, without parsing any values except those in the time column.
+    All headers are processed up front, so every column is known before the first get(),
+    even one that streaming would only discover partway through the file.
+**/
+template<class T>
+void
+InputHolder<T>::buildIndex ()
+{
+    indexOffset.clear ();
+    indexTime  .clear ();
+    rowCount = 0;
+
+    const char * data     = map->data;
+    uint64_t     size     = map->size;
+    uint64_t     position = 0;
+    while (position < size)
+    {
+        const char * begin   = data + position;
+        const char * newline = (const char *) memchr (begin, '\n', size - position);
+        const char * end     = newline ? newline : data + size;
+        if (end > begin  &&  end[-1] == '\r') end--;
+        if (end > begin)
+        {
+            detectDelimiter (begin, end);
+            if (! parseHeader (begin, end))
+            {
+                if (rowCount % indexStride == 0)
+                {
+                    indexOffset.push_back (position);
+                    if (time) indexTime.push_back (parseTime (begin, end));
+                }
+                rowCount++;
+            }
+        }
+        if (! newline) break;
+        position = newline - data + 1;
+    }
+
+    // Size buffers for full width of file.
+    if (currentCount < columnCount)
+    {
+        delete[] currentValues;
+        currentValues = new T[columnCount];
+        currentCount  = columnCount;
+    }
+    if (nextCount < columnCount)
+    {
+        if (nextValues) delete[] nextValues;
+        nextValues = new T[columnCount];
+        nextCount  = columnCount;
+    }
+}
+
+template<class T>
+void
+InputHolder<T>::openIndexed ()
+{
+    if (share)
+    {
+        // Everything that affects the parsed values goes into the key.
+        String key = "InputTable|" + fileName + "|" + (time ? "t" : "");
+#       ifdef n2a_FP
+        key = key + "|" + exponent + "|" + Event<T>::exponent;
+#       endif
+        shared = (InputTable<T> *) Holder::acquire (key, [this, &key] () -> Holder *
+        {
+            InputTable<T> * result = new InputTable<T> (key);
+            InputHolder<T> builder (fileName);
+            builder.time     = time;
+            builder.indexed  = true;
+            builder.cache    = cache;
+            builder.tabulate = true;
+#           ifdef n2a_FP
+            builder.exponent = exponent;
+#           endif
+            builder.openIndexed ();
+            if (builder.table)
+            {
+                result->columnCount = builder.columnCount;
+                result->timeColumn  = builder.timeColumn;
+                result->delimiter   = builder.delimiter;
+                result->rowCount    = builder.rowCount;
+                result->table       = builder.table;
+                result->sidecar     = builder.sidecar;
+                builder.sidecar     = 0;
+                result->columnMap.swap (builder.columnMap);
+                result->tableData.swap (builder.tableData);  // Buffer moves intact, so table remains valid.
+            }
+            return result;
+        });
+
+        if (! shared->table)
+        {
+            Holder::release (shared);
+            shared  = 0;
+            indexed = false;
+            cache   = false;
+            return;
+        }
+        columnCount   = shared->columnCount;
+        columnMap     = shared->columnMap;
+        timeColumn    = shared->timeColumn;
+        delimiter     = shared->delimiter;
+        rowCount      = shared->rowCount;
+        table         = shared->table;
+        timeColumnSet = true;
+        delimiterSet  = true;
+        if (currentCount < columnCount)
+        {
+            delete[] currentValues;
+            currentValues = new T[columnCount];
+            currentCount  = columnCount;
+        }
+        if (nextCount < columnCount)
+        {
+            if (nextValues) delete[] nextValues;
+            nextValues = new T[columnCount];
+            nextCount  = columnCount;
+        }
+        currentRow = -2;
+        loadRow (-1);
+        return;
+    }
+
+    if (! fileName.empty ())
+    {
+        if (cache  &&  readCache ()) return;
+        map = SharedMappedFile::acquire (fileName);
+    }
+    if (! map)
+    {
+        indexed = false;
+        cache   = false;
+        return;
+    }
+
+    buildIndex ();
+    if (cache  ||  tabulate)
+    {
+        buildTable ();
+        if (cache) writeCache ();
+        SharedMappedFile::release (map);  // Text is no longer needed.
+        map = 0;
+    }
+    currentRow = -2;  // Force loadRow() to do its work.
+    loadRow (-1);
+}
+
+/**
+    Payload of TABLE sidecar:
+        int32 columnCount, int32 timeColumn, int32 delimiter, int32 column map size,
+        then that many pairs of (string name, int32 index),
+        then int32 low and high halves of rowCount,
+        then rowCount*columnCount values in row-major order.
+    The variant code in the sidecar header records the time mode, since that affects
+    both the choice of time column and (for fixed-point) the exponent of its values.
+**/
+template<class T>
+bool
+InputHolder<T>::readCache ()
+{
+    uint32_t variant = time;
+#   ifdef n2a_FP
+    sidecar = new InputCache (fileName, InputCache::TABLE, cacheType<T> (), exponent, variant | (Event<T>::exponent + 128 & 0xFF) << 8);
+#   else
+    sidecar = new InputCache (fileName, InputCache::TABLE, cacheType<T> (), 0, variant);
+#   endif
+    if (sidecar->read ())
+    {
+        columnCount = sidecar->getInt ();
+        timeColumn  = sidecar->getInt ();
+        delimiter   = sidecar->getInt ();
+        int count   = sidecar->getInt ();
+        for (int i = 0; i < count; i++)
+        {
+            String name = sidecar->getString ();
+            columnMap.emplace (name, sidecar->getInt ());
+        }
+        uint32_t low  = sidecar->getInt ();
+        uint32_t high = sidecar->getInt ();
+        rowCount = (int64_t) high << 32 | low;
+        table = (const T *) sidecar->getArray (rowCount * columnCount * sizeof (T));
+    }
+    if (! table)
+    {
+        delete sidecar;
+        sidecar = 0;
+        columnMap.clear ();
+        columnCount = 0;
+        timeColumn  = 0;
+        delimiter   = ' ';
+        rowCount    = 0;
+        return false;
+    }
+
+    timeColumnSet = true;
+    delimiterSet  = true;
+    if (currentCount < columnCount)
+    {
+        delete[] currentValues;
+        currentValues = new T[columnCount];
+        currentCount  = columnCount;
+    }
+    if (nextCount < columnCount)
+    {
+        if (nextValues) delete[] nextValues;
+        nextValues = new T[columnCount];
+        nextCount  = columnCount;
+    }
+    currentRow = -2;
+    loadRow (-1);
+    return true;
+}
+
+template<class T>
+void
+InputHolder<T>::buildTable ()
+{
+    tableData.resize (rowCount * columnCount);
+    uint64_t lineEnd = 0;
+    uint64_t position = nextDataLine (0, lineEnd);
+    for (int64_t r = 0; r < rowCount; r++)
+    {
+        parseValues (map->data + position, map->data + lineEnd, &tableData[r * columnCount]);
+        position = nextDataLine (lineEnd + 1, lineEnd);
+    }
+    table = tableData.data ();
+}
+
+template<class T>
+void
+InputHolder<T>::writeCache ()
+{
+    uint32_t variant = time;
+#   ifdef n2a_FP
+    InputCache out (fileName, InputCache::TABLE, cacheType<T> (), exponent, variant | (Event<T>::exponent + 128 & 0xFF) << 8);
+#   else
+    InputCache out (fileName, InputCache::TABLE, cacheType<T> (), 0, variant);
+#   endif
+    out.putInt (columnCount);
+    out.putInt (timeColumn);
+    out.putInt (delimiter);
+    out.putInt (columnMap.size ());
+    for (auto & it : columnMap)
+    {
+        out.putString (it.first);
+        out.putInt (it.second);
+    }
+    out.putInt ((uint32_t) rowCount);
+    out.putInt ((uint32_t) (rowCount >> 32));
+    out.putArray (table, tableData.size () * sizeof (T));
+    out.write ();
+}
+
+template<class T>
+uint64_t
+InputHolder<T>::nextDataLine (uint64_t position, uint64_t & lineEnd)
+{
+    const char * data = map->data;
+    uint64_t     size = map->size;
+    while (position < size)
+    {
+        const char * begin   = data + position;
+        const char * newline = (const char *) memchr (begin, '\n', size - position);
+        const char * end     = newline ? newline : data + size;
+        if (end > begin  &&  end[-1] == '\r') end--;
+        if (end > begin)
+        {
+            char firstCharacter = *begin;
+            if (firstCharacter >= '-'  &&  firstCharacter != '/'  &&  firstCharacter <= '9')
+            {
+                lineEnd = end - data;
+                return position;
+            }
+        }
+        if (! newline) break;
+        position = newline - data + 1;
+    }
+    lineEnd = size;
+    return size;
+}
+
+template<class T>
+uint64_t
+InputHolder<T>::seekRow (int64_t row, uint64_t & lineEnd)
+{
+    uint64_t position = nextDataLine (indexOffset[row / indexStride], lineEnd);
+    for (int i = row % indexStride; i > 0; i--) position = nextDataLine (lineEnd + 1, lineEnd);
+    return position;
+}
+
+template<class T>
+void
+InputHolder<T>::stepRow ()
+{
+    T * tempValues = currentValues;
+    currentValues = nextValues;
+    nextValues    = tempValues;
+    currentLine   = nextLine;
+    currentRow++;
+    Alast = (T) NAN;
+
+    if (currentRow + 1 >= rowCount)
+    {
+        nextLine = (T) NAN;
+        return;
+    }
+    if (table)
+    {
+        memcpy (nextValues, table + (currentRow + 1) * columnCount, columnCount * sizeof (T));
+    }
+    else
+    {
+        uint64_t lineEnd;
+        uint64_t position = nextDataLine (nextPosition, lineEnd);
+        parseValues (map->data + position, map->data + lineEnd, nextValues);
+        nextPosition = lineEnd + 1;
+    }
+    if (time) nextLine = nextValues[timeColumn];
+    else      nextLine = currentLine + 1;
+}
+
+template<class T>
+void
+InputHolder<T>::loadRow (int64_t row)
+{
+    if (row == currentRow) return;
+    currentRow = row;
+    Alast = (T) NAN;
+
+    if (table)
+    {
+        if (row < 0) memset (&currentValues[0], 0,                         currentCount * sizeof (T));
+        else         memcpy (currentValues,     table + row * columnCount, columnCount  * sizeof (T));
+        if      (row >= 0) currentLine = time ? currentValues[timeColumn] : (T) row;
+        else if (time)     currentLine = -INFINITY;
+        else               currentLine = (T) -1;
+        if (row + 1 < rowCount)
+        {
+            memcpy (nextValues, table + (row + 1) * columnCount, columnCount * sizeof (T));
+            if (time) nextLine = nextValues[timeColumn];
+            else      nextLine = currentLine + 1;
+        }
+        else
+        {
+            nextLine = (T) NAN;
+        }
+        return;
+    }
+
+    uint64_t lineEnd;
+    uint64_t position;
+    if (row < 0)
+    {
+        memset (&currentValues[0], 0, currentCount * sizeof (T));
+        if (time) currentLine = -INFINITY;
+        else      currentLine = (T) -1;
+        position = nextDataLine (0, lineEnd);
+    }
+    else
+    {
+        position = seekRow (row, lineEnd);
+        parseValues (map->data + position, map->data + lineEnd, currentValues);
+        if (time) currentLine = currentValues[timeColumn];
+        else      currentLine = (T) row;
+        position = nextDataLine (lineEnd + 1, lineEnd);
+    }
+
+    if (row + 1 >= rowCount)
+    {
+        nextLine = (T) NAN;
+        return;
+    }
+    parseValues (map->data + position, map->data + lineEnd, nextValues);
+    nextPosition = lineEnd + 1;
+    if (time) nextLine = nextValues[timeColumn];
+    else      nextLine = currentLine + 1;
+}
+
+/**
+    Random-access version of the streaming loop in getRow().
+    Selects the row that streaming would select, except that it can also move backward.
+    Stepping forward by a row (the usual case) costs one line parse. Any other move does
+    a binary search of the index, then walks less than indexStride lines, parsing only
+    the time column, to find the target.
+**/
+template<class T>
+void
+InputHolder<T>::getRowIndexed (T row)
+{
+    if (rowCount == 0) return;
+
+    int64_t target;
+    if (time)
+    {
+        if (currentRow < 0  ||  ! (row < currentLine - epsilon))  // not moving backward
+        {
+            for (int steps = 0; steps < 4; steps++)
+            {
+                if (std::isnan (nextLine)  ||  row < nextLine - epsilon) return;  // current row is correct
+                stepRow ();
+            }
+        }
+
+        if (table)  // Every row is directly addressable, so search all of them.
+        {
+            int64_t lo = 0;
+            int64_t hi = rowCount;
+            while (lo < hi)
+            {
+                int64_t mid = (lo + hi) / 2;
+                if (row < table[mid * columnCount + timeColumn] - epsilon) hi = mid;
+                else                                                      lo = mid + 1;
+            }
+            loadRow (lo - 1);
+            return;
+        }
+
+        // Find last indexed row that passes the same test as streaming.
+        int lo = 0;
+        int hi = indexTime.size ();
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (row < indexTime[mid] - epsilon) hi = mid;
+            else                                lo = mid + 1;
+        }
+        int block = lo - 1;
+        if (block < 0)
+        {
+            target = -1;
+        }
+        else
+        {
+            target = (int64_t) block * indexStride;
+            uint64_t lineEnd;
+            nextDataLine (indexOffset[block], lineEnd);
+            int64_t last = std::min (rowCount, target + indexStride);
+            for (int64_t r = target + 1; r < last; r++)
+            {
+                uint64_t position = nextDataLine (lineEnd + 1, lineEnd);
+                if (row < parseTime (map->data + position, map->data + lineEnd) - epsilon) break;
+                target = r;
+            }
+        }
+    }
+    else
+    {
+        double r = std::floor ((double) row + epsilon);  // Largest line number k such that ! (row < k - epsilon)
+        if      (r < -1       ) target = -1;
+        else if (r >= rowCount) target = rowCount - 1;
+        else                    target = (int64_t) r;
+        if (target == currentRow + 1)
+        {
+            stepRow ();
+            return;
+        }
+    }
+
+    loadRow (target);
+}
+
 template<class T>
 T
 InputHolder<T>::get (T row, const String & column)
@@ -2311,6 +3612,8 @@ inputHelper (const String & fileName,               InputHolder<T> * oldHandle)
 #       ifdef n2a_FP
         handle->exponent = exponent;
 #       endif
+        handle->cache = SIMULATOR cacheInputs  &&  ! fileName.empty ();
+        handle->share = SIMULATOR shareInputs  &&  ! fileName.empty ();
     }
     return handle;
 }
@@ -2318,20 +3621,103 @@ inputHelper (const String & fileName,               InputHolder<T> * oldHandle)
 
 // OutputHolder --------------------------------------------------------------
 
+/**
+    Binary trace format, selected by the output mode hint "format=binary":
+        File header: "N2Ab", uint32 version (currently 1), uint32 flags (bit 0 = raw)
+        Sequence of blocks, each with header: uint32 rows, uint32 columns, uint32 bytes
+        then "bytes" worth of payload, which holds each column in turn.
+    All integers are little-endian. Column names and modes live in the usual .columns
+    file, so there is no header row. A column that was not set in some row holds NaN,
+    just as the text format leaves an empty field. Columns never shrink, so a block
+    may be wider than the one before it. Rows before a column was created read as NaN.
+
+    Within a block, each column is an independent stream of float bit patterns, each
+    XORed with the previous one (starting from 0). Traces change slowly from row to
+    row, so the high bytes of the XOR are usually zero. Values are grouped in pairs
+    behind a control byte whose low and high nibbles give the number of significant
+    low-order bytes (0 to 4) of the first and second value. Only those bytes follow.
+    A final single value uses only the low nibble. Constant and unset columns cost
+    half a byte per row.
+**/
+static const char     binaryMagic[]  = "N2Ab";
+static const uint32_t binaryVersion  = 1;
+
+inline void
+binaryPut (std::vector<unsigned char> & buffer, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        buffer.push_back (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+inline int
+binaryBytes (uint32_t x)
+{
+    if (x == 0)          return 0;
+    if (x <= 0xFF)       return 1;
+    if (x <= 0xFFFF)     return 2;
+    if (x <= 0xFFFFFF)   return 3;
+    return 4;
+}
+
+inline void
+binaryPack (const std::vector<float> & values, std::vector<unsigned char> & buffer)
+{
+    uint32_t previous = 0;
+    int count = values.size ();
+    for (int i = 0; i < count; i += 2)
+    {
+        uint32_t bits0;
+        memcpy (&bits0, &values[i], 4);
+        uint32_t x0 = bits0 ^ previous;
+        previous = bits0;
+        int n0 = binaryBytes (x0);
+
+        uint32_t x1 = 0;
+        int n1 = 0;
+        if (i + 1 < count)
+        {
+            uint32_t bits1;
+            memcpy (&bits1, &values[i+1], 4);
+            x1 = bits1 ^ previous;
+            previous = bits1;
+            n1 = binaryBytes (x1);
+        }
+
+        buffer.push_back (n0 | n1 << 4);
+        for (int b = 0; b < n0; b++, x0 >>= 8) buffer.push_back (x0 & 0xFF);
+        for (int b = 0; b < n1; b++, x1 >>= 8) buffer.push_back (x1 & 0xFF);
+    }
+}
+
 template<class T>
-OutputHolder<T>::OutputHolder (const String & fileName)
+OutputHolder<T>::OutputHolder (const String & fileName, int64_t resume)
 :   Holder (fileName)
 {
     columnsPrevious = 0;
     traceReceived   = false;
     t               = 0;
     raw             = false;
+    binary          = false;
+    blockSize       = 1024;
+    blockRows       = 0;
+    queue           = 0;
+    drop            = false;
+    writer          = 0;
 
     if (fileName.empty ())
     {
         out = &std::cout;
         columnFileName = "out.columns";
     }
+    else if (resume >= 0)
+    {
+        truncateFile (fileName, resume);
+        out = new std::ofstream (fileName.c_str (), std::ios::app | std::ios::binary);
+        columnFileName = fileName + ".columns";
+    }
     else
     {
         out = new std::ofstream (fileName.c_str ());
@@ -2347,11 +3733,13 @@ OutputHolder<T>::~OutputHolder ()
         try
         {
             writeTrace ();
+            if (binary) writeBlock ();
         }
         catch (...)
         {
             std::cerr << "WARNING: final trace values might have been lost" << std::endl;
         }
+        if (writer) delete writer;  // Finishes everything still in the queue.
         out->flush ();
         if (out != &std::cout) delete out;
 
@@ -2429,6 +3817,22 @@ OutputHolder<T>::addMode (const char * mode)
                 std::map<String,String> * c = columnMode[0];
                 (*c)[key] = value;
             }
+            else if (key == "format")  // Applies to whole file rather than one column.
+            {
+                if (columnsPrevious == 0) binary =  value == "binary";
+            }
+            else if (key == "block")
+            {
+                blockSize = std::max (1, atoi (value.c_str ()));
+            }
+            else if (key == "async")  // Also applies to whole file. Optional value gives size of queue.
+            {
+                if (! writer) queue = value.empty () ? 256 : std::max (1, atoi (value.c_str ()));
+            }
+            else if (key == "drop")
+            {
+                drop =  value.empty ()  ||  value == "1";
+            }
             else
             {
                 (*result)[key] = value;
@@ -2437,6 +3841,51 @@ OutputHolder<T>::addMode (const char * mode)
     }
 }
 
+template<class T>
+int
+OutputHolder<T>::getHandle (const String & column, const char * mode)
+{
+    std::unordered_map<String, int>::iterator result = columnMap.find (column);
+    if (result != columnMap.end ()) return result->second;
+
+    if (columnValues.empty ())  // Reserve first column for $t. trace(now) fills in its value.
+    {
+        columnMap["$t"] = 0;
+        columnValues.push_back (std::numeric_limits<float>::quiet_NaN ());
+        columnMode.push_back (new std::map<String,String>);
+    }
+    int index = columnValues.size ();
+    columnMap[column] = index;
+    columnValues.push_back (std::numeric_limits<float>::quiet_NaN ());
+    addMode (mode);
+    return index;
+}
+
+template<class T>
+T
+#ifdef n2a_FP
+OutputHolder<T>::trace (T now, int & handle, const char * column, T valueFP, int exponent, const char * mode)
+#else
+OutputHolder<T>::trace (T now, int & handle, const char * column, T value,                 const char * mode)
+#endif
+{
+    trace (now);
+    if (handle < 0) handle = getHandle (column, mode);
+
+#   ifdef n2a_FP
+    float value;
+    if      (valueFP ==  NAN)      value =  std::numeric_limits<float>::quiet_NaN ();
+    else if (valueFP ==  INFINITY) value =  std::numeric_limits<float>::infinity ();
+    else if (valueFP == -INFINITY) value = -std::numeric_limits<float>::infinity ();
+    else                           value = (float) valueFP / pow (2.0f, FP_MSB - exponent);
+    columnValues[handle] = value;
+    return valueFP;
+#   else
+    columnValues[handle] = (float) value;
+    return value;
+#   endif
+}
+
 template<class T>
 T
 #ifdef n2a_FP
@@ -2455,17 +3904,7 @@ OutputHolder<T>::trace (T now, const String & column, T value,                 c
     else                           value = (float) valueFP / pow (2.0f, FP_MSB - exponent);
 #   endif
 
-    std::unordered_map<String, int>::iterator result = columnMap.find (column);
-    if (result == columnMap.end ())
-    {
-        columnMap[column] = columnValues.size ();
-        columnValues.push_back ((float) value);
-        addMode (mode);
-    }
-    else
-    {
-        columnValues[result->second] = (float) value;
-    }
+    columnValues[getHandle (column, mode)] = (float) value;
 
 #   ifdef n2a_FP
     return valueFP;
@@ -2591,9 +4030,38 @@ OutputHolder<T>::writeTrace ()
     if (! traceReceived  ||  ! out) return;  // Don't output anything unless at least one value was set.
 
     const int count = columnValues.size ();
-    const int last  = count - 1;
+    float NANf = std::numeric_limits<float>::quiet_NaN ();  // Necessary because "NAN" might be an integer.
+    if (queue  &&  ! writer) writer = new AsyncWriter (binary ? std::max (2, queue / blockSize) : queue, drop);
+
+    if (binary)
+    {
+        if (columnsPrevious == 0)  // First row, so write file header.
+        {
+            if (writer) writer->push (std::bind (&OutputHolder<T>::writeHeader, this), false);
+            else        writeHeader ();
+        }
+        if (count > columnsPrevious)
+        {
+            columnsPrevious = count;
+            writeModes ();
+        }
+
+        blockColumns.resize (count);
+        for (int i = 0; i < count; i++)
+        {
+            std::vector<float> & b = blockColumns[i];
+            b.resize (blockRows, NANf);  // No-op unless column is new in this block.
+            b.push_back (columnValues[i]);
+            columnValues[i] = NANf;
+        }
+        if (++blockRows >= blockSize) writeBlock ();
+
+        traceReceived = false;
+        return;
+    }
 
-    // Write headers if new columns have been added
+    // Assemble headers if new columns have been added
+    String header;
     if (count > columnsPrevious)
     {
         if (! raw)
@@ -2601,37 +4069,112 @@ OutputHolder<T>::writeTrace ()
             std::vector<String> headers (count);
             for (auto it : columnMap) headers[it.second] = it.first;
 
-            (*out) << headers[0];  // Should be $t
+            header = headers[0];  // Should be $t
             int i = 1;
             for (; i < columnsPrevious; i++)
             {
-                (*out) << "\t";
+                header += "\t";
             }
             for (; i < count; i++)
             {
-                (*out) << "\t";
-                String header (headers[i]);  // deep copy
-                header.replace_all (' ', '_');
-                (*out) << header;
+                header += "\t";
+                String h (headers[i]);  // deep copy
+                h.replace_all (' ', '_');
+                header += h;
             }
-            (*out) << std::endl;
         }
         columnsPrevious = count;
         writeModes ();
     }
 
-    // Write values
-    float NANf = std::numeric_limits<float>::quiet_NaN ();  // Necessary because "NAN" might be an integer.
+    if (writer)
+    {
+        // Hand off the completed row and start a fresh one.
+        // A row that carries headers must not be dropped, or later rows would be misread.
+        std::vector<float> values (count, NANf);
+        values.swap (columnValues);
+        writer->push (std::bind (&OutputHolder<T>::writeRow, this, header, std::move (values)), header.empty ());
+    }
+    else
+    {
+        writeRow (header, columnValues);
+    }
+
+    traceReceived = false;
+}
+
+template<class T>
+void
+OutputHolder<T>::writeRow (const String & header, std::vector<float> & values)
+{
+    if (! header.empty ()) (*out) << header << std::endl;
+
+    float NANf = std::numeric_limits<float>::quiet_NaN ();
+    const int last = values.size () - 1;
     for (int i = 0; i <= last; i++)
     {
-        float & c = columnValues[i];
+        float & c = values[i];
         if (! std::isnan (c)) (*out) << c;
         if (i < last) (*out) << "\t";
         c = NANf;
     }
     (*out) << std::endl;
+}
 
-    traceReceived = false;
+template<class T>
+void
+OutputHolder<T>::writeHeader ()
+{
+    if (out != &std::cout)  // Reopen without text-mode translation of line endings.
+    {
+        delete out;
+        out = new std::ofstream (fileName.c_str (), std::ios::binary);
+    }
+    std::vector<unsigned char> header;
+    for (int i = 0; i < 4; i++) header.push_back (binaryMagic[i]);
+    binaryPut (header, binaryVersion);
+    binaryPut (header, raw ? 1 : 0);
+    out->write ((const char *) header.data (), header.size ());
+}
+
+template<class T>
+void
+OutputHolder<T>::writeBlock ()
+{
+    if (blockRows == 0) return;
+
+    if (writer)  // Hand off the buffered columns, leaving empty ones in their place.
+    {
+        std::vector<std::vector<float>> columns (blockColumns.size ());
+        columns.swap (blockColumns);
+        writer->push (std::bind (static_cast<void (OutputHolder<T>::*) (std::vector<std::vector<float>> &, int)> (&OutputHolder<T>::writeBlock), this, std::move (columns), blockRows));
+    }
+    else
+    {
+        writeBlock (blockColumns, blockRows);
+    }
+    blockRows = 0;
+}
+
+template<class T>
+void
+OutputHolder<T>::writeBlock (std::vector<std::vector<float>> & columns, int rows)
+{
+    std::vector<unsigned char> payload;
+    payload.reserve (rows * columns.size () * 2);
+    for (auto & b : columns)
+    {
+        binaryPack (b, payload);
+        b.clear ();
+    }
+
+    std::vector<unsigned char> header;
+    binaryPut (header, rows);
+    binaryPut (header, columns.size ());
+    binaryPut (header, payload.size ());
+    out->write ((const char *) header.data (),  header.size ());
+    out->write ((const char *) payload.data (), payload.size ());
+    out->flush ();  // Complete blocks are visible to a reader that follows the file while the job runs.
 }
 
 template<class T>
@@ -2654,10 +4197,19 @@ template<class T>
 OutputHolder<T> *
 outputHelper (const String & fileName, OutputHolder<T> * oldHandle)
 {
-    OutputHolder<T> * handle = (OutputHolder<T> *) SIMULATOR getHolder (fileName, oldHandle);
+    // When output is redirected, holders are named by their actual path.
+    const String * path = &fileName;
+    String redirected;
+    if (! SIMULATOR outputDirectory.empty ())
+    {
+        redirected = SIMULATOR outputPath (fileName);
+        path       = &redirected;
+    }
+
+    OutputHolder<T> * handle = (OutputHolder<T> *) SIMULATOR getHolder (*path, oldHandle);
     if (! handle)
     {
-        handle = new OutputHolder<T> (fileName);
+        handle = new OutputHolder<T> (*path);
         SIMULATOR holders.push_back (handle);
     }
     return handle;
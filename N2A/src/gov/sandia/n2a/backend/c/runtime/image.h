@@ -683,7 +683,9 @@ namespace n2a
         void          fromGrayFloat  (const Image & image, Image & result) const;
         void          fromGrayDouble (const Image & image, Image & result) const;
         void          fromRGBChar    (const Image & image, Image & result) const;
+        void          fromRGBAFloat  (const Image & image, Image & result) const;
         void          fromPackedYUV  (const Image & image, Image & result) const;
+        void          fromYCbCr      (const Image & image, Image & result) const;  ///< Vectorized. Hides the general version in PixelFormatRGBABits.
 
         virtual uint32_t getRGBA  (void * pixel) const;
         virtual uint8_t  getAlpha (void * pixel) const;
@@ -734,7 +736,10 @@ namespace n2a
     public:
         PixelFormatRGBAFloat ();
 
-        virtual void fromAny (const Image & image, Image & result) const; ///< This method is necessary because the default conversion goes through RGBAChar, sometimes producing unnecessary information loss.
+        virtual Image filter       (const Image & image);
+        virtual void  fromAny      (const Image & image, Image & result) const; ///< This method is necessary because the default conversion goes through RGBAChar, sometimes producing unnecessary information loss.
+        void          fromRGBAChar (const Image & image, Image & result) const;
+        void          fromYCbCr    (const Image & image, Image & result) const;
 
         virtual uint32_t getRGBA  (void * pixel) const;
         virtual void     getRGBA  (void * pixel, float values[]) const;
@@ -751,7 +756,10 @@ namespace n2a
     public:
         PixelFormatRGBFloat ();
 
-        virtual void fromAny (const Image & image, Image & result) const; ///< See comment on RGBAFloat.
+        virtual Image filter       (const Image & image);
+        virtual void  fromAny      (const Image & image, Image & result) const; ///< See comment on RGBAFloat.
+        void          fromRGBAChar (const Image & image, Image & result) const;
+        void          fromYCbCr    (const Image & image, Image & result) const;
 
         virtual uint32_t getRGBA (void * pixel) const;
         virtual void     getRGBA (void * pixel, float values[]) const;
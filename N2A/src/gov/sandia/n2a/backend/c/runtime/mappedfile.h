@@ -0,0 +1,120 @@
+/*
+A read-only memory map of a whole file.
+This is a pure header implementation, shared by the C runtime and OutputParser.
+
+Copyright 2023 National Technology & Engineering Solutions of Sandia, LLC (NTESS).
+Under the terms of Contract DE-NA0003525 with NTESS,
+the U.S. Government retains certain rights in this software.
+*/
+
+#ifndef n2a_mappedfile_h
+#define n2a_mappedfile_h
+
+#include <cstdint>
+
+#ifdef _WIN32
+#  ifndef WIN32_LEAN_AND_MEAN
+#    define WIN32_LEAN_AND_MEAN
+#  endif
+#  include <windows.h>
+#  undef min
+#  undef max
+#else
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+namespace n2a
+{
+    /**
+        Read-only view of an entire file through virtual memory.
+        Only the pages actually touched get loaded, so this works for files
+        larger than physical memory (on a 64-bit system).
+    **/
+    class MappedFile
+    {
+    public:
+        const char * data;
+        uint64_t     size;
+#       ifdef _WIN32
+        HANDLE       file;
+        HANDLE       mapping;
+#       else
+        int          fd;
+#       endif
+
+        MappedFile ()
+        {
+            data = 0;
+            size = 0;
+#           ifdef _WIN32
+            file    = INVALID_HANDLE_VALUE;
+            mapping = 0;
+#           else
+            fd      = -1;
+#           endif
+        }
+
+        ~MappedFile ()
+        {
+            close ();
+        }
+
+        /**
+            @param sequential Hint that the file will be read front to back, once.
+            @return true if the file was mapped. An empty file also succeeds, but leaves data null.
+        **/
+        bool open (const char * fileName, bool sequential = false)
+        {
+            close ();
+#           ifdef _WIN32
+            file = CreateFileA (fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+            if (file == INVALID_HANDLE_VALUE) return false;
+            LARGE_INTEGER length;
+            if (! GetFileSizeEx (file, &length)) return false;
+            size = length.QuadPart;
+            if (size == 0) return true;  // Can't map an empty file, but it is still a valid (if useless) state.
+            mapping = CreateFileMappingA (file, 0, PAGE_READONLY, 0, 0, 0);
+            if (! mapping) return false;
+            data = (const char *) MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+#           else
+            fd = ::open (fileName, O_RDONLY);
+            if (fd < 0) return false;
+            struct stat info;
+            if (fstat (fd, &info)  ||  ! S_ISREG (info.st_mode)) return false;  // Pipes and devices can't be mapped.
+            size = info.st_size;
+            if (size == 0) return true;
+            void * p = mmap (0, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                size = 0;
+                return false;
+            }
+            data = (const char *) p;
+            if (sequential) madvise (p, size, MADV_SEQUENTIAL);
+#           endif
+            return data;
+        }
+
+        void close ()
+        {
+#           ifdef _WIN32
+            if (data)                         UnmapViewOfFile (data);
+            if (mapping)                      CloseHandle (mapping);
+            if (file != INVALID_HANDLE_VALUE) CloseHandle (file);
+            file    = INVALID_HANDLE_VALUE;
+            mapping = 0;
+#           else
+            if (data)    munmap ((void *) data, size);
+            if (fd >= 0) ::close (fd);
+            fd = -1;
+#           endif
+            data = 0;
+            size = 0;
+        }
+    };
+}
+
+#endif
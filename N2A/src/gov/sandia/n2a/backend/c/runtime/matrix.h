@@ -20,6 +20,8 @@ the U.S. Government retains certain rights in this software.
 #include <vector>
 #include <map>
 #include <memory>
+#include <utility>
+#include <functional>
 #ifndef N2A_SPINNAKER
 # include <iostream>
 # include <sstream>
@@ -56,6 +58,7 @@ public:
 };
 
 template<class T> class Matrix;
+template<class T> class MatrixSparse;
 
 template<class T> SHARED void      clear      (      MatrixAbstract<T> & A, const T scalar = (T) 0);      ///< Set all elements to given value.
 template<class T> SHARED void      identity   (      MatrixAbstract<T> & A);                              ///< Set diagonal to 1 and all other elements to 0. Does not have to be a square matrix.
@@ -92,7 +95,11 @@ template<class T> SHARED Matrix<T> operator || (const MatrixAbstract<T> & A, con
 template<class T>        Matrix<T> operator || (const T scalar,              const MatrixAbstract<T> & A) {return A || scalar;}
 
 template<class T> SHARED Matrix<T> operator & (const MatrixAbstract<T> & A, const MatrixAbstract<T> & B); ///< Elementwise multiplication. The prettiest name for this operator would be ".*", but that is not overloadable.
-template<class T>        Matrix<T> operator * (const MatrixAbstract<T> & A, const MatrixAbstract<T> & B) {return Matrix<T> (A) * B;} ///< Multiply whole matrices
+template<class T>        Matrix<T> operator * (const MatrixAbstract<T> & A, const MatrixAbstract<T> & B)  ///< Multiply whole matrices
+{
+    if (A.classID () & MatrixSparseID) return (const MatrixSparse<T> &) A * B;  // Use sparse kernel rather than converting A to dense.
+    return Matrix<T> (A) * B;
+}
 template<class T> SHARED Matrix<T> operator * (const MatrixAbstract<T> & A, const T scalar);              ///< Multiply each element by scalar
 template<class T>        Matrix<T> operator * (const T scalar,              const MatrixAbstract<T> & A) {return A * scalar;}
 template<class T> SHARED Matrix<T> operator / (const MatrixAbstract<T> & A, const MatrixAbstract<T> & B); ///< Elementwise division.  Could mean this * !B, but such expressions are done other ways in linear algebra.
@@ -253,6 +260,54 @@ template<class T> SHARED Matrix<T> operator ~ (const Matrix<T> & A);
 template<class T> SHARED Matrix<T> row        (const Matrix<T> & A, int row);
 template<class T> SHARED Matrix<T> column     (const Matrix<T> & A, int column);
 
+/**
+    Operators on temporaries.
+    When an operand is an unnamed Matrix that solely owns its dense buffer, the result is written
+    into that buffer and the operand is returned by move. A chain such as A*x+b then allocates
+    only once, for the product. Each form falls back to the general operator when its operand
+    is shared (a view, or copied elsewhere) or not contiguous. A right-hand operand is only
+    reused when its shape equals the left-hand one, since the result always takes the shape
+    of the left-hand operand.
+**/
+template<class T> inline bool canReuse (const Matrix<T> & A)
+{
+    return A.data.refcount () == 1  &&  A.strideR_ == 1  &&  A.strideC_ == A.rows_;
+}
+
+template<class T> SHARED Matrix<T> visit (Matrix<T> && A, T (*function) (const T &));
+template<class T> SHARED Matrix<T> visit (Matrix<T> && A, T (*function) (const T));
+
+template<class T> SHARED Matrix<T> operator & (Matrix<T> && A,             const MatrixAbstract<T> & B);
+template<class T> SHARED Matrix<T> operator & (const MatrixStrided<T> & A, Matrix<T> && B);
+template<class T> SHARED Matrix<T> operator & (Matrix<T> && A,             Matrix<T> && B);
+template<class T> SHARED Matrix<T> operator * (Matrix<T> && A,             const T scalar);
+template<class T>        Matrix<T> operator * (const T scalar,             Matrix<T> && A) {return std::move (A) * scalar;}
+template<class T> SHARED Matrix<T> operator / (Matrix<T> && A,             const MatrixAbstract<T> & B);
+template<class T> SHARED Matrix<T> operator / (const MatrixStrided<T> & A, Matrix<T> && B);
+template<class T> SHARED Matrix<T> operator / (Matrix<T> && A,             Matrix<T> && B);
+template<class T> SHARED Matrix<T> operator / (Matrix<T> && A,             const T scalar);
+template<class T> SHARED Matrix<T> operator / (const T scalar,             Matrix<T> && A);
+template<class T> SHARED Matrix<T> operator + (Matrix<T> && A,             const MatrixAbstract<T> & B);
+template<class T> SHARED Matrix<T> operator + (const MatrixStrided<T> & A, Matrix<T> && B);
+template<class T> SHARED Matrix<T> operator + (Matrix<T> && A,             Matrix<T> && B);
+template<class T> SHARED Matrix<T> operator + (Matrix<T> && A,             const T scalar);
+template<class T>        Matrix<T> operator + (const T scalar,             Matrix<T> && A) {return std::move (A) + scalar;}
+template<class T> SHARED Matrix<T> operator - (Matrix<T> && A,             const MatrixAbstract<T> & B);
+template<class T> SHARED Matrix<T> operator - (const MatrixStrided<T> & A, Matrix<T> && B);
+template<class T> SHARED Matrix<T> operator - (Matrix<T> && A,             Matrix<T> && B);
+template<class T> SHARED Matrix<T> operator - (Matrix<T> && A,             const T scalar);
+template<class T> SHARED Matrix<T> operator - (const T scalar,             Matrix<T> && A);
+template<class T>        Matrix<T> operator - (Matrix<T> && A) {return std::move (A) * (T) -1;}
+
+#ifdef n2a_FP
+// Defined in fixedpoint.cc
+SHARED Matrix<int> shift               (Matrix<int> && A,                                   int shift);
+SHARED Matrix<int> visit               (Matrix<int> && A, int (*function) (int, int),      int exponent1);
+SHARED Matrix<int> visit               (Matrix<int> && A, int (*function) (int, int, int), int exponent1, int exponent2);
+SHARED Matrix<int> multiplyElementwise (Matrix<int> && A, const MatrixStrided<int> & B,    int shift);
+SHARED Matrix<int> multiply            (Matrix<int> && A, int b,                           int shift);
+#endif
+
 template<class T, int R, int C>
 class MatrixFixed : public MatrixStrided<T>
 {
@@ -351,19 +406,47 @@ template<int R, int C>        MatrixFixed<int,R,C> divide              (const Ma
 template<int R, int C>        MatrixFixed<int,R,C> divide              (int a,                          const MatrixFixed<int,R,C> & B, int shift);
 #endif
 
+/**
+    Lets the sparse multiply kernels and KDTree::findBatch() borrow worker threads from their host,
+    without the matrix library depending on it. The simulator installs one when it has a thread pool.
+**/
+class SHARED MatrixThreads
+{
+public:
+    virtual ~MatrixThreads () {}
+    virtual int  available () = 0;                                       ///< Number of threads run() would use if called now from this thread. 1 means work serially.
+    virtual void run       (const std::function<void (int)> & job) = 0;  ///< Calls job(t) for each t in [0,available()), concurrently. Returns after all are done.
+};
+extern SHARED MatrixThreads * matrixThreads;  ///< Null unless a host has installed one. Defined in holder.cc.
+
 /**
     Stores only nonzero elements.  Assumes that every column has at least
     one non-zero entry, so stores a structure for every column.  This is
     a trade-off between time and space (as always).  If the matrix is
     extremely sparse (not all columns used), then a sparse structure for
     holding the column structures would be better.
+
+    <p>The map form is a mutable builder. Once a matrix is stable, compress()
+    converts it to compressed sparse column (CSC) form, which holds the same
+    elements in three flat arrays and releases the maps. Reads, iteration and
+    the multiply kernels all use whichever form is current. Calling set() on
+    a compressed matrix first restores the map form.
 **/
 template<class T>
 class SHARED MatrixSparse : public MatrixAbstract<T>
 {
 public:
+    class Compressed
+    {
+    public:
+        std::vector<int> start;  ///< Offset of each column in row and value, followed by one entry holding the total count.
+        std::vector<int> row;    ///< In ascending order within each column.
+        std::vector<T>   value;
+    };
+
     int rows_;
-    std::shared_ptr<std::vector<std::map<int,T>>> data;
+    std::shared_ptr<std::vector<std::map<int,T>>> data;  ///< Map form. All maps are empty while compressed.
+    std::shared_ptr<Compressed>                   csc;   ///< Shared by copies, same as data. Empty unless compressed.
 
     MatrixSparse ();
     MatrixSparse (const int rows, const int columns);
@@ -375,7 +458,17 @@ public:
     virtual T & operator () (const int row, const int column) const;           ///< If element does not exist, this returns a dummy element. Assigning to it will have no effect. Elements must be created with set().
     virtual int rows        () const;
     virtual int columns     () const;
+
+    void compress   ();  ///< Converts map form to CSC form.
+    void compress   (int rows, int columns, const std::vector<int> & r, const std::vector<int> & c, const std::vector<T> & v); ///< Builds CSC form directly from a list of elements in any order, without going through maps. Same semantics as calling set() on each in sequence, so zeros are dropped and a later duplicate replaces an earlier one.
+    void decompress ();  ///< Rebuilds map form from CSC form, so the matrix can be modified again.
+    bool compressed () const {return csc  &&  csc->start.size ();}
 };
 
+template<class T> SHARED Matrix<T> operator * (const MatrixSparse<T> & A, const MatrixAbstract<T> & B);  ///< Sparse times dense. When A is compressed, work is split across matrixThreads, if installed.
+#ifdef n2a_FP
+SHARED Matrix<int> multiply (const MatrixSparse<int> & A, const MatrixAbstract<int> & B, int shift);  // Defined in fixedpoint.cc
+#endif
+
 
 #endif
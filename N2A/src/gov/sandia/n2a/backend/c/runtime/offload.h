@@ -0,0 +1,84 @@
+/*
+Copyright 2023 National Technology & Engineering Solutions of Sandia, LLC (NTESS).
+Under the terms of Contract DE-NA0003525 with NTESS,
+the U.S. Government retains certain rights in this software.
+*/
+
+
+#ifndef n2a_offload_h
+#define n2a_offload_h
+
+#include <cstdlib>
+#include <algorithm>
+
+/**
+    One variable of an offloaded population, stored as a structure-of-arrays column.
+    The host buffer has a matching allocation on the default OpenMP device for as long as it lives.
+    Generated kernels index data directly inside a target region. Since the buffer is already
+    present on the device, OpenMP substitutes the device copy.
+    <p>When the compiler has no offload target, or OpenMP is not enabled at all, the target regions
+    simply run on the host. In that case upload() and download() are no-ops, and the kernel is still
+    a plain loop over contiguous arrays.
+**/
+template<class E>
+class OffloadColumn
+{
+public:
+    E * data;
+    int capacity;
+
+    OffloadColumn ()
+    {
+        data     = 0;
+        capacity = 0;
+    }
+
+    OffloadColumn (const OffloadColumn & that) = delete;
+    OffloadColumn & operator= (const OffloadColumn & that) = delete;
+
+    ~OffloadColumn ()
+    {
+        release ();
+    }
+
+    /// Ensures room for n entries. Contents are lost if the buffer grows, so the caller should fill and upload all entries afterward.
+    void reserve (int n)
+    {
+        if (n <= capacity) return;
+        n = std::max (n, 2 * capacity);
+        release ();
+        data     = (E *) malloc (n * sizeof (E));
+        capacity = n;
+        E * d = data;
+#       pragma omp target enter data map(alloc: d[0:n])
+    }
+
+    void release ()
+    {
+        if (! data) return;
+        E * d = data;
+        int n = capacity;
+#       pragma omp target exit data map(delete: d[0:n])
+        free (data);
+        data     = 0;
+        capacity = 0;
+    }
+
+    /// Copies the first n entries from host to device.
+    void upload (int n)
+    {
+        if (n <= 0) return;
+        E * d = data;
+#       pragma omp target update to(d[0:n])
+    }
+
+    /// Copies the first n entries from device to host.
+    void download (int n)
+    {
+        if (n <= 0) return;
+        E * d = data;
+#       pragma omp target update from(d[0:n])
+    }
+};
+
+#endif
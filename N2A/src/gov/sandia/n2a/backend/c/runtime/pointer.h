@@ -59,6 +59,15 @@ namespace n2a
 	  attach (that);
 	}
 
+	/// Takes over the block without touching its refcount. Leaves that empty.
+	Pointer (Pointer && that)
+	{
+	  memory = that.memory;
+	  metaData = that.metaData;
+	  that.memory = 0;
+	  that.metaData = 0;
+	}
+
 	Pointer (void * that, ptrdiff_t size = 0)
 	{
 	  memory = (RefCount *) that;
@@ -93,6 +102,19 @@ namespace n2a
 	  return *this;
 	}
 
+	Pointer & operator = (Pointer && that)
+	{
+	  if (&that != this)
+	  {
+		detach ();
+		memory = that.memory;
+		metaData = that.metaData;
+		that.memory = 0;
+		that.metaData = 0;
+	  }
+	  return *this;
+	}
+
 	Pointer & operator = (void * that)
 	{
 	  attach (that);
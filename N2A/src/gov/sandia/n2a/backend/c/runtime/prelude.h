@@ -0,0 +1,27 @@
+/*
+Copyright 2023 National Technology & Engineering Solutions of Sandia, LLC (NTESS).
+Under the terms of Contract DE-NA0003525 with NTESS,
+the U.S. Government retains certain rights in this software.
+*/
+
+
+// The runtime headers that every generated model includes first.
+// JobC may precompile this file, so it must stay the first include in model.cc,
+// and its contents may only depend on macros set on the compiler's command line.
+
+#ifndef n2a_prelude_h
+#define n2a_prelude_h
+
+#include "math.h"  // math.h must always come first, because it messes with mode in which <cmath> is included.
+#include "runtime.h"
+#include "MatrixFixed.tcc"  // Pulls in matrix.h, and thus access to all other matrix classes. We need templates for MatrixFixed because dimensions are arbitrary in user code.
+#ifdef n2a_FP
+#  include "fixedpoint.tcc"  // Math functions with exponents fixed at compile time.
+#endif
+
+#include <iostream>
+#include <vector>
+#include <unordered_set>
+#include <csignal>
+
+#endif
@@ -5,62 +5,363 @@ the U.S. Government retains certain rights in this software.
 */
 
 
+#include "profiling.h"
+
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+
+#include "shared.h"
 
 
 using namespace std;
 
 
+// Kokkos --------------------------------------------------------------------
+
 void (*init_cb)        (int loadseq, uint64_t version, uint32_t ndevinfos, void * devinfos);
 void (*push_region_cb) (const char*);
 void (*pop_region_cb)  ();
 void (*finalize_cb)    ();
 
-#ifndef _WIN32
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#undef min
+#undef max
+static void * openLibrary (const char * name)
+{
+    return (void *) LoadLibraryA (name);
+}
+static void * findSymbol (void * library, const char * name)
+{
+    return (void *) GetProcAddress ((HMODULE) library, name);
+}
+
+#else
 
 #include <dlfcn.h>
+static void * openLibrary (const char * name)
+{
+    return dlopen (name, RTLD_NOW | RTLD_GLOBAL);
+}
+static void * findSymbol (void * library, const char * name)
+{
+    return dlsym (library, name);
+}
+
+#endif
+
 void get_callbacks ()
 {
     char *x = getenv ("KOKKOS_PROFILE_LIBRARY");
     if (! x) throw "KOKKOS_PROFILE_LIBRARY environment variable must be specified";
 
-    void *firstProfileLibrary = dlopen (x, RTLD_NOW | RTLD_GLOBAL);
-    if (! firstProfileLibrary) throw "dlopen() failed";
+    void *firstProfileLibrary = openLibrary (x);
+    if (! firstProfileLibrary) throw "Failed to load KOKKOS_PROFILE_LIBRARY";
 
-    void *p9  = dlsym (firstProfileLibrary, "kokkosp_push_profile_region");
-    void *p10 = dlsym (firstProfileLibrary, "kokkosp_pop_profile_region");
-    void *p11 = dlsym (firstProfileLibrary, "kokkosp_init_library");
-    void *p12 = dlsym (firstProfileLibrary, "kokkosp_finalize_library");
+    void *p9  = findSymbol (firstProfileLibrary, "kokkosp_push_profile_region");
+    void *p10 = findSymbol (firstProfileLibrary, "kokkosp_pop_profile_region");
+    void *p11 = findSymbol (firstProfileLibrary, "kokkosp_init_library");
+    void *p12 = findSymbol (firstProfileLibrary, "kokkosp_finalize_library");
 
     push_region_cb = *reinterpret_cast<decltype(push_region_cb)*> (&p9);
     pop_region_cb  = *reinterpret_cast<decltype(pop_region_cb)*>  (&p10);
     init_cb        = *reinterpret_cast<decltype(init_cb)*>        (&p11);
     finalize_cb    = *reinterpret_cast<decltype(finalize_cb)*>    (&p12);
 
-    (*init_cb) (0, 0, 0, nullptr);
+    // A tool need not implement every entry point.
+    if (init_cb) (*init_cb) (0, 0, 0, nullptr);
 }
 
+
+// Native --------------------------------------------------------------------
+
+struct Region
+{
+    string   name;
+    uint64_t calls;
+    uint64_t ticks;       ///< Inclusive time.
+    uint64_t childTicks;  ///< Portion of ticks spent in nested regions.
+};
+
+struct Frame
+{
+    Region * region;
+    uint64_t start;
+};
+
+/**
+    Regions timed by one thread. Each thread that runs simulator code gets its own table,
+    so push_region() and pop_region() never contend. finalize_profiling() merges the
+    tables by region name.
+**/
+struct RegionTable
+{
+    map<string,Region>                   regions;
+    unordered_map<const char *,Region *> literals; ///< Cache of regions by address of name, for push_region(const char *).
+    vector<Frame>                        stack;
+
+    Region * get (const string & name)
+    {
+        Region & r = regions[name];
+        if (r.name.empty ()) r.name = name;
+        return &r;
+    }
+};
+
+/**
+    Everything except the hot counters, which live in Profile so the simulator can reach
+    them inline. Region tables are owned here, one per thread that has adopted this profiler.
+**/
+struct Profiler
+{
+    map<string,Region>               regions;  ///< Merged from all tables by finalize_profiling(). Sorted by name, which groups the functions of each population together in the report.
+    vector<RegionTable *>            tables;
+    mutex                            tablesMutex;
+    string                           reportFile;
+    ofstream                         sample;
+    uint64_t                         sampleInterval;  ///< In ticks
+    uint64_t                         startTicks;
+    chrono::steady_clock::time_point startTime;
+    double                           ticksPerSecond;  ///< Initial estimate. Recomputed over the whole run when the report is written.
+
+    ~Profiler ()
+    {
+        for (RegionTable * t : tables) delete t;
+    }
+
+    RegionTable * addTable ()
+    {
+        lock_guard<mutex> lock (tablesMutex);
+        RegionTable * result = new RegionTable;
+        tables.push_back (result);
+        return result;
+    }
+};
+
+#ifdef n2a_TLS
+thread_local Profile  profile;
+thread_local Profiler profiler;
 #else
+Profile  profile;
+Profiler profiler;
+#endif
 
-void get_callbacks ()
+/// The profiler this thread reports regions to, if any. Set by start_profiling() for the simulator thread, and by profile_adopt() for its workers.
+struct RegionThread
 {
-    throw "Profiling not implemented on WIN32";
+    Profiler *    owner;
+    RegionTable * table;
+};
+static thread_local RegionThread regionThread = {0, 0};
+
+static const char * counterNames[profileCounterCount] = {"events", "spikes", "born", "died", "queueDepth"};
+
+static double calibrate ()
+{
+#   ifdef n2a_TSC
+    // Short busy-wait against the steady clock. Only used to schedule samples,
+    // so a rough figure is enough.
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now ();
+    uint64_t c0 = profile_ticks ();
+    chrono::duration<double> elapsed;
+    do elapsed = chrono::steady_clock::now () - t0;
+    while (elapsed.count () < 0.01);
+    return (profile_ticks () - c0) / elapsed.count ();
+#   else
+    return 1e9;
+#   endif
 }
 
-#endif
+void start_profiling (const char * reportFile, const char * sampleFile, double sampleInterval)
+{
+    profiler.reportFile     = reportFile ? reportFile : "";
+    profiler.ticksPerSecond = calibrate ();
+    profiler.startTime      = chrono::steady_clock::now ();
+    profiler.startTicks     = profile_ticks ();
+
+    profile.nextSample = ~(uint64_t) 0;
+    if (sampleFile  &&  sampleInterval > 0)
+    {
+        profiler.sample.open (sampleFile);
+        if (profiler.sample.good ())
+        {
+            profiler.sample << "seconds";
+            for (int i = 0; i < profileCounterCount; i++) profiler.sample << "\t" << counterNames[i];
+            profiler.sample << endl;
+            profiler.sampleInterval = (uint64_t) (sampleInterval * profiler.ticksPerSecond);
+            profile.nextSample = profiler.startTicks + profiler.sampleInterval;
+        }
+        else
+        {
+            cerr << "WARNING: Failed to open profile sample file " << sampleFile << endl;
+        }
+    }
+
+    profile.active = true;
+    profile_adopt (&profiler);
+}
+
+void * profile_context ()
+{
+    if (! profile.active) return 0;
+    return &profiler;
+}
+
+void profile_adopt (void * context)
+{
+    Profiler * p = (Profiler *) context;
+    if (p == regionThread.owner) return;
+    regionThread.owner = p;
+    regionThread.table = p ? p->addTable () : 0;
+}
 
-void push_region (const std::string& kName)
+void profile_sample ()
 {
-    if (push_region_cb) (*push_region_cb) (kName.c_str ());
+    uint64_t now = profile_ticks ();
+    profiler.sample << (now - profiler.startTicks) / profiler.ticksPerSecond;
+    for (int i = 0; i < profileCounterCount; i++) profiler.sample << "\t" << profile.counters[i];
+    profiler.sample << "\n";
+    profile.nextSample = now + profiler.sampleInterval;
+}
+
+static inline void push_native (RegionTable * t, Region * r)
+{
+    r->calls++;
+    t->stack.push_back ({r, profile_ticks ()});
+}
+
+void push_region (const char * name)
+{
+    if (push_region_cb) (*push_region_cb) (name);
+    RegionTable * t = regionThread.table;
+    if (! t) return;
+
+    Region *& r = t->literals[name];
+    if (! r) r = t->get (name);
+    push_native (t, r);
+}
+
+void push_region (const string & name)
+{
+    if (push_region_cb) (*push_region_cb) (name.c_str ());
+    RegionTable * t = regionThread.table;
+    if (! t) return;
+    push_native (t, t->get (name));
+}
+
+static inline void pop_native (RegionTable * t)
+{
+    Frame f = t->stack.back ();
+    t->stack.pop_back ();
+    uint64_t elapsed = profile_ticks () - f.start;
+    f.region->ticks += elapsed;
+    if (! t->stack.empty ()) t->stack.back ().region->childTicks += elapsed;
 }
 
 void pop_region ()
 {
     if (pop_region_cb) (*pop_region_cb) ();
+    RegionTable * t = regionThread.table;
+    if (t  &&  ! t->stack.empty ()) pop_native (t);
+}
+
+static void report (ostream & out)
+{
+    chrono::duration<double> wall = chrono::steady_clock::now () - profiler.startTime;
+    uint64_t elapsed = profile_ticks () - profiler.startTicks;
+    double tps = profiler.ticksPerSecond;
+    if (wall.count () > 0.1) tps = elapsed / wall.count ();  // Long runs give a much better estimate than the initial calibration.
+
+    out << "Wall time: " << wall.count () << " s" << endl;
+    out << endl;
+
+    uint64_t events = profile.counters[profileEvents];
+    for (int i = 0; i < profileCounterCount; i++)
+    {
+        out << setw (12) << left << counterNames[i] << right << setw (16) << profile.counters[i];
+        if (i == profileQueueDepth  &&  events) out << "  mean " << (double) profile.counters[i] / events << "  max " << profile.queueMax;
+        out << endl;
+    }
+    out << endl;
+
+    // Regions, hottest first by exclusive time
+    vector<Region *> sorted;
+    for (auto & it : profiler.regions) sorted.push_back (&it.second);
+    stable_sort (sorted.begin (), sorted.end (), [](Region * a, Region * b)
+    {
+        return a->ticks - a->childTicks > b->ticks - b->childTicks;
+    });
+
+    out << setw (12) << "self (s)" << setw (12) << "total (s)" << setw (8) << "%" << setw (14) << "calls" << setw (12) << "us/call" << "  region" << endl;
+    for (Region * r : sorted)
+    {
+        double self  = (r->ticks - r->childTicks) / tps;
+        double total = r->ticks / tps;
+        out << fixed << setprecision (6);
+        out << setw (12) << self << setw (12) << total;
+        out << setprecision (2) << setw (8) << (wall.count () > 0 ? 100 * self / wall.count () : 0);
+        out << setw (14) << r->calls;
+        out << setw (12) << (r->calls ? 1e6 * total / r->calls : 0);
+        out << "  " << r->name << endl;
+        out << defaultfloat;
+    }
 }
 
 void finalize_profiling ()
 {
-    (*finalize_cb) ();
+    if (finalize_cb) (*finalize_cb) ();
+    if (! profile.active) return;
+
+    // Close any regions left open by an early exit, so their time still counts.
+    RegionTable * t = regionThread.table;
+    if (t) while (! t->stack.empty ()) pop_native (t);
+
+    // Workers are idle between jobs, so their tables are stable here.
+    {
+        lock_guard<mutex> lock (profiler.tablesMutex);
+        for (RegionTable * table : profiler.tables)
+        {
+            for (auto & it : table->regions)
+            {
+                Region & from = it.second;
+                Region & to   = profiler.regions[it.first];
+                to.name        = from.name;
+                to.calls      += from.calls;
+                to.ticks      += from.ticks;
+                to.childTicks += from.childTicks;
+            }
+            table->regions.clear ();
+            table->literals.clear ();
+        }
+    }
+
+    if (profiler.sample.is_open ())
+    {
+        profile_sample ();
+        profiler.sample.close ();
+    }
+
+    if (profiler.reportFile.empty ())
+    {
+        report (cerr);
+    }
+    else
+    {
+        ofstream out (profiler.reportFile.c_str ());
+        if (out.good ()) report (out);
+        else             cerr << "WARNING: Failed to write profile report " << profiler.reportFile << endl;
+    }
+
+    profile.active = false;
+    profile_adopt (0);
 }
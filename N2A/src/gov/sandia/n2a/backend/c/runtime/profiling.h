@@ -8,9 +8,103 @@ the U.S. Government retains certain rights in this software.
 #ifndef n2a_profiling_h
 #define n2a_profiling_h
 
-void get_callbacks ();
-void push_region (const std::string&);
-void pop_region ();
-void finalize_profiling ();
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+
+#if defined(__x86_64__)  ||  defined(__i386__)  ||  defined(_M_X64)  ||  defined(_M_IX86)
+# ifdef _MSC_VER
+#   include <intrin.h>
+# else
+#   include <x86intrin.h>
+# endif
+# define n2a_TSC
+#endif
+
+#include "shared.h"
+
+/**
+    Two profiling modes are available, and either or both may be active:
+    <ul>
+    <li>Kokkos -- get_callbacks() loads the tool library named by KOKKOS_PROFILE_LIBRARY
+    and regions are forwarded to it.
+    <li>Native -- start_profiling() enables timers and counters built into the runtime.
+    Each region accumulates calls, inclusive and exclusive time. The simulator counts events,
+    spike deliveries, births, deaths and queue depth. A summary is written at finalize_profiling().
+    </ul>
+    Regions are the push/pop pairs that the code generator emits around integrate(),
+    update() and updateDerivative() of each population.
+**/
+SHARED void get_callbacks ();
+SHARED void start_profiling (const char * reportFile = "profile", const char * sampleFile = 0, double sampleInterval = 0);  ///< Enables native mode. If sampleInterval > 0, a line of cumulative counters is appended to sampleFile about that often (seconds of wall-clock time).
+SHARED void push_region (const char * name);         ///< Fast form for string literals. Native mode identifies the region by the address of name, so it must remain valid until finalize_profiling().
+SHARED void push_region (const std::string & name);
+SHARED void pop_region ();
+SHARED void finalize_profiling ();
+
+/**
+    Region timing is kept per thread and merged at finalize_profiling(). A thread other than
+    the one that called start_profiling() records regions only after it adopts the profiler.
+    ThreadPool does this for its workers: it fetches profile_context() when a job is posted
+    and each worker passes that value to profile_adopt() before running its share.
+**/
+SHARED void * profile_context ();                ///< @return Handle to the calling thread's active profiler, or null if native mode is off.
+SHARED void   profile_adopt   (void * context);  ///< Direct this thread's regions to the given profiler. Null stops recording.
+
+enum ProfileCounter
+{
+    profileEvents,      ///< Events dequeued and run by Simulator::run().
+    profileSpikes,      ///< Spike deliveries, counted once per target part.
+    profileBorn,        ///< Parts allocated by populations.
+    profileDied,        ///< Parts removed from simulation because finalize() returned false.
+    profileQueueDepth,  ///< Sum of event queue size sampled before each event. Divide by profileEvents for the mean.
+    profileCounterCount
+};
+
+/**
+    State touched by the hooks inside the simulator. Kept as a plain struct so a disabled
+    profiler costs one predictable branch at each hook.
+    Under n2a_TLS each thread (and thus each Simulator) has its own copy.
+**/
+struct Profile
+{
+    bool     active;
+    uint64_t counters[profileCounterCount];
+    uint64_t queueMax;
+    uint64_t nextSample;  ///< Tick count at which profile_sample() should next be called. ~0 when sampling is off.
+};
+
+#ifdef n2a_TLS
+extern SHARED thread_local Profile profile;
+#else
+extern SHARED Profile profile;
+#endif
+
+inline uint64_t profile_ticks ()
+{
+#   ifdef n2a_TSC
+    return __rdtsc ();
+#   else
+    return std::chrono::duration_cast<std::chrono::nanoseconds> (std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+#   endif
+}
+
+SHARED void profile_sample ();  ///< Appends one line to the sample file. Called by profile_event() when its interval expires.
+
+inline void profile_count (ProfileCounter which, uint64_t n = 1)
+{
+    if (profile.active) profile.counters[which] += n;
+}
+
+/// Called once per event by Simulator::run(), before the event is popped.
+inline void profile_event (size_t depth)
+{
+    if (! profile.active) return;
+    profile.counters[profileEvents]++;
+    profile.counters[profileQueueDepth] += depth;
+    if (depth > profile.queueMax) profile.queueMax = depth;
+    if (profile.nextSample != ~(uint64_t) 0  &&  profile_ticks () >= profile.nextSample) profile_sample ();
+}
 
 #endif
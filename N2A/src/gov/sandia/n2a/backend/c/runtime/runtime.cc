@@ -8,6 +8,7 @@ the U.S. Government retains certain rights in this software.
 #include "runtime.tcc"
 
 #include <csignal>
+#include <exception>
 
 
 using namespace std;
@@ -20,6 +21,8 @@ template SHARED n2a_T uniform (n2a_T sigma);
 template SHARED n2a_T uniform (n2a_T lo, n2a_T hi, n2a_T step);
 template SHARED n2a_T gaussian ();
 template SHARED n2a_T gaussian (n2a_T sigma);
+template SHARED void  uniform  (n2a_T * result, int count);
+template SHARED void  gaussian (n2a_T * result, int count);
 
 template SHARED MatrixFixed<n2a_T,3,1> grid    (int i, int nx, int ny, int nz);
 template SHARED MatrixFixed<n2a_T,3,1> gridRaw (int i, int nx, int ny, int nz);
@@ -29,6 +32,7 @@ template SHARED n2a_T pulse (n2a_T t, n2a_T width, n2a_T period, n2a_T rise, n2a
 template SHARED n2a_T unitmap (const MatrixAbstract<n2a_T> & A, n2a_T row, n2a_T column);
 
 template SHARED void removeMonitor (std::vector<Part<n2a_T> *> & partList, Part<n2a_T> * part);
+template SHARED void removeMonitor (SynapseRow<n2a_T>          & partList, Part<n2a_T> * part);
 
 #ifndef N2A_SPINNAKER
 void signalHandler (int number)
@@ -50,6 +54,12 @@ void signalHandler (int number)
 }
 #endif
 
+static uint64_t              randomSeed = 0;          ///< Given to n2a_srand() while there was no simulator. Starting seed of each new RandomSource.
+static std::atomic<uint64_t> randomGenerations (1);  ///< Source of RandomSource::generation values.
+#ifdef n2a_TLS
+static RandomSource          randomDefault;          ///< For threads that have no simulator.
+#endif
+
 void n2a_srand (unsigned int seed)
 {
     // By putting this here, it gets compiled into the runtime library.
@@ -57,6 +67,352 @@ void n2a_srand (unsigned int seed)
     // the seed is different between the calling code and the library code,
     // so setting seed in main() doesn't work.
     srand (seed);
+#   ifdef n2a_TLS
+    if (Simulator<n2a_T>::instance)
+    {
+        Simulator<n2a_T>::instance->random.reseed (seed);
+        return;
+    }
+    randomSeed = seed;  // For simulators created after this
+    randomDefault.reseed (seed);
+#   else
+    Simulator<n2a_T>::instance.random.reseed (seed);
+#   endif
+}
+
+int n2a_rand ()
+{
+    return RandomStream::current ()->next () & RAND_MAX;
+}
+
+
+// class RandomStream --------------------------------------------------------
+
+static thread_local RandomStream *  installedStream  = 0;
+static thread_local RandomStream    threadStream;
+static thread_local uint64_t        threadGeneration = 0;
+static thread_local uint64_t        threadIndex      = 0;  ///< Stream id of the default stream. Set by ThreadPool::work(), so it is the same from run to run.
+
+RandomStream::RandomStream (uint64_t seed, uint64_t id)
+{
+    this->seed (seed, id);
+}
+
+void
+RandomStream::seed (uint64_t seed, uint64_t id)
+{
+    key[0]       = (uint32_t) seed;
+    key[1]       = (uint32_t) (seed >> 32);
+    counter[0]   = 0;
+    counter[1]   = 0;
+    counter[2]   = (uint32_t) id;
+    counter[3]   = (uint32_t) (id >> 32);
+    used         = 4;
+    haveGaussian = false;
+}
+
+void
+RandomStream::seek (uint64_t position)
+{
+    uint64_t b = position >> 2;
+    counter[0] = (uint32_t) b;
+    counter[1] = (uint32_t) (b >> 32);
+    used       = 4;
+    int offset = position & 3;
+    if (offset)
+    {
+        next32 ();
+        used = offset;
+    }
+}
+
+uint32_t
+RandomStream::next32 ()
+{
+    if (used >= 4)
+    {
+        philox (counter, key, block);
+        if (++counter[0] == 0) counter[1]++;
+        used = 0;
+    }
+    return block[used++];
+}
+
+int
+RandomStream::next ()
+{
+    return next32 () >> 1;
+}
+
+void
+RandomStream::fill (uint32_t * result, int count)
+{
+    while (count > 0  &&  used < 4)
+    {
+        *result++ = block[used++];
+        count--;
+    }
+    while (count >= 4)
+    {
+        philox (counter, key, result);
+        if (++counter[0] == 0) counter[1]++;
+        result += 4;
+        count  -= 4;
+    }
+    while (count-- > 0) *result++ = next32 ();
+}
+
+void
+RandomStream::philox (const uint32_t counter[4], const uint32_t key[2], uint32_t result[4])
+{
+    uint32_t c0 = counter[0];
+    uint32_t c1 = counter[1];
+    uint32_t c2 = counter[2];
+    uint32_t c3 = counter[3];
+    uint32_t k0 = key[0];
+    uint32_t k1 = key[1];
+    for (int r = 0; r < 10; r++)
+    {
+        uint64_t p0 = (uint64_t) 0xD2511F53 * c0;
+        uint64_t p1 = (uint64_t) 0xCD9E8D57 * c2;
+        c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+        c1 = (uint32_t) p1;
+        c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+        c3 = (uint32_t) p0;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+    result[0] = c0;
+    result[1] = c1;
+    result[2] = c2;
+    result[3] = c3;
+}
+
+RandomStream *
+RandomStream::current ()
+{
+    if (installedStream) return installedStream;
+#   ifdef n2a_TLS
+    RandomSource & source = Simulator<n2a_T>::instance ? Simulator<n2a_T>::instance->random : randomDefault;
+#   else
+    RandomSource & source = Simulator<n2a_T>::instance.random;
+#   endif
+    uint64_t g = source.generation.load (memory_order_acquire);
+    if (threadGeneration != g)
+    {
+        threadStream.seed (source.seed, threadIndex);
+        threadGeneration = g;
+    }
+    return &threadStream;
+}
+
+RandomStream *
+RandomStream::install (RandomStream * stream)
+{
+    RandomStream * result = installedStream;
+    installedStream = stream;
+    return result;
+}
+
+
+// class RandomSource --------------------------------------------------------
+
+RandomSource::RandomSource ()
+{
+    seed = randomSeed;
+    generation.store (randomGenerations.fetch_add (1, memory_order_relaxed), memory_order_relaxed);
+}
+
+void
+RandomSource::reseed (uint64_t seed)
+{
+    this->seed = seed;
+    generation.store (randomGenerations.fetch_add (1, memory_order_relaxed), memory_order_release);
+}
+
+
+// class ThreadPool ----------------------------------------------------------
+
+ThreadPool::ThreadPool (int count)
+:   count (count)
+{
+    job            = 0;
+    profileContext = 0;
+    generation     = 0;
+    remaining  = 0;
+    quit       = false;
+    error      = 0;
+    busy.resize (count, 0.0);
+    workers.reserve (count - 1);
+    for (int i = 1; i < count; i++) workers.emplace_back (&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool ()
+{
+    {
+        lock_guard<std::mutex> lock (mutex);
+        quit = true;
+        generation++;
+    }
+    wake.notify_all ();
+    for (auto & w : workers) w.join ();
+}
+
+void
+ThreadPool::run (const function<void (int)> & job)
+{
+    this->job      = &job;
+    error          = 0;
+    profileContext = profile_context ();
+    remaining.store (count - 1, memory_order_relaxed);
+    {
+        lock_guard<std::mutex> lock (mutex);
+        generation++;
+    }
+    wake.notify_all ();
+
+    // Workers are still using job and whatever it captured from our caller's stack,
+    // so an exception here must wait for the barrier like any other.
+    exception_ptr callerError;
+    try
+    {
+        job (0);
+    }
+    catch (const char * message)
+    {
+        lock_guard<std::mutex> lock (mutex);
+        if (! error) error = message;
+    }
+    catch (...)
+    {
+        callerError = current_exception ();
+    }
+
+    // Barrier. Phases are often short, so spin rather than sleep.
+    while (remaining.load (memory_order_acquire) > 0) this_thread::yield ();
+    this->job = 0;
+    if (callerError) rethrow_exception (callerError);
+    if (error) throw error;
+}
+
+void
+ThreadPool::work (int index)
+{
+    threadIndex = index;  // This thread's default RandomStream
+    int seen = 0;
+    while (true)
+    {
+        // Spin briefly in case the next phase follows immediately, then block.
+        int spin = 0;
+        while (generation.load (memory_order_acquire) == seen)
+        {
+            if (++spin < 1000)
+            {
+                this_thread::yield ();
+                continue;
+            }
+            unique_lock<std::mutex> lock (mutex);
+            wake.wait (lock, [this, seen] {return generation.load () != seen;});
+        }
+        seen = generation.load (memory_order_acquire);
+        if (quit) return;
+
+        profile_adopt (profileContext);
+        try
+        {
+            (*job) (index);
+        }
+        catch (const char * message)
+        {
+            lock_guard<std::mutex> lock (mutex);
+            if (! error) error = message;
+        }
+        catch (...)
+        {
+            lock_guard<std::mutex> lock (mutex);
+            if (! error) error = "Generic Exception in worker thread";
+        }
+        remaining.fetch_sub (1, memory_order_release);
+    }
+}
+
+void
+ThreadPool::report (ostream & out)
+{
+    double most = 0;
+    for (double b : busy) most = max (most, b);
+    out << "Thread busy time (seconds, fraction of busiest):" << endl;
+    for (int i = 0; i < count; i++)
+    {
+        out << "  " << i << "\t" << busy[i];
+        if (most > 0) out << "\t" << busy[i] / most;
+        out << endl;
+    }
+}
+
+
+// class PartArena -----------------------------------------------------------
+
+PartArena::PartArena (size_t size, int chunkSize)
+:   chunkSize (chunkSize)
+{
+    const size_t a = alignof (max_align_t);
+    size = std::max (size, sizeof (void *));
+    this->size = (size + a - 1) / a * a;
+    available  = 0;
+    live       = 0;
+    capacity   = 0;
+}
+
+PartArena::~PartArena ()
+{
+    if (live) return;
+    for (char * c : chunks) delete[] c;
+}
+
+void *
+PartArena::allocate ()
+{
+    lock_guard<std::mutex> lock (mutex);
+    if (! available) grow (chunkSize);
+    void * result = available;
+    available = * (void **) result;
+    live++;
+    return result;
+}
+
+void
+PartArena::release (void * slot)
+{
+    if (! slot) return;
+    lock_guard<std::mutex> lock (mutex);
+    * (void **) slot = available;
+    available = slot;
+    live--;
+}
+
+void
+PartArena::reserve (int n)
+{
+    lock_guard<std::mutex> lock (mutex);
+    int shortfall = n - (capacity - live);
+    if (shortfall > 0) grow (std::max (shortfall, chunkSize));
+}
+
+void
+PartArena::grow (int n)
+{
+    char * c = new char[size * n + alignment];
+    chunks.push_back (c);
+    char * first = (char *) (((uintptr_t) c + alignment - 1) / alignment * alignment);
+    // Thread free list in reverse, so slots come out in address order.
+    for (int i = n - 1; i >= 0; i--)
+    {
+        void ** slot = (void **) (first + i * size);
+        *slot = available;
+        available = slot;
+    }
+    capacity += n;
 }
 
 
@@ -70,12 +426,29 @@ template class WrapperBase<n2a_T>;
 template class ConnectIterator<n2a_T>;
 template class ConnectPopulation<n2a_T>;
 template class ConnectPopulationNN<n2a_T>;
+template class NNCache<n2a_T>;
 template class ConnectMatrix<n2a_T>;
+template class SynapseRow<n2a_T>;
+template class SynapseTable<n2a_T>;
 template class Population<n2a_T>;
+template class CalendarQueue<n2a_T>;
+template class EventQueue<n2a_T>;
 template class Simulator<n2a_T>;
+template class SimulatorMatrixThreads<n2a_T>;
+template class Checkpoint<n2a_T>;
 template class Integrator<n2a_T>;
 template class Euler<n2a_T>;
 template class RungeKutta<n2a_T>;
+#ifdef n2a_TLS
+template class Ensemble<n2a_T>;
+#endif
+#ifdef n2a_MPI
+template class Distributed<n2a_T>;
+template class EventExchange<n2a_T>;
+#endif
+#ifndef n2a_FP
+template class DormandPrince<n2a_T>;
+#endif
 template class Event<n2a_T>;
 template class EventStep<n2a_T>;
 template class EventSpike<n2a_T>;
@@ -83,7 +456,13 @@ template class EventSpikeSingle<n2a_T>;
 template class EventSpikeSingleLatch<n2a_T>;
 template class EventSpikeMulti<n2a_T>;
 template class EventSpikeMultiLatch<n2a_T>;
+template class Slab<EventSpikeSingle<n2a_T>>;
+template class Slab<EventSpikeSingleLatch<n2a_T>>;
+template class Slab<EventSpikeMulti<n2a_T>>;
+template class Slab<EventSpikeMultiLatch<n2a_T>>;
+template class SpikePool<n2a_T>;
 template class Visitor<n2a_T>;
 template class VisitorStep<n2a_T>;
 template class VisitorSpikeMulti<n2a_T>;
 template class DelayBuffer<n2a_T>;
+template class DelayBufferRing<n2a_T>;
@@ -18,6 +18,20 @@ the U.S. Government retains certain rights in this software.
 #include <queue>
 #include <vector>
 #include <map>
+#include <deque>
+#include <tuple>
+#include <unordered_set>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+
+#ifdef n2a_MPI
+# include <mpi.h>
+#endif
 
 #include "shared.h"
 
@@ -49,25 +63,30 @@ template<> inline int modFloor (int a, int b)
     return result;
 }
 
-SHARED void n2a_srand (unsigned int seed);  // Hack to work around Microsoft C library behavior when in DLL.
+SHARED void n2a_srand (unsigned int seed);  ///< Seeds the default RandomStream of every thread working for the current simulator. Originally a hack to work around Microsoft C library behavior when in DLL.
+SHARED int  n2a_rand ();                    ///< Same range as rand(), but draws from RandomStream::current(). Kept for compatibility with code written against rand().
 template<class T> SHARED T                  uniform ();
 template<class T> SHARED T                  uniform (T sigma);
 template<class T> SHARED T                  uniform (T lo, T hi, T step = (T) 1);
+template<class T> SHARED void               uniform (T * result, int count);  ///< Fills result with count independent draws from [0,1). Generates whole blocks of random bits at a time, so this is much cheaper than calling uniform() in a loop.
 template<class T, int R> MatrixFixed<T,R,1> uniform (const MatrixFixed<T,R,1> & sigma)
 {
     MatrixFixed<T,R,1> result;
-    const T * s = sigma.base ();
-    T *       r = result.base ();
+    T *       r   = result.base ();
     T *       end = r + R;
-    while (r < end) *r++ = uniform (*s++);
+    const T * s   = sigma.base ();
+    uniform<T> (r, R);
+#   ifdef n2a_FP
+    while (r < end) {*r = (int64_t) *r * *s++ >> 31; r++;}  // See uniform<int>(int) in runtime.tcc
+#   else
+    while (r < end) *r++ *= *s++;
+#   endif
     return result;
 }
 template<class T, int R, int C> MatrixFixed<T,R,1> uniform (const MatrixFixed<T,R,C> & sigma)
 {
     MatrixFixed<T,C,1> temp;
-    T * t   = temp.base ();
-    T * end = t + C;
-    while (t < end) *t++ = uniform<T> ();
+    uniform<T> (temp.base (), C);
 #   ifdef n2a_FP
     return multiply (sigma, temp, 31);  // See uniform<int>(int) in runtime.tcc
 #   else
@@ -77,21 +96,25 @@ template<class T, int R, int C> MatrixFixed<T,R,1> uniform (const MatrixFixed<T,
 
 template<class T> SHARED T                  gaussian ();
 template<class T> SHARED T                  gaussian (T sigma);
+template<class T> SHARED void               gaussian (T * result, int count);  ///< Fills result with count independent draws from the standard normal distribution. Same advantage as the batch form of uniform().
 template<class T, int R> MatrixFixed<T,R,1> gaussian (const MatrixFixed<T,R,1> & sigma)
 {
     MatrixFixed<T,R,1> result;
-    const T * s = sigma.base ();
-    T *       r = result.base ();
+    T *       r   = result.base ();
     T *       end = r + R;
-    while (r < end) *r++ = gaussian (*s++);
+    const T * s   = sigma.base ();
+    gaussian<T> (r, R);
+#   ifdef n2a_FP
+    while (r < end) {*r = (int64_t) *r * *s++ >> 28; r++;}  // See gaussian<int>(int) in runtime.tcc
+#   else
+    while (r < end) *r++ *= *s++;
+#   endif
     return result;
 }
 template<class T, int R, int C> MatrixFixed<T,R,1> gaussian (const MatrixFixed<T,R,C> & sigma)
 {
     MatrixFixed<T,C,1> temp;
-    T * t   = temp.base ();
-    T * end = t + C;
-    while (t < end) *t++ = gaussian<T> ();
+    gaussian<T> (temp.base (), C);
 #   ifdef n2a_FP
     return multiply (sigma, temp, 28);  // See gaussian<int>(int) in runtime.tcc
 #   else
@@ -104,7 +127,7 @@ template<class T, int R> MatrixFixed<T,R,1> sphere (const MatrixFixed<T,R,1> & s
     MatrixFixed<T,R,1> result;
     T * r   = result.base ();
     T * end = r + R;
-    while (r < end) *r++ = gaussian<T> ();
+    gaussian<T> (r, R);
 
     // The basic idea is to scale a Gaussian vector to unit length, thus getting random
     // directions on a sphere of dimension R, then scale that vector so that it fills
@@ -127,9 +150,7 @@ template<class T, int R> MatrixFixed<T,R,1> sphere (const MatrixFixed<T,R,1> & s
 template<class T, int R, int C> MatrixFixed<T,R,1> sphere (const MatrixFixed<T,R,C> & sigma)
 {
     MatrixFixed<T,C,1> temp;
-    T * t   = temp.base ();
-    T * end = t + C;
-    while (t < end) *t++ = gaussian<T> ();
+    gaussian<T> (temp.base (), C);
 
 #   ifdef n2a_FP
     int n     = norm (temp, 2 << 15, 2, 4);
@@ -170,6 +191,57 @@ template<class T> SHARED Matrix<T> glTranslate (T x, T y, T z);
 SHARED void signalHandler (int number);
 #endif
 
+/**
+    Counter-based random number generator (Philox4x32-10).
+    Each block of four 32-bit outputs is a pure function of the key and a 128-bit counter,
+    so there is no shared state to contend over, the period is effectively unlimited,
+    and a stream can jump to any position without generating the values before it.
+    The key comes from the seed. The upper half of the counter is a stream id
+    (for example a part index or a block of parallel work), and the lower half is the
+    position within the stream (for example cycle number in the high word, draw count in the low word).
+
+    Every thread has a default stream, keyed by the seed of its simulator (see RandomSource)
+    and its worker index in the simulator's ThreadPool. Any thread outside a pool, such as the
+    one that calls Simulator::run(), is index 0. Parallel work that must come out the same
+    regardless of how it is divided among threads installs its own streams instead.
+    All random functions in the runtime draw from current().
+**/
+class SHARED RandomStream
+{
+public:
+    uint32_t key[2];
+    uint32_t counter[4];    ///< [0,1] = position in stream, in blocks of 4 outputs. [2,3] = stream id.
+    uint32_t block[4];      ///< Most recently generated outputs.
+    int      used;          ///< Number of entries in block already handed out.
+    bool     haveGaussian;  ///< Second value from the polar method is waiting in nextGaussian.
+    double   nextGaussian;  ///< Holds an int directly when n2a_FP, since double represents it exactly.
+
+    RandomStream (uint64_t seed = 0, uint64_t id = 0);
+    void     seed   (uint64_t seed, uint64_t id = 0); ///< Restart at position 0 of the given stream.
+    void     seek   (uint64_t position);              ///< Jump to the given position, counted in 32-bit outputs.
+    uint32_t next32 ();
+    int      next   ();                               ///< @return Value in [0,RAND_MAX], same as rand().
+    void     fill   (uint32_t * result, int count);   ///< Same as calling next32() count times, but generates whole blocks in a tight loop.
+
+    static void           philox  (const uint32_t counter[4], const uint32_t key[2], uint32_t result[4]);
+    static RandomStream * current ();                        ///< The stream installed on the calling thread, or its default stream.
+    static RandomStream * install (RandomStream * stream);   ///< Makes stream the source for current() on the calling thread. Null restores the default stream. @return The previously installed stream.
+};
+
+/**
+    Seed for the default RandomStreams of one simulator. Each Simulator owns one,
+    so concurrent simulators (such as Ensemble members) don't reseed each other.
+**/
+class SHARED RandomSource
+{
+public:
+    uint64_t              seed;
+    std::atomic<uint64_t> generation;  ///< Unique across all sources, and changes with each reseed(), so a thread knows when to restart its default stream.
+
+    RandomSource ();  ///< Starts with the seed given to n2a_srand() before any simulator existed, or 0.
+    void reseed (uint64_t seed);
+};
+
 
 // Simulation classes --------------------------------------------------------
 
@@ -180,6 +252,7 @@ template<class T> class WrapperBase;
 template<class T> class ConnectIterator;
 template<class T> class ConnectPopulation;
 template<class T> class ConnectPopulationNN;
+template<class T> class NNCache;
 template<class T> class ConnectMatrix;
 template<class T> class Population;
 template<class T> class Simulator;
@@ -193,10 +266,21 @@ template<class T> class EventSpikeSingle;
 template<class T> class EventSpikeSingleLatch;
 template<class T> class EventSpikeMulti;
 template<class T> class EventSpikeMultiLatch;
+template<class T> class CalendarQueue;
+template<class T> class SpikePool;
+template<class T> class EventQueue;
 template<class T> class Visitor;
 template<class T> class VisitorStep;
 template<class T> class VisitorSpikeMulti;
 template<class T> class DelayBuffer;
+template<class T> class DelayBufferRing;
+template<class T> class SynapseRow;
+template<class T> class SynapseTable;
+template<class T> class Checkpoint;
+#ifdef n2a_MPI
+template<class T> class Distributed;
+template<class T> class EventExchange;
+#endif
 
 
 /**
@@ -237,7 +321,6 @@ public:
 
     // Interface for numerical manipulation
     // This is deliberately a minimal set of functions to support Runge-Kutta, with folded push and pop operations.
-    // This interface will no doubt need to be generalized when another integrator is added.
     virtual void snapshot           ();         ///< save all members trashed by integration
     virtual void restore            ();         ///< restore all members trashed by integration
     virtual void pushDerivative     ();         ///< push D0; D0 = members
@@ -245,6 +328,17 @@ public:
     virtual void multiply           (T scalar); ///< members *= scalar; for fixed-point, exponentScalar=1
     virtual void addToMembers       ();         ///< members += D0; pop D0
 
+    // Interface for embedded Runge-Kutta methods (Dormand-Prince)
+    // Each stage is an entry on the derivative stack. The top count entries are combined,
+    // with coefficient a[0] going to the oldest of them (the first stage) and a[count-1] going to D0.
+    // Only generated for floating-point types.
+    virtual void stageCombine       (int count, const T * a, T h);  ///< integrated members = preserved + h * sum_j a[j] * D_j
+    virtual T    stageError         (int count, const T * e, T h, T atol, T rtol);  ///< @return Largest ratio |h * sum_j e[j] * D_j| / (atol + rtol * |member|) over all integrated members. 0 if there are none.
+    virtual void popDerivative      (int count); ///< discard the top count entries of the derivative stack
+
+    // Interface for checkpoints
+    virtual void serialize          (Checkpoint<T> & c);  ///< Transfers every member needed to resume simulation, in the direction given by c.loading. Default does nothing.
+
     // Generic metadata
     virtual void path (String & result);
     virtual void getNamedValue (const String & name, String & value);
@@ -285,9 +379,94 @@ public:
     virtual T    eventDelay (int i);
     virtual void setLatch   (int i);
     virtual void finalizeEvent ();  ///< Does finalize on any external references touched by some event in this part.
+
+#   ifdef n2a_MPI
+    virtual void getMonitors (std::vector<std::pair<Part<T> *, SynapseRow<T> *>> & result);  ///< Appends each endpoint whose events this part monitors, along with the row of that endpoint this part registers in. Default is none.
+#   endif
 };
 
 template<class T> SHARED void removeMonitor (std::vector<Part<T> *> & partList, Part<T> * part);
+template<class T> SHARED void removeMonitor (SynapseRow<T>          & partList, Part<T> * part);
+
+/**
+    The list of parts that monitor events in a given source part.
+    Spike delivery walks this list, so for large networks it should be dense in memory.
+    Entries added after the last SynapseTable::pack() live in the private vector pending.
+    At pack time they are moved into this row's slice of the table, which is stored
+    back to back with the slices of every other row. Removing a packed entry
+    just nulls it, so the slice never moves outside of pack().
+    The interface mimics the subset of std::vector used by generated code.
+**/
+template<class T>
+class SHARED SynapseRow
+{
+public:
+    Part<T> **             packed;  ///< This row's slice of SynapseTable::targets. Removed entries are null.
+    int                    count;   ///< Size of the packed slice, including nulls.
+    std::vector<Part<T> *> pending; ///< Entries added since the last pack.
+    SynapseTable<T> *      table;   ///< The table this row is registered with, or null if it has never held an entry.
+    int                    index;   ///< Position in table->rows.
+    EventSpikeMulti<T> *   merge;   ///< Most recent spike event that delivers to this row. Used by Simulator::queueSpike() to avoid visiting the same row twice in one event.
+#   ifdef n2a_MPI
+    std::vector<int>       subscribers; ///< Other ranks that hold monitors on their proxy of this row's source. Every spike into this row is forwarded to them.
+    Part<T> *              tester;      ///< Evaluates the event condition on behalf of subscribers, for when every monitor lives on another rank. Never receives spikes.
+    int                    source;      ///< Global id of the part that holds this row, or -1 if the row has not been involved in any exchange.
+    int                    offset;      ///< Position of this row within its source part, in bytes. Identifies the row on other ranks, since they run the same binary.
+#   endif
+
+    class iterator
+    {
+    public:
+        Part<T> ** p;
+        Part<T> ** end;
+        Part<T> ** next;     ///< Start of pending.
+        Part<T> ** nextEnd;
+
+        void       settle     ();  ///< Skip nulls, and jump from packed to pending when the first is exhausted.
+        iterator & operator++ ()                       {p++; settle (); return *this;}
+        Part<T> *  operator*  () const                 {return *p;}
+        bool       operator!= (const iterator & that) const {return p != that.p;}
+        bool       operator== (const iterator & that) const {return p == that.p;}
+    };
+
+    SynapseRow ();
+    ~SynapseRow ();
+
+    void      push_back (Part<T> * part);
+    void      remove    (Part<T> * part);
+    bool      empty     () const {return begin () == end ();}
+    Part<T> * first     () const {return *begin ();}  ///< Only valid if the row is not empty.
+    iterator  begin     () const;
+    iterator  end       () const;
+
+#   ifdef n2a_MPI
+    bool      listened  () const {return ! empty ()  ||  (tester  &&  ! subscribers.empty ());}  ///< Replaces ! empty() in generated code, so a source still tests its events when all the monitors are remote.
+    Part<T> * probe     () const {return empty () ? tester : first ();}  ///< The part on which to evaluate a shared event condition. Only valid if listened().
+#   endif
+};
+
+/**
+    Contiguous storage for all the SynapseRows of a simulation, in the manner of
+    compressed sparse row format. The row pointers play the part of the offset array.
+    Connection weights stay in the connection parts themselves, so only targets are stored here.
+**/
+template<class T>
+class SHARED SynapseTable
+{
+public:
+    std::vector<Part<T> *>       targets;
+    std::vector<SynapseRow<T> *> rows;
+    int                          pending; ///< Total number of entries in the pending vectors of all rows.
+    int                          holes;   ///< Number of null or orphaned entries in targets.
+
+    SynapseTable ();
+    ~SynapseTable ();
+    void clear    ();
+    void add      (SynapseRow<T> * row);
+    void remove   (SynapseRow<T> * row);
+    bool needPack () const;  ///< @return true if enough has changed since the last pack to make it worthwhile.
+    void pack     ();        ///< Rebuilds targets from scratch, with all rows compacted and pending entries merged in.
+};
 
 /**
     Supports ability to dequeue and move to a different simulation period.
@@ -365,6 +544,8 @@ public:
     int  offset;
     int  i;
     int  stop;
+    int  rangeBegin;  ///< When rangeEnd > rangeBegin, the innermost iterator covers only positions [rangeBegin,rangeEnd) of its pass. See restrict().
+    int  rangeEnd;
 
     // Endpoint parameters get stashed here, rather than using accessors.
     int Max;  // $max. Capitalized to avoid name collision with macro or function.
@@ -377,18 +558,39 @@ public:
     bool                          explicitXYZ; ///< c explicitly defines $xyz, which takes precedence over any $project value
     typename KDTree<T>::Vector3 * xyz;         ///< C.$xyz (that is, probe $xyz), shared by all iterators
     KDTree<T> *                   NN;          ///< "nearest neighbor" search class
+    bool                          deleteNN;    ///< We own NN. False when NN belongs to an NNCache.
     typename KDTree<T>::Entry *   entries;     ///< A dynamically-allocated array
+    bool                          incremental; ///< Positions of existing instances never change, so NN may persist across calls to connect(). See NNCache.
 
     ConnectPopulation (int index, bool poll);
     virtual ~ConnectPopulation ();
 
-    void         prepareNN ();
+    void         prepareNN (NNCache<T> * cache = 0); ///< Sets up NN, either from scratch or by bringing cache up to date with our instances.
     virtual bool setProbe  (Part<T> * probe); ///< @return true If we need to advance to the next instance. This happens when p has reached its max number of connections.
     virtual void reset     (bool newOnly);
+    void         restrict  (int begin, int end); ///< Limits the innermost iterator to one block of its instances, and rewinds all levels. Used by Population::connectParallel(). Only valid without $max, since iteration starts at a fixed position.
     bool         old       ();                ///< Indicates that all iterators from this level down return a part that is old.
     virtual bool next      ();
 };
 
+/**
+    Spatial index over one endpoint of a connection population, kept across calls to connect().
+    Entries correspond one-to-one with slots in the endpoint's instances vector.
+    Each update compares slots with entries, adds newborn instances to the tree's
+    side buffer and marks vanished ones dead. The cost is a pointer scan plus work
+    proportional to the number of changes, rather than projecting and sorting the
+    whole population. Only valid if an instance's projected position never changes.
+**/
+template<class T>
+class SHARED NNCache
+{
+public:
+    KDTree<T>                             tree;
+    std::deque<typename KDTree<T>::Entry> entries;  ///< entries[i] goes with (*instances)[i]. Deque keeps addresses stable as it grows.
+
+    void update (ConnectPopulation<T> * it);  ///< it->c must be set, same as for ConnectPopulation::prepareNN().
+};
+
 /**
     Isolates KDTree link dependencies.
     Most of the KDTree-related members are in our superclass, but they do not
@@ -398,10 +600,19 @@ template<class T>
 class SHARED ConnectPopulationNN : public ConnectPopulation<T>
 {
 public:
+    typename KDTree<T>::Query                query;   ///< Scratch space reused by every search from this iterator.
+    std::vector<typename KDTree<T>::Entry *> result;
+
+    // Searches done ahead of time for a run of slots in the innermost iterator. See lookup().
+    std::vector<typename KDTree<T>::Vector3>                batchXYZ;
+    std::vector<std::vector<typename KDTree<T>::Entry *>>   batchResult;
+    int                                                     batchBegin;  ///< Slot in the innermost iterator's instances that goes with batchXYZ[0].
+
     ConnectPopulationNN (int index, bool poll);
     virtual ~ConnectPopulationNN ();
 
-    virtual void reset (bool newOnly);
+    virtual void                              reset  (bool newOnly);
+    std::vector<typename KDTree<T>::Entry *> & lookup ();  ///< @return Neighbors of the current C.$xyz.
 };
 
 template<class T>
@@ -441,19 +652,40 @@ template<class T>
 class SHARED Population : public Simulatable<T>
 {
 public:
-    Part<T> * container;
-    Part<T> * dead; ///< Head of linked list of available parts, using Part::next.
+    Part<T> *                     container;
+    Part<T> *                     dead;    ///< Head of linked list of available parts, using Part::next. Every part on this list is free (no remaining references), so it can be reused immediately.
+    std::unordered_set<Part<T> *> waiting; ///< Parts that have left the simulation but are still referenced by other parts (such as connections). They move to the dead list via reclaim().
 
     Population ();
-    virtual ~Population ();  ///< Deletes all parts on our dead list.
+    virtual ~Population ();  ///< Deletes all parts on our dead and waiting lists.
 
     // Instance management
     virtual Part<T> * create   ();               ///< Construct an instance of the kind of part this population holds. Caller is fully responsible for lifespan of result, unless it gives the part to us via add().
     virtual void      add      (Part<T> * part); ///< The given part is going onto a simulator queue, but we may also account for it in other ways.
-    virtual void      remove   (Part<T> * part); ///< Move part to dead list, and update any other accounting for the part.
+    virtual void      remove   (Part<T> * part); ///< Move part to dead list (or waiting list, if still referenced), and update any other accounting for the part.
+    void              reclaim  (Part<T> * part); ///< Called by generated code when the last reference to a part goes away. If the part is on the waiting list, moves it to the dead list.
+    void              reserve  (int n);          ///< Ensures that at least n parts are available on the dead list, so the next n calls to allocate() do no searching or construction.
+    virtual void      reserveStorage (int n);    ///< Subroutine of reserve(). Prepares memory for n new parts, so that constructing them costs at most one allocation. Default does nothing. Generated code overrides this when parts live in a PartArena.
     virtual Part<T> * allocate ();               ///< If a dead part is available, re-use it. Otherwise, create and add a new part.
-    virtual void      resize   (int n);          ///< Add or kill instances until $n matches given n.
+    virtual void      resize   (int n);          ///< Add or kill instances until $n matches given n. When parallelInit is set, growth by more than one instance goes through the bulk path: every new part enters its event as a block, then all of them run init() via initParallel().
     virtual int       getN     ();               ///< Subroutine for resize(). Returns current number of live instances (true n). Not exactly the same as an accessor for $n, because it does not give the requested size, only actual size.
+    bool              parallelInit;              ///< init() of our instances only writes their own members, so resize() may call it on worker threads. Set by generated code.
+    void              initParallel (std::vector<Part<T> *> & parts);  ///< Subroutine of resize(). Calls init() on each of parts, using the simulator's thread pool. Like connectParallel(), the result depends only on the random seed, not the thread count.
+
+    // Batch integration
+    // When the code generator determines that instances are homogeneous (no connections, no events,
+    // constant $t', Euler), it drops the per-instance integrate() and instead emits integrateAll(),
+    // a tight loop over the batch list. Generated add() and remove() maintain the list.
+    // With offload, integrateAll() is a single kernel over state mirrored in OffloadColumns (see offload.h),
+    // so it must always be called for the whole batch.
+    std::vector<Part<T> *> batch;    ///< Instances whose integration is done by integrateAll().
+    T                      batchDt;  ///< Constant $t' shared by all instances in batch. Selects which EventStep drives integrateAll().
+    bool                   offload;  ///< integrateAll() runs on an accelerator, so Simulator::integrateBatches() must not split it among threads.
+    int          addBatch     (Part<T> * part, T dt, bool offload = false); ///< Appends part to batch. Registers with the simulator when batch becomes non-empty. @return Index of part in batch.
+    Part<T> *    removeBatch  (int index);            ///< Removes the entry at index by moving the last entry into its place. @return The part that moved, so caller can update its stored index. Null if nothing moved.
+    virtual void integrateAll (T dt, int begin, int end); ///< Integrates batch entries in [begin,end). Default does nothing.
+
+    virtual void serialize (Checkpoint<T> & c);  ///< Handles the waiting list and batch. Generated populations call this before transferring their own members.
 
     // Connections
     virtual void                   connect            ();          ///< For a connection population, evaluate each possible connection (or some well-defined subset thereof).
@@ -461,7 +693,13 @@ public:
     virtual ConnectIterator<T> *   getIterators       (bool poll); ///< Assembles one or more nested iterators in an optimal manner and returns the outermost one.
     ConnectIterator<T> *           getIteratorsSimple (bool poll); ///< Implementation of getIterators() without nearest-neighbor search.
     ConnectIterator<T> *           getIteratorsNN     (bool poll); ///< Implementation of getIterators() which uses KDTree for nearest-neighbor search.
+    void                           connectParallel    (ConnectPopulation<T> * outer); ///< Implementation of connect() used when Simulator::parallelConnect is set. Evaluates candidates on worker threads in fixed blocks, then creates the accepted connections serially in block order. The result depends only on the random seed, not the thread count. Takes ownership of outer.
     virtual ConnectPopulation<T> * getIterator        (int i, bool poll);
+    std::vector<NNCache<T> *>      caches;  ///< Persistent spatial index for each endpoint that requests it. Indexed by endpoint. Owned by us.
+
+#   ifdef n2a_MPI
+    int partition;  ///< -1 if every rank simulates all our instances. Otherwise, the number of instances assigned to ranks so far. See Distributed::claim().
+#   endif
 };
 
 template<class T>
@@ -478,6 +716,7 @@ public:
 
     virtual void run () = 0;  ///< Does all the work of a simulation cycle. This may be adapted to the specifics of the event type.
     virtual void visit (std::function<void (Visitor<T> * visitor)> f) = 0;  ///< Applies function to each part associated with this event. May visit multiple parts in parallel using separate threads.
+    virtual void visitUpdate (std::function<void (Visitor<T> * visitor)> f);  ///< Same as visit(), but for phases (update and updateDerivative) that are only parallel when the model permits. Default is to call visit().
 };
 
 template<class T>
@@ -514,6 +753,234 @@ class priorityQueue : public std::priority_queue<Event<T> *,std::vector<Event<T>
 {
 };
 
+/**
+    Event queue optimized for the common case where most events are scheduled a short time ahead,
+    such as spikes with small synaptic delays.
+    Near-term events are hashed by time into a ring of buckets, each spanning "width" units of time.
+    Events beyond the end of the ring wait in an ordinary priority queue, and migrate into the
+    ring as time advances. Bucket assignment depends only on absolute time, so it never drifts.
+    Within a bucket, events are kept in pop order, following the same tie-breaking rules as More.
+    Since events generally arrive in time order, insertion only scans a few entries at the end
+    of a bucket, giving amortized O(1) push and pop.
+**/
+template<class T>
+class SHARED CalendarQueue
+{
+public:
+    struct Bucket
+    {
+        std::vector<Event<T> *> events;
+        int                     head;  ///< Index of first event that has not been popped yet.
+    };
+
+    T                   width;    ///< Span of time covered by one bucket.
+    int64_t             mask;     ///< Number of buckets minus 1. The number of buckets is always a power of 2.
+    std::vector<Bucket> buckets;
+    int64_t             current;  ///< Absolute index (time/width) of the earliest bucket that might contain events.
+    int                 count;    ///< Number of events held in buckets. Does not include overflow.
+    priorityQueue<T>    overflow; ///< Events at or beyond the end of the ring.
+
+    CalendarQueue (T width, int buckets);
+
+    bool       empty () const;
+    Event<T> * top   ();  ///< Advances current to the first non-empty bucket, then returns its first event.
+    void       pop   ();  ///< Removes the event returned by top(). Must be preceded by a call to top().
+    void       push  (Event<T> * event);
+
+    int64_t slot     (T t) const;         ///< Absolute bucket index for the given time.
+    void    insert   (Event<T> * event);  ///< Places event in the ring. Caller must ensure it falls before the end of the ring.
+    void    migrate  ();                  ///< Moves events from overflow into the ring, if they now fall within it.
+};
+
+/**
+    The queue actually held by Simulator. Wraps either a binary heap (the default)
+    or a CalendarQueue, as selected by the code generator.
+**/
+template<class T>
+class SHARED EventQueue
+{
+public:
+    priorityQueue<T>   heap;
+    CalendarQueue<T> * calendar;  ///< When non-null, all events are held here rather than in heap.
+
+    EventQueue ();
+    ~EventQueue ();
+
+    void useCalendar (T width, int buckets);  ///< Switches to a calendar queue. Any events already queued are moved over.
+    void useHeap     ();                      ///< Switches back to the binary heap. Any events already queued are moved over.
+
+    bool       empty () const;
+    size_t     size  () const;
+    Event<T> * top   ();
+    void       pop   ();
+    void       push  (Event<T> * event);
+};
+
+/**
+    A persistent set of worker threads that execute one job at a time, in lock-step.
+    Used by EventStep to process each of its VisitorStep queues on a separate thread.
+    The thread that calls run() participates as thread 0, so a pool of size n
+    only launches n-1 workers. Each call to run() returns only after all threads
+    have finished the job, so consecutive calls are separated by a barrier.
+**/
+class SHARED ThreadPool
+{
+public:
+    int                               count;      ///< Total number of threads that execute each job, including the caller of run().
+    std::vector<std::thread>          workers;
+    const std::function<void (int)> * job;        ///< The job currently being executed. Only valid during run().
+    std::atomic<int>                  generation; ///< Incremented each time a new job is posted. Workers compare against the last value they saw.
+    std::atomic<int>                  remaining;  ///< Number of workers that have not yet finished the current job.
+    bool                              quit;
+    const char *                      error;      ///< First exception message thrown by a worker during the current job.
+    void *                            profileContext; ///< Profiler of the thread that posted the current job, adopted by each worker so its regions are recorded. See profile_context().
+    std::mutex                        mutex;
+    std::condition_variable           wake;
+    std::vector<double>               busy;       ///< Seconds each thread has spent processing parts. Filled in by EventStep::visit().
+
+    ThreadPool (int count);
+    ~ThreadPool ();  ///< Stops and joins all workers.
+
+    void run    (const std::function<void (int)> & job);  ///< Calls job(i) for each i in [0,count), concurrently. The caller executes job(0). Rethrows any exception message from a worker.
+    void work   (int index);                               ///< Main loop of each worker thread.
+    void report (std::ostream & out);                      ///< Prints busy time of each thread, and its ratio to the busiest thread.
+};
+
+/// Lends Simulator::threads to the sparse matrix kernels. Installed by Simulator::setThreads().
+template<class T>
+class SimulatorMatrixThreads : public MatrixThreads
+{
+public:
+    virtual int  available ();  ///< 1 if the current simulator has no pool, or its pool is already inside a job (such as a parallel update()), since ThreadPool::run() can't be re-entered.
+    virtual void run       (const std::function<void (int)> & job);
+};
+
+/**
+    Backing store for one generated part class, selected with $meta.backend.c.contiguous.
+    The class routes its operator new and delete here, so instances are packed into large
+    chunks aligned on cache-line boundaries, rather than scattered across the heap.
+    A fresh chunk hands out slots in address order, so a newly-built population occupies
+    one contiguous range and each pass over it streams through memory.
+    Released slots go on a free list and are reused first, which keeps the population compact
+    under birth/death churn. Allocation is guarded by a mutex, since connections may be
+    constructed on worker threads.
+**/
+class SHARED PartArena
+{
+public:
+    static const size_t alignment = 64;  ///< Cache line size on most current processors.
+
+    size_t              size;       ///< Bytes per slot. The object size rounded up to a multiple of alignof(max_align_t).
+    int                 chunkSize;  ///< Number of slots in each chunk.
+    std::vector<char *> chunks;     ///< Raw memory blocks, as returned by new[]. The first slot in each is at the next alignment boundary.
+    void *              available;  ///< Head of free list. Each free slot holds a pointer to the next one.
+    int                 live;       ///< Number of slots currently handed out.
+    int                 capacity;   ///< Number of slots in all chunks.
+    std::mutex          mutex;
+
+    PartArena (size_t size, int chunkSize = 1024);
+    ~PartArena ();  ///< Frees all chunks, but only if every slot has been released. Otherwise, leaks them rather than risk a dangling part.
+
+    void * allocate ();
+    void   release  (void * slot);
+    void   reserve  (int n);  ///< Ensures that the next n calls to allocate() don't need more memory. Any shortfall is made up with one chunk, which may be larger than chunkSize.
+    void   grow     (int n);  ///< Subroutine of allocate() and reserve(). Adds a chunk of n slots to the free list. Caller must hold mutex.
+};
+
+#ifdef n2a_MPI
+/**
+    Periodic event that runs Distributed::exchange(). It reschedules itself every
+    Distributed::interval, for as long as any rank has work left.
+**/
+template<class T>
+class SHARED EventExchange : public Event<T>
+{
+public:
+    virtual void run   ();
+    virtual void visit (std::function<void (Visitor<T> * visitor)> f);  ///< Does nothing, since no parts are associated with this event.
+};
+
+/**
+    Divides one simulation among several MPI ranks, each running the same program.
+    <p>Instances of each population registered with add() are dealt out to ranks in round-robin order.
+    Every rank still constructs and initializes every instance, so that $index, $xyz and connection
+    candidates are identical everywhere. On the ranks that do not own an instance, it becomes a proxy:
+    it is parked on an EventStep that never enters the event queue, so it never integrates,
+    updates or tests its own events.
+    <p>A connection is made only on the rank that owns its last partitioned endpoint. By convention
+    that is the target of the connection's events (B in the usual A->B synapse). When the source
+    endpoint is a proxy, the connection registers in the proxy's event monitor row in the usual way,
+    and subscribe() asks the source's owner to forward spikes from the matching row.
+    On the owner, the row needs some part to evaluate the event condition when no local monitor
+    exists. place() keeps one such tester, taken from the candidate connections it would otherwise discard.
+    <p>Forwarded spikes collect in outgoing and are exchanged by EventExchange every interval.
+    A spike sent at time t arrives no later than t+interval, so it is on time as long as interval
+    does not exceed its delay. Later spikes are delivered at once, and counted in late if they
+    are not latches.
+    <p>Only the event path crosses ranks. A connection that reads other values from a remote endpoint
+    sees the proxy's initial state. Events whose condition or delay depends on the target part, and
+    population changes after init, are only handled within each rank.
+    <p>Each rank other than 0 writes its output under the directory "rank" + number.
+**/
+template<class T>
+class SHARED Distributed
+{
+public:
+    enum Placement {local, remote, tester};
+    enum Kind      {kindSpike, kindSpikeLatch, kindSubscribe};
+
+    struct Message
+    {
+        int32_t part;    ///< Global id of the source part.
+        int32_t offset;  ///< Position of the SynapseRow within the source part, in bytes.
+        int32_t kind;
+        int32_t latch;
+        T       t;       ///< When the spike should be delivered.
+    };
+
+    int                                rank;
+    int                                size;
+    bool                               initialized;  ///< We started MPI, so we are responsible to shut it down.
+    bool                               halt;         ///< Some rank requested stop, as agreed by the last exchange(). Simulator::run() honors only this when there is more than one rank.
+    T                                  interval;     ///< Time between exchanges. Should not exceed the shortest delay of any event that crosses ranks. If zero, start() uses the period of the wrapper part.
+    std::vector<Part<T> *>             parts;        ///< Every instance of a partitioned population, indexed by global id. The same on every rank, except that released proxies are null.
+    std::vector<int>                   owners;       ///< Rank that simulates each entry in parts.
+    std::vector<Population<T> *>       populations;  ///< Population that holds each entry in parts.
+    std::vector<bool>                  referenced;   ///< Some connection on this rank (live or tester) has the entry in parts as an endpoint.
+    bool                               prune;        ///< Set by generated code when no instance or connection can appear after init. Then start() releases proxies that nothing refers to.
+    std::unordered_map<Part<T> *,int>  ids;          ///< Inverse of parts.
+    std::map<T,EventStep<T> *>         parked;       ///< Holds proxies, keyed by dt. These events are never queued.
+    std::vector<Part<T> *>             testers;      ///< Owned by us.
+    std::vector<std::vector<Message>>  outgoing;     ///< Indexed by destination rank.
+    std::vector<Message>               incoming;
+    EventExchange<T>                   event;
+    uint64_t                           late;         ///< Number of non-latch spikes that arrived after their delivery time.
+
+    Distributed ();
+    void init     ();  ///< Starts MPI if needed, determines rank and size, and redirects output of ranks other than 0.
+    void finalize ();  ///< Shuts down MPI, but only if init() started it.
+    void clear    ();  ///< Releases proxies and testers. Leaves MPI running.
+
+    void           add     (Population<T> * population);                  ///< Called by the generated init() of a population whose instances should be divided among ranks.
+    bool           claim   (Population<T> * population, Part<T> * part);  ///< Assigns the next global id to a new instance. @return true if this rank owns it. Otherwise it should be parked.
+    EventStep<T> * park    (T dt);                                       ///< @return The holding event for proxies with the given period.
+    bool           isParked (Event<T> * event) const;
+    void           release ();                                         ///< Deletes every proxy that is not referenced. Its global id stays assigned, so ownership and $n are the same as before.
+    int            owner   (Part<T> * part) const;                        ///< @return Rank that simulates part, or -1 if part is not partitioned (simulated on every rank).
+
+    int  home      (Part<T> * connection) const;  ///< Subroutine of place() that makes no changes, so it is safe on worker threads.
+    int  place     (Part<T> * connection);        ///< Decides what becomes of a candidate connection whose endpoints are set. If the result is tester, we have taken ownership of it.
+    bool keepTester (Part<T> * connection);       ///< Installs connection as tester in any row of a local source that lacks one. @return true if it was used.
+    void reference (Part<T> * connection);        ///< Marks every partitioned endpoint of connection as referenced.
+    void subscribe (Part<T> * connection);        ///< Called after a connection enters simulation. Requests forwarding from the owner of each remote source it monitors.
+    void forward   (EventSpikeMulti<T> * spike);  ///< Called by Simulator::queueSpike() for rows with subscribers.
+
+    void start    ();  ///< Called at the end of Simulator::init(). Releases unused proxies (if prune is set), sends the initial subscriptions and queues the first exchange.
+    bool exchange ();  ///< Sends and receives all pending messages. Every rank must call this together. @return true if any rank still has events to process.
+    void deliver  (const Message & m, int from);
+};
+#endif
+
 /**
     Lifetime management: When the simulator shuts down, it must dequeue all
     parts. In general, a simulator will run until its queue is empty.
@@ -526,7 +993,7 @@ class SHARED Simulator
 #endif
 {
 public:
-    priorityQueue<T>                             queueEvent;    ///< Pending events in time order.
+    EventQueue<T>                                queueEvent;    ///< Pending events in time order.
     std::vector<std::pair<Population<T> *, int>> queueResize;   ///< Populations that need to change $n after the current cycle completes.
     std::queue<Population<T> *>                  queueConnect;  ///< Connection populations that want to construct or recheck their instances after all populations are resized in current cycle.
     std::vector<Population<T> *>                 queueClearNew; ///< Populations whose newborn index needs to be reset.
@@ -536,6 +1003,26 @@ public:
     Event<T> *                                   currentEvent;
     bool                                         after;         ///< When true, and timesteps match, sort spike events after step events. Otherwise sort them before.
     std::vector<Holder *>                        holders;
+    ThreadPool *                                 threads;        ///< Workers for multi-visitor mode. Null when all parts are processed on the calling thread.
+    bool                                         parallelUpdate; ///< update() and updateDerivative() may run concurrently on separate threads. Only true if no part writes into another part's buffers or touches shared IO objects during those phases.
+    bool                                         parallelConnect; ///< Population::connect() evaluates candidate connections on separate threads. See Population::connectParallel().
+    RandomSource                                 random;         ///< Seed for the default RandomStream of each thread working for this simulator. See n2a_srand().
+    SpikePool<T>                                 spikes;         ///< Recycles spike events. Generated code allocates all spikes from here, and they return here once processed.
+    std::vector<Population<T> *>                 batches;        ///< Populations with a non-empty batch list. See Population::integrateAll().
+    SynapseTable<T>                              synapses;       ///< Packed storage for event monitor lists. Repacked by updatePopulations() after connections change.
+    bool                                         mergeSpikes;    ///< Multi-target spikes with the same time, latch and class are coalesced into one event. See queueSpike().
+    std::map<std::tuple<T,int,bool>, EventSpikeMulti<T> *> pendingSpikes; ///< Multi-target spikes that are queued but have not run yet, keyed by (t, latch, isLatch).
+    bool                                         cacheInputs;    ///< Input holders keep the parsed form of text files in binary sidecars, and load from them when current. See InputCache.
+    bool                                         shareInputs;    ///< Read-only input holders come from the process-wide registry, so concurrent simulators share one copy. See Holder::acquire().
+    String                                       outputDirectory; ///< When non-empty, relative output file names are placed under this directory, and stdout goes to "out" there. See Ensemble.
+    WrapperBase<T> *                             wrapper;        ///< Root of the part tree, as given to init().
+    T                                            checkpointInterval;  ///< Simulated time between checkpoints. Zero means none are written. See Checkpoint.
+    T                                            checkpointNext;      ///< Time at or after which the next checkpoint is due.
+    String                                       checkpointPath;
+    uint32_t                                     checkpointSignature; ///< Supplied by the code generator. Identifies the layout of the generated classes, so an image from a different build is not loaded.
+#   ifdef n2a_MPI
+    Distributed<T>                               distributed;
+#   endif
 
     // Singleton
 #   ifdef n2a_TLS
@@ -548,26 +1035,165 @@ public:
     ~Simulator ();
     void clear ();  ///< Restores simulator to same condition as newly-constructed object.
 
+    void setThreads (int count);          ///< Configures the number of visitors in each EventStep. Must be called before init(). A count less than 1 means use all available hardware threads.
     void init (WrapperBase<T> * wrapper); ///< init phase and event queue set up
     void run (T until = (T) INFINITY);    ///< Run until given time. This function can be called multiple times to step through simulation. Default value runs until queue is empty.
     void updatePopulations ();
 
     void enqueue      (Part<T> * part, T dt); ///< Places part on event with period dt. If the event already exists, then the actual time till the part next executes may be less than dt, but thereafter will be exactly dt. Caller is responsible to call dequeue() or enterSimulation().
     void removePeriod (EventStep<T> * event);
+    void integrateBatches (EventStep<T> * event);  ///< Runs integrateAll() on every registered population whose batchDt matches the given event. Called by Euler before visiting individual parts.
+    void queueSpike   (EventSpikeMulti<T> * spike); ///< Either pushes spike onto queueEvent, or folds its targets into a pending event that will run at the same time. In the latter case, spike is released.
+    void retireSpike  (EventSpikeMulti<T> * spike); ///< Called by a multi-target spike when it starts to run, so no more rows get merged into it.
+    void checkpoint   (T t);                        ///< Called by run() after each event at time t. Writes an image to checkpointPath if one is due.
 
     // callbacks
     void resize   (Population<T> * population, int n); ///< Schedule population to be resized at end of current cycle.
     void connect  (Population<T> * population);        ///< Schedule connections to be evaluated at end of current cycle, after all resizing is done.
     void clearNew (Population<T> * population);        ///< Schedule population to have its newborn index reset after all new connections are evaluated.
 
-    Holder * getHolder (const String & fileName, Holder * oldHandle);
+    Holder * getHolder  (const String & fileName, Holder * oldHandle);
+    String   outputPath (const String & fileName);  ///< Applies outputDirectory to the name of an output file.
+};
+
+/**
+    Image of a running simulation, from which a later process can resume at the same point
+    without running init or rebuilding connections. Enabled by $meta.backend.c.checkpoint,
+    which gives the simulated time between images.
+    <p>Each io() function handles one kind of object in both directions, according to loading,
+    so the order of fields can't get out of step between save and load. Generated parts and
+    populations do the same in serialize().
+    <p>A pointer to a part is written as the address it had in the saving process. Each part record
+    starts with its own old address, so the loader can map old addresses to new parts. A pointer into
+    the middle of a part (to a member population or SynapseRow) keeps its offset from the part's base.
+    Translation waits until every part has been created, since a connection may be read before its endpoints.
+    <p>The image depends on the exact layout of the generated classes, so it is only good for the
+    binary that wrote it. Output holders are recreated with their files cut back to the length they
+    had at the time of the image. Other holders are not recorded. Inputs simply read their files again
+    on demand. Only the random stream of the main thread is recorded.
+**/
+template<class T>
+class SHARED Checkpoint
+{
+public:
+    bool                                loading;
+    std::vector<char>                   buffer;    ///< Image accumulated by save().
+    n2a::MappedFile                     map;       ///< Image being loaded.
+    const char *                        position;  ///< Read cursor within map.
+    std::map<uintptr_t, char *>         bases;     ///< Address of each part in the saving process, mapped to its counterpart in this one.
+    std::vector<void **>                fixups;    ///< Locations that still hold addresses from the saving process.
+    std::vector<std::function<void ()>> deferred;  ///< Work that needs translated pointers, such as filling event monitor rows. Runs at the end of translate().
+
+    Checkpoint ();
+
+    bool save      (const String & path);       ///< Writes the state of SIMULATOR under a temporary name, then renames it to path. Only valid between events. @return false if the file could not be written.
+    bool open      (const String & path);       ///< Maps the image and checks its header, then recreates output holders. Must come before initIO(), so the holders are found there rather than started fresh. @return false if there is no usable image, in which case the caller should run init as usual.
+    void load      (WrapperBase<T> * wrapper);  ///< Rebuilds the part tree under wrapper, the event queue and the random streams from an image that passed open().
+    void translate ();                          ///< Resolves all fixups, then runs deferred work.
+    void streams   ();                          ///< Transfers the default RandomStream of every thread in the simulator's pool, in worker order.
+
+    void raw (void * data, size_t bytes);
+    template<class E>               void io (E & value)              {static_assert (std::is_arithmetic<E>::value, "class types need their own overload of io()"); raw (&value, sizeof (E));}
+    template<class E, int R, int C> void io (MatrixFixed<E,R,C> & A) {raw (A.data, sizeof (A.data));}  // Skips the vtable pointer, which differs between processes.
+    template<class E>               void io (std::vector<E> & v);
+    void io (Matrix<T> & A);
+    void io (String & value);
+    void io (DelayBuffer<T> & d);
+    void io (DelayBufferRing<T> & d);
+    void io (SynapseRow<T> & row);
+    void io (OutputHolder<T> & h);
+    void io (RandomStream & r);
+
+    /// Transfers a reference to a part, or to a member of a part.
+    template<class P> void pointer (P *& p)
+    {
+        uint64_t address = (uintptr_t) p;
+        io (address);
+        if (! loading) return;
+        p = (P *) (uintptr_t) address;
+        if (p) fixups.push_back ((void **) &p);
+    }
+
+    template<class P> void pointers (std::vector<P *> & list)
+    {
+        int count = list.size ();
+        io (count);
+        if (loading) list.resize (count);
+        for (auto & p : list) pointer (p);
+    }
+
+    /// Writes the address of p, or maps it from the address it had in the saving process. Must precede p->serialize().
+    void part (Part<T> * p)
+    {
+        uint64_t address = (uintptr_t) p;
+        io (address);
+        if (loading) bases[(uintptr_t) address] = (char *) p;
+    }
+
+    /// Transfers every instance in list, with empty slots left in place. When loading, creates the parts through population.
+    template<class P> void instances (std::vector<P *> & list, Population<T> * population)
+    {
+        int count = list.size ();
+        io (count);
+        if (loading) list.assign (count, 0);
+        for (auto & p : list)
+        {
+            bool present = p;
+            io (present);
+            if (! present) continue;
+            if (loading) p = (P *) population->create ();
+            part (p);
+            p->serialize (*this);
+        }
+    }
 };
 
+#ifdef n2a_TLS
+/**
+    Runs many variants of one model concurrently within a single process, such as the points
+    of a parameter sweep. Each member runs on a worker thread with its own thread-local Simulator.
+    That simulator is created here before the model's init() is called, so it can be configured:
+    read-only inputs are shared between all members, and each member writes its outputs into
+    its own directory.
+    The model entry points are the ones exported by a library built with $meta.backend.c.tls.
+    Parameters reach the model as command-line arguments, so the library should also be built
+    with cli.
+**/
+template<class T>
+class Ensemble
+{
+public:
+    typedef void (*Init)   (int argc, const char * argv[]);
+    typedef void (*Run)    (T until);
+    typedef void (*Finish) ();
+
+    struct Member
+    {
+        Parameters<T> parameters;
+        String        directory;  ///< Receives every output file with a relative name, and also stdout as "out". Empty means current directory, in which case members with the same outputs will collide.
+        String        error;      ///< Exception message if this member failed. Empty on success.
+    };
+
+    Init                modelInit;
+    Run                 modelRun;
+    Finish              modelFinish;
+    std::vector<Member> members;
+    std::atomic<int>    next;  ///< Index of next member to start.
+
+    Ensemble (Init init, Run run, Finish finish);
+
+    void add       (const Parameters<T> & parameters, const String & directory = "");
+    void run       (T until = (T) INFINITY, int threadCount = 0);  ///< Executes all members, at most threadCount at a time. A count less than 1 means use all available hardware threads. Returns when every member is done.
+    void runMember (Member & member, T until);                     ///< Subroutine of run(). Executes one member on the calling thread.
+    int  failures  () const;                                       ///< @return Number of members that threw an exception.
+};
+#endif
+
 template<class T>
 class SHARED Integrator
 {
 public:
-    // For now, we don't need a virtual dtor, because this class contains no data.
+    virtual ~Integrator ();
     virtual void run (Event<T> & event) = 0;
 };
 
@@ -585,6 +1211,25 @@ public:
     virtual void run (Event<T> & event);
 };
 
+/**
+    Adaptive 5th-order Runge-Kutta with embedded 4th-order error estimate.
+    The simulator still advances in whole steps of $t', so each EventStep cycle is covered
+    by one or more sub-steps. The sub-step size is chosen so that the largest relative error
+    of any integrated member stays within tolerance, and carries over to the next cycle.
+    Only available for floating-point types.
+**/
+template<class T>
+class SHARED DormandPrince : public Integrator<T>
+{
+public:
+    T atol;  ///< absolute tolerance
+    T rtol;  ///< relative tolerance
+    std::unordered_map<EventStep<T> *, T> h;  ///< Most recent sub-step size for each event.
+
+    DormandPrince (T atol = 1e-6, T rtol = 1e-3);
+    virtual void run (Event<T> & event);
+};
+
 /**
     Holds parts that are formally queued for simulation.
     Executes on a periodic basis ("step" refers to dt). No other event type can hold parts for the simulator.
@@ -602,15 +1247,27 @@ class SHARED EventStep : public Event<T>
 public:
     T dt;
     std::vector<VisitorStep<T> *> visitors;
+    int                           chunk;  ///< Number of parts a thread claims at one time during a parallel visit. Smaller values balance better, but cost more atomic operations.
 
-    EventStep (T t, T dt);
+    EventStep (T t, T dt);  ///< Creates one visitor per thread in the simulator's pool.
     virtual ~EventStep ();  ///< Frees any parts that have not yet died.
     virtual bool isStep () const;
 
-    virtual void  run     ();
-    virtual void  visit   (std::function<void (Visitor<T> * visitor)> f);
-    void          requeue ();  ///< Subroutine of run(). If our load of instances is non-empty, then get back in the simulation queue.
-    void          enqueue (Part<T> * part);
+    virtual void  run         ();
+    virtual void  visit       (std::function<void (Visitor<T> * visitor)> f);  ///< Processes all visitors concurrently when the simulator has a thread pool. Returns after every visitor is done.
+    void          visitSerial (std::function<void (Visitor<T> * visitor)> f);  ///< Processes visitors one after another on the calling thread. Used for phases that modify simulator-wide structures, such as finalize().
+    virtual void  visitUpdate (std::function<void (Visitor<T> * visitor)> f);  ///< Selects between visit() and visitSerial() according to Simulator::parallelUpdate.
+
+    // Templated versions of the above, for the integrators and run().
+    // Passing a lambda directly lets the compiler inline it into the loop over parts,
+    // rather than making a type-erased call through std::function for each one.
+    template<class F> void visitInline       (const F & f);
+    template<class F> void visitSerialInline (const F & f);
+    template<class F> void visitUpdateInline (const F & f);
+
+    void          requeue     ();  ///< Subroutine of run(). If our load of instances is non-empty, then get back in the simulation queue.
+    void          enqueue     (Part<T> * part);  ///< Assigns part to the visitor with the smallest load.
+    void          enqueue     (std::vector<Part<T> *> & parts);  ///< Same as calling enqueue(part) on each entry in order, but each visitor takes its share in a single splice.
 };
 
 /**
@@ -621,6 +1278,8 @@ class SHARED EventSpike : public Event<T>
 {
 public:
     int latch;
+
+    virtual void release () = 0;  ///< Returns this event to SIMULATOR spikes. Replaces "delete this" at the end of run().
 };
 
 template<class T>
@@ -629,25 +1288,29 @@ class SHARED EventSpikeSingle : public EventSpike<T>
 public:
     Part<T> * target;
 
-    virtual void run   ();
-    virtual void visit (std::function<void (Visitor<T> * visitor)> f);
+    virtual void run     ();
+    virtual void visit   (std::function<void (Visitor<T> * visitor)> f);
+    virtual void release ();
 };
 
 template<class T>
 class SHARED EventSpikeSingleLatch : public EventSpikeSingle<T>
 {
 public:
-    virtual void run ();
+    virtual void run     ();
+    virtual void release ();
 };
 
 template<class T>
 class SHARED EventSpikeMulti : public EventSpike<T>
 {
 public:
-    std::vector<Part<T> *> * targets;
+    SynapseRow<T> *              targets;
+    std::vector<SynapseRow<T> *> merged;  ///< Rows of other sources whose spikes arrive at the same time with the same latch. See Simulator::queueSpike().
 
-    virtual void run   ();
-    virtual void visit (std::function<void (Visitor<T> * visitor)> f);
+    virtual void run     ();
+    virtual void visit   (std::function<void (Visitor<T> * visitor)> f);
+    virtual void release ();
     void setLatch ();
 };
 
@@ -655,7 +1318,63 @@ template<class T>
 class SHARED EventSpikeMultiLatch : public EventSpikeMulti<T>
 {
 public:
-    virtual void run ();
+    virtual void run     ();
+    virtual void release ();
+};
+
+/**
+    Hands out objects of a single class, carved from large blocks.
+    Released objects go on a free list and get handed out again, so in steady state
+    there is no traffic through the general heap allocator.
+    Objects are not reconstructed when recycled. The caller is responsible to fill in all fields.
+**/
+template<class E>
+class SHARED Slab
+{
+public:
+    std::vector<E *> available;  ///< Free list
+    std::vector<E *> blocks;     ///< Each entry is an array of blockSize objects, allocated with new[].
+    int              blockSize;
+
+    Slab (int blockSize = 256);
+    ~Slab ();
+
+    E *  allocate ();
+    void release  (E * e);
+    void reserve  (int count);  ///< Ensures at least count objects are on the free list.
+    void clear    ();           ///< Frees all blocks. Any outstanding objects become invalid.
+};
+
+/**
+    One slab for each concrete class of spike event, along with usage statistics.
+    Spike events are created and processed in the serial parts of the simulation cycle,
+    so each Simulator (and thus each thread under n2a_TLS) needs only one pool.
+**/
+template<class T>
+class SHARED SpikePool
+{
+public:
+    Slab<EventSpikeSingle<T>>      single;
+    Slab<EventSpikeSingleLatch<T>> singleLatch;
+    Slab<EventSpikeMulti<T>>       multi;
+    Slab<EventSpikeMultiLatch<T>>  multiLatch;
+    int                            live;  ///< Number of spike events currently handed out.
+    int                            peak;  ///< Largest value live has reached. Useful for choosing the argument to reserve().
+
+    SpikePool ();
+
+    EventSpikeSingle<T> *      allocateSingle      ();
+    EventSpikeSingleLatch<T> * allocateSingleLatch ();
+    EventSpikeMulti<T> *       allocateMulti       ();
+    EventSpikeMultiLatch<T> *  allocateMultiLatch  ();
+
+    void release (EventSpikeSingle<T> *      e);
+    void release (EventSpikeSingleLatch<T> * e);
+    void release (EventSpikeMulti<T> *       e);
+    void release (EventSpikeMultiLatch<T> *  e);
+
+    void reserve (int count);  ///< Pre-allocates count events of each class.
+    void clear   ();           ///< Frees all memory. Only safe when no spike events remain in the queue.
 };
 
 /**
@@ -682,14 +1401,26 @@ template<class T>
 class SHARED VisitorStep : public Visitor<T>
 {
 public:
-    Part<T>   queue;    ///< The head of a singly-linked list. queue itself never executes, rather, its "next" field points to the first active part.
-    Part<T> * previous; ///< Points to the part immediately ahead of the current part.
+    Part<T>    queue;    ///< The head of a singly-linked list. queue itself never executes, rather, its "next" field points to the first active part.
+    Part<T> *  previous; ///< Points to the part immediately ahead of the current part.
+    int        count;    ///< Number of parts in queue. Used by EventStep::enqueue() to balance load.
+    std::mutex mutex;    ///< Guards changes to queue made outside the visit loop, for example by PartTime::dequeue().
+
+    // Work stealing
+    // During a parallel visit, queue is not allowed to change, so it can be flattened into an array.
+    // Threads claim chunks of the array, first from their own visitor, then from any other visitor.
+    std::vector<Part<T> *> parts;    ///< Snapshot of queue in list order.
+    bool                   changed;  ///< queue has been modified since parts was last collected.
+    std::atomic<int>       claimed;  ///< Index in parts of the next entry no thread has taken yet.
 
     VisitorStep (EventStep<T> * event);
     ~VisitorStep ();  ///< Free any parts still lingering in queue.
 
     virtual void visit   (std::function<void (Visitor<T> * visitor)> f);
+    template<class F> void visitInline (const F & f);  ///< Same as visit(), but with f inlined into the loop.
     virtual void enqueue (Part<T> * newPart);  ///< Puts newPart on our local queue. Called by EventStep::enqueue(), which balances load across all threads.
+    void         enqueue (Part<T> ** parts, int n);  ///< Puts n parts on our local queue, leaving them in the same order as n separate calls to enqueue(). Takes the lock only once.
+    void         collect ();                   ///< Rebuilds parts from queue if it has changed, and resets claimed.
 };
 
 template<class T>
@@ -701,10 +1432,11 @@ public:
     virtual void visit (std::function<void (Visitor<T> * visitor)> f);
 };
 
-// TODO: This implementation using std::map is quite inefficient in both memory and time.
-// If we can assume constant delay and constant dt, then a fixed-size ring buffer would be best.
-// Maybe we can have two implementations: one general and one efficient. The code generator
-// could choose between them based on whether the above conditions are met.
+/**
+    General implementation of delay(), for the case where delay or dt may vary.
+    Uses std::map, which is rather inefficient in both memory and time.
+    When the code generator can prove that delay and dt are both constant, it uses DelayBufferRing instead.
+**/
 template<class T>
 class SHARED DelayBuffer
 {
@@ -717,5 +1449,26 @@ public:
     T step (T now, T delay, T value, T initialValue);
 };
 
+/**
+    Implementation of delay() for constant delay and constant dt, where delay is a whole number of steps.
+    Stores exactly one entry per step, in a fixed-size ring, so there is no allocation after the first call.
+    Entries are stamped with the step at which they were written. Thus it gives the same result as
+    DelayBuffer even if step() is skipped on some cycles (conditional evaluation) or called more than
+    once in the same cycle.
+**/
+template<class T>
+class SHARED DelayBufferRing
+{
+public:
+    T                    value;
+    std::vector<T>       buffer;
+    std::vector<int64_t> stamps;  ///< Step index at which each entry in buffer was written.
+    int64_t              last;    ///< Step index of the most recent call to step().
+
+    DelayBufferRing ();
+
+    T step (T now, T dt, int steps, T value, T initialValue);  ///< @param steps Length of delay in units of dt. Must be at least 1, and must be the same on every call.
+};
+
 
 #endif
@@ -12,8 +12,10 @@ the U.S. Government retains certain rights in this software.
 #include "math.h"
 #include "runtime.h"
 #include "matrix.h"
+#include "profiling.h"
 
 #include <climits>
+#include <fstream>
 
 #ifdef _WIN32
 # define WIN32_LEAN_AND_MEAN
@@ -26,18 +28,28 @@ the U.S. Government retains certain rights in this software.
 
 // General functions ---------------------------------------------------------
 
+// Converts 32 random bits to a uniform draw from [0,1).
+// For float, only 24 bits fit exactly in the mantissa. Using more could round up to 1.
+template<class T>
+inline T
+uniformBits (uint32_t bits)
+{
+    if (sizeof (T) < sizeof (double)) return (bits >> 8) * (T) (1.0 / 16777216);  // 2^-24
+    return                                    bits * (T) (1.0 / 4294967296.0);     // 2^-32
+}
+
 template<class T>
 T
 uniform ()
 {
-    return rand () / (RAND_MAX + (T) 1);
+    return uniformBits<T> (RandomStream::current ()->next32 ());
 }
 
 template<class T>
 T
 uniform (T sigma)
 {
-    return sigma * rand () / (RAND_MAX + (T) 1);
+    return sigma * uniform<T> ();
 }
 
 template<class T>
@@ -45,7 +57,24 @@ T
 uniform (T lo, T hi, T step)
 {
     int steps = floor ((hi - lo) / step + 1);
-    return lo + step * (rand () % steps);
+    return lo + step * (RandomStream::current ()->next32 () % steps);
+}
+
+template<class T>
+void
+uniform (T * result, int count)
+{
+    RandomStream * stream = RandomStream::current ();
+    const int size = 256;
+    uint32_t bits[size];
+    while (count > 0)
+    {
+        int n = std::min (count, size);
+        stream->fill (bits, n);
+        for (int i = 0; i < n; i++) result[i] = uniformBits<T> (bits[i]);
+        result += n;
+        count  -= n;
+    }
 }
 
 // Box-Muller method (polar variant) for Gaussian random numbers.
@@ -53,31 +82,58 @@ template<class T>
 T
 gaussian ()
 {
-    static bool haveNextGaussian = false;
-    static T nextGaussian;
-
-    if (haveNextGaussian)
+    RandomStream * stream = RandomStream::current ();
+    if (stream->haveGaussian)
     {
-        haveNextGaussian = false;
-        return nextGaussian;
+        stream->haveGaussian = false;
+        return stream->nextGaussian;
     }
     else
     {
         T v1, v2, s;
         do
         {
-            v1 = uniform<T> () * 2 - 1;   // between -1.0 and 1.0
-            v2 = uniform<T> () * 2 - 1;
+            v1 = uniformBits<T> (stream->next32 ()) * 2 - 1;   // between -1.0 and 1.0
+            v2 = uniformBits<T> (stream->next32 ()) * 2 - 1;
             s = v1 * v1 + v2 * v2;
         }
         while (s >= 1 || s == 0);
         T multiplier = sqrt (- 2 * log (s) / s);
-        nextGaussian = v2 * multiplier;
-        haveNextGaussian = true;
+        stream->nextGaussian = v2 * multiplier;
+        stream->haveGaussian = true;
         return v1 * multiplier;
     }
 }
 
+// Box-Muller method (basic form) for batches.
+// Unlike the polar variant, there is no rejection loop, so every element does the same arithmetic
+// and the loop can be vectorized.
+template<class T>
+void
+gaussian (T * result, int count)
+{
+    RandomStream * stream = RandomStream::current ();
+    const int size = 256;  // must be even
+    uint32_t bits[size];
+    const T twoPi = (T) 6.283185307179586;
+    while (count > 1)
+    {
+        int n = std::min (count, size) & ~1;
+        stream->fill (bits, n);
+        for (int i = 0; i < n; i += 2)
+        {
+            T u1 = 1 - uniformBits<T> (bits[i]);  // (0,1], so log() is finite
+            T u2 =     uniformBits<T> (bits[i+1]);
+            T r  = sqrt (-2 * log (u1));
+            result[i]   = r * cos (twoPi * u2);
+            result[i+1] = r * sin (twoPi * u2);
+        }
+        result += n;
+        count  -= n;
+    }
+    if (count) *result = gaussian<T> ();
+}
+
 template<class T>
 T
 gaussian (T sigma)
@@ -341,18 +397,18 @@ glTranslate (T x, T y, T z)
 
 #ifdef n2a_FP
 
+template<>
+inline int
+uniformBits<int> (uint32_t bits)
+{
+    return bits >> 1;  // exponent=-1; We promise the semi-open interval [0,1), so must never actaully reach 1.
+}
+
 template<>
 int
 uniform ()
 {
-    // exponent=-1; We promise the semi-open interval [0,1), so must never actaully reach 1.
-#if RAND_MAX == 0x7FFFFFFF
-    return rand ();
-#elif RAND_MAX == 0x7FFF
-    return rand () << 16;
-#else
-# error Need support for unique size of RAND_MAX
-#endif
+    return uniformBits<int> (RandomStream::current ()->next32 ());
 }
 
 template<>
@@ -368,7 +424,7 @@ uniform (int lo, int hi, int step)
 {
     // lo, hi and step all have same exponent
     int steps = (hi - lo) / step + 1;
-    return lo + step * (rand () % steps);
+    return lo + step * (RandomStream::current ()->next32 () % steps);
 }
 
 // Box-Muller method (polar variant) for Gaussian random numbers.
@@ -378,13 +434,11 @@ template<>
 int
 gaussian ()
 {
-    static bool haveNextGaussian = false;
-    static int nextGaussian;
-
-    if (haveNextGaussian)
+    RandomStream * stream = RandomStream::current ();
+    if (stream->haveGaussian)
     {
-        haveNextGaussian = false;
-        return nextGaussian;
+        stream->haveGaussian = false;
+        return stream->nextGaussian;
     }
     else
     {
@@ -394,8 +448,8 @@ gaussian ()
         int v1, v2, s;
         do
         {
-            v1 = uniform<int> () - half;   // u-0.5; Then implicitly double by treating exponent as 0 rather than -1.
-            v2 = uniform<int> () - half;
+            v1 = uniformBits<int> (stream->next32 ()) - half;   // u-0.5; Then implicitly double by treating exponent as 0 rather than -1.
+            v2 = uniformBits<int> (stream->next32 ()) - half;
             // Squaring v puts exponent=0 at bit MSB*2
             // Down-shift puts exponent=14 at bit MSB.
             // We could keep more bits, but this approach is better conditioned.
@@ -407,12 +461,21 @@ gaussian ()
         // Ideal shift is 15(=MSB-15), to put exponent=15 at MSB.
         // We also multiply by 2, so claim exponent=16.
         int multiplier = sqrt (((int64_t) log (s, 14, 14) << FP_MSB - 15) / -s, 16, 14);  // multiplier has exponent=14; v1 and v2 have exponent=0
-        nextGaussian = (int64_t) v2 * multiplier >> FP_MSB - 12;  // product has exponent=14 at bit MSB*2; shift so exponent=2 at MSB
-        haveNextGaussian = true;
-        return         (int64_t) v1 * multiplier >> FP_MSB - 12;
+        stream->nextGaussian = (int) ((int64_t) v2 * multiplier >> FP_MSB - 12);  // product has exponent=14 at bit MSB*2; shift so exponent=2 at MSB
+        stream->haveGaussian = true;
+        return                         (int64_t) v1 * multiplier >> FP_MSB - 12;
     }
 }
 
+// Fixed-point has no cheap sin() or cos(), so stay with the polar method.
+template<>
+void
+gaussian (int * result, int count)
+{
+    int * end = result + count;
+    while (result < end) *result++ = gaussian<int> ();
+}
+
 template<>
 int
 gaussian (int sigma)
@@ -585,6 +648,31 @@ Simulatable<T>::addToMembers ()
 {
 }
 
+template<class T>
+void
+Simulatable<T>::stageCombine (int count, const T * a, T h)
+{
+}
+
+template<class T>
+T
+Simulatable<T>::stageError (int count, const T * e, T h, T atol, T rtol)
+{
+    return 0;
+}
+
+template<class T>
+void
+Simulatable<T>::popDerivative (int count)
+{
+}
+
+template<class T>
+void
+Simulatable<T>::serialize (Checkpoint<T> & c)
+{
+}
+
 template<class T>
 void
 Simulatable<T>::path (String & result)
@@ -735,6 +823,14 @@ Part<T>::finalizeEvent ()
 {
 }
 
+#ifdef n2a_MPI
+template<class T>
+void
+Part<T>::getMonitors (std::vector<std::pair<Part<T> *, SynapseRow<T> *>> & result)
+{
+}
+#endif
+
 template<class T>
 void
 removeMonitor (std::vector<Part<T> *> & partList, Part<T> * part)
@@ -749,6 +845,229 @@ removeMonitor (std::vector<Part<T> *> & partList, Part<T> * part)
     }
 }
 
+template<class T>
+void
+removeMonitor (SynapseRow<T> & partList, Part<T> * part)
+{
+    partList.remove (part);
+}
+
+
+// class SynapseRow ----------------------------------------------------------
+
+template<class T>
+void
+SynapseRow<T>::iterator::settle ()
+{
+    while (true)
+    {
+        while (p < end  &&  ! *p) p++;
+        if (p < end  ||  end == nextEnd) return;  // Either found an entry or exhausted pending. In the latter case, p equals the end iterator.
+        p   = next;
+        end = nextEnd;
+    }
+}
+
+template<class T>
+SynapseRow<T>::SynapseRow ()
+{
+    packed = 0;
+    count  = 0;
+    table  = 0;
+    index  = -1;
+    merge  = 0;
+#   ifdef n2a_MPI
+    tester = 0;
+    source = -1;
+    offset = 0;
+#   endif
+}
+
+template<class T>
+SynapseRow<T>::~SynapseRow ()
+{
+    if (table) table->remove (this);
+}
+
+template<class T>
+void
+SynapseRow<T>::push_back (Part<T> * part)
+{
+    if (! table) SIMULATOR synapses.add (this);
+    pending.push_back (part);
+    table->pending++;
+}
+
+template<class T>
+void
+SynapseRow<T>::remove (Part<T> * part)
+{
+    // Most recent additions are most likely to be removed first, same as removeMonitor() on a plain vector.
+    int last = pending.size () - 1;
+    for (int i = last; i >= 0; i--)
+    {
+        if (pending[i] != part) continue;
+        if (last > i) pending[i] = pending[last];
+        pending.resize (last);
+        table->pending--;
+        return;
+    }
+    for (int i = count - 1; i >= 0; i--)
+    {
+        if (packed[i] != part) continue;
+        packed[i] = 0;
+        table->holes++;
+        return;
+    }
+}
+
+template<class T>
+typename SynapseRow<T>::iterator
+SynapseRow<T>::begin () const
+{
+    iterator result;
+    Part<T> ** p = (Part<T> **) pending.data ();
+    result.p       = packed;
+    result.end     = packed + count;
+    result.next    = p;
+    result.nextEnd = p + pending.size ();
+    result.settle ();
+    return result;
+}
+
+template<class T>
+typename SynapseRow<T>::iterator
+SynapseRow<T>::end () const
+{
+    iterator result;
+    result.p       = (Part<T> **) pending.data () + pending.size ();
+    result.end     = result.p;
+    result.next    = result.p;
+    result.nextEnd = result.p;
+    return result;
+}
+
+
+// class SynapseTable --------------------------------------------------------
+
+template<class T>
+SynapseTable<T>::SynapseTable ()
+{
+    pending = 0;
+    holes   = 0;
+}
+
+template<class T>
+SynapseTable<T>::~SynapseTable ()
+{
+    clear ();
+}
+
+template<class T>
+void
+SynapseTable<T>::clear ()
+{
+    // Rows may outlive the table, for example parts still held in a dead list.
+    // Detach them so their destructors don't reach back here.
+    for (auto row : rows)
+    {
+        row->packed = 0;
+        row->count  = 0;
+        row->table  = 0;
+        row->index  = -1;
+    }
+    rows.clear ();
+    std::vector<Part<T> *> ().swap (targets);
+    pending = 0;
+    holes   = 0;
+}
+
+template<class T>
+void
+SynapseTable<T>::add (SynapseRow<T> * row)
+{
+    row->table = this;
+    row->index = rows.size ();
+    rows.push_back (row);
+}
+
+template<class T>
+void
+SynapseTable<T>::remove (SynapseRow<T> * row)
+{
+    pending -= row->pending.size ();
+    holes   += row->count;  // Slice is orphaned until next pack.
+    int last = rows.size () - 1;
+    if (row->index < last)
+    {
+        SynapseRow<T> * r = rows[last];
+        rows[row->index] = r;
+        r->index = row->index;
+    }
+    rows.resize (last);
+    row->packed = 0;
+    row->count  = 0;
+    row->table  = 0;
+    row->index  = -1;
+}
+
+template<class T>
+bool
+SynapseTable<T>::needPack () const
+{
+    // Repacking costs a pass over every entry, so only do it when a sizable fraction is out of place.
+    // The first pass after initial connect always qualifies, since targets is then empty.
+    int threshold = targets.size () / 4;
+    return  pending > threshold  ||  holes > threshold;
+}
+
+template<class T>
+void
+SynapseTable<T>::pack ()
+{
+    std::vector<Part<T> *> result;
+    result.reserve (targets.size () - holes + pending);
+    int j = 0;
+    int last = rows.size ();
+    while (j < last)
+    {
+        SynapseRow<T> * row = rows[j];
+        int start = result.size ();
+        for (int i = 0; i < row->count; i++) if (row->packed[i]) result.push_back (row->packed[i]);
+        for (auto p : row->pending) result.push_back (p);
+        std::vector<Part<T> *> ().swap (row->pending);  // release heap held by pending
+        row->count = result.size () - start;
+        if (row->count)
+        {
+            j++;
+            continue;
+        }
+
+        // Drop empty rows, so the registry only holds rows that carry entries.
+        // The row will register again if it receives a new entry.
+        row->packed = 0;
+        row->table  = 0;
+        row->index  = -1;
+        last--;
+        if (j < last)
+        {
+            rows[j] = rows[last];
+            rows[j]->index = j;
+        }
+    }
+    rows.resize (last);
+    targets.swap (result);
+
+    Part<T> ** p = targets.data ();
+    for (auto row : rows)
+    {
+        row->packed = p;
+        p += row->count;
+    }
+    pending = 0;
+    holes   = 0;
+}
+
 
 // class PartTime ------------------------------------------------------------
 
@@ -777,7 +1096,7 @@ template<class T>
 void
 PartTime<T>::dequeue ()
 {
-    // TODO: Need mutex on visitor when modifying its queue, even if it is not part of currentEvent.
+    std::lock_guard<std::mutex> lock (visitor->mutex);  // The visitor may belong to some other event, possibly running on another thread.
     if (SIMULATOR currentEvent == visitor->event)
     {
         // Avoid damaging iterator in visitor
@@ -785,6 +1104,8 @@ PartTime<T>::dequeue ()
     }
     if (this->next) this->next->setPrevious (previous);
     previous->next = this->next;
+    visitor->count--;
+    visitor->changed = true;
 }
 
 template<class T>
@@ -792,6 +1113,13 @@ void
 PartTime<T>::setPeriod (T dt)
 {
     dequeue ();
+#   ifdef n2a_MPI
+    if (SIMULATOR distributed.isParked (visitor->event))  // A proxy must stay out of the simulation, even if its period changes.
+    {
+        SIMULATOR distributed.park (dt)->enqueue (this);
+        return;
+    }
+#   endif
     SIMULATOR enqueue (this, dt);
 }
 
@@ -909,6 +1237,9 @@ ConnectPopulation<T>::ConnectPopulation (int index, bool poll)
     i    = 0;  // These two values force a reset
     stop = 0;
 
+    rangeBegin = 0;
+    rangeEnd   = 0;
+
     Max    = 0;
     Min    = 0;
     k      = 0;
@@ -918,7 +1249,9 @@ ConnectPopulation<T>::ConnectPopulation (int index, bool poll)
     explicitXYZ = false;
     xyz         = 0;
     NN          = 0;
+    deleteNN    = false;
     entries     = 0;
+    incremental = false;
 }
 
 template<class T>
@@ -932,13 +1265,24 @@ ConnectPopulation<T>::~ConnectPopulation ()
 
 template<class T>
 void
-ConnectPopulation<T>::prepareNN ()
+ConnectPopulation<T>::prepareNN (NNCache<T> * cache)
 {
-    NN = new KDTree<T> ();
+    if (cache)
+    {
+        cache->update (this);
+        NN       = &cache->tree;
+        deleteNN = false;
+    }
+    else
+    {
+        NN       = new KDTree<T> ();
+        deleteNN = true;
+    }
     if (k > 0) NN->k = k;
     else       NN->k = INT_MAX;
     if (radius > 0) NN->radius = radius;
-    //else NN->radius is INFINITY
+    else            NN->radius = INFINITY;
+    if (cache) return;
 
     entries = new typename KDTree<T>::Entry[size];
     std::vector<typename KDTree<T>::Entry *> pointers;
@@ -997,6 +1341,23 @@ ConnectPopulation<T>::reset (bool newOnly)
     stop = i + count;
 }
 
+template<class T>
+void
+ConnectPopulation<T>::restrict (int begin, int end)
+{
+    i    = 0;  // These two values force a reset
+    stop = 0;
+    if (permute)
+    {
+        permute->restrict (begin, end);
+    }
+    else
+    {
+        rangeBegin = begin;
+        rangeEnd   = end;
+    }
+}
+
 template<class T>
 bool
 ConnectPopulation<T>::old ()
@@ -1021,6 +1382,12 @@ ConnectPopulation<T>::next ()
                 // The innermost iterator of a multi-way connection should iterate over all instances.
                 // Polling should iterate over all instances.
                 reset (! contained  &&  ! poll);
+                if (rangeEnd > rangeBegin)  // Restricted to one block, so start from a fixed position rather than a random one.
+                {
+                    i    = rangeBegin;
+                    stop = std::min (rangeEnd, count);
+                    if (i >= stop) return false;
+                }
             }
             else  // There is another iterator below us. If it has more items, then we should start iteration again.
             {
@@ -1084,18 +1451,68 @@ ConnectPopulation<T>::next ()
 }
 
 
+// class NNCache -------------------------------------------------------------
+
+template<class T>
+void
+NNCache<T>::update (ConnectPopulation<T> * it)
+{
+    std::vector<Part<T> *> & instances = *it->instances;
+    int  size    = instances.size ();
+    int  old     = std::min (size, (int) entries.size ());
+    bool rebuild = entries.empty ();
+
+    for (int i = 0; i < old; i++)
+    {
+        typename KDTree<T>::Entry & e = entries[i];
+        Part<T> * p = instances[i];
+        if (e.part == p) continue;
+        if (e.part) tree.remove (&e);
+        if (p)  // Slot was reused. Its stale coordinates may still be in the tree, so start over.
+        {
+            e.part = p;
+            it->c->setPart (it->index, p);
+            it->c->getProject (it->index, e);
+            rebuild = true;
+        }
+    }
+    for (int i = old; i < (int) entries.size (); i++) tree.remove (&entries[i]);  // instances shrank
+
+    for (int i = old; i < size; i++)
+    {
+        entries.emplace_back ();
+        typename KDTree<T>::Entry & e = entries.back ();
+        Part<T> * p = instances[i];
+        e.part = p;
+        if (! p) continue;
+        it->c->setPart (it->index, p);
+        it->c->getProject (it->index, e);
+        if (! rebuild) tree.add (&e);
+    }
+
+    if (rebuild)
+    {
+        std::vector<typename KDTree<T>::Entry *> pointers;
+        pointers.reserve (entries.size ());
+        for (auto & e : entries) if (e.part) pointers.push_back (&e);
+        tree.set (pointers);
+    }
+}
+
+
 // class ConnectPopulationNN -------------------------------------------------
 
 template<class T>
 ConnectPopulationNN<T>::ConnectPopulationNN (int index, bool poll)
 :   ConnectPopulation<T> (index, poll)
 {
+    batchBegin = 0;
 }
 
 template<class T>
 ConnectPopulationNN<T>::~ConnectPopulationNN ()
 {
-    if (this->NN) delete this->NN;
+    if (this->NN  &&  this->deleteNN) delete this->NN;
 }
 
 template<class T>
@@ -1104,24 +1521,78 @@ ConnectPopulationNN<T>::reset (bool newOnly)
 {
     assert (this->NN);
     this->newOnly = newOnly;
-    std::vector<typename KDTree<T>::Entry *> result;
-    this->NN->find (*this->xyz, result);
-    this->count = result.size ();
+    std::vector<typename KDTree<T>::Entry *> & found = lookup ();
+    this->count = found.size ();
     this->filtered.clear ();
     this->filtered.reserve (this->count);
     if (newOnly)
     {
-        for (auto e : result) if (e->part->getNewborn ()) this->filtered.push_back (e->part);
+        for (auto e : found) if (e->part->getNewborn ()) this->filtered.push_back (e->part);
         this->count = this->filtered.size ();
     }
     else
     {
-        for (auto e : result)                             this->filtered.push_back (e->part);
+        for (auto e : found)                             this->filtered.push_back (e->part);
     }
     this->i = 0;
     this->stop = this->count;
 }
 
+/**
+    Only the innermost iterator moves C.$xyz, and it visits its instances in slot order.
+    So rather than search once per reset, we project a run of upcoming slots and search them
+    all together with KDTree::findBatch(). A batch answer is used only if its position matches
+    C.$xyz exactly. Anything else (such as a projection that depends on other endpoints)
+    falls back to a single search, so the result is always the same as the direct path.
+**/
+template<class T>
+std::vector<typename KDTree<T>::Entry *> &
+ConnectPopulationNN<T>::lookup ()
+{
+    const int batchSize = 256;
+    ConnectPopulation<T> * inner = this->permute;
+    while (inner  &&  inner->permute) inner = inner->permute;
+    if (inner  &&  ! inner->explicitXYZ  &&  inner->count > 0  &&  inner->i > 0)
+    {
+        // Recover the slot of inner->p from the state next() left behind.
+        int slot = (inner->i - 1) % inner->count;
+        if (inner->newOnly) slot += inner->firstborn;
+        int n = slot - batchBegin;
+        if (n < 0  ||  n >= (int) batchXYZ.size ())
+        {
+            int end = inner->size;
+            if (inner->rangeEnd > inner->rangeBegin) end = std::min (end, inner->rangeEnd);
+            int count = std::max (1, std::min (batchSize, end - slot));
+            batchBegin = slot;
+            batchXYZ   .resize (count);
+            batchResult.resize (count);
+            Part<T> * c = this->c;
+            for (int j = 0; j < count; j++)
+            {
+                typename KDTree<T>::Vector3 & v = batchXYZ[j];
+                Part<T> * q = (*inner->instances)[slot + j];
+                if (q)
+                {
+                    c->setPart (inner->index, q);
+                    c->getProject (inner->index, v);
+                }
+                else
+                {
+                    v = *this->xyz;  // Never visited, so any position will do.
+                }
+            }
+            c->setPart (inner->index, inner->p);
+            this->NN->findBatch (batchXYZ.data (), count, batchResult.data ());
+            n = 0;
+        }
+        const typename KDTree<T>::Vector3 & v = batchXYZ[n];
+        const typename KDTree<T>::Vector3 & x = *this->xyz;
+        if (v[0] == x[0]  &&  v[1] == x[1]  &&  v[2] == x[2]) return batchResult[n];
+    }
+    this->NN->find (*this->xyz, result, query);
+    return result;
+}
+
 
 // class ConnectMatrix -------------------------------------------------------
 
@@ -1180,7 +1651,12 @@ ConnectMatrix<T>::next ()
 template<class T>
 Population<T>::Population ()
 {
-    dead = 0;
+    dead         = 0;
+    offload      = false;
+    parallelInit = false;
+#   ifdef n2a_MPI
+    partition = -1;
+#   endif
 }
 
 template<class T>
@@ -1193,6 +1669,8 @@ Population<T>::~Population ()
         delete p;
         p = next;
     }
+    for (auto w : waiting) delete w;
+    for (auto c : caches)  delete c;
 }
 
 template<class T>
@@ -1212,68 +1690,286 @@ template<class T>
 void
 Population<T>::remove (Part<T> * part)
 {
+    if (part->isFree ())
+    {
+        part->next = dead;
+        dead = part;
+    }
+    else
+    {
+        waiting.insert (part);
+    }
+}
+
+template<class T>
+void
+Population<T>::reclaim (Part<T> * part)
+{
+    if (waiting.empty ()) return;  // fast path, since parts usually lose their references while still alive
+    if (! waiting.erase (part)) return;
     part->next = dead;
     dead = part;
 }
 
 template<class T>
-Part<T> *
-Population<T>::allocate ()
+void
+Population<T>::reserve (int n)
 {
-    Part<T> * result = 0;
-
-    Part<T> ** p = &dead;
-    while (*p)
+    Part<T> * p = dead;
+    for (; p  &&  n > 0; n--) p = p->next;
+    if (n > 0) reserveStorage (n);
+    for (; n > 0; n--)
     {
-        if ((*p)->isFree ())
-        {
-            result = *p;
-            result->clear ();
-            *p = (*p)->next;  // remove from dead
-            break;
-        }
-        p = & (*p)->next;
+        p = create ();
+        p->next = dead;
+        dead = p;
     }
-
-    if (! result) result = create ();
-    add (result);
-
-    return result;
 }
 
 template<class T>
 void
-Population<T>::resize (int n)
+Population<T>::reserveStorage (int n)
 {
-    EventStep<T> * event = container->getEvent ();
-    for (int currentN = getN (); currentN < n; currentN++)
-    {
-        Part<T> * p = allocate ();
-        p->enterSimulation ();
-        event->enqueue (p);
-        p->init ();
-    }
 }
 
 template<class T>
 int
-Population<T>::getN ()
+Population<T>::addBatch (Part<T> * part, T dt, bool offload)
 {
-    return 1;
+    if (batch.empty ()) SIMULATOR batches.push_back (this);
+    batchDt       = dt;
+    this->offload = offload;
+    batch.push_back (part);
+    return batch.size () - 1;
 }
 
 template<class T>
-void
-Population<T>::connect ()
+Part<T> *
+Population<T>::removeBatch (int index)
 {
-    ConnectIterator<T> * outer = getIterators (false);  // If this version of connect() is called, then poll is known to be false.
-    if (! outer) return;
-
-    EventStep<T> * event = container->getEvent ();
+    int last = batch.size () - 1;
+    Part<T> * moved = 0;
+    if (index < last)
+    {
+        moved = batch[last];
+        batch[index] = moved;
+    }
+    batch.pop_back ();
+    if (batch.empty ())
+    {
+        std::vector<Population<T> *> & batches = SIMULATOR batches;
+        for (int i = batches.size () - 1; i >= 0; i--)
+        {
+            if (batches[i] != this) continue;
+            batches.erase (batches.begin () + i);
+            break;
+        }
+    }
+    return moved;
+}
+
+template<class T>
+void
+Population<T>::integrateAll (T dt, int begin, int end)
+{
+}
+
+template<class T>
+void
+Population<T>::serialize (Checkpoint<T> & c)
+{
+    // Parts on the waiting list have left the simulation, but other parts may still read them.
+    int count = waiting.size ();
+    c.io (count);
+    if (c.loading)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            Part<T> * p = create ();
+            c.part (p);
+            p->serialize (c);
+            waiting.insert (p);
+        }
+    }
+    else
+    {
+        for (auto p : waiting)
+        {
+            c.part (p);
+            p->serialize (c);
+        }
+    }
+
+    // A loaded batch doesn't go through addBatch(), since the simulator's list of batches is restored as a whole.
+    c.pointers (batch);
+    c.io (batchDt);
+    c.io (offload);
+}
+
+template<class T>
+Part<T> *
+Population<T>::allocate ()
+{
+    Part<T> * result = dead;
+    if (result)
+    {
+        result->clear ();
+        dead = result->next;
+    }
+    else
+    {
+        result = create ();
+    }
+    add (result);
+    profile_count (profileBorn);
+
+    return result;
+}
+
+template<class T>
+void
+Population<T>::resize (int n)
+{
+    EventStep<T> * event = container->getEvent ();
+    int count = n - getN ();
+    if (count <= 0) return;
+    if (count == 1  ||  ! parallelInit)
+    {
+        // An arbitrary init() may look at the queue or at parts born before it, so each part
+        // enters and is initialized before the next one is allocated. This keeps the queue order
+        // and the sequence of random draws the same as they have always been.
+        if (count > 1) reserve (count);
+        for (int i = 0; i < count; i++)
+        {
+            Part<T> * p = allocate ();
+            p->enterSimulation ();
+#           ifdef n2a_MPI
+            // A proxy is initialized like any other instance, so its structure is the same on every rank, but it never runs.
+            // If no connection on this rank ends up using it, Distributed::release() may delete it once init is done.
+            if (partition >= 0  &&  ! SIMULATOR distributed.claim (this, p)) SIMULATOR distributed.park (event->dt)->enqueue (p);
+            else
+#           endif
+            event->enqueue (p);
+            p->init ();
+        }
+        return;
+    }
+
+    // Bulk path
+    // Only for populations whose init() was shown to write nothing but its own part (see
+    // parallelInit), so it can't tell that its neighbors are already in place.
+    // Parts come off the dead list in the reverse of the order reserve() built them, and a splice
+    // reverses them again, so a freshly-allocated population sits in its queue in address order.
+    reserve (count);
+    std::vector<Part<T> *> born;
+    born.reserve (count);
+    for (int i = 0; i < count; i++)
+    {
+        Part<T> * p = allocate ();
+        p->enterSimulation ();
+        born.push_back (p);
+    }
+#   ifdef n2a_MPI
+    if (partition >= 0)
+    {
+        std::vector<Part<T> *> local;
+        local.reserve (count);
+        for (auto p : born)
+        {
+            if (SIMULATOR distributed.claim (this, p)) local.push_back (p);
+            else                                       SIMULATOR distributed.park (event->dt)->enqueue (p);
+        }
+        event->enqueue (local);
+    }
+    else
+#   endif
+    event->enqueue (born);
+    initParallel (born);
+}
+
+template<class T>
+void
+Population<T>::initParallel (std::vector<Part<T> *> & parts)
+{
+    // Same scheme as connectParallel(): fixed blocks, each with its own random stream.
+    const int blockSize = 256;
+    int count  = parts.size ();
+    int blocks = (count + blockSize - 1) / blockSize;
+    RandomStream * source = RandomStream::current ();
+    uint64_t seed = (uint64_t) source->next32 () << 32;
+    seed |= source->next32 ();
+
+    std::atomic<int> claimed (0);
+#   ifdef n2a_TLS
+    Simulator<T> * simulator = Simulator<T>::instance;
+#   endif
+    auto job = [&](int i)
+    {
+#       ifdef n2a_TLS
+        Simulator<T>::instance = simulator;
+#       endif
+        while (true)
+        {
+            int b = claimed.fetch_add (1, std::memory_order_relaxed);
+            if (b >= blocks) break;
+
+            RandomStream stream (seed, b);
+            RandomStream * previous = RandomStream::install (&stream);
+            int end = std::min (count, (b + 1) * blockSize);
+            for (int j = b * blockSize; j < end; j++) parts[j]->init ();
+            RandomStream::install (previous);
+        }
+    };
+    ThreadPool * threads = SIMULATOR threads;
+    if (threads) threads->run (job);
+    else         job (0);
+}
+
+template<class T>
+int
+Population<T>::getN ()
+{
+    return 1;
+}
+
+template<class T>
+void
+Population<T>::connect ()
+{
+    ConnectIterator<T> * outer = getIterators (false);  // If this version of connect() is called, then poll is known to be false.
+    if (! outer) return;
+
+    if (SIMULATOR parallelConnect)
+    {
+        // Only ConnectPopulation can be divided. $max makes the outcome of each candidate depend on
+        // all the connections made before it, so it forces the serial path.
+        ConnectPopulation<T> * cp = dynamic_cast<ConnectPopulation<T> *> (outer);
+        bool limited = false;
+        for (ConnectPopulation<T> * it = cp; it; it = it->permute) if (it->Max > 0) limited = true;
+        if (cp  &&  ! limited)
+        {
+            connectParallel (cp);
+            return;
+        }
+    }
+
+    EventStep<T> * event = container->getEvent ();
     Part<T> * c = create ();
     outer->setProbe (c);
     while (outer->next ())
     {
+#       ifdef n2a_MPI
+        int placement = SIMULATOR distributed.place (c);
+        if (placement != Distributed<T>::local)
+        {
+            if (placement == Distributed<T>::tester)  // c now belongs to distributed, so we need a new probe.
+            {
+                c = this->create ();
+                outer->setProbe (c);
+            }
+            continue;
+        }
+#       endif
         T create = c->getP ();
         // Yes, we need all 3 conditions. If create is 0 or 1, we do not do a random draw, since it would have no effect.
         if (create <= 0) continue;
@@ -1286,6 +1982,10 @@ Population<T>::connect ()
         c->enterSimulation ();
         event->enqueue (c);
         c->init ();
+        profile_count (profileBorn);
+#       ifdef n2a_MPI
+        SIMULATOR distributed.subscribe (c);
+#       endif
 
         c = this->create ();
         outer->setProbe (c);
@@ -1294,6 +1994,127 @@ Population<T>::connect ()
     delete outer;  // Automatically deletes inner iterators as well.
 }
 
+template<class T>
+void
+Population<T>::connectParallel (ConnectPopulation<T> * outer)
+{
+    // Divide the innermost (slowest) iterator into fixed blocks. Each block has its own random stream,
+    // and its accepted connections are kept separately. Neither depends on thread count,
+    // so the final set of connections and the order they enter the simulation don't either.
+    const int blockSize = 64;
+    ConnectPopulation<T> * innermost = outer;
+    int arity = 1;
+    while (innermost->permute)
+    {
+        innermost = innermost->permute;
+        arity++;
+    }
+    int blocks = (innermost->size + blockSize - 1) / blockSize;
+    RandomStream * source = RandomStream::current ();
+    uint64_t seed = (uint64_t) source->next32 () << 32;  // Consumes the same draws from the main stream regardless of thread count.
+    seed |= source->next32 ();
+
+    // Every thread needs its own iterators and probe.
+    ThreadPool * threads = SIMULATOR threads;
+    int count = threads ? threads->count : 1;
+    std::vector<ConnectPopulation<T> *> iterators (count);
+    std::vector<Part<T> *>              probes    (count);
+    iterators[0] = outer;
+    for (int i = 1; i < count; i++) iterators[i] = (ConnectPopulation<T> *) getIterators (false);  // Same population state as first call, so same structure.
+    for (int i = 0; i < count; i++) probes[i] = create ();
+
+    std::vector<std::vector<Part<T> *>> accepted (blocks);  // Endpoints of each accepted connection, arity entries per connection, in iterator order.
+#   ifdef n2a_MPI
+    std::vector<std::vector<Part<T> *>> candidates (blocks);  // Endpoints of connections that belong to other ranks, but might be needed as testers. Same layout as accepted.
+#   endif
+    std::atomic<int> claimed (0);
+#   ifdef n2a_TLS
+    Simulator<T> * simulator = Simulator<T>::instance;
+#   endif
+    auto job = [&](int i)
+    {
+#       ifdef n2a_TLS
+        Simulator<T>::instance = simulator;
+#       endif
+        ConnectPopulation<T> * it = iterators[i];
+        Part<T> *              c  = probes[i];
+        while (true)
+        {
+            int b = claimed.fetch_add (1, std::memory_order_relaxed);
+            if (b >= blocks) break;
+
+            RandomStream stream (seed, b);
+            RandomStream * previous = RandomStream::install (&stream);
+            std::vector<Part<T> *> & result = accepted[b];
+            it->restrict (b * blockSize, (b + 1) * blockSize);
+            it->setProbe (c);
+            while (it->next ())
+            {
+#               ifdef n2a_MPI
+                int placement = SIMULATOR distributed.home (c);
+                if (placement != Distributed<T>::local)
+                {
+                    if (placement == Distributed<T>::tester) for (ConnectPopulation<T> * j = it; j; j = j->permute) candidates[b].push_back (j->p);
+                    continue;
+                }
+#               endif
+                T create = c->getP ();
+                if (create <= 0) continue;
+#               ifdef n2a_FP
+                if (create < 1  &&  create < uniform<T> () >> 16) continue;
+#               else
+                if (create < 1  &&  create < uniform<T> ()) continue;
+#               endif
+                for (ConnectPopulation<T> * j = it; j; j = j->permute) result.push_back (j->p);
+            }
+            RandomStream::install (previous);
+        }
+    };
+    if (threads) threads->run (job);
+    else         job (0);
+
+    std::vector<int> indices;  // Endpoint index of each level in the iterator chain.
+    for (ConnectPopulation<T> * j = outer; j; j = j->permute) indices.push_back (j->index);
+    for (int i = 0; i < count; i++)
+    {
+        delete probes[i];
+        delete iterators[i];  // Automatically deletes inner iterators as well.
+    }
+
+    // Merge. Entering the simulation touches shared structures (event queues, counts, refcounts), so do it serially, in block order.
+    EventStep<T> * event = container->getEvent ();
+    for (auto & result : accepted)
+    {
+        int n = result.size ();
+        for (int k = 0; k < n; k += arity)
+        {
+            Part<T> * c = this->create ();
+            for (int j = 0; j < arity; j++) c->setPart (indices[j], result[k+j]);
+            c->enterSimulation ();
+            event->enqueue (c);
+            c->init ();
+            profile_count (profileBorn);
+#           ifdef n2a_MPI
+            SIMULATOR distributed.subscribe (c);
+#           endif
+        }
+    }
+
+#   ifdef n2a_MPI
+    Part<T> * c = this->create ();
+    for (auto & result : candidates)
+    {
+        int n = result.size ();
+        for (int k = 0; k < n; k += arity)
+        {
+            for (int j = 0; j < arity; j++) c->setPart (indices[j], result[k+j]);
+            if (SIMULATOR distributed.place (c) == Distributed<T>::tester) c = this->create ();
+        }
+    }
+    delete c;
+#   endif
+}
+
 template<class T>
 void
 Population<T>::clearNew ()
@@ -1430,7 +2251,14 @@ Population<T>::getIteratorsNN (bool poll)
         if (A->k > 0  ||  A->radius > 0)  // Note that NN structure won't be created on deepest iterator. TODO: Is this correct?
         {
             A->c = create ();
-            A->prepareNN ();
+            NNCache<T> * cache = 0;
+            if (A->incremental  &&  ! A->deleteInstances)  // Only a direct reference to a population's instances has stable slots.
+            {
+                if (caches.size () <= A->index) caches.resize (A->index + 1, 0);
+                cache = caches[A->index];
+                if (! cache) cache = caches[A->index] = new NNCache<T>;
+            }
+            A->prepareNN (cache);
             delete A->c;
         }
     }
@@ -1446,215 +2274,1701 @@ Population<T>::getIterator (int i, bool poll)
 }
 
 
-// class Simulator -----------------------------------------------------------
-
-#ifdef n2a_TLS
-template<class T> thread_local Simulator<T> * Simulator<T>::instance = 0;
-#else
-template<class T> SHARED Simulator<T> Simulator<T>::instance;
-#endif
+// class CalendarQueue -------------------------------------------------------
 
 template<class T>
-Simulator<T>::Simulator ()
+CalendarQueue<T>::CalendarQueue (T width, int buckets)
+:   width (width)
 {
-    integrator   = 0;
-    stop         = false;
-    currentEvent = 0;
-    after        = false;
+    if (this->width <= 0) this->width = 1;  // Guard against division by zero in slot(). For fixed-point, this is the smallest representable time step.
+    int n = 1;
+    while (n < buckets) n <<= 1;
+    mask    = n - 1;
+    current = 0;
+    count   = 0;
+    this->buckets.resize (n);
+    for (auto & b : this->buckets) b.head = 0;
 }
 
 template<class T>
-Simulator<T>::~Simulator ()
+bool
+CalendarQueue<T>::empty () const
 {
-    clear ();
+    return count == 0  &&  overflow.empty ();
 }
 
 template<class T>
-void
-Simulator<T>::clear ()
+Event<T> *
+CalendarQueue<T>::top ()
 {
-    // Free all non-step events still in queue.
-    while (! queueEvent.empty ())
+    if (count == 0)
     {
-        currentEvent = queueEvent.top ();
-        queueEvent.pop ();
-        if (! currentEvent->isStep ()) delete currentEvent;
+        // Ring is empty, so jump directly to the bucket holding the next overflow event.
+        // Caller guarantees that we are not completely empty.
+        current = slot (overflow.top ()->t);
+        migrate ();
+    }
+    while (true)
+    {
+        Bucket & b = buckets[current & mask];
+        if (b.head < b.events.size ()) return b.events[b.head];
+        b.events.clear ();
+        b.head = 0;
+        current++;
+        migrate ();
     }
-    currentEvent = 0;
-
-    queueResize.clear ();
-    std::queue<Population<T> *> ().swap (queueConnect);  // Necessary because queue lacks clear() function. Exchange contents with an empty queue. Then temporary queue object (now holding any content from queueConnect) is automagically disposed.
-    queueClearNew.clear ();
-
-    // Free all step events
-    for (auto event : periods) delete event;
-    periods.clear ();
-
-    if (integrator) delete integrator;
-    integrator = 0;
-
-    for (auto it : holders) delete it;
-    holders.clear ();
-
-    stop  = false;
-    after = false;
 }
 
 template<class T>
 void
-Simulator<T>::init (WrapperBase<T> * wrapper)
+CalendarQueue<T>::pop ()
 {
-#   ifdef n2a_FP
-    EventStep<T> * event = new EventStep<T> (0, (1 << FP_MSB) / 10000);  // Works for exponentTime=0. For any other case, it is necessary for top-level part to call setPeriod().
-#   else
-    EventStep<T> * event = new EventStep<T> ((T) 0, (T) 1e-4);
-#   endif
-    currentEvent = event;
-    periods.push_back (event);
-
-    // Init cycle
-    event->enqueue (wrapper);  // no need for wrapper->enterSimulation()
-    wrapper->init ();
-    updatePopulations ();
-    event->requeue ();  // Only reinserts self if not empty.
+    // top() has already positioned current on a non-empty bucket.
+    buckets[current & mask].head++;
+    count--;
 }
 
 template<class T>
 void
-Simulator<T>::run (T until)
+CalendarQueue<T>::push (Event<T> * event)
 {
-#   ifdef _WIN32
-    // Handle graceful shutdown on Windows.
-    int64_t lastCheck = 0;  // Wasting extra bits so we will be ready for the end of Unix time in 2038. By then N2A will have taken over the world, but will Windows still be around?
-#   endif
-
-    // Regular simulation
-    while (! queueEvent.empty ()  &&  ! stop)
+    int64_t s = slot (event->t);
+    if (count == 0  &&  s > current)
     {
-        currentEvent = queueEvent.top ();
-        if (currentEvent->t >= until) return;  // Event remains in queue, so a subsequent call to run() will resume seamlessly.
-        queueEvent.pop ();
-        currentEvent->run ();
-
-#       ifdef _WIN32
-        // Since time() is in seconds, simply checking for a difference is sufficient
-        // to throttle our check rate to once per second.
-        int64_t wallTime = (int64_t) time (0);
-        if (wallTime != lastCheck)
-        {
-            if (GetFileAttributes ("finished") != INVALID_FILE_ATTRIBUTES) break;
-            lastCheck = wallTime;
-        }
-#       endif
+        // Nothing in the ring, so we are free to move it forward.
+        current = s;
+        migrate ();
     }
+    if (s > current + mask) overflow.push (event);
+    else                    insert (event);
 }
 
 template<class T>
-void
-Simulator<T>::updatePopulations ()
+int64_t
+CalendarQueue<T>::slot (T t) const
 {
-    // Resize populations that have requested it
-    for (auto it : queueResize) it.first->resize (it.second);
-    queueResize.clear ();
-
-    // Evaluate connection populations that have requested it
-    while (! queueConnect.empty ())
-    {
-        queueConnect.front ()->connect ();
-        queueConnect.pop ();
-    }
-
-    // Clear new flag from populations that have requested it
-    for (auto it : queueClearNew) it->clearNew ();
-    queueClearNew.clear ();
+    return (int64_t) std::floor ((double) t / (double) width);
 }
 
 template<class T>
 void
-Simulator<T>::enqueue (Part<T> * part, T dt)
+CalendarQueue<T>::insert (Event<T> * event)
 {
-    // find a matching event
-    int index = 0;
-    int count = periods.size ();
-    for (; index < count; index++)
-    {
-        if (periods[index]->dt >= dt) break;
-    }
+    // An event may arrive at the same time as current, but slightly before it due to rounding.
+    // Clamp it into the current bucket so it can't be lost behind us.
+    int64_t s = std::max (slot (event->t), current);
+    Bucket & b = buckets[s & mask];
 
-    EventStep<T> * event;
-    if (index < count  &&  periods[index]->dt == dt)
-    {
-        event = periods[index];
-    }
-    else
-    {
-        event = new EventStep<T> (currentEvent->t + dt, dt);
-        periods.insert (periods.begin () + index, event);
-        queueEvent.push (event);
-    }
-    event->enqueue (part);
+    // Find insertion point by scanning back from end.
+    // Most events arrive in time order, so this usually stops immediately.
+    // More returns true when event belongs after the existing entry, including FIFO ties.
+    More<T> more;
+    std::vector<Event<T> *> & events = b.events;
+    int i = events.size ();
+    while (i > b.head  &&  ! more (event, events[i-1])) i--;
+    events.insert (events.begin () + i, event);
+    count++;
 }
 
 template<class T>
 void
-Simulator<T>::removePeriod (EventStep<T> * event)
+CalendarQueue<T>::migrate ()
 {
-    typename std::vector<EventStep<T> *>::iterator it;
-    for (it = periods.begin (); it != periods.end (); it++)
+    int64_t end = current + mask;
+    while (! overflow.empty ())
     {
-        if (*it == event)
-        {
-            periods.erase (it);
-            break;
-        }
+        Event<T> * event = overflow.top ();
+        if (slot (event->t) > end) break;
+        overflow.pop ();
+        insert (event);
     }
-    delete event;  // Events still in periods at end will get deleted by dtor.
 }
 
+
+// class EventQueue ----------------------------------------------------------
+
 template<class T>
-void
-Simulator<T>::resize (Population<T> * population, int n)
+EventQueue<T>::EventQueue ()
 {
-    queueResize.push_back (std::make_pair (population, n));
+    calendar = 0;
 }
 
 template<class T>
-void
+EventQueue<T>::~EventQueue ()
+{
+    if (calendar) delete calendar;
+}
+
+template<class T>
+void
+EventQueue<T>::useCalendar (T width, int buckets)
+{
+    CalendarQueue<T> * next = new CalendarQueue<T> (width, buckets);
+    while (! empty ())
+    {
+        next->push (top ());
+        pop ();
+    }
+    if (calendar) delete calendar;
+    calendar = next;
+}
+
+template<class T>
+void
+EventQueue<T>::useHeap ()
+{
+    if (! calendar) return;
+    CalendarQueue<T> * c = calendar;
+    calendar = 0;
+    while (! c->empty ())
+    {
+        heap.push (c->top ());
+        c->pop ();
+    }
+    delete c;
+}
+
+template<class T>
+bool
+EventQueue<T>::empty () const
+{
+    if (calendar) return calendar->empty ();
+    return heap.empty ();
+}
+
+template<class T>
+size_t
+EventQueue<T>::size () const
+{
+    if (calendar) return calendar->count + calendar->overflow.size ();
+    return heap.size ();
+}
+
+template<class T>
+Event<T> *
+EventQueue<T>::top ()
+{
+    if (calendar) return calendar->top ();
+    return heap.top ();
+}
+
+template<class T>
+void
+EventQueue<T>::pop ()
+{
+    if (calendar) calendar->pop ();
+    else          heap.pop ();
+}
+
+template<class T>
+void
+EventQueue<T>::push (Event<T> * event)
+{
+    if (calendar) calendar->push (event);
+    else          heap.push (event);
+}
+
+
+// class SimulatorMatrixThreads ----------------------------------------------
+
+template<class T>
+int
+SimulatorMatrixThreads<T>::available ()
+{
+#   ifdef n2a_TLS
+    if (! Simulator<T>::instance) return 1;
+#   endif
+    ThreadPool * p = SIMULATOR threads;
+    if (! p  ||  p->job) return 1;
+    return p->count;
+}
+
+template<class T>
+void
+SimulatorMatrixThreads<T>::run (const std::function<void (int)> & job)
+{
+    SIMULATOR threads->run (job);
+}
+
+
+// class Simulator -----------------------------------------------------------
+
+#ifdef n2a_TLS
+template<class T> thread_local Simulator<T> * Simulator<T>::instance = 0;
+#else
+template<class T> SHARED Simulator<T> Simulator<T>::instance;
+#endif
+
+template<class T>
+Simulator<T>::Simulator ()
+{
+    integrator      = 0;
+    stop            = false;
+    currentEvent    = 0;
+    after           = false;
+    threads         = 0;
+    parallelUpdate  = false;
+    parallelConnect = false;
+    mergeSpikes     = true;
+    cacheInputs     = false;
+    shareInputs     = false;
+    wrapper         = 0;
+
+    checkpointInterval  = 0;
+    checkpointNext      = 0;
+    checkpointSignature = 0;
+}
+
+template<class T>
+Simulator<T>::~Simulator ()
+{
+    clear ();
+}
+
+template<class T>
+void
+Simulator<T>::clear ()
+{
+    // Free all non-step events still in queue.
+    while (! queueEvent.empty ())
+    {
+        currentEvent = queueEvent.top ();
+        queueEvent.pop ();
+#       ifdef n2a_MPI
+        if (currentEvent == &distributed.event) continue;
+#       endif
+        if (! currentEvent->isStep ()) ((EventSpike<T> *) currentEvent)->release ();
+    }
+    currentEvent = 0;
+    queueEvent.useHeap ();
+    pendingSpikes.clear ();
+    spikes.clear ();
+
+    queueResize.clear ();
+    batches.clear ();
+    std::queue<Population<T> *> ().swap (queueConnect);  // Necessary because queue lacks clear() function. Exchange contents with an empty queue. Then temporary queue object (now holding any content from queueConnect) is automagically disposed.
+    queueClearNew.clear ();
+
+#   ifdef n2a_MPI
+    distributed.clear ();  // Before periods, because parked events still hold proxies.
+#   endif
+
+    // Free all step events
+    for (auto event : periods) delete event;
+    periods.clear ();
+
+    if (integrator) delete integrator;
+    integrator = 0;
+
+    for (auto it : holders) Holder::release (it);
+    holders.clear ();
+
+    if (threads) delete threads;
+    threads = 0;
+
+    synapses.clear ();
+
+    stop            = false;
+    after           = false;
+    parallelUpdate  = false;
+    parallelConnect = false;
+    mergeSpikes     = true;
+    cacheInputs     = false;
+    shareInputs     = false;
+    outputDirectory.clear ();
+    wrapper         = 0;
+
+    checkpointInterval  = 0;
+    checkpointNext      = 0;
+    checkpointSignature = 0;
+    checkpointPath.clear ();
+}
+
+template<class T>
+void
+Simulator<T>::setThreads (int count)
+{
+    if (count < 1) count = std::max (1u, std::thread::hardware_concurrency ());
+    if (threads)
+    {
+        if (threads->count == count) return;
+        delete threads;
+        threads = 0;
+    }
+    if (count > 1)
+    {
+        threads = new ThreadPool (count);
+        static SimulatorMatrixThreads<T> lend;
+        matrixThreads = &lend;
+    }
+}
+
+template<class T>
+void
+Simulator<T>::init (WrapperBase<T> * wrapper)
+{
+#   ifdef n2a_FP
+    EventStep<T> * event = new EventStep<T> (0, (1 << FP_MSB) / 10000);  // Works for exponentTime=0. For any other case, it is necessary for top-level part to call setPeriod().
+#   else
+    EventStep<T> * event = new EventStep<T> ((T) 0, (T) 1e-4);
+#   endif
+    currentEvent = event;
+    periods.push_back (event);
+    this->wrapper  = wrapper;
+    checkpointNext = checkpointInterval;
+
+    // Init cycle
+    event->enqueue (wrapper);  // no need for wrapper->enterSimulation()
+    wrapper->init ();
+    updatePopulations ();
+    event->requeue ();  // Only reinserts self if not empty.
+
+#   ifdef n2a_MPI
+    if (distributed.size > 1) distributed.start ();
+#   endif
+}
+
+template<class T>
+void
+Simulator<T>::run (T until)
+{
+#   ifdef _WIN32
+    // Handle graceful shutdown on Windows.
+    int64_t lastCheck = 0;  // Wasting extra bits so we will be ready for the end of Unix time in 2038. By then N2A will have taken over the world, but will Windows still be around?
+#   endif
+
+    // Regular simulation
+    while (! queueEvent.empty ())
+    {
+        bool done = stop;
+#       ifdef n2a_MPI
+        if (distributed.size > 1) done = distributed.halt;  // A stop on one rank takes effect at the next exchange, so that all ranks leave the queue together.
+#       endif
+        if (done) break;
+
+        currentEvent = queueEvent.top ();
+        if (currentEvent->t >= until) return;  // Event remains in queue, so a subsequent call to run() will resume seamlessly.
+        profile_event (queueEvent.size ());
+        queueEvent.pop ();
+        T t = currentEvent->t;  // Event may be gone after it runs.
+        currentEvent->run ();
+        if (checkpointInterval > 0  &&  t >= checkpointNext  &&  ! stop) checkpoint (t);
+
+#       ifdef _WIN32
+        // Since time() is in seconds, simply checking for a difference is sufficient
+        // to throttle our check rate to once per second.
+        int64_t wallTime = (int64_t) time (0);
+        if (wallTime != lastCheck)
+        {
+            if (GetFileAttributes ("finished") != INVALID_FILE_ATTRIBUTES) break;
+            lastCheck = wallTime;
+        }
+#       endif
+    }
+}
+
+template<class T>
+void
+Simulator<T>::updatePopulations ()
+{
+    // Resize populations that have requested it
+    for (auto it : queueResize) it.first->resize (it.second);
+    queueResize.clear ();
+
+    // Evaluate connection populations that have requested it
+    while (! queueConnect.empty ())
+    {
+        queueConnect.front ()->connect ();
+        queueConnect.pop ();
+    }
+
+    // Compact event monitor lists, now that connections are stable for this cycle
+    if (synapses.needPack ()) synapses.pack ();
+
+    // Clear new flag from populations that have requested it
+    for (auto it : queueClearNew) it->clearNew ();
+    queueClearNew.clear ();
+}
+
+template<class T>
+void
+Simulator<T>::enqueue (Part<T> * part, T dt)
+{
+    // find a matching event
+    int index = 0;
+    int count = periods.size ();
+    for (; index < count; index++)
+    {
+        if (periods[index]->dt >= dt) break;
+    }
+
+    EventStep<T> * event;
+    if (index < count  &&  periods[index]->dt == dt)
+    {
+        event = periods[index];
+    }
+    else
+    {
+        event = new EventStep<T> (currentEvent->t + dt, dt);
+        periods.insert (periods.begin () + index, event);
+        queueEvent.push (event);
+    }
+    event->enqueue (part);
+}
+
+template<class T>
+void
+Simulator<T>::queueSpike (EventSpikeMulti<T> * spike)
+{
+#   ifdef n2a_MPI
+    SynapseRow<T> * row = spike->targets;
+    if (! row->subscribers.empty ())
+    {
+        distributed.forward (spike);
+        if (row->empty ())  // Only the tester is listening here.
+        {
+            spike->release ();
+            return;
+        }
+    }
+#   endif
+
+    if (mergeSpikes)
+    {
+        std::tuple<T,int,bool> key (spike->t, spike->latch, dynamic_cast<EventSpikeMultiLatch<T> *> (spike) != 0);
+        auto it = pendingSpikes.find (key);
+        if (it == pendingSpikes.end ())
+        {
+            pendingSpikes.emplace (key, spike);
+        }
+        else
+        {
+            EventSpikeMulti<T> * target = it->second;
+            SynapseRow<T> *      row    = spike->targets;
+            // If the same source fires twice into the same instant (say, from two different cycles
+            // with different delays), keep the events separate so its targets still see two events.
+            if (row->merge != target)
+            {
+                row->merge = target;
+                target->merged.push_back (row);
+                spike->release ();
+                return;
+            }
+        }
+    }
+    spike->targets->merge = spike;
+    queueEvent.push (spike);
+}
+
+template<class T>
+void
+Simulator<T>::retireSpike (EventSpikeMulti<T> * spike)
+{
+    if (pendingSpikes.empty ()) return;
+    std::tuple<T,int,bool> key (spike->t, spike->latch, dynamic_cast<EventSpikeMultiLatch<T> *> (spike) != 0);
+    auto it = pendingSpikes.find (key);
+    if (it != pendingSpikes.end ()  &&  it->second == spike) pendingSpikes.erase (it);
+}
+
+template<class T>
+void
+Simulator<T>::checkpoint (T t)
+{
+    // Population changes requested by a spike are only applied by the next step event, so wait for it.
+    if (! queueResize.empty ()  ||  ! queueConnect.empty ()  ||  ! queueClearNew.empty ()) return;
+
+    while (checkpointNext <= t) checkpointNext += checkpointInterval;
+    Checkpoint<T> c;
+    if (! c.save (checkpointPath)) std::cerr << "WARNING: Failed to write checkpoint " << checkpointPath << std::endl;
+}
+
+template<class T>
+void
+Simulator<T>::removePeriod (EventStep<T> * event)
+{
+    typename std::vector<EventStep<T> *>::iterator it;
+    for (it = periods.begin (); it != periods.end (); it++)
+    {
+        if (*it == event)
+        {
+            periods.erase (it);
+            break;
+        }
+    }
+    delete event;  // Events still in periods at end will get deleted by dtor.
+}
+
+template<class T>
+void
+Simulator<T>::integrateBatches (EventStep<T> * event)
+{
+    T dt = event->dt;
+#   ifdef n2a_TLS
+    Simulator<T> * simulator = Simulator<T>::instance;
+#   endif
+    for (auto p : batches)
+    {
+        if (p->batchDt != dt) continue;
+        int n = p->batch.size ();
+        if (! threads  ||  p->offload  ||  n < threads->count * event->chunk)  // Not enough work to be worth waking the pool, or the work happens elsewhere.
+        {
+            p->integrateAll (dt, 0, n);
+            continue;
+        }
+        int count = threads->count;
+        threads->run ([&](int i)
+        {
+#           ifdef n2a_TLS
+            Simulator<T>::instance = simulator;
+#           endif
+            p->integrateAll (dt, (int64_t) n * i / count, (int64_t) n * (i + 1) / count);
+        });
+    }
+}
+
+template<class T>
+void
+Simulator<T>::resize (Population<T> * population, int n)
+{
+    queueResize.push_back (std::make_pair (population, n));
+}
+
+template<class T>
+void
 Simulator<T>::connect (Population<T> * population)
 {
-    queueConnect.push (population);
+    queueConnect.push (population);
+}
+
+template<class T>
+void
+Simulator<T>::clearNew (Population<T> * population)
+{
+    queueClearNew.push_back (population);
+}
+
+template<class T>
+Holder *
+Simulator<T>::getHolder (const String & fileName, Holder * oldHandle)
+{
+    std::vector<Holder *>::iterator it;
+    if (oldHandle)
+    {
+        if (oldHandle->fileName == fileName) return oldHandle;
+        for (it = holders.begin (); it != holders.end (); it++)
+        {
+            if (*it == oldHandle)
+            {
+                holders.erase (it);
+                Holder::release (oldHandle);
+                break;
+            }
+        }
+    }
+    for (it = holders.begin (); it != holders.end (); it++)
+    {
+        if ((*it)->fileName == fileName) return *it;
+    }
+    return 0;
+}
+
+
+template<class T>
+String
+Simulator<T>::outputPath (const String & fileName)
+{
+    if (outputDirectory.empty ()) return fileName;
+    if (fileName.empty ()) return outputDirectory + "/out";
+    if (fileName[0] == '/'  ||  fileName[0] == '\\') return fileName;
+    if (fileName.size () > 1  &&  fileName[1] == ':') return fileName;  // Windows drive letter
+    return outputDirectory + "/" + fileName;
+}
+
+
+// class Checkpoint ----------------------------------------------------------
+
+static const char     checkpointMagic[]  = "N2Ak";
+static const uint32_t checkpointVersion  = 2;
+
+template<class T>
+Checkpoint<T>::Checkpoint ()
+{
+    loading  = false;
+    position = 0;
+}
+
+template<class T>
+bool
+Checkpoint<T>::save (const String & path)
+{
+    loading = false;
+    buffer.clear ();
+
+    char     magic[4];
+    uint32_t version   = checkpointVersion;
+    uint32_t type      = sizeof (T) + (std::is_integral<T>::value ? 0x100 : 0);
+    uint32_t signature = SIMULATOR checkpointSignature;
+    memcpy (magic, checkpointMagic, 4);
+    raw (magic, 4);
+    io (version);
+    io (type);
+    io (signature);
+
+    // Output holders come first, so open() can recreate them before the model's initIO().
+    std::vector<OutputHolder<T> *> outputs;
+    for (auto h : SIMULATOR holders)
+    {
+        OutputHolder<T> * o = dynamic_cast<OutputHolder<T> *> (h);
+        if (o) outputs.push_back (o);
+    }
+    int count = outputs.size ();
+    io (count);
+    for (auto o : outputs)
+    {
+        if (o->writer) o->writer->drain ();
+        o->out->flush ();
+        int64_t length = o->out == &std::cout ? 0 : (int64_t) o->out->tellp ();
+        io (o->fileName);
+        io (length);
+        io (*o);
+    }
+
+    io (SIMULATOR checkpointNext);
+    streams ();
+
+    // Part tree
+    WrapperBase<T> * wrapper = SIMULATOR wrapper;
+    part (wrapper);
+    wrapper->population->serialize (*this);
+
+    // Step events, along with the list of parts held by each visitor
+    std::vector<EventStep<T> *> & periods = SIMULATOR periods;
+    count = periods.size ();
+    io (count);
+    for (auto e : periods)
+    {
+        io (e->t);
+        io (e->dt);
+        int visitors = e->visitors.size ();
+        io (visitors);
+        for (auto v : e->visitors)
+        {
+            std::vector<Part<T> *> parts;
+            for (Part<T> * p = v->queue.next; p; p = p->next) parts.push_back (p);
+            pointers (parts);
+        }
+    }
+    pointers (SIMULATOR batches);
+
+    // Event queue
+    // Events come out in the order they will run, and going back in the same order preserves ties.
+    EventQueue<T> & queue = SIMULATOR queueEvent;
+    std::vector<Event<T> *> events;
+    events.reserve (queue.size ());
+    while (! queue.empty ())
+    {
+        events.push_back (queue.top ());
+        queue.pop ();
+    }
+    for (auto e : events) queue.push (e);
+    count = events.size ();
+    io (count);
+    for (auto e : events)
+    {
+        int kind;
+        if      (e->isStep ())                                   kind = 0;
+        else if (dynamic_cast<EventSpikeSingleLatch<T> *> (e))   kind = 2;
+        else if (dynamic_cast<EventSpikeSingle<T> *> (e))        kind = 1;
+        else if (dynamic_cast<EventSpikeMultiLatch<T> *> (e))    kind = 4;
+        else if (dynamic_cast<EventSpikeMulti<T> *> (e))         kind = 3;
+        else throw "Checkpoint can't record this kind of event";
+        io (kind);
+        io (e->t);
+        if (kind == 0)
+        {
+            int index = std::find (periods.begin (), periods.end (), e) - periods.begin ();
+            io (index);
+            continue;
+        }
+        io (((EventSpike<T> *) e)->latch);
+        if (kind <= 2)
+        {
+            pointer (((EventSpikeSingle<T> *) e)->target);
+        }
+        else
+        {
+            EventSpikeMulti<T> * m = (EventSpikeMulti<T> *) e;
+            pointer  (m->targets);
+            pointers (m->merged);
+        }
+    }
+
+#   ifndef n2a_FP
+    // Sub-step sizes of the adaptive integrator
+    DormandPrince<T> * adaptive = dynamic_cast<DormandPrince<T> *> (SIMULATOR integrator);
+    count = adaptive ? periods.size () : 0;
+    io (count);
+    for (int i = 0; i < count; i++)
+    {
+        auto it = adaptive->h.find (periods[i]);
+        bool found = it != adaptive->h.end ();
+        io (found);
+        if (found) io (it->second);
+    }
+#   endif
+
+    // Write under a temporary name, then move into place, so an interrupted write never replaces a good image.
+    String temp = path + ".tmp";
+    {
+        std::ofstream out (temp.c_str (), std::ios::binary);
+        if (! out.good ()) return false;
+        out.write (buffer.data (), buffer.size ());
+        if (! out.good ())
+        {
+            out.close ();
+            remove (temp.c_str ());
+            return false;
+        }
+    }
+#   ifdef _WIN32
+    remove (path.c_str ());  // Windows won't rename over an existing file.
+#   endif
+    if (rename (temp.c_str (), path.c_str ()))
+    {
+        remove (temp.c_str ());
+        return false;
+    }
+    return true;
+}
+
+template<class T>
+bool
+Checkpoint<T>::open (const String & path)
+{
+    loading = true;
+    if (! map.open (path.c_str ())  ||  map.size < 16) return false;
+    position = map.data;
+
+    char     magic[4];
+    uint32_t version;
+    uint32_t type;
+    uint32_t signature;
+    raw (magic, 4);
+    io (version);
+    io (type);
+    io (signature);
+    if (   memcmp (magic, checkpointMagic, 4)
+        || version   != checkpointVersion
+        || type      != sizeof (T) + (std::is_integral<T>::value ? 0x100 : 0)
+        || signature != SIMULATOR checkpointSignature)
+    {
+        std::cerr << "WARNING: Checkpoint " << path << " was written by a different build of the model. Starting from the beginning." << std::endl;
+        map.close ();
+        return false;
+    }
+
+    int count;
+    io (count);
+    for (int i = 0; i < count; i++)
+    {
+        String  fileName;
+        int64_t length;
+        io (fileName);
+        io (length);
+        OutputHolder<T> * h = new OutputHolder<T> (fileName, length);
+        io (*h);
+        SIMULATOR holders.push_back (h);
+    }
+    return true;
+}
+
+template<class T>
+void
+Checkpoint<T>::load (WrapperBase<T> * wrapper)
+{
+    io (SIMULATOR checkpointNext);
+    streams ();
+
+    // Part tree
+    SIMULATOR wrapper = wrapper;
+    part (wrapper);
+    wrapper->population->serialize (*this);
+
+    // Step events
+    // Deques keep element addresses stable as they grow, so fixups can point into them.
+    std::vector<EventStep<T> *> & periods = SIMULATOR periods;
+    std::vector<int>                   visitorCounts;
+    std::deque<std::vector<Part<T> *>> queues;
+    int count;
+    io (count);
+    for (int i = 0; i < count; i++)
+    {
+        T t;
+        T dt;
+        int visitors;
+        io (t);
+        io (dt);
+        io (visitors);
+        periods.push_back (new EventStep<T> (t, dt));
+        visitorCounts.push_back (visitors);
+        for (int j = 0; j < visitors; j++)
+        {
+            queues.emplace_back ();
+            pointers (queues.back ());
+        }
+    }
+    pointers (SIMULATOR batches);
+
+    // Event queue
+    struct Entry
+    {
+        int                          kind;
+        T                            t;
+        int                          index;
+        int                          latch;
+        Part<T> *                    target;
+        SynapseRow<T> *              targets;
+        std::vector<SynapseRow<T> *> merged;
+    };
+    std::deque<Entry> entries;
+    io (count);
+    for (int i = 0; i < count; i++)
+    {
+        entries.emplace_back ();
+        Entry & e = entries.back ();
+        io (e.kind);
+        io (e.t);
+        if (e.kind == 0)
+        {
+            io (e.index);
+            continue;
+        }
+        io (e.latch);
+        if (e.kind <= 2)
+        {
+            pointer (e.target);
+        }
+        else
+        {
+            pointer  (e.targets);
+            pointers (e.merged);
+        }
+    }
+
+#   ifndef n2a_FP
+    DormandPrince<T> * adaptive = dynamic_cast<DormandPrince<T> *> (SIMULATOR integrator);
+    io (count);
+    for (int i = 0; i < count; i++)
+    {
+        bool found;
+        io (found);
+        if (! found) continue;
+        T h;
+        io (h);
+        if (adaptive) adaptive->h[periods[i]] = h;
+    }
+#   endif
+
+    translate ();
+    map.close ();
+
+    // Restore the queues of parts. VisitorStep::enqueue() puts each part at the front of its list,
+    // so go through each list backward. If the thread count has changed, let EventStep rebalance.
+    int q = 0;
+    int periodCount = periods.size ();
+    for (int i = 0; i < periodCount; i++)
+    {
+        EventStep<T> * e = periods[i];
+        int visitors = visitorCounts[i];
+        int current  = e->visitors.size ();
+        for (int j = 0; j < visitors; j++)
+        {
+            std::vector<Part<T> *> & parts = queues[q++];
+            VisitorStep<T> * v = visitors == current ? e->visitors[j] : 0;
+            for (int k = parts.size () - 1; k >= 0; k--)
+            {
+                if (v) v->enqueue (parts[k]);
+                else   e->enqueue (parts[k]);
+            }
+        }
+    }
+
+    EventQueue<T> & queue = SIMULATOR queueEvent;
+    SpikePool<T> &  spikes = SIMULATOR spikes;
+    for (auto & e : entries)
+    {
+        if (e.kind == 0)
+        {
+            queue.push (periods[e.index]);
+            continue;
+        }
+        if (e.kind <= 2)
+        {
+            EventSpikeSingle<T> * spike;
+            if (e.kind == 1) spike = spikes.allocateSingle ();
+            else             spike = spikes.allocateSingleLatch ();
+            spike->t      = e.t;
+            spike->latch  = e.latch;
+            spike->target = e.target;
+            queue.push (spike);
+            continue;
+        }
+        EventSpikeMulti<T> * spike;
+        if (e.kind == 3) spike = spikes.allocateMulti ();
+        else             spike = spikes.allocateMultiLatch ();
+        spike->t       = e.t;
+        spike->latch   = e.latch;
+        spike->targets = e.targets;
+        spike->merged  = e.merged;
+        spike->targets->merge = spike;
+        for (auto row : spike->merged) row->merge = spike;
+        // The first pending spike for a given key is the one later spikes would merge into, and emplace() keeps the first.
+        if (SIMULATOR mergeSpikes) SIMULATOR pendingSpikes.emplace (std::make_tuple (spike->t, spike->latch, e.kind == 4), spike);
+        queue.push (spike);
+    }
+    SIMULATOR currentEvent = queue.empty () ? 0 : queue.top ();
+}
+
+template<class T>
+void
+Checkpoint<T>::translate ()
+{
+    for (auto f : fixups)
+    {
+        uintptr_t address = (uintptr_t) *f;
+        auto it = bases.upper_bound (address);  // First part that starts after address
+        if (it == bases.begin ()) throw "Checkpoint refers to a part it does not contain";
+        it--;
+        *f = it->second + (address - it->first);
+    }
+    fixups.clear ();
+
+    for (auto & d : deferred) d ();
+    deferred.clear ();
+}
+
+template<class T>
+void
+Checkpoint<T>::raw (void * data, size_t bytes)
+{
+    if (loading)
+    {
+        if (position + bytes > map.data + map.size) throw "Checkpoint is truncated";
+        memcpy (data, position, bytes);
+        position += bytes;
+    }
+    else
+    {
+        const char * p = (const char *) data;
+        buffer.insert (buffer.end (), p, p + bytes);
+    }
+}
+
+template<class T>
+template<class E>
+void
+Checkpoint<T>::io (std::vector<E> & v)
+{
+    int count = v.size ();
+    io (count);
+    if (loading) v.resize (count);
+    for (auto & e : v) io (e);
+}
+
+template<class T>
+void
+Checkpoint<T>::io (Matrix<T> & A)
+{
+    int rows    = A.rows ();
+    int columns = A.columns ();
+    io (rows);
+    io (columns);
+    if (loading) A.resize (rows, columns);
+    for (int c = 0; c < columns; c++)
+    {
+        for (int r = 0; r < rows; r++) io (A(r,c));
+    }
+}
+
+template<class T>
+void
+Checkpoint<T>::io (String & value)
+{
+    int length = value.size ();
+    io (length);
+    if (loading)
+    {
+        if (position + length > map.data + map.size) throw "Checkpoint is truncated";
+        value.assign (position, length);
+        position += length;
+    }
+    else
+    {
+        raw ((void *) value.c_str (), length);
+    }
+}
+
+template<class T>
+void
+Checkpoint<T>::io (DelayBuffer<T> & d)
+{
+    io (d.value);
+    int count = d.buffer.size ();
+    io (count);
+    if (loading)
+    {
+        d.buffer.clear ();
+        for (int i = 0; i < count; i++)
+        {
+            T key;
+            T value;
+            io (key);
+            io (value);
+            d.buffer.emplace (key, value);
+        }
+    }
+    else
+    {
+        for (auto & it : d.buffer)
+        {
+            T key = it.first;
+            io (key);
+            io (it.second);
+        }
+    }
+}
+
+template<class T>
+void
+Checkpoint<T>::io (DelayBufferRing<T> & d)
+{
+    io (d.value);
+    io (d.buffer);
+    io (d.stamps);
+    io (d.last);
+}
+
+template<class T>
+void
+Checkpoint<T>::io (SynapseRow<T> & row)
+{
+    if (! loading)
+    {
+        std::vector<Part<T> *> entries;
+        for (auto p : row) entries.push_back (p);
+        pointers (entries);
+        return;
+    }
+
+    // Hold the entries in pending until they are translated, then register them the usual way.
+    pointers (row.pending);
+    if (row.pending.empty ()) return;
+    SynapseRow<T> * r = &row;
+    deferred.push_back ([r] ()
+    {
+        std::vector<Part<T> *> entries;
+        entries.swap (r->pending);
+        for (auto p : entries) r->push_back (p);
+    });
+}
+
+template<class T>
+void
+Checkpoint<T>::io (OutputHolder<T> & h)
+{
+    io (h.raw);
+    io (h.binary);
+    io (h.blockSize);
+    io (h.queue);
+    io (h.drop);
+
+    int count = h.columnMap.size ();
+    io (count);
+    if (loading)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            String column;
+            int    index;
+            io (column);
+            io (index);
+            h.columnMap[column] = index;
+        }
+    }
+    else
+    {
+        for (auto & it : h.columnMap)
+        {
+            String column = it.first;
+            io (column);
+            io (it.second);
+        }
+    }
+
+    count = h.columnMode.size ();
+    io (count);
+    for (int i = 0; i < count; i++)
+    {
+        if (loading) h.columnMode.push_back (new std::map<String,String>);
+        std::map<String,String> & mode = *h.columnMode[i];
+        int n = mode.size ();
+        io (n);
+        if (loading)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                String key;
+                String value;
+                io (key);
+                io (value);
+                mode[key] = value;
+            }
+        }
+        else
+        {
+            for (auto & it : mode)
+            {
+                String key = it.first;
+                io (key);
+                io (it.second);
+            }
+        }
+    }
+
+    io (h.columnValues);
+    io (h.columnsPrevious);
+    io (h.traceReceived);
+    io (h.t);
+    io (h.blockRows);
+    io (h.blockColumns);
+}
+
+template<class T>
+void
+Checkpoint<T>::streams ()
+{
+    // Default streams are thread-local, so each worker copies its own in or out.
+    ThreadPool * threads = SIMULATOR threads;
+    int count = threads ? threads->count : 1;
+    std::vector<RandomStream> copies (count);
+#   ifdef n2a_TLS
+    Simulator<T> * simulator = Simulator<T>::instance;
+#   endif
+    auto job = [&](int i)
+    {
+#       ifdef n2a_TLS
+        Simulator<T>::instance = simulator;
+#       endif
+        RandomStream * r = RandomStream::current ();
+        if (! loading)               copies[i] = *r;
+        else if (i < (int) copies.size ()) *r = copies[i];
+    };
+
+    if (loading)
+    {
+        int saved;
+        io (saved);
+        if (saved != count) std::cerr << "WARNING: Checkpoint was written with " << saved << " threads, but this run has " << count << ". Random draws will not continue the same way." << std::endl;
+        copies.resize (saved);
+        for (auto & r : copies) io (r);
+        if (threads) threads->run (job);
+        else         job (0);
+    }
+    else
+    {
+        if (threads) threads->run (job);
+        else         job (0);
+        io (count);
+        for (auto & r : copies) io (r);
+    }
+}
+
+template<class T>
+void
+Checkpoint<T>::io (RandomStream & r)
+{
+    raw (r.key,     sizeof (r.key));
+    raw (r.counter, sizeof (r.counter));
+    raw (r.block,   sizeof (r.block));
+    io (r.used);
+    io (r.haveGaussian);
+    io (r.nextGaussian);
+}
+
+
+#ifdef n2a_MPI
+
+// class EventExchange -------------------------------------------------------
+
+template<class T>
+void
+EventExchange<T>::run ()
+{
+    Distributed<T> & d = SIMULATOR distributed;
+    if (! d.exchange ()  ||  SIMULATOR stop) return;  // Every rank reaches the same answer, so they all leave the queue together.
+    this->t += d.interval;
+    SIMULATOR queueEvent.push (this);
+}
+
+template<class T>
+void
+EventExchange<T>::visit (std::function<void (Visitor<T> * visitor)> f)
+{
+}
+
+
+// class Distributed ---------------------------------------------------------
+
+template<class T>
+Distributed<T>::Distributed ()
+{
+    rank        = 0;
+    size        = 1;
+    initialized = false;
+    halt        = false;
+    prune       = false;
+    interval    = 0;
+    late        = 0;
+}
+
+template<class T>
+void
+Distributed<T>::init ()
+{
+    int running;
+    MPI_Initialized (&running);
+    if (! running)
+    {
+        MPI_Init (0, 0);
+        initialized = true;
+    }
+    MPI_Comm_rank (MPI_COMM_WORLD, &rank);
+    MPI_Comm_size (MPI_COMM_WORLD, &size);
+    outgoing.resize (size);
+
+    if (rank > 0)
+    {
+        String dir = String ("rank") + std::to_string (rank).c_str ();
+        String & outputDirectory = SIMULATOR outputDirectory;
+        if (! outputDirectory.empty ()) dir = outputDirectory + "/" + dir;
+        n2a::mkdirs (dir + "/");
+        outputDirectory = dir;
+    }
+}
+
+template<class T>
+void
+Distributed<T>::finalize ()
+{
+    if (! initialized) return;
+    int done;
+    MPI_Finalized (&done);
+    if (! done) MPI_Finalize ();
+    initialized = false;
+}
+
+template<class T>
+void
+Distributed<T>::clear ()
+{
+    if (late) std::cerr << "WARNING: rank " << rank << " received " << late << " spikes after their delivery time. Reduce $meta.backend.c.mpi.interval." << std::endl;
+    late = 0;
+
+    for (auto p : testers) delete p;
+    testers.clear ();
+    for (auto it : parked) delete it.second;  // Like periods, these don't own their parts. Populations do.
+    parked.clear ();
+
+    parts.clear ();
+    owners.clear ();
+    populations.clear ();
+    referenced.clear ();
+    ids.clear ();
+    for (auto & o : outgoing) o.clear ();
+    incoming.clear ();
+    interval = 0;
+}
+
+template<class T>
+void
+Distributed<T>::add (Population<T> * population)
+{
+    if (size > 1) population->partition = 0;
+}
+
+template<class T>
+bool
+Distributed<T>::claim (Population<T> * population, Part<T> * part)
+{
+    int id    = parts.size ();
+    int owner = population->partition++ % size;
+    parts.push_back (part);
+    owners.push_back (owner);
+    populations.push_back (population);
+    referenced.push_back (false);
+    ids[part] = id;
+    return owner == rank;
+}
+
+template<class T>
+EventStep<T> *
+Distributed<T>::park (T dt)
+{
+    EventStep<T> *& result = parked[dt];
+    if (! result) result = new EventStep<T> (0, dt);
+    return result;
+}
+
+template<class T>
+bool
+Distributed<T>::isParked (Event<T> * event) const
+{
+    for (auto it : parked) if (it.second == event) return true;
+    return false;
+}
+
+template<class T>
+void
+Distributed<T>::release ()
+{
+    // Unlink unused proxies from the holding events.
+    std::vector<Part<T> *> unused;
+    for (auto it : parked)
+    {
+        for (auto v : it.second->visitors)
+        {
+            Part<T> * previous = &v->queue;
+            Part<T> * p;
+            while ((p = previous->next))
+            {
+                auto id = ids.find (p);
+                if (id == ids.end ()  ||  referenced[id->second]  ||  ! p->isFree ())
+                {
+                    previous = p;
+                    continue;
+                }
+                if (p->next) p->next->setPrevious (previous);
+                previous->next = p->next;
+                v->count--;
+                v->changed = true;
+                unused.push_back (p);
+            }
+        }
+    }
+
+    for (auto p : unused)
+    {
+        int id = ids[p];
+        ids.erase (p);
+        parts[id] = 0;
+        Population<T> * population = populations[id];
+        p->leaveSimulation ();  // Clears the slot in its population's instances, and drops whatever references it holds.
+        if (population->dead == p)
+        {
+            population->dead = p->next;
+            delete p;
+        }
+    }
+}
+
+template<class T>
+int
+Distributed<T>::owner (Part<T> * part) const
+{
+    auto it = ids.find (part);
+    if (it == ids.end ()) return -1;
+    return owners[it->second];
+}
+
+template<class T>
+int
+Distributed<T>::home (Part<T> * connection) const
+{
+    if (size < 2) return local;
+
+    int  result       = -1;
+    bool hasLocal     = false;
+    Part<T> * p;
+    for (int i = 0; (p = connection->getPart (i)); i++)
+    {
+        int o = owner (p);
+        if (o < 0) continue;
+        result = o;
+        if (o == rank) hasLocal = true;
+    }
+    if (result < 0  ||  result == rank) return local;
+    if (! hasLocal) return remote;
+    return tester;  // Only a candidate. place() decides whether it is needed.
+}
+
+template<class T>
+int
+Distributed<T>::place (Part<T> * connection)
+{
+    int result = home (connection);
+    if (result != tester) return result;
+    if (keepTester (connection)) return tester;
+    return remote;
+}
+
+template<class T>
+bool
+Distributed<T>::keepTester (Part<T> * connection)
+{
+    std::vector<std::pair<Part<T> *, SynapseRow<T> *>> monitors;
+    connection->getMonitors (monitors);
+    bool used = false;
+    for (auto & m : monitors)
+    {
+        if (owner (m.first) != rank) continue;
+        SynapseRow<T> * row = m.second;
+        if (row->tester) continue;
+        row->tester = connection;
+        used = true;
+    }
+    if (used)
+    {
+        testers.push_back (connection);
+        reference (connection);
+    }
+    return used;
 }
 
 template<class T>
 void
-Simulator<T>::clearNew (Population<T> * population)
+Distributed<T>::reference (Part<T> * connection)
 {
-    queueClearNew.push_back (population);
+    Part<T> * p;
+    for (int i = 0; (p = connection->getPart (i)); i++)
+    {
+        auto it = ids.find (p);
+        if (it != ids.end ()) referenced[it->second] = true;
+    }
 }
 
 template<class T>
-Holder *
-Simulator<T>::getHolder (const String & fileName, Holder * oldHandle)
+void
+Distributed<T>::subscribe (Part<T> * connection)
 {
-    std::vector<Holder *>::iterator it;
-    if (oldHandle)
+    if (size < 2) return;
+    reference (connection);
+    std::vector<std::pair<Part<T> *, SynapseRow<T> *>> monitors;
+    connection->getMonitors (monitors);
+    for (auto & m : monitors)
     {
-        if (oldHandle->fileName == fileName) return oldHandle;
-        for (it = holders.begin (); it != holders.end (); it++)
+        Part<T> * source = m.first;
+        SynapseRow<T> * row = m.second;
+        int o = owner (source);
+        if (o < 0  ||  o == rank  ||  row->source >= 0) continue;  // A row subscribes only once, no matter how many local monitors it has.
+        row->source = ids[source];
+        row->offset = (char *) row - (char *) source;
+        outgoing[o].push_back ({row->source, row->offset, kindSubscribe, 0, (T) 0});
+    }
+}
+
+template<class T>
+void
+Distributed<T>::forward (EventSpikeMulti<T> * spike)
+{
+    SynapseRow<T> * row = spike->targets;
+    int32_t kind = dynamic_cast<EventSpikeMultiLatch<T> *> (spike) ? kindSpikeLatch : kindSpike;
+    for (int r : row->subscribers) outgoing[r].push_back ({row->source, row->offset, kind, spike->latch, spike->t});
+}
+
+template<class T>
+void
+Distributed<T>::start ()
+{
+    if (interval <= 0) interval = SIMULATOR wrapper->getEvent ()->dt;
+    if (prune) release ();  // Connections made during init are all the connections there will be.
+
+    exchange ();  // Subscriptions made during init.
+    event.t = SIMULATOR currentEvent->t + interval;
+    SIMULATOR queueEvent.push (&event);
+}
+
+template<class T>
+bool
+Distributed<T>::exchange ()
+{
+    const int width = sizeof (Message);
+    std::vector<int> sendCounts (size);
+    std::vector<int> sendOffsets (size);
+    std::vector<int> receiveCounts (size);
+    std::vector<int> receiveOffsets (size);
+    std::vector<Message> sending;
+    for (int r = 0; r < size; r++)
+    {
+        sendOffsets[r] = sending.size () * width;
+        sendCounts[r]  = outgoing[r].size () * width;
+        sending.insert (sending.end (), outgoing[r].begin (), outgoing[r].end ());
+        outgoing[r].clear ();
+    }
+    MPI_Alltoall (sendCounts.data (), 1, MPI_INT, receiveCounts.data (), 1, MPI_INT, MPI_COMM_WORLD);
+    int total = 0;
+    for (int r = 0; r < size; r++)
+    {
+        receiveOffsets[r] = total;
+        total += receiveCounts[r];
+    }
+    incoming.resize (total / width);
+    MPI_Alltoallv (sending.data (), sendCounts.data (), sendOffsets.data (), MPI_BYTE, incoming.data (), receiveCounts.data (), receiveOffsets.data (), MPI_BYTE, MPI_COMM_WORLD);
+
+    for (int r = 0; r < size; r++)
+    {
+        int begin = receiveOffsets[r] / width;
+        int end   = begin + receiveCounts[r] / width;
+        for (int i = begin; i < end; i++) deliver (incoming[i], r);
+    }
+    incoming.clear ();
+
+    int status[2] = {! SIMULATOR queueEvent.empty (), SIMULATOR stop};
+    MPI_Allreduce (MPI_IN_PLACE, status, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if (status[1])
+    {
+        SIMULATOR stop = true;
+        halt           = true;
+    }
+    return status[0];
+}
+
+template<class T>
+void
+Distributed<T>::deliver (const Message & m, int from)
+{
+    SynapseRow<T> * row = (SynapseRow<T> *) ((char *) parts[m.part] + m.offset);
+    if (m.kind == kindSubscribe)
+    {
+        if (std::find (row->subscribers.begin (), row->subscribers.end (), from) == row->subscribers.end ()) row->subscribers.push_back (from);
+        row->source = m.part;
+        row->offset = m.offset;
+        if (row->empty ()  &&  ! row->tester) std::cerr << "WARNING: No tester available for events of part " << m.part << " on rank " << rank << std::endl;
+        return;
+    }
+
+    EventSpikeMulti<T> * spike;
+    if (m.kind == kindSpikeLatch) spike = SIMULATOR spikes.allocateMultiLatch ();
+    else                      spike = SIMULATOR spikes.allocateMulti ();
+    spike->t = m.t;
+    T now = SIMULATOR currentEvent->t;
+    if (spike->t < now)
+    {
+        spike->t = now;
+        if (m.kind == kindSpike) late++;  // A latch only needs to arrive before the target's next cycle, so it is never really late.
+    }
+    spike->latch   = m.latch;
+    spike->targets = row;
+    SIMULATOR queueSpike (spike);
+}
+
+#endif
+
+#ifdef n2a_TLS
+
+// class Ensemble ------------------------------------------------------------
+
+template<class T>
+Ensemble<T>::Ensemble (Init init, Run run, Finish finish)
+:   modelInit   (init),
+    modelRun    (run),
+    modelFinish (finish),
+    next        (0)
+{
+}
+
+template<class T>
+void
+Ensemble<T>::add (const Parameters<T> & parameters, const String & directory)
+{
+    members.emplace_back ();
+    Member & m = members.back ();
+    m.parameters = parameters;
+    m.directory  = directory;
+}
+
+template<class T>
+void
+Ensemble<T>::run (T until, int threadCount)
+{
+    if (threadCount < 1) threadCount = std::max (1u, std::thread::hardware_concurrency ());
+    threadCount = std::min (threadCount, (int) members.size ());
+
+    next = 0;
+    auto work = [this, until] ()
+    {
+        while (true)
         {
-            if (*it == oldHandle)
-            {
-                holders.erase (it);
-                delete *it;
-                break;
-            }
+            int i = next++;
+            if (i >= (int) members.size ()) break;
+            runMember (members[i], until);
         }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threadCount; i++) workers.emplace_back (work);
+    for (auto & w : workers) w.join ();
+}
+
+template<class T>
+void
+Ensemble<T>::runMember (Member & member, T until)
+{
+    // The model's init() uses this simulator rather than making its own.
+    Simulator<T>::instance = new Simulator<T>;
+    Simulator<T>::instance->shareInputs     = true;
+    Simulator<T>::instance->outputDirectory = member.directory;
+    if (! member.directory.empty ()) n2a::mkdirs (member.directory + "/");
+
+    std::vector<String> arguments;
+    arguments.reserve (member.parameters.namedValues.size ());
+    for (auto & it : member.parameters.namedValues) arguments.push_back (it.first + "=" + it.second);
+    std::vector<const char *> argv;
+    argv.push_back ("ensemble");  // Program name, skipped by Parameters::parse().
+    for (auto & a : arguments) argv.push_back (a.c_str ());
+
+    try
+    {
+        modelInit (argv.size (), argv.data ());
+        modelRun (until);
+        modelFinish ();
     }
-    for (it = holders.begin (); it != holders.end (); it++)
+    catch (const char * message)
     {
-        if ((*it)->fileName == fileName) return *it;
+        member.error = message;
     }
-    return 0;
+    catch (const std::exception & e)  // For example, std::bad_alloc from a member that outgrew memory.
+    {
+        member.error = e.what ();
+    }
+    catch (...)
+    {
+        member.error = "Generic Exception";
+    }
+
+    // finish() normally disposes of the simulator, but not if an exception skipped it.
+    if (Simulator<T>::instance)
+    {
+        delete Simulator<T>::instance;
+        Simulator<T>::instance = 0;
+    }
+}
+
+template<class T>
+int
+Ensemble<T>::failures () const
+{
+    int result = 0;
+    for (auto & m : members) if (! m.error.empty ()) result++;
+    return result;
+}
+
+#endif
+
+
+// class Integrator ----------------------------------------------------------
+
+template<class T>
+Integrator<T>::~Integrator ()
+{
 }
 
 
@@ -1664,77 +3978,97 @@ template<class T>
 void
 Euler<T>::run (Event<T> & event)
 {
-    event.visit ([](Visitor<T> * visitor)
+    auto f = [](Visitor<T> * visitor)
     {
         visitor->part->integrate ();
-    });
+    };
+    if (event.isStep ())
+    {
+        EventStep<T> & es = (EventStep<T> &) event;
+        SIMULATOR integrateBatches (&es);
+        es.visitInline (f);
+    }
+    else  // Spike events visit only a few parts, so no need to avoid std::function.
+    {
+        event.visit (f);
+    }
 }
 
 
 // class RungeKutta ----------------------------------------------------------
 
+/**
+    Classic 4th-order Runge-Kutta.
+    Cross-part dependencies only arise in updateDerivative(), so every other per-part operation
+    is fused into the pass that precedes or follows it. This gives 7 passes over the parts
+    rather than one pass per operation.
+**/
 template<class T>
 void
 RungeKutta<T>::run (Event<T> & event)
 {
-    // k1
-    event.visit ([](Visitor<T> * visitor)
-    {
-        visitor->part->snapshot ();
-        visitor->part->pushDerivative ();
-    });
-
-    // k2 and k3
-    EventStep<T> & es = (EventStep<T> &) event;
-    T t  = es.t;  // Save current values of t and dt
-    T dt = es.dt;
-    es.dt /= 2;
-    es.t  -= es.dt;  // t is the current point in time, so we must look backward half a timestep
-    for (int i = 0; i < 2; i++)
+    if (! event.isStep ())
     {
+        // Spike events have no dt, so the intermediate steps can't be formed.
+        // Parts that receive spikes integrate over the elapsed time since their last update (lastT), so a single integrate() is coherent.
         event.visit ([](Visitor<T> * visitor)
         {
             visitor->part->integrate ();
         });
-        event.visit ([](Visitor<T> * visitor)
-        {
-            visitor->part->updateDerivative ();
-        });
-        event.visit ([](Visitor<T> * visitor)
-        {
-            visitor->part->finalizeDerivative ();
-            visitor->part->multiplyAddToStack (2.0f);
-        });
+        return;
     }
-    es.dt = dt;  // restore original values
-    es.t  = t;
+    EventStep<T> & es = (EventStep<T> &) event;
+
+    T t  = es.t;  // Save current values of t and dt
+    T dt = es.dt;
+    es.dt /= 2;
+    es.t  -= es.dt;  // t is the current point in time, so we must look backward half a timestep
 
-    // k4
-    event.visit ([](Visitor<T> * visitor)
+    // k1, then advance to midpoint for k2
+    es.visitInline ([](Visitor<T> * visitor)
     {
+        visitor->part->snapshot ();
+        visitor->part->pushDerivative ();
         visitor->part->integrate ();
     });
-    event.visit ([](Visitor<T> * visitor)
+    es.visitUpdateInline ([](Visitor<T> * visitor)
     {
         visitor->part->updateDerivative ();
     });
-    event.visit ([](Visitor<T> * visitor)
+
+    // k2, then advance to midpoint for k3
+    es.visitInline ([](Visitor<T> * visitor)
     {
         visitor->part->finalizeDerivative ();
-        visitor->part->addToMembers ();  // clears stackDerivative
+        visitor->part->multiplyAddToStack (2.0f);
+        visitor->part->integrate ();
     });
-
-    // finish
-    event.visit ([](Visitor<T> * visitor)
+    es.visitUpdateInline ([](Visitor<T> * visitor)
     {
-        visitor->part->multiply ((T) 1 / 6);
+        visitor->part->updateDerivative ();
     });
-    event.visit ([](Visitor<T> * visitor)
+
+    // k3, then advance to full step for k4
+    es.dt = dt;  // restore original values
+    es.t  = t;
+    es.visitInline ([](Visitor<T> * visitor)
     {
+        visitor->part->finalizeDerivative ();
+        visitor->part->multiplyAddToStack (2.0f);
         visitor->part->integrate ();
     });
-    event.visit ([](Visitor<T> * visitor)
+    es.visitUpdateInline ([](Visitor<T> * visitor)
+    {
+        visitor->part->updateDerivative ();
+    });
+
+    // k4 and finish
+    es.visitInline ([](Visitor<T> * visitor)
     {
+        visitor->part->finalizeDerivative ();
+        visitor->part->addToMembers ();  // clears stackDerivative
+        visitor->part->multiply ((T) 1 / 6);
+        visitor->part->integrate ();
         visitor->part->restore ();
     });
 }
@@ -1745,71 +4079,195 @@ template<>
 void
 RungeKutta<int>::run (Event<int> & event)
 {
-    // k1
-    event.visit ([](Visitor<int> * visitor)
+    if (! event.isStep ())
     {
-        visitor->part->snapshot ();
-        visitor->part->pushDerivative ();
-    });
-
-    // k2 and k3
+        // Spike events have no dt, so the intermediate steps can't be formed.
+        // Parts that receive spikes integrate over the elapsed time since their last update (lastT), so a single integrate() is coherent.
+        event.visit ([](Visitor<int> * visitor)
+        {
+            visitor->part->integrate ();
+        });
+        return;
+    }
     EventStep<int> & es = (EventStep<int> &) event;
+
     int t  = es.t;  // Save current values of t and dt
     int dt = es.dt;
     es.dt >>= 1;  // divide by 2
     es.t   -= es.dt;  // t is the current point in time, so we must look backward half a timestep
-    for (int i = 0; i < 2; i++)
+
+    // k1, then advance to midpoint for k2
+    es.visitInline ([](Visitor<int> * visitor)
     {
-        event.visit ([](Visitor<int> * visitor)
+        visitor->part->snapshot ();
+        visitor->part->pushDerivative ();
+        visitor->part->integrate ();
+    });
+    es.visitUpdateInline ([](Visitor<int> * visitor)
+    {
+        visitor->part->updateDerivative ();
+    });
+
+    // k2, then advance to midpoint for k3
+    es.visitInline ([](Visitor<int> * visitor)
+    {
+        visitor->part->finalizeDerivative ();
+        visitor->part->multiplyAddToStack (2 << FP_MSB - 1);  // exponent=1, just enough to hold the values used by RK4
+        visitor->part->integrate ();
+    });
+    es.visitUpdateInline ([](Visitor<int> * visitor)
+    {
+        visitor->part->updateDerivative ();
+    });
+
+    // k3, then advance to full step for k4
+    es.dt = dt;  // restore original values
+    es.t  = t;
+    es.visitInline ([](Visitor<int> * visitor)
+    {
+        visitor->part->finalizeDerivative ();
+        visitor->part->multiplyAddToStack (2 << FP_MSB - 1);
+        visitor->part->integrate ();
+    });
+    es.visitUpdateInline ([](Visitor<int> * visitor)
+    {
+        visitor->part->updateDerivative ();
+    });
+
+    // k4 and finish
+    es.visitInline ([](Visitor<int> * visitor)
+    {
+        visitor->part->finalizeDerivative ();
+        visitor->part->addToMembers ();  // clears stackDerivative
+        visitor->part->multiply ((1 << FP_MSB - 1) / 6);
+        visitor->part->integrate ();
+        visitor->part->restore ();
+    });
+}
+
+#endif
+
+
+// class DormandPrince -------------------------------------------------------
+
+template<class T>
+DormandPrince<T>::DormandPrince (T atol, T rtol)
+:   atol (atol),
+    rtol (rtol)
+{
+}
+
+template<class T>
+void
+DormandPrince<T>::run (Event<T> & event)
+{
+    if (! event.isStep ())
+    {
+        // Same reasoning as RungeKutta.
+        event.visit ([](Visitor<T> * visitor)
         {
             visitor->part->integrate ();
         });
-        event.visit ([](Visitor<int> * visitor)
+        return;
+    }
+    EventStep<T> & es = (EventStep<T> &) event;
+
+    // Butcher tableau. Row i gives the coefficients for forming the input to stage i+1.
+    // The last row is the 5th-order solution, which is also the input to stage 7 (first same as last).
+    static const T c[7] = {0, (T) 1 / 5, (T) 3 / 10, (T) 4 / 5, (T) 8 / 9, 1, 1};
+    static const T a[6][6] =
+    {
+        {(T) 1 / 5},
+        {(T) 3 / 40,           (T) 9 / 40},
+        {(T) 44 / 45,          (T) -56 / 15,          (T) 32 / 9},
+        {(T) 19372 / 6561,     (T) -25360 / 2187,     (T) 64448 / 6561,     (T) -212 / 729},
+        {(T) 9017 / 3168,      (T) -355 / 33,         (T) 46732 / 5247,     (T) 49 / 176,     (T) -5103 / 18656},
+        {(T) 35 / 384,         0,                     (T) 500 / 1113,       (T) 125 / 192,    (T) -2187 / 6784,     (T) 11 / 84}
+    };
+    // Difference between 5th and 4th order weights.
+    static const T e[7] = {(T) 71 / 57600, 0, (T) -71 / 16695, (T) 71 / 1920, (T) -17253 / 339200, (T) 22 / 525, (T) -1 / 40};
+
+    T t  = es.t;  // Save current values of t and dt
+    T dt = es.dt;
+    T & step = h[&es];
+    if (step <= 0  ||  step > dt) step = dt;
+
+    // t is the current point in time, so the interval to cover is [t-dt, t].
+    T remaining = dt;
+    while (remaining > 0)
+    {
+        T    hh   = step;
+        bool last = hh >= remaining * (T) 0.99;  // Don't leave a sliver at the end.
+        if (last) hh = remaining;
+        T start = t - remaining;
+        es.dt = hh;
+
+        // k1 is the derivative left by the previous update (or by stage 7 of the previous sub-step).
+        es.visitInline ([&](Visitor<T> * visitor)
         {
-            visitor->part->updateDerivative ();
+            visitor->part->snapshot ();
+            visitor->part->pushDerivative ();
+            visitor->part->stageCombine (1, a[0], hh);
         });
-        event.visit ([](Visitor<int> * visitor)
+        for (int i = 1; i < 7; i++)
+        {
+            es.t = start + c[i] * hh;
+            es.visitUpdateInline ([](Visitor<T> * visitor)
+            {
+                visitor->part->updateDerivative ();
+            });
+            const T * ai = i < 6 ? a[i] : 0;
+            es.visitInline ([&](Visitor<T> * visitor)
+            {
+                visitor->part->finalizeDerivative ();
+                visitor->part->pushDerivative ();
+                if (ai) visitor->part->stageCombine (i + 1, ai, hh);
+            });
+        }
+
+        // The error norm is a reduction over all parts, so do it on a single thread.
+        T error = 0;
+        es.visitSerialInline ([&](Visitor<T> * visitor)
+        {
+            error = std::max (error, visitor->part->stageError (7, e, hh, atol, rtol));
+        });
+
+        T factor = error > 0 ? (T) 0.9 * std::pow (error, (T) -0.2) : 5;
+        factor = std::min ((T) 5, std::max ((T) 0.2, factor));
+        bool accept = error <= 1  ||  hh <= dt * (T) 1e-6;  // Give up on accuracy rather than stall.
+        if (accept)
+        {
+            // Members already hold the 5th-order solution, and the stage-7 derivative is k1 for the next sub-step.
+            es.visitInline ([](Visitor<T> * visitor)
+            {
+                visitor->part->popDerivative (7);
+                visitor->part->restore ();
+            });
+            if (last) remaining = 0;
+            else      remaining -= hh;
+            // A sub-step that was clipped to fit the interval says little about the best size, so don't let it shrink step.
+            if (last  &&  hh < step) step = std::max (step, hh * factor);
+            else                     step = hh * factor;
+        }
+        else
         {
-            visitor->part->finalizeDerivative ();
-            visitor->part->multiplyAddToStack (2 << FP_MSB - 1);  // exponent=1, just enough to hold the values used by RK4
-        });
+            // Put back k1 and the preserved members, then try again with a smaller step.
+            es.visitInline ([&](Visitor<T> * visitor)
+            {
+                visitor->part->popDerivative (6);
+                visitor->part->multiply (0);
+                visitor->part->addToMembers ();
+                visitor->part->stageCombine (0, a[0], hh);
+                visitor->part->restore ();
+            });
+            step = hh * factor;
+        }
+        step = std::min (step, dt);
     }
     es.dt = dt;  // restore original values
     es.t  = t;
-
-    // k4
-    event.visit ([](Visitor<int> * visitor)
-    {
-        visitor->part->integrate ();
-    });
-    event.visit ([](Visitor<int> * visitor)
-    {
-        visitor->part->updateDerivative ();
-    });
-    event.visit ([](Visitor<int> * visitor)
-    {
-        visitor->part->finalizeDerivative ();
-        visitor->part->addToMembers ();  // clears stackDerivative
-    });
-
-    // finish
-    event.visit ([](Visitor<int> * visitor)
-    {
-        visitor->part->multiply ((1 << FP_MSB - 1) / 6);
-    });
-    event.visit ([](Visitor<int> * visitor)
-    {
-        visitor->part->integrate ();
-    });
-    event.visit ([](Visitor<int> * visitor)
-    {
-        visitor->part->restore ();
-    });
 }
 
-#endif
-
-
 // class Event ---------------------------------------------------------------
 
 #ifdef n2a_FP
@@ -1828,6 +4286,13 @@ Event<T>::isStep () const
     return false;
 }
 
+template<class T>
+void
+Event<T>::visitUpdate (std::function<void (Visitor<T> * visitor)> f)
+{
+    visit (f);
+}
+
 
 // class EventStep -----------------------------------------------------------
 
@@ -1836,7 +4301,10 @@ EventStep<T>::EventStep (T t, T dt)
 :   dt (dt)
 {
     this->t = t;
-    visitors.push_back (new VisitorStep<T> (this));
+    chunk = 64;
+    int count = SIMULATOR threads ? SIMULATOR threads->count : 1;
+    visitors.reserve (count);
+    for (int i = 0; i < count; i++) visitors.push_back (new VisitorStep<T> (this));
 }
 
 template<class T>
@@ -1858,11 +4326,11 @@ EventStep<T>::run ()
 {
     // Update parts
     SIMULATOR integrator->run (*this);
-    visit ([](Visitor<T> * visitor)
+    visitUpdateInline ([](Visitor<T> * visitor)
     {
         visitor->part->update ();
     });
-    visit ([](Visitor<T> * visitor)
+    visitSerialInline ([](Visitor<T> * visitor)
     {
         if (! visitor->part->finalize ())
         {
@@ -1870,7 +4338,10 @@ EventStep<T>::run ()
             Part<T> * p = visitor->part;  // for convenience
             if (p->next) p->next->setPrevious (v->previous);
             v->previous->next = p->next;
+            v->count--;
+            v->changed = true;
             p->leaveSimulation ();
+            profile_count (profileDied);
         }
     });
     if (SIMULATOR stop) return;
@@ -1883,14 +4354,115 @@ template<class T>
 void
 EventStep<T>::visit (std::function<void (Visitor<T> * visitor)> f)
 {
-    visitors[0]->visit (f);
+    visitInline (f);
+}
+
+template<class T>
+void
+EventStep<T>::visitSerial (std::function<void (Visitor<T> * visitor)> f)
+{
+    visitSerialInline (f);
+}
+
+template<class T>
+void
+EventStep<T>::visitUpdate (std::function<void (Visitor<T> * visitor)> f)
+{
+    visitUpdateInline (f);
+}
+
+template<class T>
+template<class F>
+void
+EventStep<T>::visitInline (const F & f)
+{
+    ThreadPool * threads = SIMULATOR threads;
+    if (! threads  ||  visitors.size () == 1)
+    {
+        visitors[0]->visitInline (f);
+        return;
+    }
+
+    bool changed = false;
+    for (auto v : visitors) if (v->changed) changed = true;
+    if (changed)
+    {
+        threads->run ([this](int i)
+        {
+            visitors[i]->collect ();
+        });
+    }
+    else
+    {
+        for (auto v : visitors) v->claimed.store (0, std::memory_order_relaxed);
+    }
+
+#   ifdef n2a_TLS
+    Simulator<T> * simulator = Simulator<T>::instance;  // Worker threads have their own copy of the thread-local instance pointer, so it must be forwarded.
+#   endif
+    int count = visitors.size ();
+    threads->run ([&](int i)
+    {
+#       ifdef n2a_TLS
+        Simulator<T>::instance = simulator;
+#       endif
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now ();
+
+        // Work through our own visitor first, then steal from the others.
+        // Parts are always processed through our own visitor object, since it carries per-thread state.
+        VisitorStep<T> * v = visitors[i];
+        for (int k = 0; k < count; k++)
+        {
+            VisitorStep<T> * source = visitors[(i + k) % count];
+            int size = source->parts.size ();
+            while (true)
+            {
+                int begin = source->claimed.fetch_add (chunk, std::memory_order_relaxed);
+                if (begin >= size) break;
+                int end = std::min (begin + chunk, size);
+                for (int j = begin; j < end; j++)
+                {
+                    v->part = source->parts[j];
+                    f (v);
+                }
+            }
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now () - start;
+        threads->busy[i] += elapsed.count ();
+    });
+}
+
+template<class T>
+template<class F>
+void
+EventStep<T>::visitSerialInline (const F & f)
+{
+    for (auto v : visitors) v->visitInline (f);
+}
+
+template<class T>
+template<class F>
+void
+EventStep<T>::visitUpdateInline (const F & f)
+{
+    if (SIMULATOR parallelUpdate) visitInline (f);
+    else                          visitSerialInline (f);
 }
 
 template<class T>
 void
 EventStep<T>::requeue ()
 {
-    if (visitors[0]->queue.next)  // still have instances, so re-queue event
+    bool empty = true;
+    for (auto v : visitors)
+    {
+        if (! v->queue.next) continue;
+        empty = false;
+        break;
+    }
+
+    if (! empty)  // still have instances, so re-queue event
     {
         this->t += dt;
         SIMULATOR queueEvent.push (this);
@@ -1905,7 +4477,39 @@ template<class T>
 void
 EventStep<T>::enqueue (Part<T> * part)
 {
-    visitors[0]->enqueue (part);
+    VisitorStep<T> * best = visitors[0];
+    int count = visitors.size ();
+    for (int i = 1; i < count; i++)
+    {
+        VisitorStep<T> * v = visitors[i];
+        if (v->count < best->count) best = v;
+    }
+    best->enqueue (part);
+}
+
+template<class T>
+void
+EventStep<T>::enqueue (std::vector<Part<T> *> & parts)
+{
+    int count = visitors.size ();
+    if (count == 1)
+    {
+        visitors[0]->enqueue (parts.data (), parts.size ());
+        return;
+    }
+
+    // Deal out parts exactly as the single-part version would, but against a local copy of the loads.
+    std::vector<int>                    load   (count);
+    std::vector<std::vector<Part<T> *>> shares (count);
+    for (int i = 0; i < count; i++) load[i] = visitors[i]->count;
+    for (auto p : parts)
+    {
+        int best = 0;
+        for (int i = 1; i < count; i++) if (load[i] < load[best]) best = i;
+        shares[best].push_back (p);
+        load[best]++;
+    }
+    for (int i = 0; i < count; i++) visitors[i]->enqueue (shares[i].data (), shares[i].size ());
 }
 
 
@@ -1916,6 +4520,7 @@ void
 EventSpikeSingle<T>::run ()
 {
     target->setLatch (this->latch);
+    profile_count (profileSpikes);
 
     SIMULATOR integrator->run (*this);
     visit ([](Visitor<T> * visitor)
@@ -1925,7 +4530,7 @@ EventSpikeSingle<T>::run ()
         visitor->part->finalizeEvent ();
     });
 
-    delete this;
+    release ();
 }
 
 template<class T>
@@ -1936,6 +4541,13 @@ EventSpikeSingle<T>::visit (std::function<void (Visitor<T> * visitor)> f)
     f (&v);
 }
 
+template<class T>
+void
+EventSpikeSingle<T>::release ()
+{
+    SIMULATOR spikes.release (this);
+}
+
 
 // class EventSpikeSingleLatch -----------------------------------------------
 
@@ -1944,7 +4556,15 @@ void
 EventSpikeSingleLatch<T>::run ()
 {
     this->target->setLatch (this->latch);
-    delete this;
+    profile_count (profileSpikes);
+    release ();
+}
+
+template<class T>
+void
+EventSpikeSingleLatch<T>::release ()
+{
+    SIMULATOR spikes.release (this);
 }
 
 
@@ -1954,6 +4574,7 @@ template<class T>
 void
 EventSpikeMulti<T>::run ()
 {
+    SIMULATOR retireSpike (this);
     setLatch ();
 
     SIMULATOR integrator->run (*this);
@@ -1968,7 +4589,7 @@ EventSpikeMulti<T>::run ()
         // A part could die during event processing, but it can wait till next EventStep to leave queue.
     });
 
-    delete this;
+    release ();
 }
 
 template<class T>
@@ -1979,27 +4600,22 @@ EventSpikeMulti<T>::visit (std::function<void (Visitor<T> * visitor)> f)
     v.visit (f);
 }
 
+template<class T>
+void
+EventSpikeMulti<T>::release ()
+{
+    SIMULATOR spikes.release (this);
+}
+
 template<class T>
 void
 EventSpikeMulti<T>::setLatch ()
 {
-    int i = 0;
-    int last = targets->size () - 1;
-    while (i <= last)
-    {
-        Part<T> * target = (*targets)[i];
-        if (target)
-        {
-            target->setLatch (EventSpike<T>::latch);
-        }
-        else
-        {
-            (*targets)[i] = (*targets)[last--];
-        }
-        i++;  // can go past last, but this will cause no harm.
-    }
-    if ((*targets)[last]) targets->resize (last + 1);
-    else                  targets->resize (last);
+    int latch = EventSpike<T>::latch;
+    uint64_t count = 0;
+    for (auto target : *targets) {target->setLatch (latch); count++;}
+    for (auto row : merged) for (auto target : *row) {target->setLatch (latch); count++;}
+    profile_count (profileSpikes, count);
 }
 
 
@@ -2009,8 +4625,169 @@ template<class T>
 void
 EventSpikeMultiLatch<T>::run ()
 {
+    SIMULATOR retireSpike (this);
     this->setLatch ();
-    delete this;
+    release ();
+}
+
+template<class T>
+void
+EventSpikeMultiLatch<T>::release ()
+{
+    SIMULATOR spikes.release (this);
+}
+
+
+// class Slab ----------------------------------------------------------------
+
+template<class E>
+Slab<E>::Slab (int blockSize)
+:   blockSize (blockSize)
+{
+}
+
+template<class E>
+Slab<E>::~Slab ()
+{
+    clear ();
+}
+
+template<class E>
+E *
+Slab<E>::allocate ()
+{
+    if (available.empty ()) reserve (blockSize);
+    E * result = available.back ();
+    available.pop_back ();
+    return result;
+}
+
+template<class E>
+void
+Slab<E>::release (E * e)
+{
+    available.push_back (e);
+}
+
+template<class E>
+void
+Slab<E>::reserve (int count)
+{
+    int needed = count - available.size ();
+    if (needed <= 0) return;
+    needed = std::max (needed, blockSize);
+    E * block = new E[needed];
+    blocks.push_back (block);
+    available.reserve (available.size () + needed);
+    // Push in reverse, so objects come out in address order.
+    for (int i = needed - 1; i >= 0; i--) available.push_back (block + i);
+}
+
+template<class E>
+void
+Slab<E>::clear ()
+{
+    for (E * block : blocks) delete[] block;
+    blocks.clear ();
+    available.clear ();
+}
+
+
+// class SpikePool -----------------------------------------------------------
+
+template<class T>
+SpikePool<T>::SpikePool ()
+{
+    live = 0;
+    peak = 0;
+}
+
+template<class T>
+EventSpikeSingle<T> *
+SpikePool<T>::allocateSingle ()
+{
+    if (++live > peak) peak = live;
+    return single.allocate ();
+}
+
+template<class T>
+EventSpikeSingleLatch<T> *
+SpikePool<T>::allocateSingleLatch ()
+{
+    if (++live > peak) peak = live;
+    return singleLatch.allocate ();
+}
+
+template<class T>
+EventSpikeMulti<T> *
+SpikePool<T>::allocateMulti ()
+{
+    if (++live > peak) peak = live;
+    return multi.allocate ();
+}
+
+template<class T>
+EventSpikeMultiLatch<T> *
+SpikePool<T>::allocateMultiLatch ()
+{
+    if (++live > peak) peak = live;
+    return multiLatch.allocate ();
+}
+
+template<class T>
+void
+SpikePool<T>::release (EventSpikeSingle<T> * e)
+{
+    live--;
+    single.release (e);
+}
+
+template<class T>
+void
+SpikePool<T>::release (EventSpikeSingleLatch<T> * e)
+{
+    live--;
+    singleLatch.release (e);
+}
+
+template<class T>
+void
+SpikePool<T>::release (EventSpikeMulti<T> * e)
+{
+    live--;
+    e->merged.clear ();
+    multi.release (e);
+}
+
+template<class T>
+void
+SpikePool<T>::release (EventSpikeMultiLatch<T> * e)
+{
+    live--;
+    e->merged.clear ();
+    multiLatch.release (e);
+}
+
+template<class T>
+void
+SpikePool<T>::reserve (int count)
+{
+    single     .reserve (count);
+    singleLatch.reserve (count);
+    multi      .reserve (count);
+    multiLatch .reserve (count);
+}
+
+template<class T>
+void
+SpikePool<T>::clear ()
+{
+    single     .clear ();
+    singleLatch.clear ();
+    multi      .clear ();
+    multiLatch .clear ();
+    live = 0;
+    peak = 0;
 }
 
 
@@ -2038,7 +4815,10 @@ VisitorStep<T>::VisitorStep (EventStep<T> * event)
 :   Visitor<T> (event)
 {
     queue.next = 0;
-    previous = 0;
+    previous   = 0;
+    count      = 0;
+    changed    = false;
+    claimed    = 0;
 }
 
 template<class T>
@@ -2056,6 +4836,14 @@ VisitorStep<T>::~VisitorStep ()
 template<class T>
 void
 VisitorStep<T>::visit (std::function<void (Visitor<T> * visitor)> f)
+{
+    visitInline (f);
+}
+
+template<class T>
+template<class F>
+void
+VisitorStep<T>::visitInline (const F & f)
 {
     previous = &queue;
     while (previous->next)
@@ -2070,11 +4858,50 @@ template<class T>
 void
 VisitorStep<T>::enqueue (Part<T> * newPart)
 {
+    std::lock_guard<std::mutex> lock (mutex);
     newPart->setVisitor (this);
     if (queue.next) queue.next->setPrevious (newPart);
     newPart->setPrevious (&queue);
     newPart->next = queue.next;
     queue.next = newPart;
+    count++;
+    changed = true;
+}
+
+template<class T>
+void
+VisitorStep<T>::enqueue (Part<T> ** parts, int n)
+{
+    if (n <= 0) return;
+    std::lock_guard<std::mutex> lock (mutex);
+    // Each part goes in front of the one before it, just as with separate calls to enqueue().
+    Part<T> * head = queue.next;
+    for (int i = 0; i < n; i++)
+    {
+        Part<T> * p = parts[i];
+        p->setVisitor (this);
+        if (head) head->setPrevious (p);
+        p->next = head;
+        head = p;
+    }
+    head->setPrevious (&queue);
+    queue.next = head;
+    count += n;
+    changed = true;
+}
+
+template<class T>
+void
+VisitorStep<T>::collect ()
+{
+    if (changed)
+    {
+        parts.clear ();
+        parts.reserve (count);
+        for (Part<T> * p = queue.next; p; p = p->next) parts.push_back (p);
+        changed = false;
+    }
+    claimed.store (0, std::memory_order_relaxed);
 }
 
 
@@ -2096,6 +4923,14 @@ VisitorSpikeMulti<T>::visit (std::function<void (Visitor<T> * visitor)> f)
         this->part = target;
         f (this);
     }
+    for (auto row : e->merged)
+    {
+        for (auto target : *row)
+        {
+            this->part = target;
+            f (this);
+        }
+    }
 }
 
 
@@ -2125,4 +4960,58 @@ DelayBuffer<T>::step (T now, T delay, T futureValue, T initialValue)
 }
 
 
+// class DelayBufferRing -----------------------------------------------------
+
+template<class T>
+DelayBufferRing<T>::DelayBufferRing ()
+{
+    last = INT64_MIN;
+}
+
+template<class T>
+T
+DelayBufferRing<T>::step (T now, T dt, int steps, T futureValue, T initialValue)
+{
+    int64_t k = (int64_t) std::round ((double) now / (double) dt);
+    if (buffer.empty ())
+    {
+        value = initialValue;
+        buffer.resize (steps);
+        stamps.assign (steps, INT64_MIN);
+    }
+    else if (k == last)
+    {
+        return value;  // Same cycle as previous call. Like DelayBuffer, we keep the first value offered for this time.
+    }
+
+    // Find the most recent entry that has come due since the previous call.
+    // In the regular case (one call per cycle), this is simply the entry written exactly steps ago.
+    if (last != INT64_MIN)
+    {
+        if (last <= k - steps)  // Everything written so far has come due, so the latest entry wins.
+        {
+            value = buffer[last % steps];
+        }
+        else  // Entries written in (last-steps, last] are all intact, so search back from newest that is due.
+        {
+            for (int64_t j = k - steps; j > last - steps  &&  j >= 0; j--)
+            {
+                int i = j % steps;
+                if (stamps[i] == j)
+                {
+                    value = buffer[i];
+                    break;
+                }
+            }
+        }
+    }
+
+    int i = k % steps;
+    buffer[i] = futureValue;
+    stamps[i] = k;
+    last      = k;
+    return value;
+}
+
+
 #endif
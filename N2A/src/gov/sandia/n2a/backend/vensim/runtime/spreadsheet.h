@@ -10,11 +10,15 @@ the U.S. Government retains certain rights in this software.
 #include <runtime.h>
 #include <shared.h>
 
+#include <set>
+#include <unordered_map>
+
 /**
     Matrices which provide cell values for the entire sheet.
     In general, a cell with either be a number, a string or empty.
     We don't know ahead of time whether the matrix is dense or sparse, so the
     exact type of matrix is decided by the loader.
+    The cells are not read until the sheet is first referenced.
 **/
 template<class T>
 class SHARED Sheet
@@ -24,23 +28,44 @@ public:
     MatrixAbstract<int> * strings; ///< 1-based indices into string collection. Empty cells and numbers are 0.
     int                   rows;
     int                   columns;
+    const T *             dense;   ///< Column-major values of numbers, when it is a dense matrix. Null if sparse.
+    String                target;  ///< Path of worksheet XML within the archive.
+    bool                  loaded;
 
+    Sheet ();
     ~Sheet ();
+
+    T number (int row, int column) const  ///< @return Numeric value of cell, or 0 if cell is outside the sheet.
+    {
+        if (row < 0  ||  column < 0  ||  row >= rows  ||  column >= columns) return 0;
+        if (dense) return dense[(size_t) column * rows + row];
+        return (*numbers)(row,column);
+    }
 };
 
 template<class T>
 class SHARED Spreadsheet : public Holder
 {
 public:
-    std::vector<String>          strings;  ///< collection of all strings that appear in the workbook
-    std::map<String, Sheet<T> *> wb;       ///< workbook, a collection of worksheets
-    Sheet<T> *                   first;    ///< The first sheet defined in the file. This is the default when no sheet is specified in cell address.
-    String                       cell;     ///< The most recently parsed anchor cell address. Includes sheet name and coordinates.
-    Sheet<T> *                   ws;       ///< Anchor sheet
-    int                          ar;       ///< Anchor row
-    int                          ac;       ///< Anchor column
+    struct Anchor
+    {
+        Sheet<T> * ws;
+        int        ar;
+        int        ac;
+    };
+
+    std::vector<String>               strings;    ///< collection of all strings that appear in the workbook
+    std::map<String, Sheet<T> *>      wb;         ///< workbook, a collection of worksheets
+    Sheet<T> *                        first;      ///< The first sheet defined in the file. This is the default when no sheet is specified in cell address.
+    String                            cell;       ///< The most recently parsed anchor cell address. Includes sheet name and coordinates.
+    Sheet<T> *                        ws;         ///< Anchor sheet
+    int                               ar;         ///< Anchor row
+    int                               ac;         ///< Anchor column
+    std::unordered_map<String,Anchor> anchors;    ///< Every anchor cell address parsed so far, so that repeated lookups don't parse it again.
+    std::set<int>                     dateStyles; ///< collection of all style numbers that should be treated as date
+    std::mutex                        mutex;      ///< Guards the anchor state when this holder is shared between simulators.
 #   ifdef n2a_FP
-    int                          exponent; ///< of value returned by get()
+    int                               exponent;   ///< of value returned by get()
 #   endif
 
     Spreadsheet (const String & fileName);
@@ -48,6 +73,7 @@ public:
 
     void parse   (const String & cell);       ///< Subroutine for all functions that take an anchor cell address.
     void parseA1 (const String & coordinate); ///< Process just the coordinates of a cell address.
+    void load    (Sheet<T> * sheet);          ///< Reads the cells of a worksheet. Called when sheet is first referenced.
 
     // These counts are always relative to an anchor cell.
     int rows         (const String & cell);
@@ -32,6 +32,7 @@ Uncomment the following define in miniz.h:
 
 #include "spreadsheet.h"
 
+#define MINIZ_NO_ZLIB_COMPATIBLE_NAMES  // Otherwise macros such as "compress" collide with MatrixSparse members.
 #include "miniz.h"
 #include "miniz.c"
 #pragma GCC diagnostic ignored "-Wsubobject-linkage"
@@ -43,6 +44,17 @@ Uncomment the following define in miniz.h:
 #include <MatrixSparse.tcc>
 #include <set>
 
+template<class T>
+Sheet<T>::Sheet ()
+{
+    numbers = 0;
+    strings = 0;
+    rows    = 0;
+    columns = 0;
+    dense   = 0;
+    loaded  = false;
+}
+
 template<class T>
 Sheet<T>::~Sheet ()
 {
@@ -69,23 +81,208 @@ unzipFile (mz_zip_archive * archive, const String & fileName)
     return result;
 }
 
-String
-extractSI (const pugi::xml_node & si)
+/*
+    Minimal streaming scanner for the large parts of a workbook (worksheets and shared strings).
+    These are machine-generated and regular, so there is no need to build a DOM for them.
+    Each function works on a range of text [begin,end). A tag name is followed directly by
+    whitespace, '/' or '>'.
+*/
+
+/// @return true if the tag that starts at p (just after '<') has the given name.
+static bool
+xmlIs (const char * p, const char * end, const char * name)
 {
-    String result;
-    for (auto n : si)
+    while (*name)
     {
-        String name = n.name ();
-        if (name == "t")  // simple text element
+        if (p >= end  ||  *p != *name) return false;
+        p++;
+        name++;
+    }
+    if (p >= end) return false;
+    char c = *p;
+    return c == '>'  ||  c == '/'  ||  c == ' '  ||  c == '\t'  ||  c == '\r'  ||  c == '\n';
+}
+
+/// @return The '>' that closes the tag starting at p, or null if the text is truncated. Skips over quoted attribute values.
+static const char *
+xmlTagEnd (const char * p, const char * end)
+{
+    char quote = 0;
+    for (; p < end; p++)
+    {
+        char c = *p;
+        if (quote)
         {
-            result += n.child_value ();
+            if (c == quote) quote = 0;
         }
-        else if (name == "r")  // rich text element
+        else if (c == '"'  ||  c == '\'') quote = c;
+        else if (c == '>') return p;
+    }
+    return 0;
+}
+
+/// @return The '<' of the next element with the given name, or null if none.
+static const char *
+xmlFind (const char * p, const char * end, const char * name)
+{
+    while (p < end)
+    {
+        p = (const char *) memchr (p, '<', end - p);
+        if (! p) return 0;
+        if (xmlIs (p + 1, end, name)) return p;
+        p++;
+    }
+    return 0;
+}
+
+/// @return The '<' of the closing tag with the given name, or null if none.
+static const char *
+xmlClose (const char * p, const char * end, const char * name)
+{
+    while (p < end)
+    {
+        p = (const char *) memchr (p, '<', end - p);
+        if (! p) return 0;
+        if (p + 1 < end  &&  p[1] == '/'  &&  xmlIs (p + 2, end, name)) return p;
+        p++;
+    }
+    return 0;
+}
+
+/// Finds an attribute within a tag. tag points just after '<' and tagEnd at the closing '>'.
+static bool
+xmlAttribute (const char * tag, const char * tagEnd, const char * name, const char *& value, const char *& valueEnd)
+{
+    int length = strlen (name);
+    const char * p = tag;
+    while (p < tagEnd  &&  *p != ' '  &&  *p != '\t'  &&  *p != '\r'  &&  *p != '\n') p++;  // Skip tag name.
+    while (p < tagEnd)
+    {
+        while (p < tagEnd  &&  (*p == ' '  ||  *p == '\t'  ||  *p == '\r'  ||  *p == '\n')) p++;
+        const char * n = p;
+        while (p < tagEnd  &&  *p != '='  &&  *p != ' '  &&  *p != '/') p++;
+        const char * nEnd = p;
+        while (p < tagEnd  &&  *p != '"'  &&  *p != '\'') p++;
+        if (p >= tagEnd) return false;
+        char quote = *p++;
+        const char * v = p;
+        while (p < tagEnd  &&  *p != quote) p++;
+        if (nEnd - n == length  &&  strncmp (n, name, length) == 0)
         {
-            for (auto m : n) if (String (m.name ()) == "t") result += m.child_value ();
+            value    = v;
+            valueEnd = p;
+            return true;
         }
+        p++;
+    }
+    return false;
+}
+
+/// Appends text to result, replacing character and entity references.
+static void
+xmlDecode (const char * p, const char * end, String & result)
+{
+    while (p < end)
+    {
+        const char * amp = (const char *) memchr (p, '&', end - p);
+        if (! amp)
+        {
+            result.append (p, end - p);
+            return;
+        }
+        result.append (p, amp - p);
+        const char * semi = (const char *) memchr (amp, ';', end - amp);
+        if (! semi)
+        {
+            result.append (amp, end - amp);
+            return;
+        }
+        String entity;
+        entity.assign (amp + 1, semi - amp - 1);
+        if      (entity == "amp" ) result += '&';
+        else if (entity == "lt"  ) result += '<';
+        else if (entity == "gt"  ) result += '>';
+        else if (entity == "quot") result += '"';
+        else if (entity == "apos") result += '\'';
+        else if (entity.size () > 1  &&  entity[0] == '#')
+        {
+            unsigned long code;
+            if (entity[1] == 'x'  ||  entity[1] == 'X') code = strtoul (entity.c_str () + 2, 0, 16);
+            else                                        code = strtoul (entity.c_str () + 1, 0, 10);
+            // Encode as UTF-8
+            if (code < 0x80)
+            {
+                result += (char) code;
+            }
+            else if (code < 0x800)
+            {
+                result += (char) (0xC0 | code >> 6);
+                result += (char) (0x80 | code & 0x3F);
+            }
+            else if (code < 0x10000)
+            {
+                result += (char) (0xE0 | code >> 12);
+                result += (char) (0x80 | code >> 6 & 0x3F);
+                result += (char) (0x80 | code & 0x3F);
+            }
+            else
+            {
+                result += (char) (0xF0 | code >> 18);
+                result += (char) (0x80 | code >> 12 & 0x3F);
+                result += (char) (0x80 | code >> 6 & 0x3F);
+                result += (char) (0x80 | code & 0x3F);
+            }
+        }
+        else result.append (amp, semi - amp + 1);  // unknown entity, so pass through
+        p = semi + 1;
     }
-    return result;
+}
+
+/// Collects the text of a string item: all <t> elements in the given range, whether plain or within rich text runs, but not phonetic runs.
+static void
+xmlText (const char * p, const char * end, String & result)
+{
+    while (p < end)
+    {
+        p = (const char *) memchr (p, '<', end - p);
+        if (! p) return;
+        const char * tag    = p + 1;
+        const char * tagEnd = xmlTagEnd (tag, end);
+        if (! tagEnd) return;
+        p = tagEnd + 1;
+        if (tagEnd[-1] == '/') continue;  // empty element
+        if (xmlIs (tag, end, "rPh"))
+        {
+            const char * close = xmlClose (p, end, "rPh");
+            if (! close) return;
+            p = close + 6;
+        }
+        else if (xmlIs (tag, end, "t"))
+        {
+            const char * close = xmlClose (p, end, "t");
+            if (! close) return;
+            xmlDecode (p, close, result);
+            p = close + 4;
+        }
+    }
+}
+
+/// Converts letters and digits of a cell address to 0-based row and column.
+static void
+a1 (const char * p, const char * end, int & row, int & column)
+{
+    column = 0;  // Must start at 0 for column converter to work correctly.
+    for (; p < end; p++)
+    {
+        char c = *p;
+        if (c >= 97) c &= 0xDF;  // convert to upper case by clearing bit 5
+        if (c < 'A') break;
+        column = column * 26 + c - 'A' + 1;
+    }
+    column--;
+    row = 0;
+    for (; p < end  &&  *p >= '0'  &&  *p <= '9'; p++) row = row * 10 + *p - '0';
+    if (row > 0) row--;  // Cell addresses are usually 1-based, so need to convert to 0-based.
 }
 
 template<class T>
@@ -129,19 +326,36 @@ Spreadsheet<T>::Spreadsheet (const String & fileName)
     }
 
     // Load shared strings
+    // This table can be as large as the sheets themselves, so scan it directly rather than building a DOM.
     if (! sharedStringsPath.empty ())
     {
-        pugi::xml_document sharedStrings;
         fileContents = unzipFile (&archive, sharedStringsPath);
-        sharedStrings.load_string (fileContents.c_str (), pugi::parse_default | pugi::parse_ws_pcdata);
-        auto sst = sharedStrings.document_element ();
-        int uniqueCount = sst.attribute ("uniqueCount").as_int ();
-        strings.reserve (uniqueCount);
-        for (auto si : sst) strings.push_back (extractSI (si));
+        const char * p   = fileContents.c_str ();
+        const char * end = p + fileContents.size ();
+        const char * sst = xmlFind (p, end, "sst");
+        if (sst)
+        {
+            const char * tagEnd = xmlTagEnd (sst + 1, end);
+            const char * v;
+            const char * vEnd;
+            if (tagEnd  &&  xmlAttribute (sst + 1, tagEnd, "uniqueCount", v, vEnd)) strings.reserve (atoi (v));
+            p = sst + 1;
+        }
+        while ((p = xmlFind (p, end, "si")))
+        {
+            const char * tagEnd = xmlTagEnd (p + 1, end);
+            if (! tagEnd) break;
+            p = tagEnd + 1;
+            strings.push_back (String ());
+            if (tagEnd[-1] == '/') continue;  // empty string
+            const char * close = xmlClose (p, end, "si");
+            if (! close) break;
+            xmlText (p, close, strings.back ());
+            p = close + 5;
+        }
     }
 
     // Determine date styles
-    std::set<int> dateStyles;  // collection of all style numbers that should be treated as date
     if (! stylesPath.empty ())
     {
         pugi::xml_document styles;
@@ -156,9 +370,9 @@ Spreadsheet<T>::Spreadsheet (const String & fileName)
             styleNumber++;
         }
     }
-    std::set<int>::iterator dateStylesEnd = dateStyles.end ();
 
     // Scan workbook for sheets
+    // Only the list of sheets is read here. The cells of each sheet are read on first reference. See load().
     pugi::xml_document workbook;
     fileContents = unzipFile (&archive, "xl/workbook.xml");
     workbook.load_string (fileContents.c_str (), pugi::parse_default | pugi::parse_ws_pcdata);
@@ -168,102 +382,10 @@ Spreadsheet<T>::Spreadsheet (const String & fileName)
         String rid = n.attribute ("r:id").value ();
         if (IDtarget.find (rid) == IDtarget.end ()) continue;
         String name = n.attribute ("name").value ();
-        String target = IDtarget[rid];
-
-        // Process worksheet
-        // We could try to read the dimension element, but it is not reliable
-        // (not required to be present, and not always formatted correctly).
-        // Thus, the only safe way to load a spreadsheet is with sparse matrices.
-        // There are several delicate tradeoffs between time and space here.
-        // We don't want to lock down more memory than necessary. OTOH, it is a
-        // waste of time to convert to dense matrix if each element is accessed
-        // only once during a simulation. Here it is impossible to know how
-        // all that will play out, so we use a simple heuristic based on fill-in
-        // to decide whether to covnert to dense matrix after the load finishes.
         ws = new Sheet<T>;
+        ws->target = IDtarget[rid];
         wb[name] = ws;
         if (first == 0) first = ws;
-        MatrixSparse<T>   * N = new MatrixSparse<T>;
-        MatrixSparse<int> * S = new MatrixSparse<int>;
-        ws->numbers = N;
-        ws->strings = S;
-        int fillN = 0;
-        int fillS = 0;
-        const double fillThreshold = 0.5;
-
-        pugi::xml_document worksheet;
-        fileContents = unzipFile (&archive, target);
-        worksheet.load_string (fileContents.c_str (), pugi::parse_default | pugi::parse_ws_pcdata);
-        for (auto row : worksheet.document_element ().child ("sheetData"))
-        {
-            for (auto c : row)
-            {
-                String t = c.attribute ("t").value ();
-                if (t == "e") continue;
-                parseA1 (c.attribute ("r").value ());  // result stored in ar and ac
-                if (t == "s")
-                {
-                    int index = atoi (c.child_value ("v"));
-                    if (strings[index].empty ()) continue;
-                    S->set (ar, ac, index+1);  // Offset index by 1, so the 0 can represent empty string.
-                    fillS++;
-                }
-                else if (t == "str")
-                {
-                    String v = c.child_value ("v");
-                    v.trim ();
-                    if (v.empty ()) continue;
-                    strings.push_back (v);
-                    S->set (ar, ac, strings.size ());  // by putting this call after the push_back(), we get 1-based index
-                    fillS++;
-                }
-                else if (t == "inlineStr")
-                {
-                    String si = extractSI (c.child ("si"));
-                    if (si.empty ()) continue;
-                    strings.push_back (si);
-                    S->set (ar, ac, strings.size ());
-                    fillS++;
-                }
-                else  // all remaining types should be numeric
-                {
-                    // Dates are stored internally as number of days since December 31, 1899.
-                    // Day 25569 is start of Unix epoch, January 1, 1970.
-                    // I believe that day number includes leap days, so all we need to do is multiply by 86400.
-                    // There are more subtle elements of horology to consider, but this should be good enough.
-
-                    // The difficulty is identifying a date cell. The only way is to check style (attribute "s").
-                    // See https://www.brendanlong.com/the-minimum-viable-xlsx-reader.html
-                    // At a minimum, we could check all pre-defined date styles: 14-22, 45-47
-                    // It appears that MS Excel won't store negative date numbers. Instead, the value is stored as a string.
-
-                    T v = atof (c.child_value ("v"));
-                    int s = c.attribute ("s").as_int (-1);
-                    if (dateStyles.find (s) != dateStylesEnd) v = (v - 25569) * 86400;  // Convert from Excel time to Unix time.
-                    if (v == 0) continue;  // should we also check for NAN?
-                    N->set (ar, ac, v);
-                    fillN++;
-                }
-            }
-        }
-
-        // Check fill-in and possibly convert to dense
-        int Nrows = N->rows ();
-        int Ncols = N->columns ();
-        int Srows = S->rows ();
-        int Scols = S->columns ();
-        ws->rows    = std::max (Nrows, Srows);
-        ws->columns = std::max (Ncols, Scols);
-        if ((double) fillN / (Nrows * Ncols) > fillThreshold)
-        {
-            ws->numbers = new Matrix<T> (*N);
-            delete N;
-        }
-        if ((double) fillS / (Srows * Scols) > fillThreshold)
-        {
-            ws->strings = new Matrix<int> (*S);
-            delete S;
-        }
     }
 
     ws = first;
@@ -279,12 +401,204 @@ Spreadsheet<T>::~Spreadsheet ()
     for (auto s : wb) delete s.second;
 }
 
+template<class T>
+void
+Spreadsheet<T>::load (Sheet<T> * sheet)
+{
+    sheet->loaded = true;
+
+    mz_zip_archive archive;
+    mz_zip_zero_struct (&archive);
+    if (! mz_zip_reader_init_file (&archive, fileName.c_str (), 0))
+    {
+        throw mz_zip_get_error_string (archive.m_last_error);
+    }
+    String fileContents = unzipFile (&archive, sheet->target);
+    mz_zip_reader_end (&archive);
+
+    // Collect cells as coordinate lists.
+    // We could try to read the dimension element, but it is not reliable
+    // (not required to be present, and not always formatted correctly).
+    // Collecting first means the extent of the sheet is known before any matrix is built,
+    // so each one can be built directly in its final form.
+    std::vector<int> Nr;
+    std::vector<int> Nc;
+    std::vector<T>   Nv;
+    std::vector<int> Sr;
+    std::vector<int> Sc;
+    std::vector<int> Sv;
+    int Nrows = 0;
+    int Ncols = 0;
+    int Srows = 0;
+    int Scols = 0;
+    std::set<int>::iterator dateStylesEnd = dateStyles.end ();
+
+    const char * p   = fileContents.c_str ();
+    const char * end = p + fileContents.size ();
+    p = xmlFind (p, end, "sheetData");
+    int row    = -1;
+    int column = -1;
+    while (p  &&  p < end)
+    {
+        p = (const char *) memchr (p, '<', end - p);
+        if (! p) break;
+        const char * tag    = p + 1;
+        const char * tagEnd = xmlTagEnd (tag, end);
+        if (! tagEnd) break;
+        p = tagEnd + 1;
+
+        const char * v;
+        const char * vEnd;
+        if (xmlIs (tag, end, "/sheetData")) break;
+        if (xmlIs (tag, end, "row"))
+        {
+            if (xmlAttribute (tag, tagEnd, "r", v, vEnd)) row = atoi (v) - 1;
+            else                                          row++;
+            column = -1;
+            continue;
+        }
+        if (! xmlIs (tag, end, "c")) continue;
+
+        if (xmlAttribute (tag, tagEnd, "r", v, vEnd)) a1 (v, vEnd, row, column);
+        else                                          column++;
+        if (tagEnd[-1] == '/') continue;  // empty cell
+        const char * content = p;
+        const char * close   = xmlClose (p, end, "c");
+        if (! close) break;
+        p = close + 4;
+
+        String t;
+        if (xmlAttribute (tag, tagEnd, "t", v, vEnd)) t.assign (v, vEnd - v);
+        if (t == "e") continue;
+
+        if (t == "inlineStr")
+        {
+            String si;
+            xmlText (content, close, si);
+            if (si.empty ()) continue;
+            strings.push_back (si);
+            Sr.push_back (row);
+            Sc.push_back (column);
+            Sv.push_back (strings.size ());  // by putting this after the push_back(), we get 1-based index
+            Srows = std::max (Srows, row + 1);
+            Scols = std::max (Scols, column + 1);
+            continue;
+        }
+
+        const char * value = xmlFind (content, close, "v");
+        if (! value) continue;
+        const char * valueTagEnd = xmlTagEnd (value + 1, close);
+        if (! valueTagEnd  ||  valueTagEnd[-1] == '/') continue;
+        value = valueTagEnd + 1;
+        const char * valueEnd = xmlClose (value, close, "v");
+        if (! valueEnd) continue;
+
+        if (t == "s")
+        {
+            int index = atoi (value);
+            if (index < 0  ||  index >= strings.size ()  ||  strings[index].empty ()) continue;
+            Sr.push_back (row);
+            Sc.push_back (column);
+            Sv.push_back (index + 1);  // Offset index by 1, so the 0 can represent empty string.
+            Srows = std::max (Srows, row + 1);
+            Scols = std::max (Scols, column + 1);
+        }
+        else if (t == "str")
+        {
+            String s;
+            xmlDecode (value, valueEnd, s);
+            s.trim ();
+            if (s.empty ()) continue;
+            strings.push_back (s);
+            Sr.push_back (row);
+            Sc.push_back (column);
+            Sv.push_back (strings.size ());
+            Srows = std::max (Srows, row + 1);
+            Scols = std::max (Scols, column + 1);
+        }
+        else  // all remaining types should be numeric
+        {
+            // Dates are stored internally as number of days since December 31, 1899.
+            // Day 25569 is start of Unix epoch, January 1, 1970.
+            // I believe that day number includes leap days, so all we need to do is multiply by 86400.
+            // There are more subtle elements of horology to consider, but this should be good enough.
+
+            // The difficulty is identifying a date cell. The only way is to check style (attribute "s").
+            // See https://www.brendanlong.com/the-minimum-viable-xlsx-reader.html
+            // At a minimum, we could check all pre-defined date styles: 14-22, 45-47
+            // It appears that MS Excel won't store negative date numbers. Instead, the value is stored as a string.
+
+            T n = parseNumber (value, valueEnd);
+            int s = -1;
+            if (xmlAttribute (tag, tagEnd, "s", v, vEnd)) s = atoi (v);
+            if (dateStyles.find (s) != dateStylesEnd) n = (n - 25569) * 86400;  // Convert from Excel time to Unix time.
+            if (n == 0) continue;  // should we also check for NAN?
+            Nr.push_back (row);
+            Nc.push_back (column);
+            Nv.push_back (n);
+            Nrows = std::max (Nrows, row + 1);
+            Ncols = std::max (Ncols, column + 1);
+        }
+    }
+
+    // Choose dense or sparse for each matrix.
+    // There are several delicate tradeoffs between time and space here.
+    // We don't want to lock down more memory than necessary. OTOH, dense lookup is
+    // a single array access, while sparse lookup is a search. A sheet that is either
+    // mostly full or small in absolute terms is stored dense, spanning the whole sheet,
+    // so every lookup within the sheet is direct.
+    const double fillThreshold = 0.5;
+    const double denseCells    = 1 << 20;  // Below this size, dense storage costs at most a few MB.
+    sheet->rows    = std::max (Nrows, Srows);
+    sheet->columns = std::max (Ncols, Scols);
+    double cells = (double) sheet->rows * sheet->columns;
+
+    if (cells <= denseCells  ||  Nv.size () > fillThreshold * Nrows * Ncols)
+    {
+        Matrix<T> * N = new Matrix<T> (sheet->rows, sheet->columns);
+        clear (*N);
+        for (size_t i = 0; i < Nv.size (); i++) (*N)(Nr[i],Nc[i]) = Nv[i];
+        sheet->numbers = N;
+        sheet->dense   = (const T *) N->data;
+    }
+    else
+    {
+        MatrixSparse<T> * N = new MatrixSparse<T>;
+        for (size_t i = 0; i < Nv.size (); i++) N->set (Nr[i], Nc[i], Nv[i]);
+        sheet->numbers = N;
+    }
+
+    if (cells <= denseCells  ||  Sv.size () > fillThreshold * Srows * Scols)
+    {
+        Matrix<int> * S = new Matrix<int> (sheet->rows, sheet->columns);
+        clear (*S);
+        for (size_t i = 0; i < Sv.size (); i++) (*S)(Sr[i],Sc[i]) = Sv[i];
+        sheet->strings = S;
+    }
+    else
+    {
+        MatrixSparse<int> * S = new MatrixSparse<int>;
+        for (size_t i = 0; i < Sv.size (); i++) S->set (Sr[i], Sc[i], Sv[i]);
+        sheet->strings = S;
+    }
+}
+
 template<class T>
 void
 Spreadsheet<T>::parse (const String & cell)
 {
     if (cell == this->cell) return;
 
+    auto found = anchors.find (cell);
+    if (found != anchors.end ())
+    {
+        ws = found->second.ws;
+        ar = found->second.ar;
+        ac = found->second.ac;
+        this->cell = cell;
+        return;
+    }
+
     String sheetName;
     String coordinates;
     int pos = cell.find_first_of ('!');
@@ -305,7 +619,9 @@ Spreadsheet<T>::parse (const String & cell)
         typename std::map<String, Sheet<T> *>::iterator it = wb.find (sheetName);
         if (it != wb.end ()) ws = it->second;
     }
+    if (! ws->loaded) load (ws);
 
+    anchors[cell] = Anchor {ws, ar, ac};
     this->cell = cell;
 }
 
@@ -313,31 +629,22 @@ template<class T>
 void
 Spreadsheet<T>::parseA1 (const String & coordinates)
 {
-    ac = 0;  // Must start at 0 for column converter to work correctly.
     if (coordinates.empty ())
     {
         ar = 0;
+        ac = 0;
         return;
     }
-
-    int pos = 0;
-    int length = coordinates.size ();
-    for (; pos < length; pos++)
-    {
-        char c = coordinates[pos];
-        if (c >= 97) c &= 0xDF;  // convert to upper case by clearing bit 5
-        if (c < 'A') break;
-        ac = ac * 26 + c - 'A' + 1;
-    }
-    ac--;
-    ar = atoi (coordinates.substr (pos).c_str ());
-    if (ar > 0) ar--;  // Cell addresses are usually 1-based, so need to convert to 0-based.
+    const char * p = coordinates.c_str ();
+    a1 (p, p + coordinates.size (), ar, ac);
 }
 
 template<class T>
 int
 Spreadsheet<T>::rows (const String & cell)
 {
+    std::unique_lock<std::mutex> lock (mutex, std::defer_lock);
+    if (! sharedKey.empty ()) lock.lock ();
     parse (cell);
     return std::max (0, ws->rows - ar);
 }
@@ -346,6 +653,8 @@ template<class T>
 int
 Spreadsheet<T>::columns (const String & cell)
 {
+    std::unique_lock<std::mutex> lock (mutex, std::defer_lock);
+    if (! sharedKey.empty ()) lock.lock ();
     parse (cell);
     return std::max (0, ws->columns - ac);
 }
@@ -354,11 +663,13 @@ template<class T>
 int
 Spreadsheet<T>::rowsInColumn (const String & cell)
 {
+    std::unique_lock<std::mutex> lock (mutex, std::defer_lock);
+    if (! sharedKey.empty ()) lock.lock ();
     parse (cell);
     int result = 0;
     for (int r = ar; r < ws->rows; r++)
     {
-        if ((*ws->strings)(r,ac) == 0  &&  (*ws->numbers)(r,ac) == 0) break;
+        if ((*ws->strings)(r,ac) == 0  &&  ws->number (r,ac) == 0) break;
         result++;
     }
     return result;
@@ -368,11 +679,13 @@ template<class T>
 int
 Spreadsheet<T>::columnsInRow (const String & cell)
 {
+    std::unique_lock<std::mutex> lock (mutex, std::defer_lock);
+    if (! sharedKey.empty ()) lock.lock ();
     parse (cell);
     int result = 0;
     for (int c = ac; c < ws->columns; c++)
     {
-        if ((*ws->strings)(ar,c) == 0  &&  (*ws->numbers)(ar,c) == 0) break;
+        if ((*ws->strings)(ar,c) == 0  &&  ws->number (ar,c) == 0) break;
         result++;
     }
     return result;
@@ -383,19 +696,20 @@ template<class T>
 T
 Spreadsheet<T>::get (const String & cell, T row, T column)
 {
+    std::unique_lock<std::mutex> lock (mutex, std::defer_lock);
+    if (! sharedKey.empty ()) lock.lock ();
     parse (cell);
     row    += ar;
     column += ac;
     int r = (int) row;
     int c = (int) column;
-    // TODO: handle out of bounds access on dense matrix. See Spreadsheet.java
-    T d00 = (*ws->numbers)(r,c);
+    T d00 = ws->number (r,c);
     if (r == row  &&  c == column) return d00;  // integer coordinates, so no need for interpolation
 
     // Interpolate data
-    T d01 = (*ws->numbers)(r,  c+1);
-    T d10 = (*ws->numbers)(r+1,c  );
-    T d11 = (*ws->numbers)(r+1,c+1);
+    T d01 = ws->number (r,  c+1);
+    T d10 = ws->number (r+1,c  );
+    T d11 = ws->number (r+1,c+1);
     if (c >= ws->columns)
     {
         d01 = d00;
@@ -417,9 +731,12 @@ template<class T>
 String
 Spreadsheet<T>::get (const String & cell, const String & prefix, T row, T column)
 {
+    std::unique_lock<std::mutex> lock (mutex, std::defer_lock);
+    if (! sharedKey.empty ()) lock.lock ();
     parse (cell);
     int r = (int) row    + ar;
     int c = (int) column + ac;
+    if (r < 0  ||  c < 0  ||  r >= ws->rows  ||  c >= ws->columns) return prefix;
     int index = (*ws->strings)(r,c);
     if (index > 0) return prefix + strings[index-1];  // back to 0-based index
     return prefix;
@@ -539,6 +856,8 @@ template<class T>
 IteratorNonzero<T> *
 Spreadsheet<T>::getIterator (const String & cell)
 {
+    std::unique_lock<std::mutex> lock (mutex, std::defer_lock);
+    if (! sharedKey.empty ()) lock.lock ();
     parse (cell);
     // see MatrixInput::getIterator () in io.tcc
     if (ws->numbers->classID () & MatrixSparseID) return new IteratorSparseCell<T> ((MatrixSparse<T> *) ws->numbers, ar, ac);
@@ -556,11 +875,27 @@ spreadsheetHelper (const String & fileName,               Spreadsheet<T> * oldHa
     Spreadsheet<T> * handle = (Spreadsheet<T> *) SIMULATOR getHolder (fileName, oldHandle);
     if (! handle)
     {
-        handle = new Spreadsheet<T> (fileName);
+        auto create = [&] () -> Holder *
+        {
+            Spreadsheet<T> * result = new Spreadsheet<T> (fileName);
+#           ifdef n2a_FP
+            result->exponent = exponent;
+#           endif
+            return result;
+        };
+        if (SIMULATOR shareInputs)
+        {
+            String key = "Spreadsheet|" + fileName;
+#           ifdef n2a_FP
+            key = key + "|" + exponent;
+#           endif
+            handle = (Spreadsheet<T> *) Holder::acquire (key, create);
+        }
+        else
+        {
+            handle = (Spreadsheet<T> *) create ();
+        }
         SIMULATOR holders.push_back (handle);
-#       ifdef n2a_FP
-        handle->exponent = exponent;
-#       endif
     }
     return handle;
 }
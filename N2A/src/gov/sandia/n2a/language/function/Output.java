@@ -45,6 +45,7 @@ public class Output extends Function
     public String  name;          // For C backend, the name of the OutputHolder object.
     public String  fileName;      // For C backend, the name of the string variable holding the file name, if any.
     public String  columnName;    // For C backend, the name of the string variable holding the generated column name, if any.
+    public String  columnHandle;  // For C backend, the name of the int variable caching the column index, if any.
 
     public static Factory factory ()
     {
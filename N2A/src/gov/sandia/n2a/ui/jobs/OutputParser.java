@@ -10,6 +10,7 @@ import java.awt.Color;
 import java.io.ByteArrayOutputStream;
 import java.io.IOException;
 import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
 import java.nio.channels.SeekableByteChannel;
 import java.nio.file.Files;
 import java.nio.file.Path;
@@ -70,7 +71,8 @@ public class OutputParser
         {
             if (reader == null) reader = new SafeReader (path);
             else                reader.open (path);
-            while (true)
+            if (reader.binary ()) parseBinary ();
+            else while (true)
             {
                 String line = reader.readLine ();
                 if (line == null) break;  // indicates end of stream
@@ -236,6 +238,63 @@ public class OutputParser
         }
     }
 
+    /**
+        Reads all complete blocks of a binary trace file. See OutputHolder::writeBlock()
+        in the C runtime for a description of the format. Column names come from the
+        .columns file, just as for raw text output.
+    **/
+    public void parseBinary () throws IOException
+    {
+        raw = (reader.flags & 1) != 0;
+        while (true)
+        {
+            ByteBuffer block = reader.readBlock ();
+            if (block == null) break;
+            int blockRows = block.getInt ();
+            int count     = block.getInt ();
+            block.getInt ();  // payload size, already used by readBlock()
+
+            while (columns.size () < count)
+            {
+                Column c = new Column ();
+                c.startRow = rows;
+                columns.add (c);
+            }
+            for (int i = 0; i < count; i++)
+            {
+                Column c = columns.get (i);
+                int previous = 0;
+                for (int r = 0; r < blockRows; r += 2)
+                {
+                    int control = block.get () & 0xFF;
+                    for (int j = 0; j < 2  &&  r + j < blockRows; j++)
+                    {
+                        int n = j == 0 ? control & 0xF : control >> 4;
+                        int x = 0;
+                        for (int k = 0; k < n; k++) x |= (block.get () & 0xFF) << 8 * k;
+                        previous ^= x;
+                        float value = Float.intBitsToFloat (previous);
+                        if (Float.isNaN (value))
+                        {
+                            value = defaultValue;  // NaN marks a value that was not set, like an empty field in text.
+                        }
+                        else if (c.textWidth < 12)
+                        {
+                            c.textWidth = Math.max (c.textWidth, Float.toString (value).length ());
+                        }
+                        c.values.add (value);
+                    }
+                }
+            }
+            for (int i = count; i < columns.size (); i++)
+            {
+                Column c = columns.get (i);
+                for (int r = 0; r < blockRows; r++) c.values.add (defaultValue);
+            }
+            rows += blockRows;
+        }
+    }
+
     /**
         Optional post-processing step to give columns their position in a spike raster.
     **/
@@ -381,6 +440,8 @@ public class OutputParser
         protected ByteBuffer            readBuffer;     // for direct IO
         protected long                  readBufferBase; // position in file of first bye in readBuffer, if there is one
         protected ByteArrayOutputStream lineBuffer;     // for accumulating the return string
+        protected boolean               binary;         // File starts with the binary trace header.
+        public    int                   flags;          // From binary header. Bit 0 indicates raw output.
 
         public SafeReader (Path path) throws IOException
         {
@@ -409,6 +470,54 @@ public class OutputParser
             catch (IOException e) {}
         }
 
+        /**
+            Checks for the header of a binary trace file. If present, this positions the
+            reader at the first block.
+        **/
+        public boolean binary () throws IOException
+        {
+            if (nextPosition > 0) return binary;
+
+            ByteBuffer header = ByteBuffer.allocate (12).order (ByteOrder.LITTLE_ENDIAN);
+            channel.position (0);
+            while (header.hasRemaining ()  &&  channel.read (header) > 0);
+            int count = header.position ();
+            byte[] magic = "N2Ab".getBytes ();
+            binary = count > 0;
+            for (int i = 0; i < Math.min (count, 4); i++) if (header.get (i) != magic[i]) binary = false;
+            if (binary  &&  count == 12)  // Otherwise the header is not finished, so try again on next call.
+            {
+                flags        = header.getInt (8);
+                nextPosition = 12;
+            }
+            channel.position (nextPosition);
+            return binary;
+        }
+
+        /**
+            Reads the next complete block of a binary trace file.
+            @return The block header followed by its payload, ready for reading.
+            Null if no complete block is available yet.
+        **/
+        public ByteBuffer readBlock () throws IOException
+        {
+            if (nextPosition == 0) return null;  // Header not yet complete.
+            ByteBuffer header = ByteBuffer.allocate (12).order (ByteOrder.LITTLE_ENDIAN);
+            channel.position (nextPosition);
+            while (header.hasRemaining ()  &&  channel.read (header) > 0);
+            if (header.hasRemaining ()) return null;
+            int bytes = header.getInt (8);
+
+            ByteBuffer result = ByteBuffer.allocate (12 + bytes).order (ByteOrder.LITTLE_ENDIAN);
+            header.flip ();
+            result.put (header);
+            while (result.hasRemaining ()  &&  channel.read (result) > 0);
+            if (result.hasRemaining ()) return null;  // Block is still being written.
+            nextPosition += 12 + bytes;
+            result.flip ();
+            return result;
+        }
+
         public String readLine () throws IOException
         {
             String result = null;